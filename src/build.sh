@@ -1 +1 @@
-gcc -g -fsanitize=address -o xps main.c core/xps_core.c core/xps_loop.c core/xps_pipe.c lib/vec/vec.c network/xps_connection.c network/xps_listener.c network/xps_upstream.c utils/xps_logger.c utils/xps_utils.c utils/xps_buffer.c
+gcc -g -fsanitize=address -o xps main.c core/xps_config.c core/xps_core.c core/xps_loop.c core/xps_pipe.c core/xps_signal.c core/xps_session.c core/xps_hedge.c core/xps_workers.c lib/vec/vec.c network/xps_connection.c network/xps_listener.c network/xps_upstream.c network/xps_handover.c network/xps_ratelimit.c network/xps_backend.c network/xps_tls.c network/xps_udp.c network/xps_zerocopy.c network/xps_sockopt.c http/xps_http.c http/xps_cache.c http/xps_compress.c http/xps_hpack.c http/xps_h2.c utils/xps_logger.c utils/xps_utils.c utils/xps_buffer.c utils/xps_pool.c -lz -lssl -lcrypto -lpthread
@@ -0,0 +1,253 @@
+#include "../xps.h"
+
+u_long config_get_ulong(const char *name, u_long default_val);
+const char *config_get_str(const char *name, const char *default_val);
+bool config_qos_next(const char **str, u_int *port, u_int *weight, u_long *rate);
+
+xps_config_t *xps_config_create(char *argv[]) {
+  xps_config_t *config = malloc(sizeof(xps_config_t));
+  if (config == NULL) {
+    logger(LOG_ERROR, "xps_config_create()", "malloc() failed for 'config'");
+    return NULL;
+  }
+
+  config->pipe_mem_budget = config_get_ulong("XPS_PIPE_MEM_BUDGET", DEFAULT_PIPE_MEM_BUDGET);
+  config->io_budget_bytes = config_get_ulong("XPS_IO_BUDGET_BYTES", DEFAULT_IO_BUDGET_BYTES);
+  config->io_budget_ops = config_get_ulong("XPS_IO_BUDGET_OPS", DEFAULT_IO_BUDGET_OPS);
+  config->accept_budget = config_get_ulong("XPS_ACCEPT_BUDGET", DEFAULT_ACCEPT_BUDGET);
+  config->max_connections = config_get_ulong("XPS_MAX_CONNECTIONS", DEFAULT_MAX_CONNECTIONS);
+  config->listener_max_connections =
+      config_get_ulong("XPS_LISTENER_MAX_CONNECTIONS", DEFAULT_LISTENER_MAX_CONNECTIONS);
+  config->max_loop_lag_msec = config_get_ulong("XPS_MAX_LOOP_LAG_MSEC", DEFAULT_MAX_LOOP_LAG_MSEC);
+  config->drain_timeout_msec =
+      config_get_ulong("XPS_DRAIN_TIMEOUT_MSEC", DEFAULT_DRAIN_TIMEOUT_MSEC);
+  config->upgrade_socket = config_get_str("XPS_UPGRADE_SOCKET", DEFAULT_UPGRADE_SOCKET);
+  config->cache_max_bytes = config_get_ulong("XPS_CACHE_MAX_BYTES", DEFAULT_CACHE_MAX_BYTES);
+  config->pool_debug = config_get_ulong("XPS_POOL_DEBUG", 0) != 0;
+  config->shadow_port = config_get_ulong("XPS_SHADOW_PORT", 0);
+  config->gzip_level = config_get_ulong("XPS_GZIP_LEVEL", DEFAULT_GZIP_LEVEL);
+  config->zstd_level = config_get_ulong("XPS_ZSTD_LEVEL", DEFAULT_ZSTD_LEVEL);
+  config->compress_min_len = config_get_ulong("XPS_COMPRESS_MIN_LEN", DEFAULT_COMPRESS_MIN_LEN);
+  config->rate_conns = config_get_ulong("XPS_RATE_CONNS", 0);
+  config->rate_conns_burst = config_get_ulong("XPS_RATE_CONNS_BURST", 0);
+  config->rate_bytes = config_get_ulong("XPS_RATE_BYTES", 0);
+  config->rate_bytes_burst = config_get_ulong("XPS_RATE_BYTES_BURST", 0);
+  config->qos = config_get_str("XPS_QOS", "");
+  config->upstreams = config_get_str("XPS_UPSTREAMS", DEFAULT_UPSTREAMS);
+  config->unix_listeners = config_get_str("XPS_UNIX_LISTENERS", "");
+  config->health_interval_msec =
+      config_get_ulong("XPS_HEALTH_INTERVAL_MSEC", DEFAULT_HEALTH_INTERVAL_MSEC);
+  config->health_path = config_get_str("XPS_HEALTH_PATH", "");
+  config->max_fails = config_get_ulong("XPS_MAX_FAILS", DEFAULT_MAX_FAILS);
+  config->eject_msec = config_get_ulong("XPS_EJECT_MSEC", DEFAULT_EJECT_MSEC);
+  config->hedge_percentile = config_get_ulong("XPS_HEDGE_PERCENTILE", 0);
+  config->hedge_min_msec = config_get_ulong("XPS_HEDGE_MIN_MSEC", DEFAULT_HEDGE_MIN_MSEC);
+  config->hedge_budget_percent =
+      config_get_ulong("XPS_HEDGE_BUDGET_PERCENT", DEFAULT_HEDGE_BUDGET_PERCENT);
+  config->workers = config_get_ulong("XPS_WORKERS", DEFAULT_WORKERS);
+  config->h2_upstreams = config_get_ulong("XPS_H2_UPSTREAMS", DEFAULT_H2_UPSTREAMS);
+  config->sock_profiles = config_get_str("XPS_SOCK_PROFILES", "");
+  config->listener_profiles = config_get_str("XPS_LISTENER_PROFILES", "");
+  config->upstream_profiles = config_get_str("XPS_UPSTREAM_PROFILES", "");
+  config->zerocopy_min = config_get_ulong("XPS_ZEROCOPY_MIN", 0);
+  config->udp_proxies = config_get_str("XPS_UDP_PROXIES", "");
+  config->udp_idle_msec = config_get_ulong("XPS_UDP_IDLE_MSEC", DEFAULT_UDP_IDLE_MSEC);
+  config->udp_max_flows = config_get_ulong("XPS_UDP_MAX_FLOWS", DEFAULT_UDP_MAX_FLOWS);
+  config->tls_ports = config_get_str("XPS_TLS_PORTS", "");
+  config->tls_cert = config_get_str("XPS_TLS_CERT", "");
+  config->tls_key = config_get_str("XPS_TLS_KEY", config->tls_cert);
+  config->tls_session_cache = config_get_ulong("XPS_TLS_SESSION_CACHE", DEFAULT_TLS_SESSION_CACHE);
+  config->cpu = getenv("XPS_CPU") != NULL ? (int)config_get_ulong("XPS_CPU", -1) : -1;
+  config->reuseport_group = config_get_ulong("XPS_REUSEPORT_GROUP", 0);
+  config->argv = argv;
+
+  // Budgets of 0 would stall the loop
+  if (config->io_budget_bytes == 0)
+    config->io_budget_bytes = DEFAULT_IO_BUDGET_BYTES;
+  if (config->io_budget_ops == 0)
+    config->io_budget_ops = DEFAULT_IO_BUDGET_OPS;
+  if (config->accept_budget == 0)
+    config->accept_budget = DEFAULT_ACCEPT_BUDGET;
+
+  if (config->hedge_percentile > 99)
+    config->hedge_percentile = 99;
+
+  // A single failure is the least that can eject an upstream
+  if (config->max_fails == 0)
+    config->max_fails = 1;
+  if (config->eject_msec == 0)
+    config->eject_msec = DEFAULT_EJECT_MSEC;
+
+  // Weights are relative to the highest one
+  config->qos_max_weight = 1;
+  const char *qos = config->qos;
+  u_int port, weight;
+  u_long rate;
+  while (config_qos_next(&qos, &port, &weight, &rate)) {
+    if (weight > config->qos_max_weight)
+      config->qos_max_weight = weight;
+  }
+
+  // Read before main() pins the process. Workers keep off the pinned CPU,
+  // on the rest of its node when the process may run there.
+  CPU_ZERO(&(config->worker_cpus));
+  if (config->cpu >= 0 && config->cpu < CPU_SETSIZE &&
+      sched_getaffinity(0, sizeof(cpu_set_t), &(config->worker_cpus)) == 0) {
+    CPU_CLR(config->cpu, &(config->worker_cpus));
+    cpu_set_t node_cpus;
+    if (get_node_cpus(get_cpu_node(config->cpu), &node_cpus) == OK) {
+      CPU_AND(&node_cpus, &node_cpus, &(config->worker_cpus));
+      if (CPU_COUNT(&node_cpus) > 0)
+        config->worker_cpus = node_cpus;
+    }
+  }
+
+  // Out of range levels fail compressor creation
+  if (config->gzip_level > 9)
+    config->gzip_level = 9;
+#ifdef XPS_ZSTD
+  if (config->zstd_level > ZSTD_maxCLevel())
+    config->zstd_level = ZSTD_maxCLevel();
+#else
+  config->zstd_level = 0;
+#endif
+
+  logger(LOG_DEBUG, "xps_config_create()", "created config");
+
+  return config;
+}
+
+void xps_config_destroy(xps_config_t *config) {
+  assert(config != NULL);
+
+  free(config);
+
+  logger(LOG_DEBUG, "xps_config_destroy()", "destroyed config");
+}
+
+/**
+ * Reads an unsigned integer from an environment variable
+ *
+ * @param name : name of the environment variable
+ * @param default_val : value returned when variable is unset or invalid
+ * @return : parsed value or default_val
+ */
+u_long config_get_ulong(const char *name, u_long default_val) {
+  const char *str = getenv(name);
+  if (str == NULL || *str == '\0')
+    return default_val;
+
+  char *end;
+  errno = 0;
+  u_long val = strtoul(str, &end, 10);
+  if (errno != 0 || *end != '\0') {
+    logger(LOG_WARNING, "config_get_ulong()", "invalid value '%s' for %s, using %lu", str, name,
+           default_val);
+    return default_val;
+  }
+
+  return val;
+}
+
+
+/**
+ * Reads a string from an environment variable
+ *
+ * @param name : name of the environment variable
+ * @param default_val : value returned when variable is unset or empty
+ * @return : value of the variable or default_val
+ */
+const char *config_get_str(const char *name, const char *default_val) {
+  const char *str = getenv(name);
+  if (str == NULL || *str == '\0')
+    return default_val;
+  return str;
+}
+/**
+ * Checks whether a listener port terminates TLS
+ *
+ * XPS_TLS_PORTS lists ports separated by commas, e.g. "8001,8003".
+ *
+ * @param config : config instance
+ * @param port : listener port
+ * @return : true if port is listed
+ */
+bool xps_config_tls(xps_config_t *config, u_int port) {
+  assert(config != NULL);
+
+  const char *str = config->tls_ports;
+  while (*str != '\0') {
+    char *end;
+    u_long curr_port = strtoul(str, &end, 10);
+    if (end != str && (*end == ',' || *end == '\0') && curr_port == port)
+      return true;
+
+    str = strchr(str, ',');
+    if (str == NULL)
+      break;
+    str++;
+  }
+  return false;
+}
+
+/**
+ * Finds the QoS class of a listener port
+ *
+ * XPS_QOS lists classes as "port:weight[:rate]", separated by commas, e.g.
+ * "8001:8,8002:1:1048576". Sinks of a listener's connections share writes in
+ * proportion to weight, and each connection of it writes at most rate bytes
+ * per second. Ports not listed get weight 1 and no rate cap.
+ *
+ * @param config : config instance
+ * @param port : listener port
+ * @param weight : filled with weight of port
+ * @param rate : filled with per connection rate of port, 0 for no cap
+ */
+void xps_config_qos(xps_config_t *config, u_int port, u_int *weight, u_long *rate) {
+  assert(config != NULL);
+
+  *weight = 1;
+  *rate = 0;
+
+  const char *qos = config->qos;
+  u_int curr_port, curr_weight;
+  u_long curr_rate;
+  while (config_qos_next(&qos, &curr_port, &curr_weight, &curr_rate)) {
+    if (curr_port == port) {
+      *weight = curr_weight;
+      *rate = curr_rate;
+      return;
+    }
+  }
+}
+
+/**
+ * Parses the next "port:weight[:rate]" class of a QoS string and advances
+ * str past it. Invalid classes are skipped with a warning.
+ *
+ * @return : false at end of string
+ */
+bool config_qos_next(const char **str, u_int *port, u_int *weight, u_long *rate) {
+  while (**str != '\0') {
+    const char *curr = *str;
+    char *end;
+    *port = strtoul(curr, &end, 10);
+    bool valid = *end == ':';
+    if (valid) {
+      *weight = strtoul(end + 1, &end, 10);
+      *rate = 0;
+      if (*end == ':')
+        *rate = strtoul(end + 1, &end, 10);
+      valid = *weight > 0 && (*end == ',' || *end == '\0');
+    }
+
+    // Move on to the next class
+    *str = strchr(curr, ',');
+    *str = *str != NULL ? *str + 1 : curr + strlen(curr);
+
+    if (valid)
+      return true;
+    logger(LOG_WARNING, "config_qos_next()", "invalid QoS class in '%s'", curr);
+  }
+  return false;
+}
@@ -0,0 +1,66 @@
+#ifndef XPS_CONFIG_H
+#define XPS_CONFIG_H
+
+#include "../xps.h"
+
+/*
+ * Runtime tunables. Every field starts from its DEFAULT_* constant in xps.h
+ * and can be overridden with an XPS_* environment variable of the same name,
+ * e.g. XPS_IO_BUDGET_BYTES=65536.
+ */
+struct xps_config_s {
+  size_t pipe_mem_budget;  // XPS_PIPE_MEM_BUDGET, pipe thresholds above MIN_PIPE_BUFF_THRESH are granted within it
+  size_t io_budget_bytes;  // XPS_IO_BUDGET_BYTES, per pipe side per iteration
+  u_int io_budget_ops;     // XPS_IO_BUDGET_OPS, handler calls per pipe side per iteration
+  u_int accept_budget;     // XPS_ACCEPT_BUDGET, accepts per listener per iteration
+  u_int max_connections;   // XPS_MAX_CONNECTIONS, 0 for no limit
+  u_int listener_max_connections; // XPS_LISTENER_MAX_CONNECTIONS, 0 for no limit
+  u_long max_loop_lag_msec; // XPS_MAX_LOOP_LAG_MSEC, 0 to disable load shedding
+  u_long drain_timeout_msec; // XPS_DRAIN_TIMEOUT_MSEC
+  const char *upgrade_socket; // XPS_UPGRADE_SOCKET, unix socket used to hand over listeners
+  size_t cache_max_bytes; // XPS_CACHE_MAX_BYTES, 0 disables the response cache
+  bool pool_debug; // XPS_POOL_DEBUG, poison freed pool objects and check for misuse
+  u_int shadow_port; // XPS_SHADOW_PORT, upstream port that gets a copy of proxied client traffic, 0 disables
+  int gzip_level; // XPS_GZIP_LEVEL, 1-9, 0 disables gzip responses
+  int zstd_level; // XPS_ZSTD_LEVEL, 0 disables zstd responses
+  size_t compress_min_len; // XPS_COMPRESS_MIN_LEN, smaller response bodies are not compressed
+  u_long rate_conns;       // XPS_RATE_CONNS, new connections per second per client IP, 0 for no limit
+  u_long rate_conns_burst; // XPS_RATE_CONNS_BURST, 0 for one second's worth
+  u_long rate_bytes;       // XPS_RATE_BYTES, bytes per second per client IP both ways, 0 for no limit
+  u_long rate_bytes_burst; // XPS_RATE_BYTES_BURST, 0 for one second's worth
+  const char *qos; // XPS_QOS, "port:weight[:rate],..." per listener, see xps_config_qos()
+  u_int qos_max_weight; // Highest weight in qos, sinks of this weight get the full io_budget_bytes
+  const char *upstreams; // XPS_UPSTREAMS, "host:port,..." new upstream connections are spread over, "unix:path" for unix sockets
+  const char *unix_listeners; // XPS_UNIX_LISTENERS, "path=port,..." unix sockets served like the TCP listener on port, "@name" for abstract ones
+  u_long health_interval_msec; // XPS_HEALTH_INTERVAL_MSEC, 0 for passive checks only
+  const char *health_path; // XPS_HEALTH_PATH, path of HTTP probes, "" to probe with a TCP connect
+  u_int max_fails;  // XPS_MAX_FAILS, failures in a row that eject an upstream
+  u_long eject_msec; // XPS_EJECT_MSEC, first ejection, doubled for every ejection in a row
+  u_int hedge_percentile; // XPS_HEDGE_PERCENTILE, GETs without a first byte after this percentile are hedged, 0 disables
+  u_long hedge_min_msec;  // XPS_HEDGE_MIN_MSEC
+  u_long hedge_budget_percent; // XPS_HEDGE_BUDGET_PERCENT, hedges per 100 requests sent upstream
+  u_int workers; // XPS_WORKERS, threads running blocking work off the loop, 0 runs it on the loop
+  u_int h2_upstreams; // XPS_H2_UPSTREAMS, upstream connections per h2c client, 0 disables h2c
+  const char *sock_profiles;     // XPS_SOCK_PROFILES, "name:option=value:...,..." socket tuning, see xps_sockopt.h
+  const char *listener_profiles; // XPS_LISTENER_PROFILES, "port=name,..." profile per listener
+  const char *upstream_profiles; // XPS_UPSTREAM_PROFILES, "host:port=name,..." profile per upstream
+  size_t zerocopy_min; // XPS_ZEROCOPY_MIN, writes of this many bytes use MSG_ZEROCOPY, 0 disables
+  const char *udp_proxies; // XPS_UDP_PROXIES, "port=host:port,..." UDP ports relayed to an upstream
+  u_long udp_idle_msec;    // XPS_UDP_IDLE_MSEC, UDP flows without traffic for this long are closed
+  u_int udp_max_flows;     // XPS_UDP_MAX_FLOWS, clients per UDP proxy
+  const char *tls_ports; // XPS_TLS_PORTS, "port,..." listeners that terminate TLS
+  const char *tls_cert;  // XPS_TLS_CERT, PEM certificate chain of TLS listeners
+  const char *tls_key;   // XPS_TLS_KEY, PEM private key of tls_cert
+  u_long tls_session_cache; // XPS_TLS_SESSION_CACHE, sessions kept for resumption, 0 disables resumption
+  int cpu; // XPS_CPU, CPU the process is pinned to, -1 when unset
+  cpu_set_t worker_cpus; // CPUs worker threads run on when cpu is set, empty to share it
+  u_int reuseport_group; // XPS_REUSEPORT_GROUP, processes sharing TCP listeners by CPU with SO_REUSEPORT, 0 disables
+  char **argv; // Command line, used to start the new process on upgrade
+};
+
+xps_config_t *xps_config_create(char *argv[]);
+void xps_config_destroy(xps_config_t *config);
+bool xps_config_tls(xps_config_t *config, u_int port);
+void xps_config_qos(xps_config_t *config, u_int port, u_int *weight, u_long *rate);
+
+#endif
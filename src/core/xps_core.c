@@ -1,7 +1,12 @@
 #include "xps_core.h"
 
+void core_drain_handler(void *ptr);
+void core_listen(xps_core_t *core, const char *host, u_int port);
+void core_destroy_udps(xps_core_t *core);
 
-xps_core_t *xps_core_create() {
+
+xps_core_t *xps_core_create(xps_config_t *config, xps_cache_t *cache) {
+  assert(config != NULL);
 
   xps_core_t *core = malloc(sizeof(xps_core_t));/* allocate memory using malloc() */
   /* handle error where core == NULL */
@@ -10,6 +15,9 @@ xps_core_t *xps_core_create() {
     return NULL;
   }
 
+  // Loop reads its settings from the config
+  core->config = config;
+
   xps_loop_t *loop = xps_loop_create(core);/* create xps_loop instance */
   /* handle error where loop == NULL */
   if(loop == NULL){
@@ -23,9 +31,68 @@ xps_core_t *xps_core_create() {
   vec_init(&(core->listeners));
   vec_init(&(core->connections));
   vec_init(&(core->pipes));
+  vec_init(&(core->sessions));
+  vec_init(&(core->h2s));
+  vec_init(&(core->udps));
   core->n_null_listeners = 0;
   core->n_null_connections = 0;
   core->n_null_pipes = 0;
+  core->n_null_sessions = 0;
+  core->cache = cache;
+  vec_init(&(core->inflight));
+  core->n_coalesced = 0;
+  vec_init(&(core->compressors));
+  core->ratelimit = NULL;
+  if (config->rate_conns > 0 || config->rate_bytes > 0) {
+    core->ratelimit = xps_ratelimit_create(config);
+    if (core->ratelimit == NULL)
+      logger(LOG_ERROR, "xps_core_create()", "xps_ratelimit_create() failed, clients are not limited");
+  }
+  vec_init(&(core->sock_profiles));
+  if (xps_sock_profiles_create(core) != OK) {
+    logger(LOG_ERROR, "xps_core_create()", "xps_sock_profiles_create() failed");
+    xps_sock_profiles_destroy(core);
+    vec_deinit(&(core->sock_profiles));
+    xps_loop_destroy(loop);
+    free(core);
+    return NULL;
+  }
+  core->workers = NULL;
+  if (config->workers > 0) {
+    core->workers = xps_workers_create(core, config->workers);
+    if (core->workers == NULL)
+      logger(LOG_ERROR, "xps_core_create()", "xps_workers_create() failed, blocking work runs on the loop");
+  }
+  vec_init(&(core->backends));
+  core->backends_rr = 0;
+  if (xps_backends_create(core) != OK)
+    logger(LOG_ERROR, "xps_core_create()", "xps_backends_create() failed, requests get 503");
+  core->hedge = NULL;
+  if (config->hedge_percentile > 0) {
+    core->hedge = xps_hedge_create(config);
+    if (core->hedge == NULL)
+      logger(LOG_ERROR, "xps_core_create()", "xps_hedge_create() failed, requests are not hedged");
+  }
+  core->tls = NULL;
+  if (config->tls_ports[0] != '\0') {
+    core->tls = xps_tls_create(core);
+    if (core->tls == NULL)
+      logger(LOG_ERROR, "xps_core_create()", "xps_tls_create() failed, TLS listeners close connections");
+  }
+  vec_init(&(core->lingering));
+  core->n_zerocopy_sends = 0;
+  core->n_zerocopy_copied = 0;
+  core->pipe_mem = 0;
+  core->n_connections = 0;
+  core->reserve_fd = open("/dev/null", O_RDONLY);
+  if (core->reserve_fd < 0)
+    logger(LOG_WARNING, "xps_core_create()", "failed to open reserve fd");
+  core->signal_fd = -1;
+  core->draining = false;
+  core->drain_start_msec = 0;
+  core->handover_fd = -1;
+  core->handover_timer = NULL;
+  vec_init(&(core->inherited));
   logger(LOG_DEBUG, "xps_core_create()", "created core");
 
   return core;
@@ -35,6 +102,27 @@ xps_core_t *xps_core_create() {
 void xps_core_destroy(xps_core_t *core) {
   assert(core != NULL);
 
+  // Sessions are destroyed independently of each other at shutdown
+  for (int i = 0; i < core->sessions.length; i++) {
+    xps_session_t *session = core->sessions.data[i];
+    if (session != NULL) {
+      session->leader = NULL;
+      vec_clear(&(session->followers));
+    }
+  }
+
+  // Destroy sessions, detaching them from pipes of their connections
+  for (int i = 0; i < core->sessions.length; i++) {
+    xps_session_t *session = core->sessions.data[i];
+    if (session != NULL)
+      xps_session_destroy(session);
+  }
+  vec_deinit(&(core->sessions));
+  vec_deinit(&(core->inflight));
+  while (core->h2s.length > 0)
+    xps_h2_destroy(core->h2s.data[0]);
+  vec_deinit(&(core->h2s));
+
   // Destroy connections
   for (int i = 0; i < core->connections.length; i++) {
     xps_connection_t *connection = core->connections.data[i];
@@ -43,6 +131,11 @@ void xps_core_destroy(xps_core_t *core) {
   }
   vec_deinit(&(core->connections));
 
+  // Sockets of closed connections stop waiting for zerocopy completions
+  while (core->lingering.length > 0)
+    xps_zerocopy_free(core->lingering.data[0]);
+  vec_deinit(&(core->lingering));
+
   /* destory all the listeners and de-initialize core->listeners */
 	for (int i = 0; i < core->listeners.length; i++) {
     xps_listener_t *listener = core->listeners.data[i];
@@ -50,6 +143,8 @@ void xps_core_destroy(xps_core_t *core) {
       xps_listener_destroy(listener); 
 	}
   vec_deinit(&(core->listeners));
+  core_destroy_udps(core);
+  vec_deinit(&(core->udps));
 
   /* destory all the listeners and de-initialize core->listeners */
 	for (int i = 0; i < core->pipes.length; i++) {
@@ -58,17 +153,45 @@ void xps_core_destroy(xps_core_t *core) {
       if(pipe->source){
         xps_pipe_source_destroy(pipe->source);
       }
-      if(pipe->sink){
-        xps_pipe_sink_destroy(pipe->sink);
+      while(pipe->sinks.length > 0){
+        xps_pipe_sink_destroy(pipe->sinks.data[0]);
       }
       xps_pipe_destroy(pipe);
     }
 	}
   vec_deinit(&(core->pipes));
 
+  // Pipes gave their compressors back while being destroyed
+  xps_compress_pool_clear(core);
+  vec_deinit(&(core->compressors));
+  if (core->ratelimit != NULL)
+    xps_ratelimit_destroy(core->ratelimit);
+  xps_backends_destroy(core);
+  if (core->workers != NULL)
+    xps_workers_destroy(core->workers);
+  xps_sock_profiles_destroy(core);
+  vec_deinit(&(core->sock_profiles));
+  vec_deinit(&(core->backends));
+  if (core->hedge != NULL)
+    xps_hedge_destroy(core->hedge);
+  if (core->tls != NULL)
+    xps_tls_destroy(core->tls);
+
+  xps_signal_detach(core);
+  // Not acked, a process that did not get to start its loop has not taken over
+  if (core->handover_fd >= 0) {
+    close(core->handover_fd);
+    core->handover_fd = -1;
+  }
+  xps_handover_finish(core);
+  vec_deinit(&(core->inherited));
+
   /* destory loop attached to core */
 	xps_loop_destroy(core->loop);
 
+  if (core->reserve_fd >= 0)
+    close(core->reserve_fd);
+
   /* free core instance */
   free(core);
 
@@ -83,13 +206,195 @@ void xps_core_start(xps_core_t *core) {
 
   logger(LOG_DEBUG, "xps_start()", "starting core");
 
+  // Pick up listening sockets from the old process during an upgrade
+  const char *inherit_socket = getenv("XPS_INHERIT_SOCKET");
+  if (inherit_socket != NULL) {
+    if (xps_handover_receive(core, inherit_socket) != OK)
+      logger(LOG_ERROR, "xps_core_start()", "xps_handover_receive() failed");
+    unsetenv("XPS_INHERIT_SOCKET");
+  }
+
   /* create listeners from port 8001 to 8004 */
-	for (int port = 8001; port <= 8004; port++) {
-		xps_listener_create(core, "0.0.0.0", port);
-		logger(LOG_INFO, "xps_core_start()", "server listening on port %d", port);
-	}
+	for (int port = 8001; port <= 8004; port++)
+    core_listen(core, "0.0.0.0", port);
+
+  // Unix socket listeners, "path=port" serves path like the TCP listener on port
+  char *list = strdup(core->config->unix_listeners);
+  char *save_ptr;
+  for (char *entry = list != NULL ? strtok_r(list, ",", &save_ptr) : NULL; entry != NULL;
+       entry = strtok_r(NULL, ",", &save_ptr)) {
+    char *equals = strrchr(entry, '=');
+    u_int port = equals != NULL ? strtoul(equals + 1, NULL, 10) : 0;
+    if (equals == NULL || equals == entry || port == 0 || !is_valid_port(port)) {
+      logger(LOG_WARNING, "xps_core_start()", "invalid unix listener '%s'", entry);
+      continue;
+    }
+    *equals = '\0';
+
+    char host[HANDOVER_HOST_LEN];
+    snprintf(host, sizeof(host), "%s%s", UNIX_SOCKET_PREFIX, entry);
+    core_listen(core, host, port);
+  }
+  free(list);
+
+  // UDP proxies, "port=host:port" relays UDP port to the upstream at host:port
+  list = strdup(core->config->udp_proxies);
+  for (char *entry = list != NULL ? strtok_r(list, ",", &save_ptr) : NULL; entry != NULL;
+       entry = strtok_r(NULL, ",", &save_ptr)) {
+    char *equals = strchr(entry, '=');
+    char *colon = strrchr(entry, ':');
+    u_int port = strtoul(entry, NULL, 10);
+    u_int upstream_port = colon != NULL ? strtoul(colon + 1, NULL, 10) : 0;
+    if (equals == NULL || colon == NULL || colon < equals + 2 || port == 0 || upstream_port == 0 ||
+        !is_valid_port(port) || !is_valid_port(upstream_port)) {
+      logger(LOG_WARNING, "xps_core_start()", "invalid UDP proxy '%s'", entry);
+      continue;
+    }
+    *colon = '\0';
+
+    xps_udp_t *udp = xps_udp_create(core, port, equals + 1, upstream_port);
+    if (udp == NULL)
+      continue;
+    vec_push(&(core->udps), udp);
+    logger(LOG_INFO, "xps_core_start()", "relaying UDP port %u to %s:%u", port, equals + 1,
+           upstream_port);
+  }
+  free(list);
+
+  // Old process closes its listeners once acked
+  xps_handover_finish(core);
+
+  if (xps_signal_attach(core) != OK)
+    logger(LOG_ERROR, "xps_core_start()", "xps_signal_attach() failed");
 
   /* run loop instance using xps_loop_run() */
 	xps_loop_run(core->loop);
 
+}
+
+/**
+ * Creates a listener, on the socket the old process hands over if there is
+ * one during an upgrade
+ */
+void core_listen(xps_core_t *core, const char *host, u_int port) {
+  xps_listener_t *listener;
+  int sock_fd = xps_handover_take_fd(core, host, port);
+  if (sock_fd >= 0) {
+    listener = xps_listener_create_from_fd(core, host, port, sock_fd);
+    if (listener == NULL)
+      close(sock_fd);
+  } else
+    listener = xps_listener_create(core, host, port);
+
+  if (listener == NULL)
+    return;
+  if (is_unix_host(host))
+    logger(LOG_INFO, "core_listen()", "server listening on %s as port %u%s", host, port,
+           sock_fd >= 0 ? " (inherited)" : "");
+  else
+    logger(LOG_INFO, "core_listen()", "server listening on port %u%s", port,
+           sock_fd >= 0 ? " (inherited)" : "");
+}
+
+void core_destroy_udps(xps_core_t *core) {
+  for (int i = 0; i < core->udps.length; i++)
+    xps_udp_destroy(core->udps.data[i]);
+  vec_clear(&(core->udps));
+}
+
+/**
+ * Stops accepting and stops the loop once all connections are closed
+ *
+ * Listeners and UDP proxies are destroyed right away, pipes keep flushing. Connections that
+ * are still open after config->drain_timeout_msec are closed when the core is
+ * destroyed. Draining a second time stops the loop immediately.
+ *
+ * @param core : core to be drained
+ */
+void xps_core_drain(xps_core_t *core) {
+  assert(core != NULL);
+
+  if (core->draining) {
+    xps_loop_stop(core->loop);
+    return;
+  }
+
+  core->draining = true;
+  core->drain_start_msec = get_time_msec();
+
+  for (int i = 0; i < core->listeners.length; i++) {
+    xps_listener_t *listener = core->listeners.data[i];
+    if (listener != NULL)
+      xps_listener_destroy(listener);
+  }
+  core_destroy_udps(core);
+
+  // Idle clients are closed now, busy ones after their current response.
+  // Destroyed sessions leave NULL in sessions, h2s are removed from theirs.
+  for (int i = 0; i < core->sessions.length; i++) {
+    xps_session_t *session = core->sessions.data[i];
+    if (session != NULL)
+      xps_session_drain(session);
+  }
+  for (int i = core->h2s.length - 1; i >= 0; i--) {
+    if (i < core->h2s.length)
+      xps_h2_drain(core->h2s.data[i]);
+  }
+
+  logger(LOG_INFO, "xps_core_drain()", "draining %u connections", core->n_connections);
+
+  core_drain_handler(core);
+}
+
+void core_drain_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_core_t *core = ptr;
+
+  if (core->n_connections == 0) {
+    logger(LOG_INFO, "core_drain_handler()", "drained");
+    xps_loop_stop(core->loop);
+    return;
+  }
+
+  if (get_time_msec() - core->drain_start_msec >= core->config->drain_timeout_msec) {
+    logger(LOG_WARNING, "core_drain_handler()", "drain timed out, closing %u connections",
+           core->n_connections);
+    xps_loop_stop(core->loop);
+    return;
+  }
+
+  xps_loop_add_timer(core->loop, DRAIN_CHECK_MSEC, core, core_drain_handler);
+}
+
+/**
+ * Logs runtime statistics of the core
+ *
+ * Called when a stats dump is requested with SIGUSR1.
+ *
+ * @param core : core whose stats are to be logged
+ */
+void xps_core_log_stats(xps_core_t *core) {
+  assert(core != NULL);
+
+  logger(LOG_INFO, "xps_core_log_stats()",
+         "connections: %u, loop lag: %lu msec, coalesced requests: %lu, cpu: %d",
+         core->n_connections, core->loop->lag_msec, core->n_coalesced, sched_getcpu());
+  xps_listener_log_stats(core);
+  xps_pipe_log_stats(core);
+  xps_buffer_log_stats();
+  xps_loop_log_stats(core->loop);
+  if (core->cache != NULL)
+    xps_cache_log_stats(core->cache);
+  if (core->ratelimit != NULL)
+    xps_ratelimit_log_stats(core->ratelimit);
+  xps_backends_log_stats(core);
+  if (core->workers != NULL)
+    xps_workers_log_stats(core->workers);
+  if (core->hedge != NULL)
+    xps_hedge_log_stats(core->hedge);
+  if (core->tls != NULL)
+    xps_tls_log_stats(core->tls);
+  xps_zerocopy_log_stats(core);
+  for (int i = 0; i < core->udps.length; i++)
+    xps_udp_log_stats(core->udps.data[i]);
 }
\ No newline at end of file
@@ -4,17 +4,47 @@
 #include "../xps.h"
 
 struct xps_core_s {
+  xps_config_t *config;
   xps_loop_t *loop;
   vec_void_t listeners;
   vec_void_t connections;
   vec_void_t pipes;
+  vec_void_t sessions;
+  vec_void_t h2s; // xps_h2_t of h2c client connections
+  vec_void_t udps; // xps_udp_t of ports in config->udp_proxies
   u_int n_null_listeners;
   u_int n_null_connections;
   u_int n_null_pipes;
+  u_int n_null_sessions;
+  xps_cache_t *cache; // Response cache shared with other cores, NULL if disabled
+  vec_void_t inflight; // Sessions whose request can be joined by identical ones
+  u_long n_coalesced;  // Requests answered with another session's response
+  vec_void_t compressors; // Idle xps_compressor_t, reused for response bodies
+  xps_ratelimit_t *ratelimit; // Per client IP limits, NULL if there are none
+  vec_void_t sock_profiles; // xps_sock_profile_t, the default profile first
+  xps_workers_t *workers; // Blocking work off the loop, NULL if config->workers is 0
+  vec_void_t backends; // xps_backend_t of upstream servers
+  u_int backends_rr;   // Round robin position in backends
+  xps_hedge_t *hedge;  // Hedging of slow upstream requests, NULL if disabled
+  xps_tls_t *tls;      // TLS context of listeners in config->tls_ports, NULL if there are none
+  vec_void_t lingering;     // xps_zerocopy_t of closed connections, see xps_zerocopy.h
+  u_long n_zerocopy_sends;  // Sends with MSG_ZEROCOPY
+  u_long n_zerocopy_copied; // Of them, sends the kernel copied anyway
+  size_t pipe_mem; // Sum of buff_thresh of all pipes
+  u_int n_connections;
+  int reserve_fd; // Spare FD, released to accept-and-close when FDs run out
+  int signal_fd;
+  bool draining;
+  u_long drain_start_msec;
+  int handover_fd; // Upgrade socket, or connection to the other process during handover
+  loop_timer_t *handover_timer;
+  vec_void_t inherited; // xps_handover_entry_t of listeners received from old process
 };
 
-xps_core_t *xps_core_create();
+xps_core_t *xps_core_create(xps_config_t *config, xps_cache_t *cache);
 void xps_core_destroy(xps_core_t *core);
 void xps_core_start(xps_core_t *core);
+void xps_core_drain(xps_core_t *core);
+void xps_core_log_stats(xps_core_t *core);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,142 @@
+#include "../xps.h"
+
+u_int hedge_bucket(u_long msec);
+u_long hedge_bucket_max(u_int bucket);
+
+/**
+ * Creates the hedging state of a core
+ *
+ * @param config : percentile, minimum delay and budget are read from here
+ * @return : hedge instance, NULL on failure
+ */
+xps_hedge_t *xps_hedge_create(xps_config_t *config) {
+  assert(config != NULL);
+
+  xps_hedge_t *hedge = calloc(1, sizeof(xps_hedge_t));
+  if (hedge == NULL) {
+    logger(LOG_ERROR, "xps_hedge_create()", "calloc() failed for 'hedge'");
+    return NULL;
+  }
+
+  // Init values
+  hedge->percentile = config->hedge_percentile;
+  hedge->min_delay_msec = config->hedge_min_msec;
+  hedge->budget_percent = config->hedge_budget_percent;
+  hedge->tokens = 0;
+
+  logger(LOG_DEBUG, "xps_hedge_create()", "created hedge");
+
+  return hedge;
+}
+
+void xps_hedge_destroy(xps_hedge_t *hedge) {
+  assert(hedge != NULL);
+
+  free(hedge);
+
+  logger(LOG_DEBUG, "xps_hedge_destroy()", "destroyed hedge");
+}
+
+/**
+ * Records the first byte time of a request
+ */
+void xps_hedge_sample(xps_hedge_t *hedge, u_long msec) {
+  assert(hedge != NULL);
+
+  hedge->hist[hedge_bucket(msec)]++;
+  hedge->n_samples++;
+
+  // Older samples count half as much
+  if (hedge->n_samples >= HEDGE_DECAY_SAMPLES) {
+    for (int i = 0; i < HEDGE_HIST_BUCKETS; i++)
+      hedge->hist[i] /= 2;
+    hedge->n_samples /= 2;
+  }
+}
+
+/**
+ * Finds how long a request may wait for its first byte before it is hedged
+ *
+ * @param hedge : hedge instance
+ * @return : delay in msec, 0 if there are too few samples to tell
+ */
+u_long xps_hedge_delay(xps_hedge_t *hedge) {
+  assert(hedge != NULL);
+
+  u_long total = 0;
+  for (int i = 0; i < HEDGE_HIST_BUCKETS; i++)
+    total += hedge->hist[i];
+  if (total < HEDGE_MIN_SAMPLES)
+    return 0;
+
+  u_long rank = (total * hedge->percentile + 99) / 100;
+  u_long seen = 0;
+  u_int i = 0;
+  for (; i < HEDGE_HIST_BUCKETS - 1; i++) {
+    seen += hedge->hist[i];
+    if (seen >= rank)
+      break;
+  }
+
+  u_long delay_msec = hedge_bucket_max(i);
+  return delay_msec > hedge->min_delay_msec ? delay_msec : hedge->min_delay_msec;
+}
+
+/**
+ * Adds the share of a hedge earned by a request sent upstream
+ */
+void xps_hedge_deposit(xps_hedge_t *hedge) {
+  assert(hedge != NULL);
+
+  hedge->tokens += hedge->budget_percent * 10;
+  if (hedge->tokens > HEDGE_BUDGET_BURST * 1000)
+    hedge->tokens = HEDGE_BUDGET_BURST * 1000;
+}
+
+/**
+ * Takes one hedge from the budget
+ *
+ * @return : true if the request may be hedged
+ */
+bool xps_hedge_take(xps_hedge_t *hedge) {
+  assert(hedge != NULL);
+
+  if (hedge->tokens < 1000) {
+    hedge->n_denied++;
+    return false;
+  }
+  hedge->tokens -= 1000;
+  hedge->n_hedged++;
+  return true;
+}
+
+void xps_hedge_log_stats(xps_hedge_t *hedge) {
+  assert(hedge != NULL);
+
+  logger(LOG_INFO, "xps_hedge_log_stats()", "delay %lu msec, hedged %lu, won %lu, denied %lu",
+         xps_hedge_delay(hedge), hedge->n_hedged, hedge->n_won, hedge->n_denied);
+}
+
+/**
+ * Maps msec to a bucket: one per msec below 16, then four per power of two
+ */
+u_int hedge_bucket(u_long msec) {
+  if (msec < 16)
+    return msec;
+
+  u_int log2 = 63 - __builtin_clzl(msec);
+  u_int bucket = 16 + (log2 - 4) * 4 + ((msec >> (log2 - 2)) & 3);
+  return bucket < HEDGE_HIST_BUCKETS ? bucket : HEDGE_HIST_BUCKETS - 1;
+}
+
+/**
+ * Highest msec that maps to a bucket
+ */
+u_long hedge_bucket_max(u_int bucket) {
+  if (bucket < 16)
+    return bucket;
+
+  u_int log2 = (bucket - 16) / 4 + 4;
+  u_long step = 1UL << (log2 - 2);
+  return (1UL << log2) + ((bucket - 16) % 4 + 1) * step - 1;
+}
@@ -0,0 +1,39 @@
+#ifndef XPS_HEDGE_H
+#define XPS_HEDGE_H
+
+#include "../xps.h"
+
+/*
+ * Hedged upstream requests.
+ *
+ * The time from sending a GET or HEAD upstream to its first response byte is
+ * kept in a log-linear histogram, halved every HEDGE_DECAY_SAMPLES samples so
+ * that it follows recent latency. A request with no first byte after the
+ * config->hedge_percentile of that time is sent to a second backend as well,
+ * see xps_session.h.
+ *
+ * Hedges are paid for from a budget: every request sent upstream adds
+ * config->hedge_budget_percent of a hedge, up to HEDGE_BUDGET_BURST hedges, so
+ * hedging adds at most that share of requests to the backends' load.
+ */
+struct xps_hedge_s {
+  u_int percentile;
+  u_long min_delay_msec;
+  u_long budget_percent;
+  u_long hist[HEDGE_HIST_BUCKETS]; // First byte times, see hedge_bucket()
+  u_long n_samples; // Samples since last decay
+  long tokens;      // Thousandths of a hedge
+  u_long n_hedged;
+  u_long n_won;     // Hedges that answered first
+  u_long n_denied;  // Hedges the budget did not allow
+};
+
+xps_hedge_t *xps_hedge_create(xps_config_t *config);
+void xps_hedge_destroy(xps_hedge_t *hedge);
+void xps_hedge_sample(xps_hedge_t *hedge, u_long msec);
+u_long xps_hedge_delay(xps_hedge_t *hedge);
+void xps_hedge_deposit(xps_hedge_t *hedge);
+bool xps_hedge_take(xps_hedge_t *hedge);
+void xps_hedge_log_stats(xps_hedge_t *hedge);
+
+#endif
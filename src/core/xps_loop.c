@@ -1,18 +1,28 @@
 #include "xps_loop.h"
 
-loop_event_t *loop_event_create(u_int fd, void *ptr, xps_handler_t read_cb, xps_handler_t write_cb, xps_handler_t close_cb);
-void loop_event_destroy(loop_event_t *event);
+loop_event_t *loop_event_create(xps_loop_t *loop, u_int fd, void *ptr, xps_handler_t read_cb, xps_handler_t write_cb, xps_handler_t close_cb);
+void loop_event_destroy(xps_loop_t *loop, loop_event_t *event);
+int loop_create_pools(xps_loop_t *loop);
+void loop_destroy_pools(xps_loop_t *loop);
 void handle_epoll_events(xps_loop_t *loop, int n_events);
+bool pipe_has_work(xps_pipe_t *pipe);
+void handle_pipe_source(xps_loop_t *loop, xps_pipe_t *pipe);
+void handle_pipe_sinks(xps_loop_t *loop, xps_pipe_t *pipe);
+void handle_pipe_drops(xps_pipe_t *pipe);
 bool handle_pipes(xps_loop_t *loop);
+bool handle_listeners(xps_loop_t *loop);
+void handle_timers(xps_loop_t *loop);
+int get_timers_timeout(xps_loop_t *loop);
 void filter_nulls(xps_core_t *core);
 
-loop_event_t *loop_event_create(u_int fd, void *ptr, xps_handler_t read_cb, xps_handler_t write_cb, xps_handler_t close_cb) {
+loop_event_t *loop_event_create(xps_loop_t *loop, u_int fd, void *ptr, xps_handler_t read_cb, xps_handler_t write_cb, xps_handler_t close_cb) {
+  assert(loop != NULL);
   assert(ptr != NULL);
 
   // Alloc memory for 'event' instance
-  loop_event_t *event = malloc(sizeof(loop_event_t));
+  loop_event_t *event = xps_pool_alloc(loop->event_pool);
   if (event == NULL) {
-    logger(LOG_ERROR, "event_create()", "malloc() failed for 'event'");
+    logger(LOG_ERROR, "event_create()", "xps_pool_alloc() failed for 'event'");
     return NULL;
   }
 
@@ -22,16 +32,18 @@ loop_event_t *loop_event_create(u_int fd, void *ptr, xps_handler_t read_cb, xps_
   event->read_cb = read_cb;
 	event->write_cb = write_cb;
 	event->close_cb = close_cb;
+	event->error_cb = NULL;
 
   logger(LOG_DEBUG, "event_create()", "created event");
 
   return event;
 }
 
-void loop_event_destroy(loop_event_t *event) {
+void loop_event_destroy(xps_loop_t *loop, loop_event_t *event) {
+  assert(loop != NULL);
   assert(event != NULL);
 
-  free(event);
+  xps_pool_free(loop->event_pool, event);
 
   logger(LOG_DEBUG, "event_destroy()", "destroyed event");
 }
@@ -49,7 +61,7 @@ void loop_event_destroy(loop_event_t *event) {
 xps_loop_t *xps_loop_create(xps_core_t *core) {
   assert(core != NULL);
 
-	int epoll_fd = epoll_create1(0);
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
 	if (epoll_fd < 0) {
 		logger(LOG_ERROR, "xps_loop_create()", "epoll_create1() failed");
 		return NULL;
@@ -62,11 +74,36 @@ xps_loop_t *xps_loop_create(xps_core_t *core) {
 		return NULL;
 	}
 
+	u_char *read_buff = malloc(MAX_READ_SIZE);
+	if (read_buff == NULL) {
+		logger(LOG_ERROR, "xps_loop_create()", "malloc() failed for 'read_buff'");
+		free(loop);
+		close(epoll_fd);
+		return NULL;
+	}
+
 	loop->core = core;
+	if (loop_create_pools(loop) != OK) {
+		logger(LOG_ERROR, "xps_loop_create()", "loop_create_pools() failed");
+		free(read_buff);
+		free(loop);
+		close(epoll_fd);
+		return NULL;
+	}
+
 	loop->epoll_fd = epoll_fd;
+	loop->read_buff = read_buff;
+	loop->udp_batch = NULL;
+	loop->pipes_rr = 0;
+	vec_init(&loop->timers);
+	loop->n_null_timers = 0;
+	loop->busy_start_msec = get_time_msec();
+	loop->lag_msec = 0;
+	loop->running = false;
 
 	vec_init(&loop->events);
 	loop->n_null_events = 0;
+	loop->time_msec = get_time_msec();
 
 	return loop;
 
@@ -88,11 +125,19 @@ void xps_loop_destroy(xps_loop_t *loop) {
 	for (u_int i = 0; i < loop->events.length; i++) {
 		loop_event_t *event = loop->events.data[i];
 		if (event != NULL) {
-			loop_event_destroy(event);
+			loop_event_destroy(loop, event);
 		}
 	}
 	vec_deinit(&loop->events);
+	for (u_int i = 0; i < loop->timers.length; i++) {
+		if (loop->timers.data[i] != NULL)
+			free(loop->timers.data[i]);
+	}
+	vec_deinit(&loop->timers);
 	close(loop->epoll_fd);
+	free(loop->read_buff);
+	free(loop->udp_batch);
+	loop_destroy_pools(loop);
 	free(loop);
 }
 
@@ -115,7 +160,7 @@ int xps_loop_attach(xps_loop_t *loop, u_int fd, int event_flags, void *ptr, xps_
 
   /* fill this */
 
-	loop_event_t *loop_event = loop_event_create(fd, ptr, read_cb, write_cb, close_cb);
+	loop_event_t *loop_event = loop_event_create(loop, fd, ptr, read_cb, write_cb, close_cb);
 	if (loop_event == NULL) {
 		logger(LOG_ERROR, "xps_loop_attach()", "loop_event_create() failed to create loop-event");
 		return E_FAIL;
@@ -127,7 +172,7 @@ int xps_loop_attach(xps_loop_t *loop, u_int fd, int event_flags, void *ptr, xps_
 
 	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
 		logger(LOG_ERROR, "xps_loop_attach()", "epoll_ctl() failed to attach fd to epoll");
-		loop_event_destroy(loop_event);
+		loop_event_destroy(loop, loop_event);
 		return E_FAIL;
 	}
 
@@ -136,6 +181,65 @@ int xps_loop_attach(xps_loop_t *loop, u_int fd, int event_flags, void *ptr, xps_
 	return OK;
 }
 
+/**
+ * Changes the epoll interest of an attached FD
+ *
+ * Used for flow control: a source whose pipe is full drops EPOLLIN and adds
+ * it back once the pipe has drained. Re-arming with EPOLL_CTL_MOD makes epoll
+ * re-check readiness, so edge-triggered FDs do not miss data that arrived
+ * while they were disarmed.
+ *
+ * @param loop : loop to which FD is attached
+ * @param fd : FD whose interest is to be changed
+ * @param event_flags : new epoll event flags
+ * @return : OK on success and E_FAIL on error
+ */
+int xps_loop_modify(xps_loop_t *loop, u_int fd, int event_flags) {
+	assert(loop != NULL);
+
+	for (u_int i = 0; i < loop->events.length; i++) {
+		loop_event_t *loop_event = loop->events.data[i];
+		if (loop_event != NULL && loop_event->fd == fd) {
+			struct epoll_event event;
+			event.events = event_flags;
+			event.data.ptr = loop_event;
+			if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0) {
+				logger(LOG_ERROR, "xps_loop_modify()", "epoll_ctl() failed to modify fd in epoll");
+				return E_FAIL;
+			}
+			return OK;
+		}
+	}
+	logger(LOG_ERROR, "xps_loop_modify()", "couldnt find matching fd in the event loop to modify");
+	return E_FAIL;
+}
+
+/**
+ * Sets the callback called on EPOLLERR without EPOLLHUP, in place of close_cb
+ *
+ * EPOLLERR is also reported while the socket's error queue holds messages,
+ * which are not errors of the socket itself. error_cb reads them and closes
+ * the socket if it does have an error.
+ *
+ * @param loop : loop to which FD is attached
+ * @param fd : attached FD
+ * @param error_cb : callback, NULL to call close_cb again
+ * @return : OK on success and E_FAIL if FD is not attached
+ */
+int xps_loop_set_error_cb(xps_loop_t *loop, u_int fd, xps_handler_t error_cb) {
+	assert(loop != NULL);
+
+	for (u_int i = 0; i < loop->events.length; i++) {
+		loop_event_t *loop_event = loop->events.data[i];
+		if (loop_event != NULL && loop_event->fd == fd) {
+			loop_event->error_cb = error_cb;
+			return OK;
+		}
+	}
+	logger(LOG_ERROR, "xps_loop_set_error_cb()", "couldnt find matching fd in the event loop");
+	return E_FAIL;
+}
+
 /**
  * Remove FD from epoll
  *
@@ -158,7 +262,7 @@ int xps_loop_detach(xps_loop_t *loop, u_int fd) {
 				logger(LOG_ERROR, "xps_loop_detach()", "epoll_ctl() failed to detach fd from epoll");
 				return E_FAIL;
 			}
-			loop_event_destroy(event);
+			loop_event_destroy(loop, event);
 			loop->events.data[i] = NULL;
 			loop->n_null_events++;
 			return OK;
@@ -168,75 +272,339 @@ int xps_loop_detach(xps_loop_t *loop, u_int fd) {
 	return E_FAIL;
 }
 
+/**
+ * Schedules a callback to be called once after delay_msec
+ *
+ * @param loop : loop on which the timer runs
+ * @param delay_msec : delay from the current loop time
+ * @param ptr : pointer passed to cb
+ * @param cb : callback to be called on expiry
+ * @return : timer instance, valid until it fires or is cancelled. NULL on error
+ */
+loop_timer_t *xps_loop_add_timer(xps_loop_t *loop, u_long delay_msec, void *ptr, xps_handler_t cb) {
+	assert(loop != NULL);
+	assert(cb != NULL);
+
+	loop_timer_t *timer = malloc(sizeof(loop_timer_t));
+	if (timer == NULL) {
+		logger(LOG_ERROR, "xps_loop_add_timer()", "malloc() failed for 'timer'");
+		return NULL;
+	}
+
+	timer->expire_msec = get_time_msec() + delay_msec;
+	timer->cb = cb;
+	timer->ptr = ptr;
+
+	vec_push(&loop->timers, timer);
+
+	return timer;
+}
+
+/**
+ * Cancels a timer that has not fired yet
+ *
+ * @param loop : loop on which the timer runs
+ * @param timer : timer to be cancelled
+ */
+void xps_loop_cancel_timer(xps_loop_t *loop, loop_timer_t *timer) {
+	assert(loop != NULL);
+	assert(timer != NULL);
+
+	for (u_int i = 0; i < loop->timers.length; i++) {
+		if (loop->timers.data[i] == timer) {
+			loop->timers.data[i] = NULL;
+			loop->n_null_timers++;
+			free(timer);
+			return;
+		}
+	}
+	logger(LOG_ERROR, "xps_loop_cancel_timer()", "couldnt find timer to cancel");
+}
+
+/**
+ * Calls callbacks of expired timers
+ *
+ * A timer is removed before its callback runs, so the callback may add new
+ * timers or cancel other ones.
+ */
+void handle_timers(xps_loop_t *loop) {
+	u_long now = get_time_msec();
+
+	// Timers added by callbacks are only due in a later iteration
+	u_int n_timers = loop->timers.length;
+	for (u_int i = 0; i < n_timers; i++) {
+		loop_timer_t *timer = loop->timers.data[i];
+		if (timer == NULL || timer->expire_msec > now)
+			continue;
+
+		loop->timers.data[i] = NULL;
+		loop->n_null_timers++;
+		xps_handler_t cb = timer->cb;
+		void *ptr = timer->ptr;
+		free(timer);
+		cb(ptr);
+	}
+}
+
+/**
+ * Returns epoll_wait timeout until the earliest timer, -1 if there are none
+ */
+int get_timers_timeout(xps_loop_t *loop) {
+	u_long now = get_time_msec();
+	long timeout = -1;
+
+	// 🟡 Linear scan, can be optimized using a min-heap
+	for (u_int i = 0; i < loop->timers.length; i++) {
+		loop_timer_t *timer = loop->timers.data[i];
+		if (timer == NULL)
+			continue;
+		long remaining = timer->expire_msec > now ? (long)(timer->expire_msec - now) : 0;
+		if (timeout < 0 || remaining < timeout)
+			timeout = remaining;
+	}
+	return (int)timeout;
+}
+
+/**
+ * Checks whether a pipe is guaranteed to make progress if handled right now
+ *
+ * Only states that a handler call will change are counted. A ready source on a
+ * paused (full) pipe, or a sink whose peer is not writable, is waiting on
+ * epoll and must not keep the loop polling with a zero timeout.
+ *
+ * @param pipe : pipe to be checked
+ * @return : true if pipe has pending work
+ */
+bool pipe_has_work(xps_pipe_t *pipe) {
+	/*Pipe has source AND source is ready AND source is not paused AND pipe is writable*/
+	if (pipe->source && pipe->source->ready && !pipe->source->paused && xps_pipe_is_writable(pipe))
+		return true;
+
+	/*Pipe has active source and no blocking sink*/
+	if (pipe->source && pipe->source->active && xps_pipe_n_blocking_sinks(pipe) == 0)
+		return true;
+
+	for (int i = 0; i < pipe->sinks.length; i++) {
+		xps_pipe_sink_t *sink = pipe->sinks.data[i];
+		size_t len = xps_pipe_sink_len(sink);
+
+		/*Sink is ready AND has bytes to read*/
+		if (sink->ready && len > 0)
+			return true;
+
+		/*Sink is active and pipe has no source and sink has read everything*/
+		if (sink->active && !(pipe->source) && len == 0)
+			return true;
+
+		/*Dropping sink fell too far behind*/
+		if (sink->mode == PIPE_SINK_DROP && len >= pipe->buff_thresh)
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * Calls the source handler of a pipe until its per-iteration budget is used
+ *
+ * The source is called at most config->io_budget_ops times and stops once
+ * config->io_budget_bytes have been written into the pipe, the source is no
+ * longer ready, or the pipe fills up.
+ */
+void handle_pipe_source(xps_loop_t *loop, xps_pipe_t *pipe) {
+	xps_config_t *config = loop->core->config;
+	size_t n_bytes = 0;
+
+	for (u_int n_ops = 0; n_ops < config->io_budget_ops && n_bytes < config->io_budget_bytes; n_ops++) {
+		/*Pipe has source AND source is ready AND source is not paused AND pipe is writable*/
+		if (!(pipe->source && pipe->source->ready && !pipe->source->paused && xps_pipe_is_writable(pipe)))
+			break;
+
+		size_t len = pipe->buff_list->len;
+		pipe->source->handler_cb(pipe->source);//call connection_source_handler to write into  pipe
+		if (pipe->buff_list->len > len)
+			n_bytes += pipe->buff_list->len - len;
+	}
+}
+
+/**
+ * Calls the handler of each sink of a pipe until its share of the iteration
+ * is used, deficit round robin style
+ *
+ * Each iteration a sink with bytes to clear is given a quantum of
+ * config->io_budget_bytes scaled by its weight relative to
+ * config->qos_max_weight, and clears bytes until its deficit runs out or
+ * config->io_budget_ops calls are made. A sink that overshoots carries the
+ * debt into the next round. Sinks with nothing to clear lose their deficit,
+ * and sinks that cannot write keep at most one quantum, so idle time is never
+ * saved up into a burst. With no weights configured every sink gets the full
+ * io_budget_bytes as before.
+ *
+ * A handler may detach or destroy its sink, so the sink is looked up again by
+ * position after every call.
+ */
+void handle_pipe_sinks(xps_loop_t *loop, xps_pipe_t *pipe) {
+	xps_config_t *config = loop->core->config;
+
+	for (int i = pipe->sinks.length - 1; i >= 0; i--) {
+		if (i >= pipe->sinks.length)
+			continue;
+		xps_pipe_sink_t *sink = pipe->sinks.data[i];
+
+		if (xps_pipe_sink_len(sink) == 0) {
+			sink->deficit = 0;
+			continue;
+		}
+		if (!sink->ready)
+			continue;
+
+		long quantum = (long)(config->io_budget_bytes * sink->weight / config->qos_max_weight);
+		if (quantum < 1)
+			quantum = 1;
+		sink->deficit += quantum;
+		if (sink->deficit > quantum)
+			sink->deficit = quantum;
+
+		for (u_int n_ops = 0; n_ops < config->io_budget_ops && sink->deficit > 0; n_ops++) {
+			/*Sink is still attached AND sink is ready AND has bytes to read*/
+			if (!(i < pipe->sinks.length && pipe->sinks.data[i] == sink && sink->ready &&
+			      xps_pipe_sink_len(sink) > 0))
+				break;
+
+			size_t len = xps_pipe_sink_len(sink);
+			sink->handler_cb(sink);//call connection_sink_handler to read from pipe
+			if (i < pipe->sinks.length && pipe->sinks.data[i] == sink && xps_pipe_sink_len(sink) < len)
+				sink->deficit -= len - xps_pipe_sink_len(sink);
+		}
+	}
+}
+
+/**
+ * Detaches sinks in PIPE_SINK_DROP mode that fell buff_thresh behind
+ *
+ * Such a sink would otherwise make the pipe hold on to data for it forever.
+ * Its close_cb is called, as if the pipe had ended for it.
+ */
+void handle_pipe_drops(xps_pipe_t *pipe) {
+	for (int i = pipe->sinks.length - 1; i >= 0; i--) {
+		if (i >= pipe->sinks.length)
+			continue;
+		xps_pipe_sink_t *sink = pipe->sinks.data[i];
+		if (sink->mode != PIPE_SINK_DROP || xps_pipe_sink_len(sink) < pipe->buff_thresh)
+			continue;
+
+		logger(LOG_WARNING, "handle_pipe_drops()", "dropping sink %zu bytes behind",
+		       xps_pipe_sink_len(sink));
+		xps_pipe_detach_sink(pipe, sink);
+		if (sink->active) {
+			sink->active = false;
+			sink->close_cb(sink);
+		}
+	}
+}
+
+/**
+ * Runs one scheduling pass over all pipes
+ *
+ * Pipes are visited round-robin, starting one position later in every
+ * iteration, and each side gets a bounded budget. A pipe that still has work
+ * when its budget runs out is continued in the next iteration, which the loop
+ * runs without blocking since pipe_has_work() reports it.
+ *
+ * @param loop : loop whose pipes are to be handled
+ * @return : true if any pipe has pending work
+ */
 bool handle_pipes(xps_loop_t *loop) {
 	assert(loop != NULL);
-	for (int i = 0; i < loop->core->pipes.length; i++) {
-		xps_pipe_t *pipe = loop->core->pipes.data[i];
+
+	u_int n_pipes = loop->core->pipes.length;
+	u_int start = n_pipes > 0 ? loop->pipes_rr % n_pipes : 0;
+	loop->pipes_rr = start + 1;
+
+	for (u_int j = 0; j < n_pipes; j++) {
+		xps_pipe_t *pipe = loop->core->pipes.data[(start + j) % n_pipes];
 		if (pipe == NULL)
 				continue;
 			
 		/*Destroy the pipe if it has no source and sink and continue*/
-		if(!(pipe->sink) && !(pipe->source)){
+		if(pipe->sinks.length == 0 && !(pipe->source)){
 			logger(LOG_DEBUG, "handle_pipes()", "pipe has no source and sink");
 			xps_pipe_destroy(pipe);
 			continue;
 		}
 		
-		/*Pipe has source AND source is ready AND pipe is writable*/
-		if (pipe->source  && pipe->source->ready && xps_pipe_is_writable(pipe)){       
-			pipe->source->handler_cb(pipe->source);//call connection_source_handler to write into  pipe
-		}
-	
-		/*Pipe has sink AND sink is ready AND pipe is readable*/
-		if (pipe->sink  && pipe->sink->ready && xps_pipe_is_readable(pipe)) {
-				pipe->sink->handler_cb(pipe->sink);//call connection_sink_handler to read from pipe
-		}
+		handle_pipe_source(loop, pipe);
+		handle_pipe_sinks(loop, pipe);
+		handle_pipe_drops(pipe);
+
+		/*Pause or resume source based on pipe watermarks*/
+		xps_pipe_update_backpressure(pipe);
+
+		/*Adapt pipe threshold to observed drain rate*/
+		xps_pipe_update_sizing(pipe, loop->time_msec);
 		
-		/*Pipe has source and no sink*/
-		if (pipe->source  && !(pipe->sink)) {
+		/*Pipe has active source and no blocking sink. close_cb is called only once*/
+		if (pipe->source && pipe->source->active && xps_pipe_n_blocking_sinks(pipe) == 0) {
 				pipe->source->active = false;
 				pipe->source->close_cb(pipe->source);
 		}
 
-		/*Pipe has sink and no source and pipe is not readable*/
-		if (pipe->sink && !(pipe->source) && !xps_pipe_is_readable(pipe)) {
-				pipe->sink->active = false;
-				pipe->sink->close_cb(pipe->sink);
+		/*Sink is active and pipe has no source and sink has read everything. close_cb is called only once*/
+		for (int i = pipe->sinks.length - 1; i >= 0; i--) {
+			if (i >= pipe->sinks.length)
+				continue;
+			xps_pipe_sink_t *sink = pipe->sinks.data[i];
+			if (sink->active && !(pipe->source) && xps_pipe_sink_len(sink) == 0) {
+					sink->active = false;
+					sink->close_cb(sink);
+			}
 		}
 	
 	}
 
 	for (int i = 0; i < loop->core->pipes.length; i++) {
 		xps_pipe_t *pipe = loop->core->pipes.data[i];
-		if (pipe == NULL){
-				logger(LOG_DEBUG, "handle_pipes", "pipe is null");
-				continue;
-		}
-		/*Pipe has source AND source is ready AND pipe is writable*/
-		if (pipe->source  && pipe->source->ready && xps_pipe_is_writable(pipe)){       
+		if (pipe != NULL && pipe_has_work(pipe))
 			return true;
-		}
-		/*Pipe has sink AND sink is ready AND pipe is readable*/
-		if (pipe->sink  && pipe->sink->ready && xps_pipe_is_readable(pipe)) {
-								return true;
-		}
-		/*Pipe has source and no sink*/
-		if (pipe->source  && !(pipe->sink)) {
-				return true;
-		}
-		/*Pipe has sink and no source and pipe is not readable*/
-		if (pipe->sink && !(pipe->source) && !xps_pipe_is_readable(pipe)) {
-				return true;
-		}
 	}
 	return false;
 }
 
+/**
+ * Continues accepting on listeners whose accept budget ran out
+ *
+ * @param loop : loop whose listeners are to be handled
+ * @return : true if any listener is still ready
+ */
+bool handle_listeners(xps_loop_t *loop) {
+	assert(loop != NULL);
+
+	bool has_ready = false;
+	for (int i = 0; i < loop->core->listeners.length; i++) {
+		xps_listener_t *listener = loop->core->listeners.data[i];
+		if (listener == NULL || !listener->ready)
+			continue;
+
+		xps_listener_connection_handler(listener);
+		if (listener->ready)
+			has_ready = true;
+	}
+	return has_ready;
+}
+
 void filter_nulls(xps_core_t *core) {
 	/*check whether number of nulls in each of events, listeners, connections, pipes list
     exceeds DEFAULT_NULLS_THRESH and filter nulls using vec_filter_null() and set
     number of nulls in each list to 0*/
 	
+	if(core->loop->n_null_timers > DEFAULT_NULLS_THRESH){
+		vec_filter_null(&(core->loop->timers));
+		core->loop->n_null_timers = 0;
+	}
+	if(core->loop->n_null_events > DEFAULT_NULLS_THRESH){
+		vec_filter_null(&(core->loop->events));
+		core->loop->n_null_events = 0;
+	}
 	if(core->n_null_connections > DEFAULT_NULLS_THRESH){
 		vec_filter_null(&(core->connections));
 		core->n_null_connections = 0;
@@ -249,6 +617,10 @@ void filter_nulls(xps_core_t *core) {
 		vec_filter_null(&(core->pipes));
 		core->n_null_pipes = 0;
 	}
+	if(core->n_null_sessions > DEFAULT_NULLS_THRESH){
+		vec_filter_null(&(core->sessions));
+		core->n_null_sessions = 0;
+	}
 
 }
 
@@ -274,9 +646,15 @@ void handle_epoll_events(xps_loop_t *loop, int n_events) {
       if (curr_event_idx == -1) {
         logger(LOG_DEBUG, "handle_epoll_events()", "event not found. skipping");
         continue;
+      }
+			// Error queue event, e.g. zerocopy completions, on a socket that is not closed
+			if ((curr_epoll_event.events & (EPOLLERR | EPOLLHUP)) == EPOLLERR &&
+			    curr_event->error_cb != NULL) {
+        logger(LOG_DEBUG, "handle_epoll_events()", "EVENT / error");
+        curr_event->error_cb(curr_event->ptr);
       }
 			//close event
-			if (curr_epoll_event.events & (EPOLLERR | EPOLLHUP)) {
+			else if (curr_epoll_event.events & (EPOLLERR | EPOLLHUP)) {
         logger(LOG_DEBUG, "handle_epoll_events()", "EVENT / close");
         if (curr_event->close_cb != NULL)
           // Pass the ptr from loop_event_t to the callback
@@ -309,19 +687,34 @@ void xps_loop_run(xps_loop_t *loop) {
 
     logger(LOG_DEBUG, "xps_loop_run()", "starting to run loop");
 
-    while (1) {
+    loop->running = true;
+    while (loop->running) {
       logger(LOG_DEBUG, "xps_loop_run()", "loop top");
+      loop->time_msec = get_time_msec();
 
-      // Handle pipes
+      // Handle expired timers
+      handle_timers(loop);
+
+      // Handle listeners with pending connections, then pipes
+      bool has_ready_listeners = handle_listeners(loop);
       bool has_ready_pipes = handle_pipes(loop);
 
-      int timeout = has_ready_pipes ? 0 : -1;
+      // A timer that stopped the loop, like the drain check, must not wait for the next one
+      int timeout = (has_ready_listeners || has_ready_pipes || !loop->running)
+                        ? 0
+                        : get_timers_timeout(loop);
+
+      // Loop lag is the time spent per iteration outside epoll_wait
+      u_long busy_msec = get_time_msec() - loop->busy_start_msec;
+      loop->lag_msec = (loop->lag_msec * 7 + busy_msec) / 8;
 
       logger(LOG_DEBUG, "xps_loop_run()", "epoll waiting");
       int n_events = epoll_wait(loop->epoll_fd,loop->epoll_events,MAX_EPOLL_EVENTS, timeout);
       logger(LOG_DEBUG, "xps_loop_run()", "epoll wait over");
+      loop->busy_start_msec = get_time_msec();
+      loop->time_msec = loop->busy_start_msec;
 
-      if (n_events < 0)
+      if (n_events < 0 && errno != EINTR)
           logger(LOG_ERROR, "xps_loop_run()", "epoll_wait() error");
 
       // Handle epoll events
@@ -331,4 +724,70 @@ void xps_loop_run(xps_loop_t *loop) {
       // Filter NULLs from vec lists
       filter_nulls(loop->core);
     }
-}
\ No newline at end of file
+
+    logger(LOG_DEBUG, "xps_loop_run()", "loop stopped");
+}
+
+/**
+ * Makes xps_loop_run() return after the current iteration
+ *
+ * @param loop : loop to be stopped
+ */
+void xps_loop_stop(xps_loop_t *loop) {
+  assert(loop != NULL);
+
+  loop->running = false;
+}
+
+/**
+ * Logs occupancy of the loop's object pools
+ *
+ * @param loop : loop whose pools are to be logged
+ */
+void xps_loop_log_stats(xps_loop_t *loop) {
+  assert(loop != NULL);
+
+  xps_pool_log_stats(loop->event_pool);
+  xps_pool_log_stats(loop->connection_pool);
+  xps_pool_log_stats(loop->pipe_pool);
+  xps_pool_log_stats(loop->source_pool);
+  xps_pool_log_stats(loop->sink_pool);
+  xps_pool_log_stats(loop->filter_pool);
+}
+
+int loop_create_pools(xps_loop_t *loop) {
+  bool debug = loop->core->config->pool_debug;
+
+  loop->event_pool = xps_pool_create("event", sizeof(loop_event_t), POOL_OBJS_PER_SLAB, debug);
+  loop->connection_pool =
+      xps_pool_create("connection", sizeof(xps_connection_t), POOL_OBJS_PER_SLAB, debug);
+  loop->pipe_pool = xps_pool_create("pipe", sizeof(xps_pipe_t), POOL_OBJS_PER_SLAB, debug);
+  loop->source_pool =
+      xps_pool_create("source", sizeof(xps_pipe_source_t), POOL_OBJS_PER_SLAB, debug);
+  loop->sink_pool = xps_pool_create("sink", sizeof(xps_pipe_sink_t), POOL_OBJS_PER_SLAB, debug);
+  loop->filter_pool =
+      xps_pool_create("filter", sizeof(xps_pipe_filter_t), POOL_OBJS_PER_SLAB, debug);
+
+  if (loop->event_pool == NULL || loop->connection_pool == NULL || loop->pipe_pool == NULL ||
+      loop->source_pool == NULL || loop->sink_pool == NULL || loop->filter_pool == NULL) {
+    loop_destroy_pools(loop);
+    return E_FAIL;
+  }
+
+  return OK;
+}
+
+void loop_destroy_pools(xps_loop_t *loop) {
+  if (loop->event_pool != NULL)
+    xps_pool_destroy(loop->event_pool);
+  if (loop->connection_pool != NULL)
+    xps_pool_destroy(loop->connection_pool);
+  if (loop->pipe_pool != NULL)
+    xps_pool_destroy(loop->pipe_pool);
+  if (loop->source_pool != NULL)
+    xps_pool_destroy(loop->source_pool);
+  if (loop->sink_pool != NULL)
+    xps_pool_destroy(loop->sink_pool);
+  if (loop->filter_pool != NULL)
+    xps_pool_destroy(loop->filter_pool);
+}
@@ -9,6 +9,23 @@ struct xps_loop_s {
   struct epoll_event epoll_events[MAX_EPOLL_EVENTS];
   vec_void_t events;
   u_int n_null_events;
+  u_long time_msec; // Cached monotonic time, updated every iteration
+  u_char *read_buff; // Scratch buffer of MAX_READ_SIZE that sources read into
+  xps_udp_batch_t *udp_batch; // Scratch datagrams of UDP proxies, NULL until one is created
+  u_int pipes_rr;    // Index of pipe handled first in next iteration
+  vec_void_t timers;
+  u_int n_null_timers;
+  u_long busy_start_msec; // Time at which epoll_wait last returned
+  u_long lag_msec;        // Smoothed time spent per iteration outside epoll_wait
+  bool running;
+
+  // Object pools for structures created per connection
+  xps_pool_t *event_pool;
+  xps_pool_t *connection_pool;
+  xps_pool_t *pipe_pool;
+  xps_pool_t *source_pool;
+  xps_pool_t *sink_pool;
+  xps_pool_t *filter_pool;
 };
 
 struct loop_event_s {
@@ -16,16 +33,29 @@ struct loop_event_s {
   xps_handler_t read_cb;
   xps_handler_t write_cb;
   xps_handler_t close_cb;
+  xps_handler_t error_cb; // Optional, see xps_loop_set_error_cb()
   void *ptr;
 };
 
 typedef struct loop_event_s loop_event_t;
 
+struct loop_timer_s {
+  u_long expire_msec;
+  xps_handler_t cb;
+  void *ptr;
+};
+
 xps_loop_t *xps_loop_create(xps_core_t *core);
 void xps_loop_destroy(xps_loop_t *loop);
 
 int xps_loop_attach(xps_loop_t *loop, u_int fd, int event_flags, void *ptr, xps_handler_t read_cb, xps_handler_t write_cb, xps_handler_t close_cb); // [!code ++ ]
+int xps_loop_modify(xps_loop_t *loop, u_int fd, int event_flags);
+int xps_loop_set_error_cb(xps_loop_t *loop, u_int fd, xps_handler_t error_cb);
 int xps_loop_detach(xps_loop_t *loop, u_int fd);
+loop_timer_t *xps_loop_add_timer(xps_loop_t *loop, u_long delay_msec, void *ptr, xps_handler_t cb);
+void xps_loop_cancel_timer(xps_loop_t *loop, loop_timer_t *timer);
 void xps_loop_run(xps_loop_t *loop);
+void xps_loop_stop(xps_loop_t *loop);
+void xps_loop_log_stats(xps_loop_t *loop);
 
 #endif
\ No newline at end of file
@@ -1,5 +1,9 @@
 #include "xps_pipe.h"
 
+void pipe_trim(xps_pipe_t *pipe);
+int pipe_push(xps_pipe_t *pipe, int stage, xps_buffer_t *buff);
+void pipe_flush_filters(xps_pipe_t *pipe);
+
 xps_pipe_t *xps_pipe_create(xps_core_t *core, size_t buff_thresh, xps_pipe_source_t *source,
                             xps_pipe_sink_t *sink) {
     assert(core != NULL);
@@ -8,9 +12,9 @@ xps_pipe_t *xps_pipe_create(xps_core_t *core, size_t buff_thresh, xps_pipe_sourc
     assert(sink != NULL);
 
     // Alloc memory for pipe instance
-    xps_pipe_t *pipe = malloc(sizeof(xps_pipe_t));
+    xps_pipe_t *pipe = xps_pool_alloc(core->loop->pipe_pool);
     if (pipe == NULL) {
-			logger(LOG_ERROR, "xps_pipe_create()", "malloc() failed for 'pipe'");
+			logger(LOG_ERROR, "xps_pipe_create()", "xps_pool_alloc() failed for 'pipe'");
 			return NULL;
     }
 
@@ -19,16 +23,31 @@ xps_pipe_t *xps_pipe_create(xps_core_t *core, size_t buff_thresh, xps_pipe_sourc
     xps_buffer_list_t* buff_list = xps_buffer_list_create();
     if (buff_list == NULL) {
         logger(LOG_ERROR, "xps_pipe_create()", "xps_buffer_list_create() failed for 'buff_list'");
-        free(pipe);
+        xps_pool_free(core->loop->pipe_pool, pipe);
         return NULL;
     }
 
+    // Fall back to the smallest threshold once the memory budget is used up.
+    // That one is always granted, even past the budget: the budget caps what
+    // pipes take beyond the minimum, the number of pipes is bounded by
+    // config->max_connections.
+    if (core->pipe_mem + buff_thresh > core->config->pipe_mem_budget)
+        buff_thresh = MIN_PIPE_BUFF_THRESH;
+
     // Init values 
     pipe->core = core;
     pipe->source = NULL;
-    pipe->sink = NULL;
+    vec_init(&(pipe->sinks));
+    vec_init(&(pipe->filters));
     pipe->buff_list = buff_list;
     pipe->buff_thresh = buff_thresh;
+    pipe->low_thresh = buff_thresh / 2;
+    pipe->read_size = DEFAULT_READ_SIZE;
+    pipe->window_start_msec = core->loop->time_msec;
+    pipe->window_out = 0;
+    pipe->window_peak = 0;
+    pipe->window_full = false;
+    core->pipe_mem += buff_thresh;
     /* Add pipe to 'pipes' list of core*/
 
     vec_push(&(core->pipes), pipe); //keep this like this as we donno the xps_core_t new structure yet
@@ -61,17 +80,224 @@ void xps_pipe_destroy(xps_pipe_t *pipe) {
 				}
 		}
 
+    pipe->core->pipe_mem -= pipe->buff_thresh;
+
+    /*Filters belong to the pipe*/
+    while (pipe->filters.length > 0)
+        xps_pipe_filter_destroy(pipe->filters.data[0]);
+    vec_deinit(&(pipe->filters));
+
     /*Destroy the buff_list of pipe*/
     xps_buffer_list_destroy(pipe->buff_list);
+    vec_deinit(&(pipe->sinks));
     /*Free the pipe*/
-    free(pipe);
+    xps_pool_free(pipe->core->loop->pipe_pool, pipe);
     logger(LOG_DEBUG, "xps_pipe_destroy()", "destroyed pipe");
 }
 
+/**
+ * Returns the number of bytes the slowest blocking sink has yet to clear
+ *
+ * Sinks in PIPE_SINK_DROP mode are not counted, they never hold the source
+ * back. Bytes held inside filter stages are counted.
+ *
+ * @param pipe : pipe instance
+ * @return : bytes buffered on behalf of blocking sinks
+ */
+size_t xps_pipe_len(xps_pipe_t *pipe) {
+    assert(pipe != NULL);
+
+    size_t offset = 0;
+    bool first = true;
+    for (int i = 0; i < pipe->sinks.length; i++) {
+        xps_pipe_sink_t *sink = pipe->sinks.data[i];
+        if (sink->mode != PIPE_SINK_BLOCK)
+            continue;
+        if (first || sink->offset < offset)
+            offset = sink->offset;
+        first = false;
+    }
+
+    size_t held = 0;
+    for (int i = 0; i < pipe->filters.length; i++) {
+        xps_pipe_filter_t *filter = pipe->filters.data[i];
+        held += filter->held;
+    }
+
+    return pipe->buff_list->len - offset + held;
+}
+
 bool xps_pipe_is_readable(xps_pipe_t *pipe) { return pipe->buff_list->len > 0; }
 
-bool xps_pipe_is_writable(xps_pipe_t *pipe) { return pipe->buff_list->len < pipe->buff_thresh; }
+bool xps_pipe_is_writable(xps_pipe_t *pipe) { return xps_pipe_len(pipe) < pipe->buff_thresh; }
+
+/**
+ * Frees buffers that every sink has cleared
+ *
+ * A pipe without sinks keeps its data for the next sink to be attached.
+ */
+void pipe_trim(xps_pipe_t *pipe) {
+    if (pipe->sinks.length == 0)
+        return;
+
+    size_t offset = ((xps_pipe_sink_t *)pipe->sinks.data[0])->offset;
+    for (int i = 1; i < pipe->sinks.length; i++) {
+        xps_pipe_sink_t *sink = pipe->sinks.data[i];
+        if (sink->offset < offset)
+            offset = sink->offset;
+    }
+
+    if (offset == 0)
+        return;
+
+    xps_buffer_list_clear(pipe->buff_list, offset);
+    for (int i = 0; i < pipe->sinks.length; i++) {
+        xps_pipe_sink_t *sink = pipe->sinks.data[i];
+        sink->offset -= offset;
+    }
+    pipe->window_out += offset;
+}
+
+/**
+ * Pauses or resumes the source of a pipe based on its watermarks
+ *
+ * Once the pipe fills up to buff_thresh the source is paused and its pause_cb
+ * is called, so that it can stop watching for input. The source is resumed
+ * only after the sink drains the pipe to low_thresh, which avoids toggling
+ * interest on every write when the sink is slow.
+ *
+ * @param pipe : pipe whose source is to be updated
+ */
+void xps_pipe_update_backpressure(xps_pipe_t *pipe) {
+    assert(pipe != NULL);
+
+    xps_pipe_source_t *source = pipe->source;
+    if (source == NULL)
+        return;
+
+    if (!source->paused && !xps_pipe_is_writable(pipe)) {
+        source->paused = true;
+        if (source->pause_cb != NULL)
+            source->pause_cb(source);
+        logger(LOG_DEBUG, "xps_pipe_update_backpressure()", "source paused");
+    }
+    else if (source->paused && xps_pipe_len(pipe) <= pipe->low_thresh) {
+        source->paused = false;
+        if (source->resume_cb != NULL)
+            source->resume_cb(source);
+        logger(LOG_DEBUG, "xps_pipe_update_backpressure()", "source resumed");
+    }
+}
+
+
+/**
+ * Adapts buff_thresh of a pipe to the rate at which its sink drains it
+ *
+ * Bytes drained in one PIPE_SIZING_INTERVAL_MSEC window approximate the
+ * bandwidth-delay product of the sink. When the pipe filled up and the sink
+ * still drained at least a full pipe in the window, the pipe is what limits
+ * throughput and it is doubled. A full pipe with a slow sink is cut down to
+ * twice what the sink drained, and a pipe that stayed mostly empty is halved.
+ * Growth is only allowed while the sum of thresholds of all pipes stays
+ * within config->pipe_mem_budget.
+ *
+ * @param pipe : pipe to be resized
+ * @param now_msec : current time in msec
+ */
+void xps_pipe_update_sizing(xps_pipe_t *pipe, u_long now_msec) {
+    assert(pipe != NULL);
+
+    size_t len = xps_pipe_len(pipe);
+    if (len > pipe->window_peak)
+        pipe->window_peak = len;
+    if (len >= pipe->buff_thresh)
+        pipe->window_full = true;
+
+    if (now_msec - pipe->window_start_msec < PIPE_SIZING_INTERVAL_MSEC)
+        return;
+
+    size_t thresh = pipe->buff_thresh;
+    size_t new_thresh = thresh;
+
+    if (pipe->window_full && pipe->window_out >= thresh)
+        new_thresh = thresh * 2;
+    else if (pipe->window_full)
+        new_thresh = pipe->window_out * 2;
+    else if (pipe->window_peak < thresh / 4)
+        new_thresh = thresh / 2;
+
+    if (new_thresh < MIN_PIPE_BUFF_THRESH)
+        new_thresh = MIN_PIPE_BUFF_THRESH;
+    if (new_thresh > MAX_PIPE_BUFF_THRESH)
+        new_thresh = MAX_PIPE_BUFF_THRESH;
+
+    xps_core_t *core = pipe->core;
+    if (new_thresh > thresh && core->pipe_mem + (new_thresh - thresh) > core->config->pipe_mem_budget)
+        new_thresh = thresh;
+
+    if (new_thresh != thresh) {
+        core->pipe_mem = core->pipe_mem - thresh + new_thresh;
+        pipe->buff_thresh = new_thresh;
+        pipe->low_thresh = new_thresh / 2;
+        logger(LOG_DEBUG, "xps_pipe_update_sizing()", "buff_thresh %zu -> %zu", thresh, new_thresh);
+    }
+
+    // Start next window
+    pipe->window_start_msec = now_msec;
+    pipe->window_out = 0;
+    pipe->window_peak = len;
+    pipe->window_full = false;
+}
+
+/**
+ * Logs distribution of buff_thresh and read_size over all pipes
+ *
+ * Pipes are bucketed by powers of two starting at MIN_PIPE_BUFF_THRESH and
+ * MIN_READ_SIZE respectively.
+ *
+ * @param core : core whose pipes are to be logged
+ */
+void xps_pipe_log_stats(xps_core_t *core) {
+    assert(core != NULL);
+
+    u_int thresh_buckets[16] = {0};
+    u_int read_buckets[16] = {0};
+    u_int n_pipes = 0;
+    size_t buffered = 0;
+
+    for (int i = 0; i < core->pipes.length; i++) {
+        xps_pipe_t *pipe = core->pipes.data[i];
+        if (pipe == NULL)
+            continue;
+
+        n_pipes++;
+        buffered += pipe->buff_list->len;
+
+        int b = 0;
+        while (b < 15 && ((size_t)MIN_PIPE_BUFF_THRESH << b) < pipe->buff_thresh)
+            b++;
+        thresh_buckets[b]++;
+
+        b = 0;
+        while (b < 15 && ((size_t)MIN_READ_SIZE << b) < pipe->read_size)
+            b++;
+        read_buckets[b]++;
+    }
+
+    logger(LOG_INFO, "xps_pipe_log_stats()", "pipes: %u, buffered: %zu bytes, thresh total: %zu / %zu bytes",
+           n_pipes, buffered, core->pipe_mem, core->config->pipe_mem_budget);
 
+    for (int b = 0; b < 16; b++) {
+        if (thresh_buckets[b] > 0)
+            logger(LOG_INFO, "xps_pipe_log_stats()", "buff_thresh <= %zu KB: %u pipes",
+                   ((size_t)MIN_PIPE_BUFF_THRESH << b) / 1024, thresh_buckets[b]);
+    }
+    for (int b = 0; b < 16; b++) {
+        if (read_buckets[b] > 0)
+            logger(LOG_INFO, "xps_pipe_log_stats()", "read_size <= %zu KB: %u pipes",
+                   ((size_t)MIN_READ_SIZE << b) / 1024, read_buckets[b]);
+    }
+}
 
 int xps_pipe_attach_source(xps_pipe_t *pipe, xps_pipe_source_t *source) {
     /*assert pipe and source not null*/
@@ -102,64 +328,163 @@ int xps_pipe_detach_source(xps_pipe_t *pipe) {
     pipe->source->pipe = NULL;
     pipe->source = NULL;
 
+    // Nothing more will be written, let stages emit what they still hold
+    pipe_flush_filters(pipe);
+
     return OK;
 }
 
+/**
+ * Attaches a sink to a pipe, in addition to the sinks it already has
+ *
+ * The first sink of a pipe receives whatever the pipe buffered while it had
+ * none. Later sinks only receive bytes written after they were attached.
+ *
+ * @param pipe : pipe instance
+ * @param sink : sink to be attached, its mode is to be set before
+ * @return : OK on success, E_FAIL if sink is attached to a pipe already
+ */
 int xps_pipe_attach_sink(xps_pipe_t *pipe, xps_pipe_sink_t *sink) {
     /*assert pipe and sink not null*/
 		assert(pipe != NULL);
 		assert(sink != NULL);
 
-    /*check whether pipe already has a sink and return E_FAIL*/
-		if(pipe->sink != NULL){
-			logger(LOG_ERROR, "xps_pipe_attach_sink()", "pipe already has a sink attached");
+    /*check whether sink is already attached to a pipe and return E_FAIL*/
+		if(sink->pipe != NULL){
+			logger(LOG_ERROR, "xps_pipe_attach_sink()", "sink already attached to a pipe");
 			return E_FAIL;
 		}
 
-    pipe->sink = sink;
+    sink->offset = pipe->sinks.length == 0 ? 0 : pipe->buff_list->len;
+    vec_push(&(pipe->sinks), sink);
     sink->pipe = pipe;
 
     return OK;
 }
 
-int xps_pipe_detach_sink(xps_pipe_t *pipe) {
-    /*assert pipe not null*/
+int xps_pipe_detach_sink(xps_pipe_t *pipe, xps_pipe_sink_t *sink) {
+    /*assert pipe and sink not null*/
 		assert(pipe != NULL);
+		assert(sink != NULL);
 
-    /*check whether pipe has no sink and return E_FAIL*/
-		if(pipe->sink == NULL){
-			logger(LOG_ERROR, "xps_pipe_detach_sink()", "pipe has no sink attached");
+    /*check whether sink is attached to this pipe and return E_FAIL*/
+		if(sink->pipe != pipe){
+			logger(LOG_ERROR, "xps_pipe_detach_sink()", "sink is not attached to pipe");
 			return E_FAIL;
 		}
 
-    pipe->sink->pipe = NULL;
-    pipe->sink = NULL;
+    vec_remove(&(pipe->sinks), sink);
+    sink->pipe = NULL;
+    sink->offset = 0;
+
+    // Bytes held back only for this sink can go now
+    pipe_trim(pipe);
 
     return OK;
 }
 
+/**
+ * Returns the number of sinks of a pipe in PIPE_SINK_BLOCK mode
+ *
+ * Only these keep the source of the pipe open, a source left with nothing
+ * but dropping sinks is closed like one without any sink.
+ */
+u_int xps_pipe_n_blocking_sinks(xps_pipe_t *pipe) {
+    assert(pipe != NULL);
+
+    u_int n = 0;
+    for (int i = 0; i < pipe->sinks.length; i++) {
+        xps_pipe_sink_t *sink = pipe->sinks.data[i];
+        if (sink->mode == PIPE_SINK_BLOCK)
+            n++;
+    }
+    return n;
+}
+
+
+/**
+ * Appends a filter stage to a pipe, after the stages it already has
+ *
+ * The pipe owns its filters from here on and destroys them with itself.
+ *
+ * @param pipe : pipe instance
+ * @param filter : filter to be attached
+ * @return : OK on success, E_FAIL if filter is attached to a pipe already
+ */
+int xps_pipe_attach_filter(xps_pipe_t *pipe, xps_pipe_filter_t *filter) {
+    assert(pipe != NULL);
+    assert(filter != NULL);
+
+    if (filter->pipe != NULL) {
+        logger(LOG_ERROR, "xps_pipe_attach_filter()", "filter already attached to a pipe");
+        return E_FAIL;
+    }
+
+    vec_push(&(pipe->filters), filter);
+    filter->pipe = pipe;
 
-xps_pipe_source_t *xps_pipe_source_create(void *ptr, xps_handler_t handler_cb,
+    return OK;
+}
+
+/**
+ * Hands a buffer to the given stage of a pipe, or to buff_list past the last one
+ */
+int pipe_push(xps_pipe_t *pipe, int stage, xps_buffer_t *buff) {
+    if (stage >= pipe->filters.length) {
+        if (buff->len == 0)
+            xps_buffer_destroy(buff);
+        else
+            xps_buffer_list_append(pipe->buff_list, buff);
+        return OK;
+    }
+
+    xps_pipe_filter_t *filter = pipe->filters.data[stage];
+    return filter->handler_cb(filter, buff);
+}
+
+/**
+ * Passes end of stream down the filter chain, once per filter
+ *
+ * Stages are flushed in order, so what one emits on flush still goes through
+ * the stages after it.
+ */
+void pipe_flush_filters(xps_pipe_t *pipe) {
+    for (int i = 0; i < pipe->filters.length; i++) {
+        xps_pipe_filter_t *filter = pipe->filters.data[i];
+        if (filter->flushed)
+            continue;
+        filter->flushed = true;
+        if (filter->handler_cb(filter, NULL) != OK)
+            logger(LOG_ERROR, "pipe_flush_filters()", "filter failed to flush");
+    }
+}
+
+xps_pipe_source_t *xps_pipe_source_create(xps_core_t *core, void *ptr, xps_handler_t handler_cb,
                                             xps_handler_t close_cb) {
     /*assert ptr, handler_cb, close_cb not null*/
+		assert(core != NULL);
 		assert(ptr != NULL);
 		assert(handler_cb != NULL);      
 		assert(close_cb != NULL);
     
     /*Allocate memory for 'source' instance, if null returned log the error and return*/
-		xps_pipe_source_t *source = malloc(sizeof(xps_pipe_source_t));
+		xps_pipe_source_t *source = xps_pool_alloc(core->loop->source_pool);
 		if (source == NULL) {
-			logger(LOG_ERROR, "xps_pipe_source_create()", "malloc() failed for 'source'");
+			logger(LOG_ERROR, "xps_pipe_source_create()", "xps_pool_alloc() failed for 'source'");
 			return NULL;
 		}
 
     // Init values
+    source->core = core;
     source->pipe = NULL;
     source->ready = false;
     source->active = false;
+    source->paused = false;
     /*similarly initialise the remaining fields of source instance*/
 		source->handler_cb = handler_cb;
 		source->close_cb = close_cb;
+		source->pause_cb = NULL;
+		source->resume_cb = NULL;
 		source->ptr = ptr;
 
     logger(LOG_DEBUG, "xps_pipe_source_create()", "source successfully created");
@@ -177,7 +502,7 @@ void xps_pipe_source_destroy(xps_pipe_source_t *source) {
 			xps_pipe_detach_source(source->pipe);
 		}
 
-    free(source);
+    xps_pool_free(source->core->loop->source_pool, source);
 
     logger(LOG_DEBUG, "xps_pipe_source_destroy()", "destroyed pipe_source");
 }
@@ -205,26 +530,77 @@ int xps_pipe_source_write(xps_pipe_source_t *source, xps_buffer_t *buff) {
 			return E_FAIL;
     }
 
-    /*Append dup_buff to buff_list of pipe*/
-		xps_buffer_list_append(source->pipe->buff_list, dup_buff);
+    // Grow read size when reads fill the buffer, shrink it when they are mostly empty
+    xps_pipe_t *pipe = source->pipe;
+    if (buff->len >= pipe->read_size && pipe->read_size < MAX_READ_SIZE)
+        pipe->read_size = pipe->read_size * 2 < MAX_READ_SIZE ? pipe->read_size * 2 : MAX_READ_SIZE;
+    else if (buff->len < pipe->read_size / 4 && pipe->read_size > MIN_READ_SIZE)
+        pipe->read_size = pipe->read_size / 2 > MIN_READ_SIZE ? pipe->read_size / 2 : MIN_READ_SIZE;
+
+    /*Pass dup_buff through the filters into buff_list of pipe*/
+    if (pipe_push(pipe, 0, dup_buff) != OK) {
+			logger(LOG_ERROR, "xps_pipe_source_write()", "filter failed");
+			return E_FAIL;
+    }
+
     return OK;
 }
 
-xps_pipe_sink_t *xps_pipe_sink_create(void *ptr, xps_handler_t handler_cb, xps_handler_t close_cb) {
+/**
+ * Appends a buffer to the pipe without copying it
+ *
+ * Unlike xps_pipe_source_write(), the pipe takes over the buffer and destroys
+ * it once the sink has cleared it. Used by sources that already hold their
+ * data in buffers, e.g. slices of cached responses.
+ *
+ * @param source : source attached to the pipe
+ * @param buff : buffer to be handed over
+ * @return : OK on success, E_FAIL if pipe is not writable
+ */
+int xps_pipe_source_append(xps_pipe_source_t *source, xps_buffer_t *buff) {
+    assert(source != NULL);
+    assert(buff != NULL);
+
+    if (source->pipe == NULL) {
+			logger(LOG_ERROR, "xps_pipe_source_append()", "source is not attached to a pipe");
+			return E_FAIL;
+    }
+
+    if (xps_pipe_is_writable(source->pipe) == false) {
+			logger(LOG_ERROR, "xps_pipe_source_append()", "pipe is not writable");
+			return E_FAIL;
+    }
+
+    if (pipe_push(source->pipe, 0, buff) != OK) {
+			logger(LOG_ERROR, "xps_pipe_source_append()", "filter failed");
+			return E_FAIL;
+    }
+
+    return OK;
+}
+
+xps_pipe_sink_t *xps_pipe_sink_create(xps_core_t *core, void *ptr, xps_handler_t handler_cb,
+                                        xps_handler_t close_cb) {
     /*refer to xps_pipe_source_create() and fill accordingly*/
+		assert(core != NULL);
 		assert(ptr != NULL);
 		assert(handler_cb != NULL);
 		assert(close_cb != NULL);
 
-		xps_pipe_sink_t* sink = malloc(sizeof(xps_pipe_sink_t));
+		xps_pipe_sink_t* sink = xps_pool_alloc(core->loop->sink_pool);
 		if(sink == NULL){
-			logger(LOG_ERROR, "xps_pipe_sink_create()", "malloc() failed for sink");
+			logger(LOG_ERROR, "xps_pipe_sink_create()", "xps_pool_alloc() failed for sink");
 			return NULL;
 		}
 
+		sink->core = core;
 		sink->active = false;
 		sink->ready = false;
 		sink->pipe = NULL;
+		sink->mode = PIPE_SINK_BLOCK;
+		sink->offset = 0;
+		sink->weight = 1;
+		sink->deficit = 0;
 		sink->ptr = ptr;
 		sink->handler_cb = handler_cb;
 		sink->close_cb = close_cb;
@@ -239,15 +615,26 @@ void xps_pipe_sink_destroy(xps_pipe_sink_t *sink) {
 		assert(sink != NULL);
 
 		if(sink->pipe != NULL){
-			xps_pipe_detach_sink(sink->pipe);
+			xps_pipe_detach_sink(sink->pipe, sink);
 		}
 
-		free(sink);
+		xps_pool_free(sink->core->loop->sink_pool, sink);
 
 		logger(LOG_DEBUG, "xps_pipe_sink_destroy()", "destroyed pipe_sink");
 
 }
 
+/**
+ * Returns the number of bytes in the pipe not yet cleared by this sink
+ */
+size_t xps_pipe_sink_len(xps_pipe_sink_t *sink) {
+    assert(sink != NULL);
+
+    if (sink->pipe == NULL)
+        return 0;
+    return sink->pipe->buff_list->len - sink->offset;
+}
+
 xps_buffer_t *xps_pipe_sink_read(xps_pipe_sink_t *sink, size_t len) {
     /*assert sink not null and len greater than 0*/
 		assert(sink != NULL);
@@ -258,14 +645,14 @@ xps_buffer_t *xps_pipe_sink_read(xps_pipe_sink_t *sink, size_t len) {
 			return NULL;
     }
 
-    if (sink->pipe->buff_list->len < len) {
+    if (xps_pipe_sink_len(sink) < len) {
 			logger(LOG_ERROR, "xps_pipe_sink_read()", "requested length more than available");
 			return NULL;
     }
 
-    xps_buffer_t *buff = xps_buffer_list_read(sink->pipe->buff_list, len);
+    xps_buffer_t *buff = xps_buffer_list_read_at(sink->pipe->buff_list, sink->offset, len);
     if (buff == NULL) {
-			logger(LOG_ERROR, "xps_pipe_sink_read()", "xps_buffer_list_read() failed");
+			logger(LOG_ERROR, "xps_pipe_sink_read()", "xps_buffer_list_read_at() failed");
 			return NULL;
     }
 
@@ -281,15 +668,192 @@ int xps_pipe_sink_clear(xps_pipe_sink_t *sink, size_t len) {
     return E_FAIL;
     }
 
-    if (sink->pipe->buff_list->len < len) {
+    if (xps_pipe_sink_len(sink) < len) {
 			logger(LOG_ERROR, "xps_pipe_sink_clear()", "requested length more than available");
 			return E_FAIL;
     }
 
-    if (xps_buffer_list_clear(sink->pipe->buff_list,len) != OK) {
-			logger(LOG_ERROR, "xps_pipe_sink_clear()", "xps_buffer_list_clear() failed");
+    sink->offset += len;
+    pipe_trim(sink->pipe);
+
+    return OK;
+}
+
+/**
+ * Points iovecs at the next len bytes of a sink without copying them, for
+ * sinks that write out several buffers at once
+ *
+ * @param sink : sink attached to the pipe
+ * @param len : number of bytes wanted
+ * @param iov : iovecs to be filled
+ * @param max_iov : size of iov
+ * @return : number of iovecs filled, E_FAIL on error
+ */
+int xps_pipe_sink_iov(xps_pipe_sink_t *sink, size_t len, struct iovec *iov, int max_iov) {
+    assert(sink != NULL);
+    assert(len > 0);
+
+    if (sink->pipe == NULL) {
+			logger(LOG_ERROR, "xps_pipe_sink_iov()", "sink is not attached to a pipe");
 			return E_FAIL;
     }
 
-    return OK;
-}
\ No newline at end of file
+    if (xps_pipe_sink_len(sink) < len) {
+			logger(LOG_ERROR, "xps_pipe_sink_iov()", "requested length more than available");
+			return E_FAIL;
+    }
+
+    return xps_buffer_list_iov(sink->pipe->buff_list, sink->offset, len, iov, max_iov);
+}
+
+/**
+ * Appends slices of the first len bytes of a sink to buff_list
+ *
+ * The slices keep the pipe's buffers alive after the sink has cleared them,
+ * e.g. while the kernel still reads them for a zerocopy send.
+ *
+ * @param sink : sink attached to the pipe
+ * @param len : number of bytes, at most xps_pipe_sink_len()
+ * @param buff_list : list to which the slices are appended
+ * @return : OK on success, E_FAIL on error
+ */
+int xps_pipe_sink_tee(xps_pipe_sink_t *sink, size_t len, xps_buffer_list_t *buff_list) {
+    assert(sink != NULL);
+    assert(buff_list != NULL);
+
+    if (sink->pipe == NULL) {
+			logger(LOG_ERROR, "xps_pipe_sink_tee()", "sink is not attached to a pipe");
+			return E_FAIL;
+    }
+
+    return xps_buffer_list_tee(sink->pipe->buff_list, sink->offset, len, buff_list);
+}
+
+/**
+ * Moves len bytes out of the pipe into buff_list without copying them
+ *
+ * Equivalent to xps_pipe_sink_read() followed by xps_pipe_sink_clear() for
+ * sinks that keep the data in buffers instead of writing it out. Buffers are
+ * handed over when this is the only sink, other sinks get slices of them.
+ *
+ * @param sink : sink attached to the pipe
+ * @param buff_list : list to which the bytes are appended
+ * @param len : number of bytes to be moved
+ * @return : OK on success, E_FAIL on error
+ */
+int xps_pipe_sink_move(xps_pipe_sink_t *sink, xps_buffer_list_t *buff_list, size_t len) {
+    assert(sink != NULL);
+    assert(buff_list != NULL);
+
+    if (sink->pipe == NULL) {
+			logger(LOG_ERROR, "xps_pipe_sink_move()", "sink is not attached to a pipe");
+			return E_FAIL;
+    }
+
+    if (len == 0)
+        return OK;
+
+    xps_pipe_t *pipe = sink->pipe;
+    if (pipe->sinks.length == 1) {
+        if (xps_buffer_list_move(pipe->buff_list, buff_list, len) != OK) {
+			logger(LOG_ERROR, "xps_pipe_sink_move()", "xps_buffer_list_move() failed");
+			return E_FAIL;
+        }
+        pipe->window_out += len;
+        return OK;
+    }
+
+    if (xps_buffer_list_tee(pipe->buff_list, sink->offset, len, buff_list) != OK) {
+			logger(LOG_ERROR, "xps_pipe_sink_move()", "xps_buffer_list_tee() failed");
+			return E_FAIL;
+    }
+
+    return xps_pipe_sink_clear(sink, len);
+}
+
+xps_pipe_filter_t *xps_pipe_filter_create(xps_core_t *core, void *ptr, xps_filter_handler_t handler_cb,
+                                          xps_handler_t close_cb) {
+    assert(core != NULL);
+    assert(handler_cb != NULL);
+
+    xps_pipe_filter_t *filter = xps_pool_alloc(core->loop->filter_pool);
+    if (filter == NULL) {
+        logger(LOG_ERROR, "xps_pipe_filter_create()", "xps_pool_alloc() failed for 'filter'");
+        return NULL;
+    }
+
+    // Init values
+    filter->core = core;
+    filter->pipe = NULL;
+    filter->handler_cb = handler_cb;
+    filter->close_cb = close_cb;
+    filter->held = 0;
+    filter->flushed = false;
+    filter->ptr = ptr;
+
+    logger(LOG_DEBUG, "xps_pipe_filter_create()", "filter successfully created");
+
+    return filter;
+}
+
+void xps_pipe_filter_destroy(xps_pipe_filter_t *filter) {
+    assert(filter != NULL);
+
+    if (filter->pipe != NULL)
+        vec_remove(&(filter->pipe->filters), filter);
+
+    if (filter->close_cb != NULL)
+        filter->close_cb(filter);
+
+    xps_pool_free(filter->core->loop->filter_pool, filter);
+
+    logger(LOG_DEBUG, "xps_pipe_filter_destroy()", "destroyed pipe_filter");
+}
+
+/**
+ * Hands a buffer from a filter stage on to the next one
+ *
+ * The next stage, or buff_list after the last stage, takes over the buffer.
+ * Passing on the buffer the stage was given adds no copy, and so does passing
+ * slices of it.
+ *
+ * @param filter : stage emitting the buffer
+ * @param buff : buffer to be passed on
+ * @return : OK on success, E_FAIL if a later stage failed
+ */
+int xps_pipe_filter_emit(xps_pipe_filter_t *filter, xps_buffer_t *buff) {
+    assert(filter != NULL);
+    assert(buff != NULL);
+
+    xps_pipe_t *pipe = filter->pipe;
+    if (pipe == NULL) {
+        logger(LOG_ERROR, "xps_pipe_filter_emit()", "filter is not attached to a pipe");
+        xps_buffer_destroy(buff);
+        return E_FAIL;
+    }
+
+    for (int i = 0; i < pipe->filters.length; i++) {
+        if (pipe->filters.data[i] == filter)
+            return pipe_push(pipe, i + 1, buff);
+    }
+
+    xps_buffer_destroy(buff);
+    return E_FAIL;
+}
+
+/**
+ * Reports how many bytes a filter stage holds back
+ *
+ * Stages that buffer data before emitting it call this whenever that amount
+ * changes. The bytes count against buff_thresh like those in buff_list, so a
+ * stage that holds on to data pauses the source; the loop re-checks the
+ * watermarks after every pass over the pipe.
+ *
+ * @param filter : stage holding the bytes
+ * @param held : bytes taken in and not emitted yet
+ */
+void xps_pipe_filter_hold(xps_pipe_filter_t *filter, size_t held) {
+    assert(filter != NULL);
+
+    filter->held = held;
+}
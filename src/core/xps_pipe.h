@@ -3,53 +3,115 @@
 
 #include "../xps.h"
 
+/*
+ * A pipe carries bytes from one source to one or more sinks. Every sink reads
+ * buff_list at its own offset, and buffers are freed only once the slowest
+ * sink has cleared them, so fanning out does not copy data per sink.
+ *
+ * Bytes written by the source can be run through a chain of filter stages
+ * before they reach buff_list. A stage takes over every buffer handed to it
+ * and emits buffers to the next stage: the same one for pass-through, slices
+ * of it to split, or new ones.
+ */
+enum xps_pipe_sink_mode_e {
+    PIPE_SINK_BLOCK, // Source is paused while this sink is buff_thresh behind
+    PIPE_SINK_DROP   // Sink is dropped once buff_thresh behind, e.g. shadow traffic
+};
+
 struct xps_pipe_s {
     xps_core_t *core;
     xps_pipe_source_t *source;
-    xps_pipe_sink_t *sink;
-    xps_buffer_list_t *buff_list;
-    size_t buff_thresh;
+    vec_void_t sinks;
+    vec_void_t filters; // Stages in order from source to sinks
+    xps_buffer_list_t *buff_list; // Bytes not yet cleared by every sink
+    size_t buff_thresh; // High watermark, source is paused at or above this
+    size_t low_thresh;  // Low watermark, paused source is resumed at or below this
+    size_t read_size;   // Suggested size of a single read by the source
+
+    // Sizing window, see xps_pipe_update_sizing()
+    u_long window_start_msec;
+    size_t window_out;  // Bytes drained by all sinks
+    size_t window_peak; // Highest xps_pipe_len() seen
+    bool window_full;   // Pipe reached buff_thresh
 };
 
 struct xps_pipe_source_s {
+    xps_core_t *core;
     xps_pipe_t *pipe;
     bool ready;
     bool active;
+    bool paused;
     xps_handler_t handler_cb;
     xps_handler_t close_cb;
+    xps_handler_t pause_cb;  // Optional, called when pipe crosses its high watermark
+    xps_handler_t resume_cb; // Optional, called when pipe drains to its low watermark
     void *ptr;
 };
 
 struct xps_pipe_sink_s {
+    xps_core_t *core;
     xps_pipe_t *pipe;
     bool ready;
     bool active;
+    enum xps_pipe_sink_mode_e mode;
+    size_t offset; // Bytes at the front of pipe->buff_list already cleared by this sink
+    u_int weight;  // Share of writes against other sinks, see handle_pipe_sinks()
+    long deficit;  // Bytes the sink may still clear in this round, negative if it overshot
     xps_handler_t handler_cb;
     xps_handler_t close_cb;
     void *ptr;
 };
 
+struct xps_pipe_filter_s {
+    xps_core_t *core;
+    xps_pipe_t *pipe;
+    xps_filter_handler_t handler_cb; // Takes over buff, called with NULL once at end of stream
+    xps_handler_t close_cb; // Optional, called when filter is destroyed
+    size_t held;  // Bytes taken in and not emitted yet, set with xps_pipe_filter_hold()
+    bool flushed; // End of stream was passed to handler_cb
+    void *ptr;
+};
+
 /* xps_pipe */
 xps_pipe_t *xps_pipe_create(xps_core_t *core, size_t buff_thresh, xps_pipe_source_t *source,
                             xps_pipe_sink_t *sink);
 void xps_pipe_destroy(xps_pipe_t *pipe);
+size_t xps_pipe_len(xps_pipe_t *pipe);
 bool xps_pipe_is_readable(xps_pipe_t *pipe);
 bool xps_pipe_is_writable(xps_pipe_t *pipe);
+void xps_pipe_update_backpressure(xps_pipe_t *pipe);
+void xps_pipe_update_sizing(xps_pipe_t *pipe, u_long now_msec);
+void xps_pipe_log_stats(xps_core_t *core);
 int xps_pipe_attach_source(xps_pipe_t *pipe, xps_pipe_source_t *source);
 int xps_pipe_detach_source(xps_pipe_t *pipe);
 int xps_pipe_attach_sink(xps_pipe_t *pipe, xps_pipe_sink_t *sink);
-int xps_pipe_detach_sink(xps_pipe_t *pipe);
+int xps_pipe_detach_sink(xps_pipe_t *pipe, xps_pipe_sink_t *sink);
+int xps_pipe_attach_filter(xps_pipe_t *pipe, xps_pipe_filter_t *filter);
+u_int xps_pipe_n_blocking_sinks(xps_pipe_t *pipe);
 
 /* xps_pipe_source */
-xps_pipe_source_t *xps_pipe_source_create(void *ptr, xps_handler_t handler_cb,
+xps_pipe_source_t *xps_pipe_source_create(xps_core_t *core, void *ptr, xps_handler_t handler_cb,
                                             xps_handler_t close_cb);
 void xps_pipe_source_destroy(xps_pipe_source_t *source);
 int xps_pipe_source_write(xps_pipe_source_t *source, xps_buffer_t *buff);
+int xps_pipe_source_append(xps_pipe_source_t *source, xps_buffer_t *buff);
 
 /* xps_pipe_sink */
-xps_pipe_sink_t *xps_pipe_sink_create(void *ptr, xps_handler_t handler_cb, xps_handler_t close_cb);
+xps_pipe_sink_t *xps_pipe_sink_create(xps_core_t *core, void *ptr, xps_handler_t handler_cb,
+                                        xps_handler_t close_cb);
 void xps_pipe_sink_destroy(xps_pipe_sink_t *sink);
+size_t xps_pipe_sink_len(xps_pipe_sink_t *sink);
 xps_buffer_t *xps_pipe_sink_read(xps_pipe_sink_t *sink, size_t len);
 int xps_pipe_sink_clear(xps_pipe_sink_t *sink, size_t len);
+int xps_pipe_sink_iov(xps_pipe_sink_t *sink, size_t len, struct iovec *iov, int max_iov);
+int xps_pipe_sink_tee(xps_pipe_sink_t *sink, size_t len, xps_buffer_list_t *buff_list);
+int xps_pipe_sink_move(xps_pipe_sink_t *sink, xps_buffer_list_t *buff_list, size_t len);
+
+/* xps_pipe_filter */
+xps_pipe_filter_t *xps_pipe_filter_create(xps_core_t *core, void *ptr, xps_filter_handler_t handler_cb,
+                                          xps_handler_t close_cb);
+void xps_pipe_filter_destroy(xps_pipe_filter_t *filter);
+int xps_pipe_filter_emit(xps_pipe_filter_t *filter, xps_buffer_t *buff);
+void xps_pipe_filter_hold(xps_pipe_filter_t *filter, size_t held);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,1275 @@
+#include "../xps.h"
+
+#define HTTP_400                                                                       \
+  "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+#define HTTP_502                                                                       \
+  "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+#define HTTP_503                                                                       \
+  "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+
+void session_client_source_handler(void *ptr);
+void session_client_source_close_handler(void *ptr);
+void session_client_sink_handler(void *ptr);
+void session_client_sink_close_handler(void *ptr);
+void session_upstream_source_handler(void *ptr);
+void session_upstream_source_close_handler(void *ptr);
+void session_upstream_sink_handler(void *ptr);
+void session_upstream_sink_close_handler(void *ptr);
+void session_shadow_sink_handler(void *ptr);
+void session_shadow_sink_close_handler(void *ptr);
+void session_mirror(xps_session_t *session, xps_connection_t *client);
+void session_process_req(xps_session_t *session);
+void session_process_res(xps_session_t *session);
+void session_res_done(xps_session_t *session);
+void session_to_client(xps_session_t *session, size_t len);
+void session_tee_res(xps_session_t *session, size_t len);
+enum xps_encoding_e session_pick_encoding(xps_session_t *session, xps_http_req_t *req);
+int session_cache_hit(xps_session_t *session, const char *key);
+xps_buffer_t *session_rewrite_head(xps_session_t *session, xps_buffer_list_t *from,
+                                   xps_http_res_t *res);
+int session_connect_upstream(xps_session_t *session);
+void session_res_started(xps_session_t *session, xps_pipe_sink_t *sink);
+void session_hedge_arm(xps_session_t *session, size_t head_len);
+void session_hedge_handler(void *ptr);
+void session_hedge_start(xps_session_t *session);
+void session_hedge_promote(xps_session_t *session);
+void session_hedge_cancel(xps_session_t *session);
+void session_tunnel(xps_session_t *session);
+int session_h2(xps_session_t *session);
+void session_error(xps_session_t *session, const char *res);
+void session_drop_capture(xps_session_t *session);
+void session_discard(xps_buffer_list_t *buff_list);
+xps_session_t *session_find_leader(xps_core_t *core, const char *key);
+void session_follow(xps_session_t *session, xps_session_t *leader, size_t head_len);
+void session_share(xps_session_t *session);
+void session_unlead(xps_session_t *session);
+void session_unfollow(xps_session_t *session);
+void session_end_followers(xps_session_t *session, bool complete);
+void session_client_gone(xps_session_t *session);
+void session_update(xps_session_t *session);
+void session_update_ready(xps_session_t *session);
+void session_free(xps_session_t *session);
+
+/**
+ * Creates a proxy session for a client connection
+ *
+ * The upstream is connected on the first request that cannot be answered
+ * from the cache.
+ *
+ * @param core : core instance
+ * @param client : client connection, its source and sink are piped to the session
+ * @return : session instance, NULL on failure
+ */
+xps_session_t *xps_session_create(xps_core_t *core, xps_connection_t *client) {
+  assert(core != NULL);
+  assert(client != NULL);
+
+  xps_session_t *session = calloc(1, sizeof(xps_session_t));
+  if (session == NULL) {
+    logger(LOG_ERROR, "xps_session_create()", "calloc() failed for 'session'");
+    return NULL;
+  }
+
+  // Init values
+  session->core = core;
+  session->listener = client->listener;
+  session->client_source = xps_pipe_source_create(core, session, session_client_source_handler,
+                                                  session_client_source_close_handler);
+  session->client_sink = xps_pipe_sink_create(core, session, session_client_sink_handler,
+                                              session_client_sink_close_handler);
+  session->upstream_source = xps_pipe_source_create(core, session, session_upstream_source_handler,
+                                                    session_upstream_source_close_handler);
+  session->upstream_sink = xps_pipe_sink_create(core, session, session_upstream_sink_handler,
+                                                session_upstream_sink_close_handler);
+  if (core->hedge != NULL) {
+    session->hedge_source = xps_pipe_source_create(core, session, session_upstream_source_handler,
+                                                   session_upstream_source_close_handler);
+    session->hedge_sink = xps_pipe_sink_create(core, session, session_upstream_sink_handler,
+                                               session_upstream_sink_close_handler);
+  }
+  session->req_buff = xps_buffer_list_create();
+  session->res_buff = xps_buffer_list_create();
+  session->to_client = xps_buffer_list_create();
+  session->to_upstream = xps_buffer_list_create();
+  session->state = SESSION_REQ_HEAD;
+  session->res_body_left = -1;
+  vec_init(&(session->followers));
+
+  if (session->client_source == NULL ||
+      session->client_sink == NULL || session->upstream_source == NULL ||
+      session->upstream_sink == NULL || session->req_buff == NULL || session->res_buff == NULL ||
+      session->to_client == NULL || session->to_upstream == NULL ||
+      (core->hedge != NULL && (session->hedge_source == NULL || session->hedge_sink == NULL))) {
+    logger(LOG_ERROR, "xps_session_create()", "failed to allocate session");
+    session_free(session);
+    return NULL;
+  }
+  if (session->listener != NULL) {
+    session->client_sink->weight = session->listener->weight;
+    session->upstream_sink->weight = session->listener->weight;
+    if (session->hedge_sink != NULL)
+      session->hedge_sink->weight = session->listener->weight;
+  }
+
+  if (xps_pipe_create(core, DEFAULT_PIPE_BUFF_THRESH, client->source, session->client_sink) ==
+          NULL ||
+      xps_pipe_create(core, DEFAULT_PIPE_BUFF_THRESH, session->client_source, client->sink) ==
+          NULL) {
+    logger(LOG_ERROR, "xps_session_create()", "xps_pipe_create() failed");
+    session_free(session);
+    return NULL;
+  }
+
+  if (core->config->shadow_port != 0)
+    session_mirror(session, client);
+
+  vec_push(&(core->sessions), session);
+  session_update(session);
+
+  logger(LOG_DEBUG, "xps_session_create()", "created session");
+
+  return session;
+}
+
+void xps_session_destroy(xps_session_t *session) {
+  assert(session != NULL);
+
+  // Set NULL in 'sessions' list of core
+  xps_core_t *core = session->core;
+  for (int i = 0; i < core->sessions.length; i++) {
+    if (core->sessions.data[i] == session) {
+      core->sessions.data[i] = NULL;
+      core->n_null_sessions++;
+      break;
+    }
+  }
+
+  session_unlead(session);
+  session_unfollow(session);
+  session_end_followers(session, false);
+
+  session_free(session);
+
+  logger(LOG_DEBUG, "xps_session_destroy()", "destroyed session");
+}
+
+/**
+ * Winds a session down while the core drains: a client idle between
+ * requests is closed now, a busy one after the current response
+ *
+ * Responses whose head is yet to be sent say "Connection: close", see
+ * session_rewrite_head(); requests read from now on are the last one too.
+ *
+ * @param session : session of a draining core
+ */
+void xps_session_drain(xps_session_t *session) {
+  assert(session != NULL);
+
+  session->req_close = true;
+
+  // A partial request in req_buff is still answered
+  if (session->state == SESSION_REQ_HEAD && session->req_buff->len == 0)
+    session->closing = true;
+
+  session_update(session);
+}
+
+void session_free(xps_session_t *session) {
+  // Destroying sources and sinks detaches them, pipes left without a peer
+  // close the client and upstream connections
+  if (session->client_source != NULL)
+    xps_pipe_source_destroy(session->client_source);
+  if (session->client_sink != NULL)
+    xps_pipe_sink_destroy(session->client_sink);
+  if (session->upstream_source != NULL)
+    xps_pipe_source_destroy(session->upstream_source);
+  if (session->upstream_sink != NULL)
+    xps_pipe_sink_destroy(session->upstream_sink);
+  if (session->hedge_timer != NULL)
+    xps_loop_cancel_timer(session->core->loop, session->hedge_timer);
+  if (session->hedge_req != NULL)
+    xps_buffer_destroy(session->hedge_req);
+  if (session->hedge_source != NULL)
+    xps_pipe_source_destroy(session->hedge_source);
+  if (session->hedge_sink != NULL)
+    xps_pipe_sink_destroy(session->hedge_sink);
+  if (session->shadow_sink != NULL)
+    xps_pipe_sink_destroy(session->shadow_sink);
+  if (session->req_buff != NULL)
+    xps_buffer_list_destroy(session->req_buff);
+  if (session->res_buff != NULL)
+    xps_buffer_list_destroy(session->res_buff);
+  if (session->to_client != NULL)
+    xps_buffer_list_destroy(session->to_client);
+  if (session->to_upstream != NULL)
+    xps_buffer_list_destroy(session->to_upstream);
+  session_drop_capture(session);
+  vec_deinit(&(session->followers));
+  free(session);
+}
+
+void session_client_source_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_pipe_source_t *source = ptr;
+  xps_session_t *session = source->ptr;
+
+  // Hand buffers over to the client pipe, cached data is not copied
+  while (session->to_client->list.length > 0 && xps_pipe_is_writable(source->pipe))
+    xps_pipe_source_append(source, xps_buffer_list_shift(session->to_client));
+
+  session_update(session);
+}
+
+void session_client_source_close_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_pipe_source_t *source = ptr;
+
+  session_client_gone(source->ptr);
+}
+
+void session_client_sink_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_pipe_sink_t *sink = ptr;
+  xps_session_t *session = sink->ptr;
+
+  if (xps_pipe_sink_move(sink, session->req_buff, xps_pipe_sink_len(sink)) != OK) {
+    logger(LOG_ERROR, "session_client_sink_handler()", "xps_pipe_sink_move() failed");
+    session->closing = true;
+  }
+
+  session_process_req(session);
+  session_update(session);
+}
+
+void session_client_sink_close_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_pipe_sink_t *sink = ptr;
+
+  session_client_gone(sink->ptr);
+}
+
+void session_upstream_source_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_pipe_source_t *source = ptr;
+  xps_session_t *session = source->ptr;
+
+  // Hedge request head was written when the hedge was connected
+  if (source == session->hedge_source)
+    return;
+
+  while (session->to_upstream->list.length > 0 && xps_pipe_is_writable(source->pipe))
+    xps_pipe_source_append(source, xps_buffer_list_shift(session->to_upstream));
+
+  session_update(session);
+}
+
+void session_upstream_source_close_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_pipe_source_t *source = ptr;
+  xps_session_t *session = source->ptr;
+
+  // Upstream stopped reading, what is left of the request cannot be sent
+  xps_pipe_detach_source(source->pipe);
+  if (source != session->hedge_source)
+    session_discard(session->to_upstream);
+
+  session_update(session);
+}
+
+void session_upstream_sink_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_pipe_sink_t *sink = ptr;
+  xps_session_t *session = sink->ptr;
+
+  // First upstream to answer serves the request
+  if (!session->res_started)
+    session_res_started(session, sink);
+
+  size_t len = xps_pipe_sink_len(sink);
+  if (len > session->core->config->io_budget_bytes)
+    len = session->core->config->io_budget_bytes;
+
+  if (xps_pipe_sink_move(sink, session->res_buff, len) != OK) {
+    logger(LOG_ERROR, "session_upstream_sink_handler()", "xps_pipe_sink_move() failed");
+    session->closing = true;
+  }
+
+  session_process_res(session);
+  session_update(session);
+}
+
+void session_upstream_sink_close_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_pipe_sink_t *sink = ptr;
+  xps_session_t *session = sink->ptr;
+
+  // Hedge closed before answering
+  if (sink == session->hedge_sink) {
+    if (session->hedge_backend != NULL)
+      xps_backend_report(session->hedge_backend, false);
+    session_hedge_cancel(session);
+    session_update(session);
+    return;
+  }
+
+  // Primary upstream failed before answering, the hedge may still
+  if (!session->res_started && session->hedge_sink != NULL && session->hedge_sink->pipe != NULL) {
+    if (session->backend != NULL)
+      xps_backend_report(session->backend, false);
+    session_hedge_promote(session);
+    session_update(session);
+    return;
+  }
+
+  // Upstream closed and all of its data has been handled
+  xps_pipe_detach_sink(sink->pipe, sink);
+
+  // Upstream left over from an earlier request, response comes from leader
+  if (session->leader != NULL) {
+    session_update(session);
+    return;
+  }
+
+  // Followers still waiting for a response head ask the upstream themselves
+  session_unlead(session);
+  session_end_followers(session, false);
+
+  if (session->state == SESSION_TUNNEL || (session->res_head_done && session->res_body_left < 0)) {
+    // Response ended with the connection, client can only tell by the close
+    session->closing = true;
+  } else if (!session->closing &&
+             (session->state == SESSION_RES || session->state == SESSION_REQ_BODY)) {
+    if (session->res_head_done)
+      session->closing = true; // Response was cut short
+    else {
+      // Refused, reset or closed without answering
+      if (session->backend != NULL)
+        xps_backend_report(session->backend, false);
+      session_error(session, HTTP_502);
+    }
+  }
+
+  session_update(session);
+}
+
+/**
+ * Handles buffered client bytes according to the session state
+ *
+ * Complete request heads are looked up in the cache. Misses are forwarded to
+ * the upstream together with their body, after which further requests wait in
+ * req_buff until the response has been forwarded.
+ */
+void session_process_req(xps_session_t *session) {
+  xps_cache_t *cache = session->core->cache;
+
+  while (!session->closing) {
+    if (session->state == SESSION_TUNNEL) {
+      xps_buffer_list_move(session->req_buff, session->to_upstream, session->req_buff->len);
+      return;
+    }
+
+    if (session->state == SESSION_RES)
+      return;
+
+    if (session->state == SESSION_REQ_BODY) {
+      size_t len = session->req_buff->len;
+      if (len > session->req_body_left)
+        len = session->req_body_left;
+      if (len == 0)
+        return;
+      xps_buffer_list_move(session->req_buff, session->to_upstream, len);
+      session->req_body_left -= len;
+      if (session->req_body_left == 0)
+        session->state = SESSION_RES;
+      continue;
+    }
+
+    // SESSION_REQ_HEAD
+    if (session->req_buff->len == 0)
+      return;
+
+    // h2c clients with prior knowledge open with the connection preface
+    if (!session->req_seen && session->core->config->h2_upstreams > 0 &&
+        session_h2(session) != E_NEXT)
+      return;
+
+    size_t len = session->req_buff->len;
+    if (len > HTTP_MAX_HEAD_SIZE)
+      len = HTTP_MAX_HEAD_SIZE;
+    xps_buffer_t *head = xps_buffer_list_read(session->req_buff, len);
+    if (head == NULL) {
+      session->closing = true;
+      return;
+    }
+
+    long head_len = xps_http_head_len(head->pos, head->len);
+    xps_http_req_t req;
+    int error = head_len < 0 ? E_AGAIN : xps_http_parse_req(head->pos, head_len, &req);
+    xps_buffer_destroy(head);
+
+    if (error == E_AGAIN) {
+      // Heads that do not fit are not HTTP this session can parse
+      if (session->req_buff->len >= HTTP_MAX_HEAD_SIZE)
+        session_tunnel(session);
+      else
+        return;
+      continue;
+    }
+
+    session->req_seen = true;
+
+    // A body that cannot be framed is not forwarded, not even through a tunnel
+    if (error == E_FAIL && req.bad_length) {
+      session_error(session, HTTP_400);
+      return;
+    }
+    if (error != OK || req.upgrade || req.chunked) {
+      session_tunnel(session);
+      continue;
+    }
+
+    bool idempotent = req.content_length <= 0 &&
+                      (strcmp(req.method, "GET") == 0 || strcmp(req.method, "HEAD") == 0);
+    bool cacheable = cache != NULL && idempotent;
+    char key[HTTP_METHOD_LEN + HTTP_HOST_LEN + HTTP_MAX_PATH_LEN];
+    snprintf(key, sizeof(key), "%s %s%s", req.method, req.host, req.path);
+    session->encoding = session_pick_encoding(session, &req);
+    session->req_close = !req.keep_alive || session->core->draining;
+
+    if (cacheable && !req.no_cache && session_cache_hit(session, key) == OK) {
+      xps_buffer_list_clear(session->req_buff, head_len);
+      session->closing = session->req_close;
+      continue;
+    }
+
+    // Wait for an identical request that is already being fetched
+    bool coalescable = idempotent && !req.no_store && !session->no_coalesce;
+    session->no_coalesce = false;
+    xps_session_t *leader = coalescable ? session_find_leader(session->core, key) : NULL;
+    if (leader != NULL) {
+      session_follow(session, leader, head_len);
+      continue;
+    }
+
+    error = session_connect_upstream(session);
+    if (error != OK) {
+      session_error(session, error == E_NOTFOUND ? HTTP_503 : HTTP_502);
+      return;
+    }
+
+    session_drop_capture(session);
+    session->cache_key = cacheable && !req.no_store ? strdup(key) : NULL;
+    if (coalescable) {
+      session->coalesce_key = strdup(key);
+      if (session->coalesce_key != NULL)
+        vec_push(&(session->core->inflight), session);
+    }
+    session->req_head_only = strcmp(req.method, "HEAD") == 0;
+    session->res_head_done = false;
+    session->res_started = false;
+    session->res_body_left = -1;
+    session->hedgeable = session->core->hedge != NULL && idempotent;
+    if (session->hedgeable)
+      session_hedge_arm(session, head_len);
+
+    xps_buffer_list_move(session->req_buff, session->to_upstream, head_len);
+    session->req_body_left = req.content_length > 0 ? req.content_length : 0;
+    session->state = session->req_body_left > 0 ? SESSION_REQ_BODY : SESSION_RES;
+  }
+}
+
+/**
+ * Forwards buffered upstream bytes to the client, finding the end of the
+ * response from its head
+ */
+void session_process_res(xps_session_t *session) {
+  // Stray bytes from an upstream left over from an earlier request
+  if (session->leader != NULL) {
+    session_discard(session->res_buff);
+    return;
+  }
+
+  while (session->res_buff->len > 0 && !session->closing) {
+    // Nothing to match the bytes against
+    if (session->state == SESSION_TUNNEL || session->state == SESSION_REQ_HEAD) {
+      session_to_client(session, session->res_buff->len);
+      return;
+    }
+
+    if (!session->res_head_done) {
+      size_t len = session->res_buff->len;
+      if (len > HTTP_MAX_HEAD_SIZE)
+        len = HTTP_MAX_HEAD_SIZE;
+      xps_buffer_t *head = xps_buffer_list_read(session->res_buff, len);
+      if (head == NULL) {
+        session->closing = true;
+        return;
+      }
+
+      long head_len = xps_http_head_len(head->pos, head->len);
+      xps_http_res_t res;
+      int error = head_len < 0 ? E_AGAIN : xps_http_parse_res(head->pos, head_len, &res);
+      xps_buffer_destroy(head);
+
+      if (error == E_AGAIN && session->res_buff->len < HTTP_MAX_HEAD_SIZE)
+        return;
+
+      if (error == E_FAIL && res.bad_length) {
+        if (session->backend != NULL)
+          xps_backend_report(session->backend, false);
+        session_discard(session->res_buff);
+        session_error(session, HTTP_502);
+        return;
+      }
+      if (error != OK) {
+        session_tunnel(session);
+        continue;
+      }
+
+      // Interim responses precede the final one
+      if (res.status < 200) {
+        session_to_client(session, head_len);
+        continue;
+      }
+
+      session->res_head_done = true;
+      session->upstream_keep_alive = res.keep_alive;
+      if (session->backend != NULL)
+        xps_backend_report(session->backend, true);
+      if (session->req_head_only || res.status == 204 || res.status == 304)
+        session->res_body_left = 0;
+      else if (!res.chunked && res.content_length >= 0)
+        session->res_body_left = res.content_length;
+      else
+        session->res_body_left = -1;
+
+      // Store only responses that end on their own
+      long ttl = xps_http_res_ttl(&res);
+      if (session->cache_key != NULL && !res.chunked && session->res_body_left >= 0 && ttl > 0) {
+        session->capture = xps_buffer_list_create();
+        session->capture_expire_msec = session->core->loop->time_msec + ttl * 1000;
+      }
+
+      // Followers get the response unless it is private or its end is unknown.
+      // Later identical requests can still join while it is being captured.
+      if (res.is_private || res.chunked) {
+        session_unlead(session);
+        session_end_followers(session, false);
+      } else {
+        session_share(session);
+        if (session->capture == NULL)
+          session_unlead(session);
+      }
+
+      xps_buffer_t *rewritten = session_rewrite_head(session, session->res_buff, &res);
+      if (rewritten != NULL) {
+        session_tee_res(session, head_len);
+        xps_buffer_list_clear(session->res_buff, head_len);
+        xps_buffer_list_append(session->to_client, rewritten);
+      } else
+        session_to_client(session, head_len);
+
+      // Chunked bodies are not parsed, so the end of the response is unknown
+      if (res.chunked)
+        session_tunnel(session);
+      else if (session->res_body_left == 0)
+        session_res_done(session);
+      continue;
+    }
+
+    if (session->res_body_left < 0) {
+      session_to_client(session, session->res_buff->len);
+      return;
+    }
+
+    size_t len = session->res_buff->len;
+    if (len > (size_t)session->res_body_left)
+      len = session->res_body_left;
+    session_to_client(session, len);
+    session->res_body_left -= len;
+    if (session->res_body_left == 0)
+      session_res_done(session);
+  }
+}
+
+/**
+ * Completes the current response, storing it if it was captured, and moves
+ * on to the next request
+ */
+void session_res_done(xps_session_t *session) {
+  if (session->capture != NULL) {
+    xps_cache_insert(session->core->cache, session->cache_key, session->capture,
+                     session->capture_expire_msec);
+  }
+  session_drop_capture(session);
+  session_hedge_cancel(session);
+  session->res_head_done = false;
+  session->res_body_left = -1;
+
+  session_unlead(session);
+  session_end_followers(session, true);
+
+  if (session->client_gone || session->req_close) {
+    session->closing = true;
+    return;
+  }
+
+  // Upstream answered before the whole request was sent
+  if (session->state != SESSION_RES) {
+    session->closing = true;
+    return;
+  }
+
+  session->state = SESSION_REQ_HEAD;
+  session_process_req(session);
+}
+
+/**
+ * Moves len bytes of response to the client, keeping slices of them if the
+ * response is being stored
+ */
+void session_to_client(xps_session_t *session, size_t len) {
+  session_tee_res(session, len);
+
+  if (session->client_gone)
+    xps_buffer_list_clear(session->res_buff, len);
+  else
+    xps_buffer_list_move(session->res_buff, session->to_client, len);
+}
+
+/**
+ * Gives slices of the next len bytes of response to the capture and the
+ * followers, which get it as the upstream sent it
+ */
+void session_tee_res(xps_session_t *session, size_t len) {
+  if (session->capture != NULL)
+    xps_buffer_list_tee(session->res_buff, 0, len, session->capture);
+
+  for (int i = 0; i < session->followers.length; i++) {
+    xps_session_t *follower = session->followers.data[i];
+    if (follower->follow_head_len == 0)
+      xps_buffer_list_tee(session->res_buff, 0, len, follower->to_client);
+  }
+}
+
+enum xps_encoding_e session_pick_encoding(xps_session_t *session, xps_http_req_t *req) {
+  xps_config_t *config = session->core->config;
+
+  // Encoded bodies are sent in chunks, which HTTP/1.0 clients do not know
+  if (req->minor_version < 1 || strcmp(req->method, "HEAD") == 0)
+    return ENCODING_IDENTITY;
+
+  if (req->accept_zstd && config->zstd_level > 0)
+    return ENCODING_ZSTD;
+  if (req->accept_gzip && config->gzip_level > 0)
+    return ENCODING_GZIP;
+  return ENCODING_IDENTITY;
+}
+
+/**
+ * Sends the stored response for key to the client, compressing its body
+ * if the client accepts it
+ *
+ * @return : OK on a hit, E_NOTFOUND otherwise
+ */
+int session_cache_hit(xps_session_t *session, const char *key) {
+  xps_cache_t *cache = session->core->cache;
+  u_long now = session->core->loop->time_msec;
+
+  // The stored head is rewritten for compression or a closing connection
+  bool rewrite = session->encoding != ENCODING_IDENTITY || session->core->draining;
+  xps_buffer_list_t *hit = rewrite ? xps_buffer_list_create() : NULL;
+  if (hit == NULL)
+    return xps_cache_lookup(cache, key, now, session->to_client);
+
+  int error = xps_cache_lookup(cache, key, now, hit);
+  if (error == OK) {
+    size_t len = hit->len < HTTP_MAX_HEAD_SIZE ? hit->len : HTTP_MAX_HEAD_SIZE;
+    xps_buffer_t *head = xps_buffer_list_read(hit, len);
+    long head_len = head != NULL ? xps_http_head_len(head->pos, head->len) : -1;
+    xps_http_res_t res;
+    if (head_len > 0 && xps_http_parse_res(head->pos, head_len, &res) == OK) {
+      xps_buffer_t *rewritten = session_rewrite_head(session, hit, &res);
+      if (rewritten != NULL) {
+        xps_buffer_list_clear(hit, head_len);
+        xps_buffer_list_append(session->to_client, rewritten);
+      }
+    }
+    if (head != NULL)
+      xps_buffer_destroy(head);
+    xps_buffer_list_move(hit, session->to_client, hit->len);
+  }
+
+  xps_buffer_list_destroy(hit);
+  return error;
+}
+
+/**
+ * Rewrites the response head at the front of from for a compressed body, and
+ * for the client to be closed after it while draining. A compressed body is
+ * then compressed in the client pipe.
+ *
+ * The new head must be appended to to_client next, as the body is expected
+ * to follow everything in to_client and the head.
+ *
+ * @return : new head, NULL if the response is to be sent as it is
+ */
+xps_buffer_t *session_rewrite_head(xps_session_t *session, xps_buffer_list_t *from,
+                                   xps_http_res_t *res) {
+  xps_config_t *config = session->core->config;
+
+  if (session->client_gone || session->client_source->pipe == NULL)
+    return NULL;
+
+  // Small, already compressed and partial bodies are not worth it
+  bool encode = session->encoding != ENCODING_IDENTITY && res->status == 200 && !res->chunked &&
+                !res->encoded && !res->no_transform && res->content_length > 0 &&
+                (size_t)res->content_length >= config->compress_min_len &&
+                xps_compress_type_ok(res->content_type);
+  bool close = session->core->draining;
+  if (!encode && !close)
+    return NULL;
+
+  xps_buffer_t *head = xps_buffer_list_read(from, res->head_len);
+  if (head == NULL)
+    return NULL;
+  xps_buffer_t *rewritten = xps_http_res_rewrite_head(
+      head->pos, head->len, encode ? xps_encoding_name(session->encoding) : NULL, close);
+  xps_buffer_destroy(head);
+  if (rewritten == NULL || !encode)
+    return rewritten;
+
+  if (xps_compress_range(session->client_source->pipe, session->encoding,
+                         session->to_client->len + rewritten->len, res->content_length) != OK) {
+    xps_buffer_destroy(rewritten);
+    return NULL;
+  }
+
+  return rewritten;
+}
+
+void session_shadow_sink_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_pipe_sink_t *sink = ptr;
+
+  xps_pipe_sink_clear(sink, xps_pipe_sink_len(sink));
+}
+
+void session_shadow_sink_close_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_pipe_sink_t *sink = ptr;
+
+  xps_pipe_detach_sink(sink->pipe, sink);
+}
+
+/**
+ * Mirrors everything the client sends to the shadow upstream
+ *
+ * The shadow connection is attached as one more sink of the client pipe, in
+ * PIPE_SINK_DROP mode, so it reads the same buffers as the session and never
+ * slows the client down. Failing to mirror does not fail the session.
+ */
+void session_mirror(xps_session_t *session, xps_connection_t *client) {
+  xps_core_t *core = session->core;
+
+  session->shadow_sink = xps_pipe_sink_create(core, session, session_shadow_sink_handler,
+                                              session_shadow_sink_close_handler);
+  if (session->shadow_sink == NULL) {
+    logger(LOG_ERROR, "session_mirror()", "xps_pipe_sink_create() failed");
+    return;
+  }
+  session->shadow_sink->ready = true;
+
+  // Shadow upstream runs next to the first backend
+  const char *shadow_host = "127.0.0.1";
+  if (core->backends.length > 0)
+    shadow_host = ((xps_backend_t *)core->backends.data[0])->host;
+  xps_connection_t *shadow = xps_upstream_create(core, shadow_host, core->config->shadow_port);
+  if (shadow == NULL) {
+    logger(LOG_ERROR, "session_mirror()", "xps_upstream_create() failed");
+    return;
+  }
+  shadow->listener = session->listener;
+  if (session->listener != NULL)
+    session->listener->n_connections++;
+
+  shadow->sink->mode = PIPE_SINK_DROP;
+  if (xps_pipe_attach_sink(client->source->pipe, shadow->sink) != OK ||
+      xps_pipe_create(core, DEFAULT_PIPE_BUFF_THRESH, shadow->source, session->shadow_sink) ==
+          NULL) {
+    logger(LOG_ERROR, "session_mirror()", "failed to pipe shadow upstream");
+    xps_connection_destroy(shadow);
+    return;
+  }
+  shadow->sink->active = true;
+}
+
+/**
+ * Connects to the upstream unless it is still connected
+ *
+ * Backends that cannot even be connected to are reported and the next one
+ * is tried.
+ *
+ * @return : OK on success, E_NOTFOUND if every backend is ejected, E_FAIL otherwise
+ */
+int session_connect_upstream(xps_session_t *session) {
+  // A tunnel keeps the upstream whatever its last response head said
+  if (session->upstream_source->pipe != NULL && session->upstream_sink->pipe != NULL &&
+      (session->upstream_keep_alive || session->state == SESSION_TUNNEL))
+    return OK;
+
+  // Drop what is left of a half closed upstream, or of one that closes after
+  // its last response
+  if (session->upstream_source->pipe != NULL)
+    xps_pipe_detach_source(session->upstream_source->pipe);
+  if (session->upstream_sink->pipe != NULL)
+    xps_pipe_detach_sink(session->upstream_sink->pipe, session->upstream_sink);
+  session_discard(session->to_upstream);
+  session_discard(session->res_buff);
+  session->backend = NULL;
+
+  xps_core_t *core = session->core;
+  xps_connection_t *upstream = NULL;
+  xps_backend_t *backend = NULL;
+  for (int i = 0; upstream == NULL && i < core->backends.length; i++) {
+    backend = xps_backend_pick(core);
+    if (backend == NULL)
+      break;
+    upstream = xps_upstream_create(core, backend->host, backend->port);
+    if (upstream == NULL)
+      xps_backend_report(backend, false);
+  }
+  if (backend == NULL) {
+    logger(LOG_WARNING, "session_connect_upstream()", "no healthy upstream");
+    return E_NOTFOUND;
+  }
+  if (upstream == NULL) {
+    logger(LOG_ERROR, "session_connect_upstream()", "xps_upstream_create() failed");
+    return E_FAIL;
+  }
+  upstream->listener = session->listener;
+  if (session->listener != NULL) {
+    session->listener->n_connections++;
+    upstream->sink->weight = session->listener->weight;
+  }
+
+  if (xps_pipe_create(core, DEFAULT_PIPE_BUFF_THRESH, session->upstream_source, upstream->sink) ==
+          NULL ||
+      xps_pipe_create(core, DEFAULT_PIPE_BUFF_THRESH, upstream->source, session->upstream_sink) ==
+          NULL) {
+    logger(LOG_ERROR, "session_connect_upstream()", "xps_pipe_create() failed");
+    xps_connection_destroy(upstream);
+    return E_FAIL;
+  }
+  session->backend = backend;
+  session->upstream_keep_alive = true;
+
+  return OK;
+}
+
+/**
+ * Ends the wait for the first response byte: a hedge that answered first
+ * becomes the upstream, the other one is closed
+ */
+void session_res_started(xps_session_t *session, xps_pipe_sink_t *sink) {
+  session->res_started = true;
+
+  if (sink == session->hedge_sink) {
+    session->core->hedge->n_won++;
+    session_hedge_promote(session);
+  }
+  session_hedge_cancel(session);
+
+  if (session->hedgeable)
+    xps_hedge_sample(session->core->hedge,
+                     session->core->loop->time_msec - session->req_sent_msec);
+}
+
+/**
+ * Sets the hedge timer of a request about to be forwarded
+ *
+ * @param session : session instance
+ * @param head_len : length of the request head at the front of req_buff
+ */
+void session_hedge_arm(xps_session_t *session, size_t head_len) {
+  xps_core_t *core = session->core;
+
+  session_hedge_cancel(session);
+  session->req_sent_msec = core->loop->time_msec;
+  xps_hedge_deposit(core->hedge);
+
+  u_long delay_msec = xps_hedge_delay(core->hedge);
+  if (delay_msec == 0 || core->backends.length < 2)
+    return;
+
+  session->hedge_req = xps_buffer_list_read(session->req_buff, head_len);
+  if (session->hedge_req != NULL)
+    session->hedge_timer =
+        xps_loop_add_timer(core->loop, delay_msec, session, session_hedge_handler);
+}
+
+void session_hedge_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_session_t *session = ptr;
+
+  session->hedge_timer = NULL;
+  if (session->res_started || session->state != SESSION_RES || session->closing) {
+    session_hedge_cancel(session);
+    return;
+  }
+
+  session_hedge_start(session);
+  session_update(session);
+}
+
+/**
+ * Sends the request head to a second backend, if the budget allows
+ */
+void session_hedge_start(xps_session_t *session) {
+  xps_core_t *core = session->core;
+
+  xps_backend_t *backend = xps_backend_pick(core);
+  if (backend == session->backend)
+    backend = xps_backend_pick(core);
+  if (backend == NULL || backend == session->backend || !xps_hedge_take(core->hedge)) {
+    session_hedge_cancel(session);
+    return;
+  }
+
+  xps_connection_t *upstream = xps_upstream_create(core, backend->host, backend->port);
+  if (upstream == NULL) {
+    logger(LOG_ERROR, "session_hedge_start()", "xps_upstream_create() failed");
+    xps_backend_report(backend, false);
+    session_hedge_cancel(session);
+    return;
+  }
+  upstream->listener = session->listener;
+  if (session->listener != NULL) {
+    session->listener->n_connections++;
+    upstream->sink->weight = session->listener->weight;
+  }
+
+  if (xps_pipe_create(core, DEFAULT_PIPE_BUFF_THRESH, session->hedge_source, upstream->sink) ==
+          NULL ||
+      xps_pipe_create(core, DEFAULT_PIPE_BUFF_THRESH, upstream->source, session->hedge_sink) ==
+          NULL) {
+    logger(LOG_ERROR, "session_hedge_start()", "xps_pipe_create() failed");
+    xps_connection_destroy(upstream);
+    session_hedge_cancel(session);
+    return;
+  }
+
+  if (xps_pipe_source_append(session->hedge_source, session->hedge_req) != OK) {
+    xps_buffer_destroy(session->hedge_req);
+    session->hedge_req = NULL;
+    session_hedge_cancel(session);
+    return;
+  }
+  session->hedge_req = NULL;
+  session->hedge_backend = backend;
+
+  logger(LOG_DEBUG, "session_hedge_start()", "hedging request to %s:%u", backend->host,
+         backend->port);
+}
+
+/**
+ * Makes the hedge the upstream of the session, closing the primary upstream
+ */
+void session_hedge_promote(xps_session_t *session) {
+  if (session->upstream_source->pipe != NULL)
+    xps_pipe_detach_source(session->upstream_source->pipe);
+  if (session->upstream_sink->pipe != NULL)
+    xps_pipe_detach_sink(session->upstream_sink->pipe, session->upstream_sink);
+  session_discard(session->to_upstream);
+
+  xps_pipe_source_t *source = session->upstream_source;
+  session->upstream_source = session->hedge_source;
+  session->hedge_source = source;
+
+  xps_pipe_sink_t *sink = session->upstream_sink;
+  session->upstream_sink = session->hedge_sink;
+  session->hedge_sink = sink;
+
+  session->backend = session->hedge_backend;
+  session->hedge_backend = NULL;
+}
+
+/**
+ * Drops the pending or running hedge of the current request
+ */
+void session_hedge_cancel(xps_session_t *session) {
+  if (session->hedge_timer != NULL) {
+    xps_loop_cancel_timer(session->core->loop, session->hedge_timer);
+    session->hedge_timer = NULL;
+  }
+  if (session->hedge_req != NULL) {
+    xps_buffer_destroy(session->hedge_req);
+    session->hedge_req = NULL;
+  }
+  if (session->hedge_source != NULL && session->hedge_source->pipe != NULL)
+    xps_pipe_detach_source(session->hedge_source->pipe);
+  if (session->hedge_sink != NULL && session->hedge_sink->pipe != NULL)
+    xps_pipe_detach_sink(session->hedge_sink->pipe, session->hedge_sink);
+  session->hedge_backend = NULL;
+}
+
+/**
+ * Stops parsing and forwards everything as is from now on
+ */
+void session_tunnel(xps_session_t *session) {
+  if (session->state == SESSION_TUNNEL)
+    return;
+
+  logger(LOG_DEBUG, "session_tunnel()", "switching session to tunnel");
+
+  session->state = SESSION_TUNNEL;
+  session_drop_capture(session);
+  session_hedge_cancel(session);
+  session->hedgeable = false;
+  session_unlead(session);
+  session_end_followers(session, false);
+
+  int error = session_connect_upstream(session);
+  if (error != OK)
+    session_error(session, error == E_NOTFOUND ? HTTP_503 : HTTP_502);
+}
+
+/**
+ * Hands the client over to an h2c connection if req_buff starts with the
+ * HTTP/2 connection preface
+ *
+ * @param session : session instance, closed once the client is handed over
+ * @return : OK if handed over, E_AGAIN if req_buff may still be the start of
+ *           the preface, E_NEXT if it is not the preface
+ */
+int session_h2(xps_session_t *session) {
+  size_t len = session->req_buff->len;
+  if (len > H2_PREFACE_LEN)
+    len = H2_PREFACE_LEN;
+  xps_buffer_t *head = xps_buffer_list_read(session->req_buff, len);
+  if (head == NULL)
+    return E_NEXT;
+  bool match = memcmp(head->pos, H2_PREFACE, len) == 0;
+  xps_buffer_destroy(head);
+
+  if (!match)
+    return E_NEXT;
+  if (len < H2_PREFACE_LEN)
+    return E_AGAIN;
+
+  xps_pipe_t *in_pipe = session->client_sink->pipe;
+  xps_pipe_t *out_pipe = session->client_source->pipe;
+  session->closing = true;
+  if (in_pipe == NULL || out_pipe == NULL)
+    return OK;
+
+  // Session lets go of the client pipes and closes
+  xps_pipe_detach_sink(in_pipe, session->client_sink);
+  xps_pipe_detach_source(out_pipe);
+  if (xps_h2_create(session->core, session->listener, in_pipe, out_pipe, session->req_buff) ==
+      NULL)
+    logger(LOG_ERROR, "session_h2()", "xps_h2_create() failed");
+
+  return OK;
+}
+
+/**
+ * Answers the client with an error response and closes it afterwards
+ */
+void session_error(xps_session_t *session, const char *res) {
+  size_t len = strlen(res);
+  xps_buffer_t *buff = session->client_gone ? NULL : xps_buffer_create(len, len, NULL);
+  if (buff != NULL) {
+    memcpy(buff->data, res, len);
+    xps_buffer_list_append(session->to_client, buff);
+  }
+
+  session_discard(session->to_upstream);
+  session_drop_capture(session);
+  session->closing = true;
+}
+
+void session_drop_capture(xps_session_t *session) {
+  if (session->capture != NULL)
+    xps_buffer_list_destroy(session->capture);
+  session->capture = NULL;
+  free(session->cache_key);
+  session->cache_key = NULL;
+}
+
+void session_discard(xps_buffer_list_t *buff_list) {
+  if (buff_list->len > 0)
+    xps_buffer_list_clear(buff_list, buff_list->len);
+}
+
+/**
+ * Finds a session fetching the response for key that can still be joined
+ */
+xps_session_t *session_find_leader(xps_core_t *core, const char *key) {
+  // 🟡 Linear scan, only sessions with a request in flight are listed
+  for (int i = 0; i < core->inflight.length; i++) {
+    xps_session_t *session = core->inflight.data[i];
+    // Joining late needs the response captured so far
+    if (session->res_head_done && session->capture == NULL)
+      continue;
+    if (strcmp(session->coalesce_key, key) == 0)
+      return session;
+  }
+  return NULL;
+}
+
+/**
+ * Makes session receive the leader's response to an identical request
+ *
+ * The request head stays in req_buff until the leader's response turns out
+ * to be shareable. A session joining after that gets what the leader has
+ * captured so far.
+ */
+void session_follow(xps_session_t *session, xps_session_t *leader, size_t head_len) {
+  session->leader = leader;
+  vec_push(&(leader->followers), session);
+  session->state = SESSION_RES;
+  session->core->n_coalesced++;
+
+  if (!leader->res_head_done) {
+    session->follow_head_len = head_len;
+    return;
+  }
+
+  xps_buffer_list_clear(session->req_buff, head_len);
+  session->follow_head_len = 0;
+  xps_buffer_list_tee(leader->capture, 0, leader->capture->len, session->to_client);
+}
+
+/**
+ * Starts sending the response to followers that were waiting for its head
+ */
+void session_share(xps_session_t *session) {
+  for (int i = 0; i < session->followers.length; i++) {
+    xps_session_t *follower = session->followers.data[i];
+    if (follower->follow_head_len > 0) {
+      xps_buffer_list_clear(follower->req_buff, follower->follow_head_len);
+      follower->follow_head_len = 0;
+    }
+  }
+}
+
+/**
+ * Stops other requests from joining the session's response
+ */
+void session_unlead(xps_session_t *session) {
+  if (session->coalesce_key == NULL)
+    return;
+
+  vec_remove(&(session->core->inflight), session);
+  free(session->coalesce_key);
+  session->coalesce_key = NULL;
+}
+
+void session_unfollow(xps_session_t *session) {
+  if (session->leader == NULL)
+    return;
+
+  vec_remove(&(session->leader->followers), session);
+  session->leader = NULL;
+}
+
+/**
+ * Lets go of all followers
+ *
+ * Followers still waiting for the response head send their request upstream
+ * themselves. Followers receiving the response move on to their next request
+ * if it was complete, otherwise they are closed.
+ *
+ * @param session : leader
+ * @param complete : whether the whole response was sent to followers
+ */
+void session_end_followers(xps_session_t *session, bool complete) {
+  if (session->followers.length == 0)
+    return;
+
+  // Followers may be destroyed below, take them off the leader first
+  vec_void_t followers = session->followers;
+  vec_init(&(session->followers));
+
+  for (int i = 0; i < followers.length; i++) {
+    xps_session_t *follower = followers.data[i];
+    follower->leader = NULL;
+    follower->state = SESSION_REQ_HEAD;
+
+    if (follower->follow_head_len > 0) {
+      follower->follow_head_len = 0;
+      follower->no_coalesce = true;
+    } else if (!complete || follower->req_close)
+      follower->closing = true;
+
+    session_process_req(follower);
+    session_update(follower);
+  }
+
+  vec_deinit(&followers);
+}
+
+/**
+ * Handles the client closing, a leader keeps fetching for its followers
+ */
+void session_client_gone(xps_session_t *session) {
+  if (session->followers.length == 0 || session->state != SESSION_RES || session->closing) {
+    xps_session_destroy(session);
+    return;
+  }
+
+  if (session->client_source->pipe != NULL)
+    xps_pipe_detach_source(session->client_source->pipe);
+  if (session->client_sink->pipe != NULL)
+    xps_pipe_detach_sink(session->client_sink->pipe, session->client_sink);
+  session_discard(session->to_client);
+  session_discard(session->req_buff);
+  session->client_gone = true;
+
+  session_update(session);
+}
+
+/**
+ * Destroys the session once it is closing and has nothing left to send,
+ * otherwise updates readiness of its sources and sinks
+ *
+ * Called at the end of every handler. Client input is not taken while a
+ * response is pending, so pipelined requests are answered in order.
+ */
+void session_update(xps_session_t *session) {
+  if (session->closing && session->to_client->len == 0) {
+    xps_session_destroy(session);
+    return;
+  }
+
+  session_update_ready(session);
+
+  // Followers have data once the leader forwarded some, and the leader reads
+  // from upstream only as fast as its slowest follower sends
+  for (int i = 0; i < session->followers.length; i++)
+    session_update_ready(session->followers.data[i]);
+  if (session->leader != NULL)
+    session_update_ready(session->leader);
+}
+
+void session_update_ready(xps_session_t *session) {
+  bool has_room = session->client_gone || session->to_client->len < DEFAULT_PIPE_BUFF_THRESH;
+  for (int i = 0; i < session->followers.length; i++) {
+    xps_session_t *follower = session->followers.data[i];
+    if (follower->to_client->len >= DEFAULT_PIPE_BUFF_THRESH)
+      has_room = false;
+  }
+
+  session->client_source->ready = session->to_client->list.length > 0;
+  session->upstream_source->ready = session->to_upstream->list.length > 0;
+  session->client_sink->ready = !session->closing && !session->client_gone &&
+                                session->state != SESSION_RES &&
+                                session->to_client->len < DEFAULT_PIPE_BUFF_THRESH &&
+                                session->to_upstream->len < DEFAULT_PIPE_BUFF_THRESH;
+  session->upstream_sink->ready = !session->closing && has_room;
+  if (session->hedge_sink != NULL) {
+    session->hedge_source->ready = false;
+    session->hedge_sink->ready = session->upstream_sink->ready;
+  }
+}
@@ -0,0 +1,106 @@
+#ifndef XPS_SESSION_H
+#define XPS_SESSION_H
+
+#include "../xps.h"
+
+/*
+ * Proxies HTTP/1.x between a client connection and an upstream, one request
+ * at a time. The session sits between two pairs of pipes:
+ *
+ *   client source -> client_sink       upstream_source -> upstream sink
+ *   client sink  <- client_source      upstream_sink   <- upstream source
+ *
+ * Request heads are parsed to look responses up in the cache. Hits are sent
+ * from the cache and never reach the upstream, which is only connected on the
+ * first miss, on a backend picked for each upstream connection; see
+ * xps_backend.h for how sessions report their health. Cacheable responses are
+ * stored while they are forwarded. Anything the session does not understand
+ * is tunneled as is.
+ *
+ * Client connections are persistent unless the request says otherwise.
+ * Pipelined requests wait in req_buff and are answered one after another, so
+ * responses keep their order; the ones that are ready together, e.g. cache
+ * hits, leave in one write.
+ *
+ * Identical GET/HEAD requests that miss while one of them is already being
+ * fetched are coalesced: the first session leads and the others follow it,
+ * receiving slices of the leader's response instead of asking the upstream.
+ *
+ * With config->shadow_port set, the client pipe gets a second sink: a
+ * connection to the shadow upstream that sees everything the client sends.
+ * Its responses are discarded and it is dropped if it cannot keep up.
+ *
+ * With hedging on, a GET or HEAD that has no response byte after the delay
+ * given by core->hedge is sent to a second backend as well. Whichever
+ * upstream answers first serves the request, and the other connection is
+ * closed. A primary upstream that fails before answering hands the request to
+ * the hedge instead of a 502.
+ *
+ * Response bodies, including cache hits, are compressed on their way to the
+ * client when it accepts gzip or zstd, see xps_compress.h. Responses the
+ * upstream encoded itself, e.g. from precompressed files, are sent as they are.
+ *
+ * While the core drains, clients idle between requests are closed and busy
+ * ones after their current response, see xps_session_drain().
+ *
+ * A client whose first bytes are the HTTP/2 connection preface is handed over
+ * to an h2c connection, see xps_h2.h, and the session closes.
+ */
+enum xps_session_state_e {
+  SESSION_REQ_HEAD, // Waiting for a request head
+  SESSION_REQ_BODY, // Forwarding a request body
+  SESSION_RES,      // Forwarding the response to the last request
+  SESSION_TUNNEL    // Forwarding bytes both ways without parsing
+};
+
+struct xps_session_s {
+  xps_core_t *core;
+  xps_listener_t *listener;
+  xps_backend_t *backend; // Upstream server of the current upstream connection, NULL if none
+  xps_pipe_source_t *client_source;
+  xps_pipe_sink_t *client_sink;
+  xps_pipe_source_t *upstream_source;
+  xps_pipe_sink_t *upstream_sink;
+  xps_pipe_source_t *hedge_source;
+  xps_pipe_sink_t *hedge_sink;
+  xps_pipe_sink_t *shadow_sink; // Discards responses of the shadow upstream, NULL if not mirrored
+  xps_buffer_list_t *req_buff;    // Bytes from client not yet handled
+  xps_buffer_list_t *res_buff;    // Bytes from upstream not yet handled
+  xps_buffer_list_t *to_client;   // Waiting for room in client pipe
+  xps_buffer_list_t *to_upstream; // Waiting for room in upstream pipe
+  enum xps_session_state_e state;
+  size_t req_body_left;
+  bool req_close;     // Client is closed after the response to current request
+  bool req_head_only; // Response to current request has no body
+  enum xps_encoding_e encoding; // Coding the client accepts for response to current request
+  char *cache_key;    // Response to current request may be stored under this key
+  bool res_head_done;
+  bool res_started;   // Upstream sent a byte since the current request was forwarded
+  bool upstream_keep_alive; // Upstream connection may take the next request
+  long res_body_left; // -1 if response ends when upstream closes
+  xps_buffer_list_t *capture; // Response being stored, NULL if it is not
+  u_long capture_expire_msec;
+  bool closing; // Client is closed once to_client is sent
+
+  // Hedging
+  bool hedgeable;         // Current request may be hedged and its first byte time is sampled
+  u_long req_sent_msec;
+  xps_buffer_t *hedge_req; // Copy of the request head for the hedge, NULL once sent or dropped
+  loop_timer_t *hedge_timer;
+  xps_backend_t *hedge_backend; // Backend of the hedge connection, NULL if none
+
+  // Request coalescing
+  char *coalesce_key;     // Key of the request this session leads, NULL if none
+  xps_session_t *leader;  // Session whose response this one receives
+  size_t follow_head_len; // Request head left in req_buff until leader's response is shared
+  bool no_coalesce;       // Send next request upstream even if identical one is in flight
+  vec_void_t followers;
+  bool client_gone;       // Client closed, response is still fetched for followers
+  bool req_seen;          // A request head was read, the h2c preface can only come before
+};
+
+xps_session_t *xps_session_create(xps_core_t *core, xps_connection_t *client);
+void xps_session_destroy(xps_session_t *session);
+void xps_session_drain(xps_session_t *session);
+
+#endif
@@ -0,0 +1,117 @@
+#include "../xps.h"
+
+#include <sys/signalfd.h>
+
+void signal_get_mask(sigset_t *mask);
+void signal_read_handler(void *ptr);
+
+/**
+ * Blocks the signals handled by the server for the calling thread
+ *
+ * Must be called before any other thread is started, so that the signals are
+ * blocked in all threads and only reach the signalfd.
+ *
+ * @return : OK on success and E_FAIL on error
+ */
+int xps_signal_block() {
+  sigset_t mask;
+  signal_get_mask(&mask);
+
+  if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+    logger(LOG_ERROR, "xps_signal_block()", "sigprocmask() failed");
+    perror("Error message");
+    return E_FAIL;
+  }
+
+  // Writes to closed sockets use MSG_NOSIGNAL, children are not waited for
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGCHLD, SIG_IGN);
+
+  return OK;
+}
+
+/**
+ * Creates a signalfd for the blocked signals and attaches it to the loop
+ *
+ * @param core : core whose loop handles the signals
+ * @return : OK on success and E_FAIL on error
+ */
+int xps_signal_attach(xps_core_t *core) {
+  assert(core != NULL);
+
+  sigset_t mask;
+  signal_get_mask(&mask);
+
+  int signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (signal_fd < 0) {
+    logger(LOG_ERROR, "xps_signal_attach()", "signalfd() failed");
+    perror("Error message");
+    return E_FAIL;
+  }
+
+  if (xps_loop_attach(core->loop, signal_fd, EPOLLIN, core, signal_read_handler, NULL, NULL) !=
+      OK) {
+    logger(LOG_ERROR, "xps_signal_attach()", "xps_loop_attach() failed");
+    close(signal_fd);
+    return E_FAIL;
+  }
+
+  core->signal_fd = signal_fd;
+
+  return OK;
+}
+
+void xps_signal_detach(xps_core_t *core) {
+  assert(core != NULL);
+
+  if (core->signal_fd < 0)
+    return;
+
+  xps_loop_detach(core->loop, core->signal_fd);
+  close(core->signal_fd);
+  core->signal_fd = -1;
+}
+
+void signal_get_mask(sigset_t *mask) {
+  sigemptyset(mask);
+  sigaddset(mask, SIGINT);
+  sigaddset(mask, SIGTERM);
+  sigaddset(mask, SIGQUIT);
+  sigaddset(mask, SIGHUP);
+  sigaddset(mask, SIGUSR1);
+  sigaddset(mask, SIGUSR2);
+}
+
+void signal_read_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_core_t *core = ptr;
+
+  struct signalfd_siginfo info;
+  while (core->signal_fd >= 0 && read(core->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+    switch (info.ssi_signo) {
+    case SIGINT:
+    case SIGTERM:
+      logger(LOG_WARNING, "signal_read_handler()", "signal %u received, draining",
+             info.ssi_signo);
+      xps_core_drain(core);
+      break;
+
+    case SIGQUIT:
+      logger(LOG_WARNING, "signal_read_handler()", "SIGQUIT received, stopping");
+      xps_loop_stop(core->loop);
+      break;
+
+    case SIGUSR1:
+      xps_core_log_stats(core);
+      break;
+
+    case SIGUSR2:
+    case SIGHUP:
+      logger(LOG_WARNING, "signal_read_handler()", "signal %u received, upgrading",
+             info.ssi_signo);
+      if (xps_handover_start(core) != OK)
+        logger(LOG_ERROR, "signal_read_handler()", "xps_handover_start() failed");
+      break;
+    }
+  }
+}
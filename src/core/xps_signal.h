@@ -0,0 +1,20 @@
+#ifndef XPS_SIGNAL_H
+#define XPS_SIGNAL_H
+
+#include "../xps.h"
+
+/*
+ * Signals are blocked for the whole process and delivered through a signalfd
+ * attached to the loop, so they are handled as regular loop events:
+ *
+ *  SIGINT, SIGTERM : graceful drain, stop accepting and exit once connections close
+ *  SIGQUIT         : stop immediately
+ *  SIGUSR1         : log stats
+ *  SIGUSR2, SIGHUP : start a new server process and hand listeners over to it
+ */
+
+int xps_signal_block();
+int xps_signal_attach(xps_core_t *core);
+void xps_signal_detach(xps_core_t *core);
+
+#endif
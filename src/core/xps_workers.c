@@ -0,0 +1,348 @@
+#include "../xps.h"
+
+void *worker_main(void *ptr);
+xps_task_t *worker_take(xps_worker_t *worker);
+void worker_push(xps_worker_t *worker, xps_task_t *task);
+void workers_event_handler(void *ptr);
+void workers_complete(xps_workers_t *workers, xps_task_t *task);
+
+/**
+ * Starts a pool of worker threads and attaches its completions to the loop
+ *
+ * @param core : core whose loop gets the completions
+ * @param n_workers : number of threads, at least 1
+ * @return : pool, NULL on failure
+ */
+xps_workers_t *xps_workers_create(xps_core_t *core, u_int n_workers) {
+  assert(core != NULL);
+  assert(n_workers > 0);
+
+  xps_workers_t *workers = malloc(sizeof(xps_workers_t));
+  if (workers == NULL) {
+    logger(LOG_ERROR, "xps_workers_create()", "malloc() failed for 'workers'");
+    return NULL;
+  }
+
+  // Init values
+  workers->core = core;
+  workers->workers = calloc(n_workers, sizeof(xps_worker_t));
+  workers->n_workers = n_workers;
+  workers->n_started = 0;
+  workers->rr = 0;
+  pthread_mutex_init(&(workers->lock), NULL);
+  pthread_cond_init(&(workers->cond), NULL);
+  workers->n_queued = 0;
+  workers->stop = false;
+  pthread_mutex_init(&(workers->done_lock), NULL);
+  workers->done_head = NULL;
+  workers->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  workers->n_inflight = 0;
+  workers->max_depth = 0;
+  workers->n_done = 0;
+  workers->wait_usec = 0;
+  workers->max_wait_usec = 0;
+  workers->exec_usec = 0;
+  workers->max_exec_usec = 0;
+
+  if (workers->workers == NULL) {
+    logger(LOG_ERROR, "xps_workers_create()", "calloc() failed for 'workers'");
+    if (workers->event_fd >= 0)
+      close(workers->event_fd);
+    workers->event_fd = -1;
+    xps_workers_destroy(workers);
+    return NULL;
+  }
+
+  for (u_int i = 0; i < n_workers; i++) {
+    xps_worker_t *worker = &(workers->workers[i]);
+    worker->workers = workers;
+    worker->index = i;
+    pthread_mutex_init(&(worker->lock), NULL);
+    worker->head = NULL;
+    worker->tail = NULL;
+    worker->n_run = 0;
+    worker->n_stolen = 0;
+  }
+
+  if (workers->event_fd < 0 ||
+      xps_loop_attach(core->loop, workers->event_fd, EPOLLIN, workers, workers_event_handler,
+                      NULL, NULL) != OK) {
+    logger(LOG_ERROR, "xps_workers_create()", "failed to set up completions");
+    if (workers->event_fd >= 0)
+      close(workers->event_fd);
+    workers->event_fd = -1;
+    xps_workers_destroy(workers);
+    return NULL;
+  }
+
+  // Threads inherit the blocked signals, the loop's signalfd still gets them all.
+  // A pinned loop's CPU affinity is not inherited, see config->worker_cpus.
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  cpu_set_t *cpus = &(core->config->worker_cpus);
+  if (CPU_COUNT(cpus) > 0)
+    pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), cpus);
+
+  for (u_int i = 0; i < n_workers; i++) {
+    xps_worker_t *worker = &(workers->workers[i]);
+    int err = pthread_create(&(worker->thread), &attr, worker_main, worker);
+    if (err != 0) {
+      logger(LOG_ERROR, "xps_workers_create()", "pthread_create() failed: %s", strerror(err));
+      pthread_attr_destroy(&attr);
+      xps_workers_destroy(workers);
+      return NULL;
+    }
+    workers->n_started++;
+
+    char name[16];
+    snprintf(name, sizeof(name), "xps-w%u", i);
+    pthread_setname_np(worker->thread, name);
+  }
+  pthread_attr_destroy(&attr);
+
+  logger(LOG_DEBUG, "xps_workers_create()", "started %u workers", n_workers);
+
+  return workers;
+}
+
+/**
+ * Stops the worker threads, waiting for the tasks they are running, and
+ * completes every task: finished ones as usual, queued ones without running
+ * their work_cb
+ *
+ * @param workers : pool to be destroyed
+ */
+void xps_workers_destroy(xps_workers_t *workers) {
+  assert(workers != NULL);
+
+  pthread_mutex_lock(&(workers->lock));
+  workers->stop = true;
+  pthread_cond_broadcast(&(workers->cond));
+  pthread_mutex_unlock(&(workers->lock));
+  for (u_int i = 0; i < workers->n_started; i++)
+    pthread_join(workers->workers[i].thread, NULL);
+
+  if (workers->event_fd >= 0) {
+    workers_event_handler(workers);
+    xps_loop_detach(workers->core->loop, workers->event_fd);
+    close(workers->event_fd);
+  }
+
+  if (workers->workers != NULL) {
+    for (u_int i = 0; i < workers->n_workers; i++) {
+      xps_worker_t *worker = &(workers->workers[i]);
+      while (worker->head != NULL) {
+        xps_task_t *task = worker->head;
+        worker->head = task->next;
+        task->done_cb(task->ptr);
+        free(task);
+      }
+      pthread_mutex_destroy(&(worker->lock));
+    }
+    free(workers->workers);
+  }
+
+  pthread_mutex_destroy(&(workers->done_lock));
+  pthread_cond_destroy(&(workers->cond));
+  pthread_mutex_destroy(&(workers->lock));
+  free(workers);
+
+  logger(LOG_DEBUG, "xps_workers_destroy()", "destroyed workers");
+}
+
+/**
+ * Queues blocking work
+ *
+ * @param workers : pool
+ * @param work_cb : run on a worker thread with ptr
+ * @param done_cb : run on the loop with ptr once work_cb has returned
+ * @param ptr : task state, owned by done_cb
+ * @return : OK on success, E_FAIL if the task could not be queued
+ */
+int xps_workers_submit(xps_workers_t *workers, xps_handler_t work_cb, xps_handler_t done_cb,
+                       void *ptr) {
+  assert(workers != NULL);
+  assert(work_cb != NULL);
+  assert(done_cb != NULL);
+
+  xps_task_t *task = malloc(sizeof(xps_task_t));
+  if (task == NULL) {
+    logger(LOG_ERROR, "xps_workers_submit()", "malloc() failed for 'task'");
+    return E_FAIL;
+  }
+
+  // Init values
+  task->work_cb = work_cb;
+  task->done_cb = done_cb;
+  task->ptr = ptr;
+  task->submit_usec = get_time_usec();
+  task->start_usec = 0;
+  task->end_usec = 0;
+  task->next = NULL;
+
+  worker_push(&(workers->workers[workers->rr]), task);
+  workers->rr = (workers->rr + 1) % workers->n_workers;
+  workers->n_inflight++;
+
+  // The task is queued before it is counted, so a worker that takes a count finds one
+  pthread_mutex_lock(&(workers->lock));
+  workers->n_queued++;
+  if (workers->n_queued > workers->max_depth)
+    workers->max_depth = workers->n_queued;
+  pthread_cond_signal(&(workers->cond));
+  pthread_mutex_unlock(&(workers->lock));
+
+  return OK;
+}
+
+void xps_workers_log_stats(xps_workers_t *workers) {
+  assert(workers != NULL);
+
+  pthread_mutex_lock(&(workers->lock));
+  u_int n_queued = workers->n_queued;
+  pthread_mutex_unlock(&(workers->lock));
+
+  u_long n_stolen = 0;
+  for (u_int i = 0; i < workers->n_workers; i++) {
+    xps_worker_t *worker = &(workers->workers[i]);
+    pthread_mutex_lock(&(worker->lock));
+    n_stolen += worker->n_stolen;
+    pthread_mutex_unlock(&(worker->lock));
+  }
+
+  u_long n_done = workers->n_done > 0 ? workers->n_done : 1;
+  logger(LOG_INFO, "xps_workers_log_stats()",
+         "workers: %u, queued: %u (max %u), running or finished: %u, done: %lu, stolen: %lu, "
+         "wait avg/max: %lu/%lu usec, exec avg/max: %lu/%lu usec",
+         workers->n_workers, n_queued, workers->max_depth, workers->n_inflight - n_queued,
+         workers->n_done, n_stolen, workers->wait_usec / n_done, workers->max_wait_usec,
+         workers->exec_usec / n_done, workers->max_exec_usec);
+}
+
+void *worker_main(void *ptr) {
+  assert(ptr != NULL);
+  xps_worker_t *worker = ptr;
+  xps_workers_t *workers = worker->workers;
+
+  for (;;) {
+    pthread_mutex_lock(&(workers->lock));
+    while (workers->n_queued == 0 && !workers->stop)
+      pthread_cond_wait(&(workers->cond), &(workers->lock));
+    if (workers->stop) {
+      pthread_mutex_unlock(&(workers->lock));
+      break;
+    }
+    workers->n_queued--;
+    pthread_mutex_unlock(&(workers->lock));
+
+    // Own queue first, then the others in turn. Queues hold at least as many
+    // tasks as workers have counted, a pass that misses one finds it next time.
+    xps_task_t *task = NULL;
+    bool stolen = false;
+    while (task == NULL) {
+      for (u_int i = 0; i < workers->n_workers && task == NULL; i++) {
+        task = worker_take(&(workers->workers[(worker->index + i) % workers->n_workers]));
+        stolen = i > 0;
+      }
+    }
+
+    task->start_usec = get_time_usec();
+    task->work_cb(task->ptr);
+    task->end_usec = get_time_usec();
+
+    pthread_mutex_lock(&(worker->lock));
+    worker->n_run++;
+    if (stolen)
+      worker->n_stolen++;
+    pthread_mutex_unlock(&(worker->lock));
+
+    pthread_mutex_lock(&(workers->done_lock));
+    task->next = workers->done_head;
+    workers->done_head = task;
+    pthread_mutex_unlock(&(workers->done_lock));
+
+    const uint64_t one = 1;
+    if (write(workers->event_fd, &one, sizeof(one)) < 0)
+      logger(LOG_ERROR, "worker_main()", "write() to eventfd failed: %s", strerror(errno));
+  }
+
+  return NULL;
+}
+
+/**
+ * Takes the oldest task of a worker's queue
+ *
+ * @return : task, NULL if the queue is empty
+ */
+xps_task_t *worker_take(xps_worker_t *worker) {
+  pthread_mutex_lock(&(worker->lock));
+  xps_task_t *task = worker->head;
+  if (task != NULL) {
+    worker->head = task->next;
+    if (worker->head == NULL)
+      worker->tail = NULL;
+    task->next = NULL;
+  }
+  pthread_mutex_unlock(&(worker->lock));
+  return task;
+}
+
+void worker_push(xps_worker_t *worker, xps_task_t *task) {
+  pthread_mutex_lock(&(worker->lock));
+  if (worker->tail != NULL)
+    worker->tail->next = task;
+  else
+    worker->head = task;
+  worker->tail = task;
+  pthread_mutex_unlock(&(worker->lock));
+}
+
+/**
+ * Completes finished tasks on the loop, in the order they finished
+ */
+void workers_event_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_workers_t *workers = ptr;
+
+  // Tasks finishing after the read write again and are handled next time
+  uint64_t n;
+  if (read(workers->event_fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+    logger(LOG_ERROR, "workers_event_handler()", "read() from eventfd failed: %s",
+           strerror(errno));
+
+  pthread_mutex_lock(&(workers->done_lock));
+  xps_task_t *done = workers->done_head;
+  workers->done_head = NULL;
+  pthread_mutex_unlock(&(workers->done_lock));
+
+  xps_task_t *oldest = NULL;
+  while (done != NULL) {
+    xps_task_t *next = done->next;
+    done->next = oldest;
+    oldest = done;
+    done = next;
+  }
+
+  while (oldest != NULL) {
+    xps_task_t *next = oldest->next;
+    workers_complete(workers, oldest);
+    oldest = next;
+  }
+}
+
+void workers_complete(xps_workers_t *workers, xps_task_t *task) {
+  u_long wait_usec = task->start_usec - task->submit_usec;
+  u_long exec_usec = task->end_usec - task->start_usec;
+
+  workers->n_inflight--;
+  workers->n_done++;
+  workers->wait_usec += wait_usec;
+  workers->exec_usec += exec_usec;
+  if (wait_usec > workers->max_wait_usec)
+    workers->max_wait_usec = wait_usec;
+  if (exec_usec > workers->max_exec_usec)
+    workers->max_exec_usec = exec_usec;
+
+  task->done_cb(task->ptr);
+  free(task);
+}
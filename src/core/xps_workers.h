@@ -0,0 +1,79 @@
+#ifndef XPS_WORKERS_H
+#define XPS_WORKERS_H
+
+#include "../xps.h"
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+/*
+ * Threads that run blocking work off the loop, config->workers of them.
+ *
+ * A task is a work_cb run on a worker thread and a done_cb run on the loop
+ * once it returns, both given the task's ptr. work_cb must only touch what
+ * ptr holds, and logger(): the loop, pools, buffers and the rest of the core
+ * are not thread safe. done_cb is called exactly once for every task and
+ * owns ptr; for tasks still queued when the pool is destroyed it is called
+ * without work_cb having run. A submitter that goes away before its task is
+ * done marks ptr so done_cb only frees it.
+ *
+ * The loop hands tasks out round robin to per-worker queues. A worker runs
+ * the oldest task of its own queue, and when that is empty steals the oldest
+ * one of the next worker that has any, so a slow task does not hold up the
+ * ones queued behind it. Finished tasks are put on a completion list and the
+ * loop is woken through an eventfd attached to it.
+ *
+ * When XPS_CPU pins the loop, workers run on the other CPUs of its NUMA
+ * node, or on the other CPUs the process was allowed before pinning, so
+ * blocking work does not compete with the loop. They share the loop's CPU
+ * only when there is no other.
+ */
+struct xps_task_s {
+  xps_handler_t work_cb;
+  xps_handler_t done_cb;
+  void *ptr;
+  u_long submit_usec;
+  u_long start_usec;
+  u_long end_usec;
+  xps_task_t *next;
+};
+
+struct xps_worker_s {
+  xps_workers_t *workers;
+  u_int index;
+  pthread_t thread;
+  pthread_mutex_t lock; // Guards the queue
+  xps_task_t *head;     // Oldest queued task
+  xps_task_t *tail;
+  u_long n_run;    // Tasks this worker ran, stolen ones included
+  u_long n_stolen; // Tasks taken from other workers' queues
+};
+
+struct xps_workers_s {
+  xps_core_t *core;
+  xps_worker_t *workers;
+  u_int n_workers;
+  u_int n_started; // Threads created, all of them once the pool is up
+  u_int rr;        // Worker the next task is queued to
+  pthread_mutex_t lock; // Guards n_queued and stop, workers wait on cond
+  pthread_cond_t cond;
+  u_int n_queued; // Tasks in queues, not yet taken by a worker
+  bool stop;
+  pthread_mutex_t done_lock; // Guards done_head
+  xps_task_t *done_head;     // Finished tasks, most recent first
+  int event_fd;              // Written by workers when a task finishes
+  u_int n_inflight; // Submitted and not yet completed on the loop
+  u_int max_depth;  // Most tasks queued at once
+  u_long n_done;
+  u_long wait_usec;     // Sum of time tasks spent queued
+  u_long max_wait_usec;
+  u_long exec_usec;     // Sum of time tasks spent in work_cb
+  u_long max_exec_usec;
+};
+
+xps_workers_t *xps_workers_create(xps_core_t *core, u_int n_workers);
+void xps_workers_destroy(xps_workers_t *workers);
+int xps_workers_submit(xps_workers_t *workers, xps_handler_t work_cb, xps_handler_t done_cb,
+                       void *ptr);
+void xps_workers_log_stats(xps_workers_t *workers);
+
+#endif
@@ -0,0 +1,415 @@
+#include "../xps.h"
+
+enum cache_queue_e { CACHE_SMALL, CACHE_MAIN, CACHE_GHOST };
+
+struct cache_entry_s {
+  u_long hash;
+  char *key;                // NULL for ghosts
+  xps_buffer_list_t *buffs; // Complete response, NULL for ghosts
+  size_t n_bytes;           // Memory charged to the shard
+  u_long expire_msec;
+  u_char freq;              // Hits since insertion or last pass over main queue, max 3
+  enum cache_queue_e queue;
+  struct cache_entry_s *hash_next;
+  struct cache_entry_s *prev; // Towards head of queue
+  struct cache_entry_s *next; // Towards tail of queue
+};
+
+typedef struct cache_entry_s cache_entry_t;
+typedef struct cache_shard_s cache_shard_t;
+typedef struct cache_queue_s cache_queue_t;
+
+u_long cache_hash(const char *key);
+cache_entry_t *cache_find(cache_shard_t *shard, u_long hash, const char *key, bool ghost);
+void cache_unlink(cache_shard_t *shard, cache_entry_t *entry);
+void cache_remove(cache_shard_t *shard, cache_entry_t *entry);
+void cache_queue_push(cache_shard_t *shard, cache_queue_t *queue, cache_entry_t *entry);
+cache_queue_t *cache_queue_of(cache_shard_t *shard, cache_entry_t *entry);
+void cache_evict(cache_shard_t *shard);
+void cache_evict_small(cache_shard_t *shard);
+void cache_evict_main(cache_shard_t *shard);
+void cache_drop_buffs(xps_buffer_list_t *buff_list);
+
+/**
+ * Creates a response cache
+ *
+ * @param max_bytes : memory limit for cached responses, split evenly among shards
+ * @return : cache instance, NULL on failure
+ */
+xps_cache_t *xps_cache_create(size_t max_bytes) {
+  assert(max_bytes > 0);
+
+  xps_cache_t *cache = malloc(sizeof(xps_cache_t));
+  if (cache == NULL) {
+    logger(LOG_ERROR, "xps_cache_create()", "malloc() failed for 'cache'");
+    return NULL;
+  }
+
+  cache->max_bytes = max_bytes;
+  cache->max_entry_bytes = max_bytes / N_CACHE_SHARDS / CACHE_MAX_ENTRY_FRACTION;
+
+  for (int i = 0; i < N_CACHE_SHARDS; i++) {
+    cache_shard_t *shard = &(cache->shards[i]);
+    memset(shard, 0, sizeof(cache_shard_t));
+
+    shard->buckets = calloc(CACHE_SHARD_BUCKETS, sizeof(cache_entry_t *));
+    if (shard->buckets == NULL) {
+      logger(LOG_ERROR, "xps_cache_create()", "calloc() failed for 'buckets'");
+      for (int j = 0; j < i; j++) {
+        pthread_mutex_destroy(&(cache->shards[j].lock));
+        free(cache->shards[j].buckets);
+      }
+      free(cache);
+      return NULL;
+    }
+    pthread_mutex_init(&(shard->lock), NULL);
+    shard->max_bytes = max_bytes / N_CACHE_SHARDS;
+  }
+
+  logger(LOG_DEBUG, "xps_cache_create()", "created cache");
+
+  return cache;
+}
+
+void xps_cache_destroy(xps_cache_t *cache) {
+  assert(cache != NULL);
+
+  for (int i = 0; i < N_CACHE_SHARDS; i++) {
+    cache_shard_t *shard = &(cache->shards[i]);
+    for (u_int j = 0; j < CACHE_SHARD_BUCKETS; j++) {
+      while (shard->buckets[j] != NULL)
+        cache_remove(shard, shard->buckets[j]);
+    }
+    free(shard->buckets);
+    pthread_mutex_destroy(&(shard->lock));
+  }
+
+  free(cache);
+
+  logger(LOG_DEBUG, "xps_cache_destroy()", "destroyed cache");
+}
+
+/**
+ * Looks up a fresh response
+ *
+ * On a hit, slices of the cached buffers are appended to buff_list. They stay
+ * valid even if the entry is evicted before they are sent.
+ *
+ * @param cache : cache instance
+ * @param key : cache key
+ * @param now_msec : current monotonic time
+ * @param buff_list : list to which the response is appended
+ * @return : OK on hit, E_NOTFOUND on miss, E_FAIL on error
+ */
+int xps_cache_lookup(xps_cache_t *cache, const char *key, u_long now_msec,
+                     xps_buffer_list_t *buff_list) {
+  assert(cache != NULL);
+  assert(key != NULL);
+  assert(buff_list != NULL);
+
+  u_long hash = cache_hash(key);
+  cache_shard_t *shard = &(cache->shards[hash % N_CACHE_SHARDS]);
+
+  pthread_mutex_lock(&(shard->lock));
+
+  cache_entry_t *entry = cache_find(shard, hash, key, false);
+  if (entry != NULL && entry->expire_msec <= now_msec) {
+    cache_remove(shard, entry);
+    shard->n_expired++;
+    entry = NULL;
+  }
+
+  if (entry == NULL) {
+    shard->n_misses++;
+    pthread_mutex_unlock(&(shard->lock));
+    return E_NOTFOUND;
+  }
+
+  size_t len = buff_list->len;
+  for (int i = 0; i < entry->buffs->list.length; i++) {
+    xps_buffer_t *buff = entry->buffs->list.data[i];
+    xps_buffer_t *slice = xps_buffer_slice(buff, 0, buff->len);
+    if (slice == NULL) {
+      pthread_mutex_unlock(&(shard->lock));
+      logger(LOG_ERROR, "xps_cache_lookup()", "xps_buffer_slice() failed");
+      return E_FAIL;
+    }
+    xps_buffer_list_append(buff_list, slice);
+  }
+
+  if (entry->freq < 3)
+    entry->freq++;
+  shard->n_hits++;
+  shard->bytes_saved += buff_list->len - len;
+
+  pthread_mutex_unlock(&(shard->lock));
+
+  return OK;
+}
+
+/**
+ * Stores a complete response, replacing any entry with the same key
+ *
+ * The response is copied out of buff_list, which is emptied whether the
+ * response is stored or not.
+ *
+ * @param cache : cache instance
+ * @param key : cache key
+ * @param buff_list : response to be stored
+ * @param expire_msec : monotonic time after which the entry is stale
+ * @return : OK if stored, E_FAIL if response was not stored
+ */
+int xps_cache_insert(xps_cache_t *cache, const char *key, xps_buffer_list_t *buff_list,
+                     u_long expire_msec) {
+  assert(cache != NULL);
+  assert(key != NULL);
+  assert(buff_list != NULL);
+
+  size_t len = buff_list->len;
+  size_t n_bytes = len + strlen(key) + sizeof(cache_entry_t) + sizeof(xps_buffer_t);
+  if (len == 0 || n_bytes > cache->max_entry_bytes) {
+    cache_drop_buffs(buff_list);
+    return E_FAIL;
+  }
+
+  // Captured slices keep whole pooled read buffers alive, the response is
+  // copied into a block of its own size so max_bytes bounds real memory
+  cache_entry_t *entry = malloc(sizeof(cache_entry_t));
+  xps_buffer_list_t *buffs = xps_buffer_list_create();
+  char *entry_key = strdup(key);
+  u_char *data = malloc(len);
+  xps_buffer_t *buff = data != NULL ? xps_buffer_create(len, 0, data) : NULL;
+  if (entry == NULL || buffs == NULL || entry_key == NULL || buff == NULL) {
+    logger(LOG_ERROR, "xps_cache_insert()", "failed to allocate entry");
+    free(entry);
+    free(entry_key);
+    if (buffs != NULL)
+      xps_buffer_list_destroy(buffs);
+    if (buff != NULL)
+      xps_buffer_destroy(buff);
+    else
+      free(data);
+    cache_drop_buffs(buff_list);
+    return E_FAIL;
+  }
+
+  for (int i = 0; i < buff_list->list.length; i++) {
+    xps_buffer_t *part = buff_list->list.data[i];
+    memcpy(buff->pos + buff->len, part->pos, part->len);
+    buff->len += part->len;
+  }
+  cache_drop_buffs(buff_list);
+  xps_buffer_list_append(buffs, buff);
+
+  entry->hash = cache_hash(key);
+  entry->key = entry_key;
+  entry->buffs = buffs;
+  entry->n_bytes = n_bytes;
+  entry->expire_msec = expire_msec;
+  entry->freq = 0;
+  entry->hash_next = NULL;
+  entry->prev = NULL;
+  entry->next = NULL;
+
+  cache_shard_t *shard = &(cache->shards[entry->hash % N_CACHE_SHARDS]);
+
+  pthread_mutex_lock(&(shard->lock));
+
+  cache_entry_t *old = cache_find(shard, entry->hash, key, false);
+  if (old != NULL)
+    cache_remove(shard, old);
+
+  // Keys seen recently enough to still be ghosts go to the main queue
+  cache_entry_t *ghost = cache_find(shard, entry->hash, NULL, true);
+  if (ghost != NULL) {
+    cache_remove(shard, ghost);
+    cache_queue_push(shard, &(shard->main), entry);
+  } else
+    cache_queue_push(shard, &(shard->small), entry);
+
+  u_long bucket = entry->hash % CACHE_SHARD_BUCKETS;
+  entry->hash_next = shard->buckets[bucket];
+  shard->buckets[bucket] = entry;
+  shard->n_inserts++;
+
+  while (shard->small.n_bytes + shard->main.n_bytes > shard->max_bytes)
+    cache_evict(shard);
+
+  // Ghost queue remembers about as many keys as the main queue holds
+  while (shard->ghost.n_entries > shard->main.n_entries + CACHE_MIN_GHOSTS)
+    cache_remove(shard, shard->ghost.tail);
+
+  pthread_mutex_unlock(&(shard->lock));
+
+  return OK;
+}
+
+void xps_cache_log_stats(xps_cache_t *cache) {
+  assert(cache != NULL);
+
+  u_long n_hits = 0, n_misses = 0, n_inserts = 0, n_evictions = 0, n_expired = 0;
+  u_long bytes_saved = 0, n_entries = 0;
+  size_t n_bytes = 0;
+
+  for (int i = 0; i < N_CACHE_SHARDS; i++) {
+    cache_shard_t *shard = &(cache->shards[i]);
+    pthread_mutex_lock(&(shard->lock));
+    n_hits += shard->n_hits;
+    n_misses += shard->n_misses;
+    n_inserts += shard->n_inserts;
+    n_evictions += shard->n_evictions;
+    n_expired += shard->n_expired;
+    bytes_saved += shard->bytes_saved;
+    n_entries += shard->small.n_entries + shard->main.n_entries;
+    n_bytes += shard->small.n_bytes + shard->main.n_bytes;
+    pthread_mutex_unlock(&(shard->lock));
+  }
+
+  u_long n_lookups = n_hits + n_misses;
+  logger(LOG_INFO, "xps_cache_log_stats()",
+         "cache: %lu entries, %zu / %zu B, hit ratio %.1f%% (%lu / %lu), bytes saved %lu, "
+         "inserts %lu, evictions %lu, expired %lu",
+         n_entries, n_bytes, cache->max_bytes,
+         n_lookups > 0 ? 100.0 * n_hits / n_lookups : 0.0, n_hits, n_lookups, bytes_saved,
+         n_inserts, n_evictions, n_expired);
+}
+
+/**
+ * FNV-1a
+ */
+u_long cache_hash(const char *key) {
+  u_long hash = 14695981039346656037UL;
+  for (const u_char *c = (const u_char *)key; *c != '\0'; c++) {
+    hash ^= *c;
+    hash *= 1099511628211UL;
+  }
+  return hash;
+}
+
+cache_entry_t *cache_find(cache_shard_t *shard, u_long hash, const char *key, bool ghost) {
+  for (cache_entry_t *entry = shard->buckets[hash % CACHE_SHARD_BUCKETS]; entry != NULL;
+       entry = entry->hash_next) {
+    if (entry->hash != hash || (entry->queue == CACHE_GHOST) != ghost)
+      continue;
+    // Ghosts only keep the hash
+    if (ghost || strcmp(entry->key, key) == 0)
+      return entry;
+  }
+  return NULL;
+}
+
+cache_queue_t *cache_queue_of(cache_shard_t *shard, cache_entry_t *entry) {
+  if (entry->queue == CACHE_SMALL)
+    return &(shard->small);
+  if (entry->queue == CACHE_MAIN)
+    return &(shard->main);
+  return &(shard->ghost);
+}
+
+void cache_queue_push(cache_shard_t *shard, cache_queue_t *queue, cache_entry_t *entry) {
+  entry->queue = queue == &(shard->small) ? CACHE_SMALL
+                 : queue == &(shard->main) ? CACHE_MAIN
+                                           : CACHE_GHOST;
+  entry->prev = NULL;
+  entry->next = queue->head;
+  if (queue->head != NULL)
+    queue->head->prev = entry;
+  queue->head = entry;
+  if (queue->tail == NULL)
+    queue->tail = entry;
+  queue->n_entries++;
+  queue->n_bytes += entry->n_bytes;
+}
+
+/**
+ * Takes an entry out of its queue, leaving it in the hash table
+ */
+void cache_unlink(cache_shard_t *shard, cache_entry_t *entry) {
+  cache_queue_t *queue = cache_queue_of(shard, entry);
+
+  if (entry->prev != NULL)
+    entry->prev->next = entry->next;
+  else
+    queue->head = entry->next;
+  if (entry->next != NULL)
+    entry->next->prev = entry->prev;
+  else
+    queue->tail = entry->prev;
+
+  queue->n_entries--;
+  queue->n_bytes -= entry->n_bytes;
+}
+
+/**
+ * Takes an entry out of its queue and the hash table and frees it
+ */
+void cache_remove(cache_shard_t *shard, cache_entry_t *entry) {
+  cache_unlink(shard, entry);
+
+  cache_entry_t **curr = &(shard->buckets[entry->hash % CACHE_SHARD_BUCKETS]);
+  while (*curr != entry)
+    curr = &((*curr)->hash_next);
+  *curr = entry->hash_next;
+
+  if (entry->buffs != NULL)
+    xps_buffer_list_destroy(entry->buffs);
+  free(entry->key);
+  free(entry);
+}
+
+void cache_evict(cache_shard_t *shard) {
+  // Small queue is kept at about 10% of the shard
+  if (shard->main.n_entries == 0 ||
+      (shard->small.n_entries > 0 && shard->small.n_bytes * 10 >= shard->max_bytes))
+    cache_evict_small(shard);
+  else
+    cache_evict_main(shard);
+}
+
+/**
+ * Evicts the tail of the small queue, promoting it to the main queue instead
+ * if it was hit while in the small queue
+ */
+void cache_evict_small(cache_shard_t *shard) {
+  cache_entry_t *entry = shard->small.tail;
+  cache_unlink(shard, entry);
+
+  if (entry->freq > 0) {
+    entry->freq = 0;
+    cache_queue_push(shard, &(shard->main), entry);
+    return;
+  }
+
+  // Keep the key as a ghost, drop the response
+  xps_buffer_list_destroy(entry->buffs);
+  entry->buffs = NULL;
+  free(entry->key);
+  entry->key = NULL;
+  entry->n_bytes = 0;
+  cache_queue_push(shard, &(shard->ghost), entry);
+  shard->n_evictions++;
+}
+
+/**
+ * Evicts the tail of the main queue, giving entries that were hit another
+ * pass through the queue
+ */
+void cache_evict_main(cache_shard_t *shard) {
+  cache_entry_t *entry = shard->main.tail;
+
+  if (entry->freq > 0) {
+    entry->freq--;
+    cache_unlink(shard, entry);
+    cache_queue_push(shard, &(shard->main), entry);
+    return;
+  }
+
+  cache_remove(shard, entry);
+  shard->n_evictions++;
+}
+
+void cache_drop_buffs(xps_buffer_list_t *buff_list) {
+  xps_buffer_t *buff;
+  while ((buff = xps_buffer_list_shift(buff_list)) != NULL)
+    xps_buffer_destroy(buff);
+}
@@ -0,0 +1,61 @@
+#ifndef XPS_CACHE_H
+#define XPS_CACHE_H
+
+#include "../xps.h"
+
+#include <pthread.h>
+
+/*
+ * Shared in-memory cache of complete HTTP responses, keyed on
+ * "METHOD host path". Responses are copied into one block of their own size
+ * on insert, so the entry is charged for the memory it holds, and handed
+ * out as slices of it, so a hit is served without copying.
+ *
+ * The cache is split into N_CACHE_SHARDS shards with a lock each, selected by
+ * key hash, so that it can be shared by several loops. Every shard evicts
+ * with S3-FIFO: new entries go to a small FIFO queue and are only promoted to
+ * the main queue when hit again before reaching its tail. Keys of entries
+ * evicted from the small queue are remembered in a ghost queue, and entries
+ * re-inserted while still a ghost go straight to the main queue.
+ */
+struct cache_entry_s;
+
+struct cache_queue_s {
+  struct cache_entry_s *head;
+  struct cache_entry_s *tail;
+  u_long n_entries;
+  size_t n_bytes;
+};
+
+struct cache_shard_s {
+  pthread_mutex_t lock;
+  struct cache_entry_s **buckets; // CACHE_SHARD_BUCKETS hash chains
+  struct cache_queue_s small;
+  struct cache_queue_s main;
+  struct cache_queue_s ghost;
+  size_t max_bytes;
+
+  // Stats
+  u_long n_hits;
+  u_long n_misses;
+  u_long n_inserts;
+  u_long n_evictions;
+  u_long n_expired;
+  u_long bytes_saved; // Bytes served from cache
+};
+
+struct xps_cache_s {
+  size_t max_bytes;
+  size_t max_entry_bytes; // Larger responses are not cached
+  struct cache_shard_s shards[N_CACHE_SHARDS];
+};
+
+xps_cache_t *xps_cache_create(size_t max_bytes);
+void xps_cache_destroy(xps_cache_t *cache);
+int xps_cache_lookup(xps_cache_t *cache, const char *key, u_long now_msec,
+                     xps_buffer_list_t *buff_list);
+int xps_cache_insert(xps_cache_t *cache, const char *key, xps_buffer_list_t *buff_list,
+                     u_long expire_msec);
+void xps_cache_log_stats(xps_cache_t *cache);
+
+#endif
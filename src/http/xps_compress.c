@@ -0,0 +1,410 @@
+#include "../xps.h"
+
+#define CHUNK_HEAD_LEN 8 // "%06zx\r\n", leading zeros are valid in chunk sizes
+
+int compress_filter_handler(xps_pipe_filter_t *filter, xps_buffer_t *buff);
+void compress_filter_close_handler(void *ptr);
+xps_pipe_filter_t *compress_filter_of(xps_pipe_t *pipe);
+int compress_write(xps_pipe_filter_t *filter, const u_char *data, size_t len, bool end);
+int compress_emit(xps_pipe_filter_t *filter);
+void compress_end_range(xps_compress_t *compress);
+xps_compressor_t *compressor_get(xps_core_t *core, enum xps_encoding_e encoding, size_t len);
+void compressor_put(xps_core_t *core, xps_compressor_t *compressor);
+void compressor_free(xps_compressor_t *compressor);
+
+// Content types that are compressed already, or nearly so
+const char *precompressed_types[] = {
+  "image/",           "audio/",           "video/",           "font/woff",
+  "application/zip",  "application/gzip", "application/x-gzip", "application/zstd",
+  "application/x-xz", "application/x-bzip2", "application/x-7z-compressed",
+  "application/x-rar-compressed", "application/pdf", "application/octet-stream",
+};
+
+/**
+ * Returns the Content-Encoding token of encoding
+ */
+const char *xps_encoding_name(enum xps_encoding_e encoding) {
+  switch (encoding) {
+  case ENCODING_GZIP:
+    return "gzip";
+  case ENCODING_ZSTD:
+    return "zstd";
+  default:
+    return "identity";
+  }
+}
+
+/**
+ * Checks whether a body of content_type is worth compressing
+ *
+ * @param content_type : value of Content-Type header, "" if absent
+ * @return : false for missing and already compressed types
+ */
+bool xps_compress_type_ok(const char *content_type) {
+  assert(content_type != NULL);
+
+  if (content_type[0] == '\0')
+    return false;
+
+  // SVG is text, unlike other images
+  if (strncasecmp(content_type, "image/svg+xml", 13) == 0)
+    return true;
+
+  for (size_t i = 0; i < sizeof(precompressed_types) / sizeof(precompressed_types[0]); i++) {
+    if (strncasecmp(content_type, precompressed_types[i], strlen(precompressed_types[i])) == 0)
+      return false;
+  }
+  return true;
+}
+
+/**
+ * Compresses len bytes of a pipe's stream with encoding
+ *
+ * The range starts after the next skip bytes written to the pipe by its
+ * source. A compression filter is attached to the pipe by the first call.
+ *
+ * @param pipe : pipe the body is written to
+ * @param encoding : ENCODING_GZIP or ENCODING_ZSTD
+ * @param skip : bytes still to be written before the body
+ * @param len : length of the body, must not be 0
+ * @return : OK on success, E_FAIL on failure, in which case nothing changes
+ */
+int xps_compress_range(xps_pipe_t *pipe, enum xps_encoding_e encoding, size_t skip, size_t len) {
+  assert(pipe != NULL);
+  assert(encoding != ENCODING_IDENTITY);
+  assert(len > 0);
+
+#ifndef XPS_ZSTD
+  if (encoding == ENCODING_ZSTD) {
+    logger(LOG_ERROR, "xps_compress_range()", "built without zstd");
+    return E_FAIL;
+  }
+#endif
+
+  xps_pipe_filter_t *filter = compress_filter_of(pipe);
+  if (filter == NULL) {
+    xps_compress_t *compress = calloc(1, sizeof(xps_compress_t));
+    if (compress == NULL) {
+      logger(LOG_ERROR, "xps_compress_range()", "calloc() failed for 'compress'");
+      return E_FAIL;
+    }
+    compress->core = pipe->core;
+    vec_init(&(compress->ranges));
+
+    filter = xps_pipe_filter_create(pipe->core, compress, compress_filter_handler,
+                                    compress_filter_close_handler);
+    if (filter == NULL) {
+      logger(LOG_ERROR, "xps_compress_range()", "xps_pipe_filter_create() failed");
+      vec_deinit(&(compress->ranges));
+      free(compress);
+      return E_FAIL;
+    }
+    if (xps_pipe_attach_filter(pipe, filter) != OK) {
+      xps_pipe_filter_destroy(filter);
+      return E_FAIL;
+    }
+  }
+
+  xps_compress_t *compress = filter->ptr;
+  xps_compress_range_t *range = malloc(sizeof(xps_compress_range_t));
+  if (range == NULL) {
+    logger(LOG_ERROR, "xps_compress_range()", "malloc() failed for 'range'");
+    return E_FAIL;
+  }
+  range->start = compress->pos + skip;
+  range->end = range->start + len;
+  range->encoding = encoding;
+  vec_push(&(compress->ranges), range);
+
+  return OK;
+}
+
+/**
+ * Frees the idle compressors of a core
+ */
+void xps_compress_pool_clear(xps_core_t *core) {
+  assert(core != NULL);
+
+  for (int i = 0; i < core->compressors.length; i++)
+    compressor_free(core->compressors.data[i]);
+  vec_clear(&(core->compressors));
+}
+
+int compress_filter_handler(xps_pipe_filter_t *filter, xps_buffer_t *buff) {
+  xps_compress_t *compress = filter->ptr;
+
+  // Stream ended, bodies cut short stay unterminated so the client notices
+  if (buff == NULL) {
+    while (compress->ranges.length > 0)
+      compress_end_range(compress);
+    xps_pipe_filter_hold(filter, compress->out != NULL ? compress->out->len : 0);
+    return OK;
+  }
+
+  size_t done = 0;
+  int error = OK;
+  while (done < buff->len && error == OK) {
+    xps_compress_range_t *range = compress->ranges.length > 0 ? compress->ranges.data[0] : NULL;
+    size_t len = buff->len - done;
+
+    if (range == NULL || compress->pos < range->start) {
+      if (range != NULL && range->start - compress->pos < len)
+        len = range->start - compress->pos;
+      compress->pos += len;
+
+      // Pass through without copying
+      if (len == buff->len)
+        return xps_pipe_filter_emit(filter, buff);
+      xps_buffer_t *slice = xps_buffer_slice(buff, done, len);
+      error = slice != NULL ? xps_pipe_filter_emit(filter, slice) : E_FAIL;
+      done += len;
+      continue;
+    }
+
+    if (range->end - compress->pos < len)
+      len = range->end - compress->pos;
+
+    if (compress->compressor == NULL) {
+      compress->compressor = compressor_get(compress->core, range->encoding, range->end - range->start);
+      if (compress->compressor == NULL) {
+        error = E_FAIL;
+        break;
+      }
+    }
+
+    compress->pos += len;
+    bool end = compress->pos == range->end;
+    error = compress_write(filter, buff->pos + done, len, end);
+    if (end)
+      compress_end_range(compress);
+    done += len;
+  }
+
+  // Input is always taken in whole, only the chunk being filled is held back
+  xps_pipe_filter_hold(filter, compress->out != NULL ? compress->out->len : 0);
+
+  xps_buffer_destroy(buff);
+  return error;
+}
+
+void compress_filter_close_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_pipe_filter_t *filter = ptr;
+  xps_compress_t *compress = filter->ptr;
+
+  while (compress->ranges.length > 0)
+    compress_end_range(compress);
+  vec_deinit(&(compress->ranges));
+  if (compress->out != NULL)
+    xps_buffer_destroy(compress->out);
+  free(compress);
+}
+
+xps_pipe_filter_t *compress_filter_of(xps_pipe_t *pipe) {
+  for (int i = 0; i < pipe->filters.length; i++) {
+    xps_pipe_filter_t *filter = pipe->filters.data[i];
+    if (filter->handler_cb == compress_filter_handler)
+      return filter;
+  }
+  return NULL;
+}
+
+/**
+ * Feeds len bytes to the compressor of the current range, emitting full
+ * chunks, and everything left plus the last chunk if end is set
+ */
+int compress_write(xps_pipe_filter_t *filter, const u_char *data, size_t len, bool end) {
+  xps_compress_t *compress = filter->ptr;
+  xps_compressor_t *compressor = compress->compressor;
+
+  while (true) {
+    if (compress->out == NULL) {
+      compress->out = xps_buffer_create(CHUNK_HEAD_LEN + COMPRESS_CHUNK_SIZE + 2, 0, NULL);
+      if (compress->out == NULL) {
+        logger(LOG_ERROR, "compress_write()", "xps_buffer_create() failed");
+        return E_FAIL;
+      }
+    }
+    xps_buffer_t *out = compress->out;
+    u_char *dst = out->pos + CHUNK_HEAD_LEN + out->len;
+    size_t avail = COMPRESS_CHUNK_SIZE - out->len;
+    bool finished = false;
+
+    if (compressor->encoding == ENCODING_GZIP) {
+      compressor->zs.next_in = (u_char *)data;
+      compressor->zs.avail_in = len;
+      compressor->zs.next_out = dst;
+      compressor->zs.avail_out = avail;
+      int ret = deflate(&(compressor->zs), end ? Z_FINISH : Z_NO_FLUSH);
+      if (ret == Z_STREAM_ERROR) {
+        logger(LOG_ERROR, "compress_write()", "deflate() failed");
+        return E_FAIL;
+      }
+      data += len - compressor->zs.avail_in;
+      len = compressor->zs.avail_in;
+      out->len += avail - compressor->zs.avail_out;
+      finished = end ? ret == Z_STREAM_END : len == 0 && compressor->zs.avail_out > 0;
+    }
+#ifdef XPS_ZSTD
+    else {
+      ZSTD_inBuffer in = {data, len, 0};
+      ZSTD_outBuffer zout = {dst, avail, 0};
+      size_t ret = ZSTD_compressStream2(compressor->cctx, &zout, &in, end ? ZSTD_e_end : ZSTD_e_continue);
+      if (ZSTD_isError(ret)) {
+        logger(LOG_ERROR, "compress_write()", "ZSTD_compressStream2() failed: %s", ZSTD_getErrorName(ret));
+        return E_FAIL;
+      }
+      data += in.pos;
+      len -= in.pos;
+      out->len += zout.pos;
+      finished = end ? ret == 0 : len == 0 && zout.pos < avail;
+    }
+#endif
+
+    if (out->len == COMPRESS_CHUNK_SIZE || (end && finished)) {
+      if (compress_emit(filter) != OK)
+        return E_FAIL;
+    }
+    if (finished)
+      break;
+  }
+
+  if (!end)
+    return OK;
+
+  // Last chunk
+  xps_buffer_t *last = xps_buffer_create(5, 5, NULL);
+  if (last == NULL) {
+    logger(LOG_ERROR, "compress_write()", "xps_buffer_create() failed");
+    return E_FAIL;
+  }
+  memcpy(last->pos, "0\r\n\r\n", 5);
+  return xps_pipe_filter_emit(filter, last);
+}
+
+/**
+ * Frames the filled part of the current output buffer as a chunk and passes
+ * it on
+ */
+int compress_emit(xps_pipe_filter_t *filter) {
+  xps_compress_t *compress = filter->ptr;
+  xps_buffer_t *out = compress->out;
+  compress->out = NULL;
+
+  if (out->len == 0) {
+    xps_buffer_destroy(out);
+    return OK;
+  }
+
+  char head[CHUNK_HEAD_LEN + 1];
+  snprintf(head, sizeof(head), "%06zx\r\n", out->len);
+  memcpy(out->pos, head, CHUNK_HEAD_LEN);
+  memcpy(out->pos + CHUNK_HEAD_LEN + out->len, "\r\n", 2);
+  out->len += CHUNK_HEAD_LEN + 2;
+
+  return xps_pipe_filter_emit(filter, out);
+}
+
+/**
+ * Drops the first range, giving its compressor back to the pool
+ */
+void compress_end_range(xps_compress_t *compress) {
+  free(compress->ranges.data[0]);
+  vec_splice(&(compress->ranges), 0, 1);
+
+  if (compress->compressor != NULL) {
+    compressor_put(compress->core, compress->compressor);
+    compress->compressor = NULL;
+  }
+  if (compress->out != NULL) {
+    xps_buffer_destroy(compress->out);
+    compress->out = NULL;
+  }
+}
+
+/**
+ * Takes an idle compressor for encoding from the pool of core, creating one
+ * if there is none
+ *
+ * @param len : length of the body to be compressed
+ */
+xps_compressor_t *compressor_get(xps_core_t *core, enum xps_encoding_e encoding, size_t len) {
+  xps_compressor_t *compressor = NULL;
+  for (int i = core->compressors.length - 1; i >= 0; i--) {
+    xps_compressor_t *idle = core->compressors.data[i];
+    if (idle->encoding == encoding) {
+      compressor = idle;
+      vec_splice(&(core->compressors), i, 1);
+      break;
+    }
+  }
+
+  if (compressor == NULL) {
+    compressor = calloc(1, sizeof(xps_compressor_t));
+    if (compressor == NULL) {
+      logger(LOG_ERROR, "compressor_get()", "calloc() failed for 'compressor'");
+      return NULL;
+    }
+    compressor->encoding = encoding;
+
+    if (encoding == ENCODING_GZIP) {
+      // 15 window bits, +16 for a gzip wrapper
+      if (deflateInit2(&(compressor->zs), core->config->gzip_level, Z_DEFLATED, 15 + 16, 8,
+                       Z_DEFAULT_STRATEGY) != Z_OK) {
+        logger(LOG_ERROR, "compressor_get()", "deflateInit2() failed");
+        free(compressor);
+        return NULL;
+      }
+    }
+#ifdef XPS_ZSTD
+    else {
+      compressor->cctx = ZSTD_createCCtx();
+      if (compressor->cctx == NULL) {
+        logger(LOG_ERROR, "compressor_get()", "ZSTD_createCCtx() failed");
+        free(compressor);
+        return NULL;
+      }
+      ZSTD_CCtx_setParameter(compressor->cctx, ZSTD_c_compressionLevel, core->config->zstd_level);
+    }
+#endif
+  }
+
+#ifdef XPS_ZSTD
+  // Lets zstd size its window to the body and record the size in the frame
+  if (encoding == ENCODING_ZSTD)
+    ZSTD_CCtx_setPledgedSrcSize(compressor->cctx, len);
+#else
+  (void)len;
+#endif
+
+  return compressor;
+}
+
+/**
+ * Resets a compressor and keeps it for the next body, unless the pool is full
+ */
+void compressor_put(xps_core_t *core, xps_compressor_t *compressor) {
+  if (core->compressors.length >= COMPRESS_POOL_SIZE) {
+    compressor_free(compressor);
+    return;
+  }
+
+  if (compressor->encoding == ENCODING_GZIP)
+    deflateReset(&(compressor->zs));
+#ifdef XPS_ZSTD
+  else
+    ZSTD_CCtx_reset(compressor->cctx, ZSTD_reset_session_only);
+#endif
+
+  vec_push(&(core->compressors), compressor);
+}
+
+void compressor_free(xps_compressor_t *compressor) {
+  if (compressor->encoding == ENCODING_GZIP)
+    deflateEnd(&(compressor->zs));
+#ifdef XPS_ZSTD
+  else
+    ZSTD_freeCCtx(compressor->cctx);
+#endif
+  free(compressor);
+}
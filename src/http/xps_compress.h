@@ -0,0 +1,45 @@
+#ifndef XPS_COMPRESS_H
+#define XPS_COMPRESS_H
+
+#include "../xps.h"
+
+/*
+ * Streaming response compression as a filter stage of the client pipe.
+ *
+ * The session keeps writing response heads and bodies to its client pipe as
+ * before. For each body it wants compressed it registers a range of the byte
+ * stream that is yet to reach the filter; bytes outside of ranges pass
+ * through untouched. Compressed bodies leave the filter as chunks, so the
+ * head sent with them must use chunked transfer coding.
+ *
+ * Compressor state, which holds the window memory, is taken from a per-core
+ * pool for each body and reset when it is given back.
+ */
+struct xps_compressor_s {
+  enum xps_encoding_e encoding;
+  z_stream zs;
+#ifdef XPS_ZSTD
+  ZSTD_CCtx *cctx;
+#endif
+};
+
+struct xps_compress_range_s {
+  size_t start; // Stream position of first byte to compress
+  size_t end;   // Stream position after last byte to compress
+  enum xps_encoding_e encoding;
+};
+
+struct xps_compress_s {
+  xps_core_t *core;
+  size_t pos;        // Bytes given to the filter so far
+  vec_void_t ranges; // Ranges not yet compressed, in stream order
+  xps_compressor_t *compressor; // Compressor of first range once it is reached
+  xps_buffer_t *out; // Chunk being filled, NULL if none
+};
+
+const char *xps_encoding_name(enum xps_encoding_e encoding);
+bool xps_compress_type_ok(const char *content_type);
+int xps_compress_range(xps_pipe_t *pipe, enum xps_encoding_e encoding, size_t skip, size_t len);
+void xps_compress_pool_clear(xps_core_t *core);
+
+#endif
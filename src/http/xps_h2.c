@@ -0,0 +1,1454 @@
+#include "../xps.h"
+
+// Frame flags
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+// Settings identifiers
+#define H2_SETTINGS_HEADER_TABLE_SIZE 0x1
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE 0x5
+
+#define H2_MAX_WINDOW 0x7fffffffL
+#define H2_DEFAULT_WINDOW 65535
+
+// Positions in a chunked response body besides chunk data
+#define H2_CHUNK_SIZE -1     // Reading a chunk size line
+#define H2_CHUNK_CRLF -2     // Reading the CRLF after chunk data
+#define H2_CHUNK_TRAILERS -3 // Reading trailer lines after the last chunk
+
+/*
+ * Request head being built from a header block
+ */
+struct h2_req_s {
+  char method[HTTP_METHOD_LEN];
+  char path[HTTP_MAX_PATH_LEN];
+  char authority[HTTP_HOST_LEN];
+  xps_buffer_t *lines;  // Regular headers as HTTP/1.1 lines
+  xps_buffer_t *cookie; // Cookie headers joined with "; "
+  long content_length;  // -1 if absent
+  bool regular_seen;    // Pseudo headers must come first
+  bool error;           // Malformed, the stream is reset
+  bool too_large;       // Does not fit in HTTP_MAX_HEAD_SIZE, the stream gets a 431
+};
+
+void h2_client_source_handler(void *ptr);
+void h2_client_source_close_handler(void *ptr);
+void h2_client_sink_handler(void *ptr);
+void h2_client_sink_close_handler(void *ptr);
+void h2_upstream_source_handler(void *ptr);
+void h2_upstream_source_close_handler(void *ptr);
+void h2_upstream_sink_handler(void *ptr);
+void h2_upstream_sink_close_handler(void *ptr);
+void h2_process_in(xps_h2_t *h2);
+void h2_on_data(xps_h2_t *h2, u_char flags, u_int id, size_t len);
+void h2_on_headers(xps_h2_t *h2, u_char flags, u_int id, xps_buffer_t *payload);
+void h2_on_header_block(xps_h2_t *h2);
+void h2_on_settings(xps_h2_t *h2, xps_buffer_t *payload);
+void h2_on_window_update(xps_h2_t *h2, u_int id, xps_buffer_t *payload);
+void h2_req_header(const char *name, const char *value, void *ptr);
+void h2_res_header(const char *name, const char *value, void *ptr);
+xps_h2_stream_t *h2_stream_create(xps_h2_t *h2, u_int id, struct h2_req_s *req, bool end_stream);
+void h2_stream_destroy(xps_h2_stream_t *stream);
+xps_h2_stream_t *h2_stream_find(xps_h2_t *h2, u_int id);
+void h2_stream_req_end(xps_h2_stream_t *stream);
+void h2_stream_respond(xps_h2_stream_t *stream, int status);
+void h2_stream_reset(xps_h2_stream_t *stream, u_int error_code);
+xps_h2_upstream_t *h2_upstream_create(xps_h2_t *h2, int *error);
+void h2_upstream_destroy(xps_h2_upstream_t *up);
+void h2_upstream_process(xps_h2_upstream_t *up);
+int h2_upstream_process_head(xps_h2_upstream_t *up);
+int h2_upstream_dechunk(xps_h2_upstream_t *up);
+void h2_upstream_res_done(xps_h2_upstream_t *up);
+void h2_dispatch(xps_h2_t *h2);
+void h2_flush(xps_h2_t *h2);
+xps_buffer_t *h2_frame_create(u_char type, u_char flags, u_int id, size_t len);
+void h2_append(xps_h2_t *h2, xps_buffer_list_t *buff_list, const char *data, size_t len);
+void h2_send_frame(xps_h2_t *h2, u_char type, u_char flags, u_int id, const u_char *payload,
+                   size_t len);
+void h2_send_u32(xps_h2_t *h2, u_char type, u_int id, u_int value);
+void h2_send_headers(xps_h2_t *h2, u_int id, const u_char *block, size_t len, bool end_stream);
+void h2_goaway(xps_h2_t *h2, u_int error_code);
+void h2_update(xps_h2_t *h2);
+void h2_update_ready(xps_h2_t *h2);
+void h2_free(xps_h2_t *h2);
+
+static u_int h2_get_u32(const u_char *data) {
+  return ((u_int)data[0] << 24) | ((u_int)data[1] << 16) | ((u_int)data[2] << 8) | data[3];
+}
+
+static void h2_put_u32(u_char *data, u_int value) {
+  data[0] = value >> 24;
+  data[1] = value >> 16;
+  data[2] = value >> 8;
+  data[3] = value;
+}
+
+/**
+ * Takes over the client pipes of a session that received the connection
+ * preface
+ *
+ * The caller detaches its own source and sink from the pipes first.
+ *
+ * @param core : core instance
+ * @param listener : listener the client came from, may be NULL
+ * @param in_pipe : pipe carrying bytes from the client
+ * @param out_pipe : pipe carrying bytes to the client
+ * @param pending : client bytes already read, starting with the preface, moved into the h2
+ * @return : h2 instance, NULL on failure
+ */
+xps_h2_t *xps_h2_create(xps_core_t *core, xps_listener_t *listener, xps_pipe_t *in_pipe,
+                        xps_pipe_t *out_pipe, xps_buffer_list_t *pending) {
+  assert(core != NULL);
+  assert(in_pipe != NULL);
+  assert(out_pipe != NULL);
+  assert(pending != NULL);
+
+  xps_h2_t *h2 = calloc(1, sizeof(xps_h2_t));
+  if (h2 == NULL) {
+    logger(LOG_ERROR, "xps_h2_create()", "calloc() failed for 'h2'");
+    return NULL;
+  }
+
+  // Init values
+  h2->core = core;
+  h2->listener = listener;
+  h2->client_source =
+      xps_pipe_source_create(core, h2, h2_client_source_handler, h2_client_source_close_handler);
+  h2->client_sink =
+      xps_pipe_sink_create(core, h2, h2_client_sink_handler, h2_client_sink_close_handler);
+  h2->in = xps_buffer_list_create();
+  h2->to_client = xps_buffer_list_create();
+  h2->decoder = xps_hpack_create();
+  vec_init(&(h2->streams));
+  vec_init(&(h2->waiting));
+  vec_init(&(h2->upstreams));
+  h2->send_window = H2_DEFAULT_WINDOW;
+  h2->peer_initial_window = H2_DEFAULT_WINDOW;
+  h2->peer_max_frame = H2_MAX_FRAME_SIZE;
+
+  if (h2->client_source == NULL || h2->client_sink == NULL || h2->in == NULL ||
+      h2->to_client == NULL || h2->decoder == NULL) {
+    logger(LOG_ERROR, "xps_h2_create()", "failed to allocate h2");
+    h2_free(h2);
+    return NULL;
+  }
+  if (listener != NULL)
+    h2->client_sink->weight = listener->weight;
+
+  if (xps_pipe_attach_sink(in_pipe, h2->client_sink) != OK ||
+      xps_pipe_attach_source(out_pipe, h2->client_source) != OK) {
+    logger(LOG_ERROR, "xps_h2_create()", "failed to attach to client pipes");
+    h2_free(h2);
+    return NULL;
+  }
+  h2->client_source->active = true;
+  h2->client_sink->active = true;
+  vec_push(&(core->h2s), h2);
+
+  // Frames of many streams interleave in small writes, Nagle would hold them
+  // back until the client's delayed ACK
+  if (in_pipe->source != NULL) {
+    xps_connection_t *client = in_pipe->source->ptr;
+    int enable = 1;
+    setsockopt(client->sock_fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+  }
+
+  // Server preface
+  u_char settings[18];
+  settings[0] = 0;
+  settings[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+  h2_put_u32(settings + 2, H2_MAX_STREAMS);
+  settings[6] = 0;
+  settings[7] = H2_SETTINGS_INITIAL_WINDOW_SIZE;
+  h2_put_u32(settings + 8, H2_STREAM_WINDOW);
+  settings[12] = 0;
+  settings[13] = H2_SETTINGS_HEADER_TABLE_SIZE;
+  h2_put_u32(settings + 14, HPACK_TABLE_SIZE);
+  h2_send_frame(h2, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+
+  xps_buffer_list_move(pending, h2->in, pending->len);
+  h2_process_in(h2);
+  h2_dispatch(h2);
+  h2_update_ready(h2);
+
+  logger(LOG_DEBUG, "xps_h2_create()", "created h2 connection");
+
+  return h2;
+}
+
+void xps_h2_destroy(xps_h2_t *h2) {
+  assert(h2 != NULL);
+
+  vec_remove(&(h2->core->h2s), h2);
+  h2_free(h2);
+
+  logger(LOG_DEBUG, "xps_h2_destroy()", "destroyed h2 connection");
+}
+
+/**
+ * Tells the client no new streams are taken, with a GOAWAY, and closes the
+ * connection once the open ones are done
+ *
+ * @param h2 : connection of a draining core
+ */
+void xps_h2_drain(xps_h2_t *h2) {
+  assert(h2 != NULL);
+
+  if (h2->goaway_sent || h2->closing)
+    return;
+
+  u_char payload[8];
+  h2_put_u32(payload, h2->last_stream_id);
+  h2_put_u32(payload + 4, H2_NO_ERROR);
+  h2_send_frame(h2, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+  h2->goaway_sent = true;
+
+  h2_update(h2);
+}
+
+void h2_free(xps_h2_t *h2) {
+  // Streams first, a stream still being served closes its upstream
+  while (h2->streams.length > 0)
+    h2_stream_destroy(h2->streams.data[0]);
+  while (h2->upstreams.length > 0)
+    h2_upstream_destroy(h2->upstreams.data[0]);
+
+  // Destroying sources and sinks detaches them, pipes left without a peer
+  // close the client connection
+  if (h2->client_source != NULL)
+    xps_pipe_source_destroy(h2->client_source);
+  if (h2->client_sink != NULL)
+    xps_pipe_sink_destroy(h2->client_sink);
+  if (h2->in != NULL)
+    xps_buffer_list_destroy(h2->in);
+  if (h2->to_client != NULL)
+    xps_buffer_list_destroy(h2->to_client);
+  if (h2->decoder != NULL)
+    xps_hpack_destroy(h2->decoder);
+  if (h2->header_block != NULL)
+    xps_buffer_destroy(h2->header_block);
+  vec_deinit(&(h2->streams));
+  vec_deinit(&(h2->waiting));
+  vec_deinit(&(h2->upstreams));
+  free(h2);
+}
+
+void h2_client_source_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_pipe_source_t *source = ptr;
+  xps_h2_t *h2 = source->ptr;
+
+  while (h2->to_client->list.length > 0 && xps_pipe_is_writable(source->pipe))
+    xps_pipe_source_append(source, xps_buffer_list_shift(h2->to_client));
+
+  // Room made in to_client lets more DATA be framed
+  h2_flush(h2);
+  while (h2->to_client->list.length > 0 && xps_pipe_is_writable(source->pipe))
+    xps_pipe_source_append(source, xps_buffer_list_shift(h2->to_client));
+
+  h2_update(h2);
+}
+
+void h2_client_source_close_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_pipe_source_t *source = ptr;
+
+  xps_h2_destroy(source->ptr);
+}
+
+void h2_client_sink_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_pipe_sink_t *sink = ptr;
+  xps_h2_t *h2 = sink->ptr;
+
+  if (xps_pipe_sink_move(sink, h2->in, xps_pipe_sink_len(sink)) != OK) {
+    logger(LOG_ERROR, "h2_client_sink_handler()", "xps_pipe_sink_move() failed");
+    h2->closing = true;
+  }
+
+  h2_process_in(h2);
+  h2_dispatch(h2);
+  h2_flush(h2);
+  h2_update(h2);
+}
+
+void h2_client_sink_close_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_pipe_sink_t *sink = ptr;
+
+  xps_h2_destroy(sink->ptr);
+}
+
+void h2_upstream_source_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_pipe_source_t *source = ptr;
+  xps_h2_upstream_t *up = source->ptr;
+  xps_h2_t *h2 = up->h2;
+  xps_h2_stream_t *stream = up->stream;
+
+  if (stream != NULL) {
+    while (stream->to_upstream->list.length > 0 && xps_pipe_is_writable(source->pipe))
+      xps_pipe_source_append(source, xps_buffer_list_shift(stream->to_upstream));
+
+    // Window is given back once the body is on its way upstream
+    if (stream->to_upstream->len == 0 && stream->recv_unacked > 0) {
+      if (!stream->req_done)
+        h2_send_u32(h2, H2_WINDOW_UPDATE, stream->id, stream->recv_unacked);
+      stream->recv_unacked = 0;
+    }
+  }
+
+  h2_update(h2);
+}
+
+void h2_upstream_source_close_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_pipe_source_t *source = ptr;
+  xps_h2_upstream_t *up = source->ptr;
+
+  // Upstream stopped reading, its sink closes as well
+  xps_pipe_detach_source(source->pipe);
+
+  h2_update(up->h2);
+}
+
+void h2_upstream_sink_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_pipe_sink_t *sink = ptr;
+  xps_h2_upstream_t *up = sink->ptr;
+  xps_h2_t *h2 = up->h2;
+
+  size_t len = xps_pipe_sink_len(sink);
+  if (len > h2->core->config->io_budget_bytes)
+    len = h2->core->config->io_budget_bytes;
+
+  if (xps_pipe_sink_move(sink, up->res_buff, len) != OK) {
+    logger(LOG_ERROR, "h2_upstream_sink_handler()", "xps_pipe_sink_move() failed");
+    h2_upstream_sink_close_handler(sink);
+    return;
+  }
+
+  h2_upstream_process(up);
+
+  h2_dispatch(h2);
+  h2_flush(h2);
+  h2_update(h2);
+}
+
+void h2_upstream_sink_close_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_pipe_sink_t *sink = ptr;
+  xps_h2_upstream_t *up = sink->ptr;
+  xps_h2_t *h2 = up->h2;
+  xps_h2_stream_t *stream = up->stream;
+
+  if (stream != NULL && up->head_done && !up->chunked && up->body_left < 0) {
+    // Response ended with the connection
+    up->keep_alive = false;
+    h2_upstream_res_done(up);
+  } else {
+    if (stream != NULL) {
+      up->stream = NULL;
+      stream->upstream = NULL;
+      if (!up->head_done) {
+        // Refused, reset or closed without answering
+        if (up->backend != NULL)
+          xps_backend_report(up->backend, false);
+        h2_stream_respond(stream, 502);
+      } else
+        h2_stream_reset(stream, H2_INTERNAL_ERROR); // Response was cut short
+    }
+    h2_upstream_destroy(up);
+  }
+
+  h2_dispatch(h2);
+  h2_flush(h2);
+  h2_update(h2);
+}
+
+/**
+ * Handles complete frames in h2->in
+ */
+void h2_process_in(xps_h2_t *h2) {
+  while (!h2->closing) {
+    if (!h2->preface_done) {
+      if (h2->in->len < H2_PREFACE_LEN)
+        return;
+      xps_buffer_t *preface = xps_buffer_list_read(h2->in, H2_PREFACE_LEN);
+      bool valid = preface != NULL && memcmp(preface->pos, H2_PREFACE, H2_PREFACE_LEN) == 0;
+      if (preface != NULL)
+        xps_buffer_destroy(preface);
+      if (!valid) {
+        h2_goaway(h2, H2_PROTOCOL_ERROR);
+        return;
+      }
+      xps_buffer_list_clear(h2->in, H2_PREFACE_LEN);
+      h2->preface_done = true;
+    }
+
+    if (h2->in->len < H2_FRAME_HEADER_LEN)
+      return;
+    xps_buffer_t *header = xps_buffer_list_read(h2->in, H2_FRAME_HEADER_LEN);
+    if (header == NULL) {
+      h2->closing = true;
+      return;
+    }
+    size_t len = (header->pos[0] << 16) | (header->pos[1] << 8) | header->pos[2];
+    u_char type = header->pos[3];
+    u_char flags = header->pos[4];
+    u_int id = h2_get_u32(header->pos + 5) & H2_MAX_WINDOW;
+    xps_buffer_destroy(header);
+
+    if (len > H2_MAX_FRAME_SIZE) {
+      h2_goaway(h2, H2_FRAME_SIZE_ERROR);
+      return;
+    }
+    if (h2->in->len < H2_FRAME_HEADER_LEN + len)
+      return;
+    xps_buffer_list_clear(h2->in, H2_FRAME_HEADER_LEN);
+
+    // Nothing may come between the frames of a header block
+    if (h2->header_block != NULL && (type != H2_CONTINUATION || id != h2->header_stream_id)) {
+      h2_goaway(h2, H2_PROTOCOL_ERROR);
+      return;
+    }
+
+    // DATA payloads are moved to their stream without copying
+    if (type == H2_DATA) {
+      h2_on_data(h2, flags, id, len);
+      continue;
+    }
+
+    xps_buffer_t *payload = NULL;
+    if (len > 0) {
+      payload = xps_buffer_list_read(h2->in, len);
+      xps_buffer_list_clear(h2->in, len);
+      if (payload == NULL) {
+        h2->closing = true;
+        return;
+      }
+    }
+
+    switch (type) {
+    case H2_HEADERS:
+      h2_on_headers(h2, flags, id, payload);
+      break;
+
+    case H2_CONTINUATION:
+      if (h2->header_block == NULL || h2->header_block->len + len > h2->header_block->size) {
+        h2_goaway(h2, h2->header_block == NULL ? H2_PROTOCOL_ERROR : H2_COMPRESSION_ERROR);
+        break;
+      }
+      if (len > 0)
+        memcpy(h2->header_block->pos + h2->header_block->len, payload->pos, len);
+      h2->header_block->len += len;
+      if (flags & H2_FLAG_END_HEADERS)
+        h2_on_header_block(h2);
+      break;
+
+    case H2_PRIORITY:
+      // Streams are served in order, priorities are not used
+      if (id == 0 || len != 5)
+        h2_goaway(h2, H2_PROTOCOL_ERROR);
+      break;
+
+    case H2_RST_STREAM: {
+      if (id == 0 || len != 4) {
+        h2_goaway(h2, H2_PROTOCOL_ERROR);
+        break;
+      }
+      xps_h2_stream_t *stream = h2_stream_find(h2, id);
+      if (stream != NULL)
+        h2_stream_destroy(stream);
+      break;
+    }
+
+    case H2_SETTINGS:
+      if (id != 0 || (flags & H2_FLAG_ACK ? len != 0 : len % 6 != 0)) {
+        h2_goaway(h2, id != 0 ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+        break;
+      }
+      if (!(flags & H2_FLAG_ACK))
+        h2_on_settings(h2, payload);
+      break;
+
+    case H2_PING:
+      if (id != 0 || len != 8) {
+        h2_goaway(h2, id != 0 ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+        break;
+      }
+      if (!(flags & H2_FLAG_ACK))
+        h2_send_frame(h2, H2_PING, H2_FLAG_ACK, 0, payload->pos, 8);
+      break;
+
+    case H2_GOAWAY:
+      // Last stream id and error code, debug data may follow
+      if (id != 0 || len < 8) {
+        h2_goaway(h2, id != 0 ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+        break;
+      }
+      h2->goaway_recv = true;
+      break;
+
+    case H2_WINDOW_UPDATE:
+      if (len != 4) {
+        h2_goaway(h2, H2_FRAME_SIZE_ERROR);
+        break;
+      }
+      h2_on_window_update(h2, id, payload);
+      break;
+
+    case H2_PUSH_PROMISE:
+      // Clients cannot push
+      h2_goaway(h2, H2_PROTOCOL_ERROR);
+      break;
+
+    default:
+      // Unknown frame types are ignored
+      break;
+    }
+
+    if (payload != NULL)
+      xps_buffer_destroy(payload);
+  }
+}
+
+/**
+ * Moves the payload of a DATA frame at the front of h2->in to its stream
+ */
+void h2_on_data(xps_h2_t *h2, u_char flags, u_int id, size_t len) {
+  if (id == 0 || id > h2->last_stream_id) {
+    h2_goaway(h2, H2_PROTOCOL_ERROR);
+    return;
+  }
+
+  size_t data_len = len;
+  size_t pad_len = 0;
+  if (flags & H2_FLAG_PADDED) {
+    xps_buffer_t *pad = len > 0 ? xps_buffer_list_read(h2->in, 1) : NULL;
+    if (pad == NULL || pad->pos[0] >= len) {
+      if (pad != NULL)
+        xps_buffer_destroy(pad);
+      h2_goaway(h2, H2_PROTOCOL_ERROR);
+      return;
+    }
+    pad_len = pad->pos[0];
+    data_len = len - 1 - pad_len;
+    xps_buffer_destroy(pad);
+    xps_buffer_list_clear(h2->in, 1);
+  }
+
+  // Connection window is given back at once, streams are limited by their own
+  if (len > 0)
+    h2_send_u32(h2, H2_WINDOW_UPDATE, 0, len);
+
+  xps_h2_stream_t *stream = h2_stream_find(h2, id);
+  if (stream == NULL) {
+    // Stream was closed, e.g. it was reset or its response came early
+    xps_buffer_list_clear(h2->in, data_len);
+  } else if (stream->req_done || stream->recv_unacked + len > H2_STREAM_WINDOW) {
+    xps_buffer_list_clear(h2->in, data_len);
+    h2_stream_reset(stream, stream->req_done ? H2_STREAM_CLOSED : H2_FLOW_CONTROL_ERROR);
+  } else {
+    stream->recv_unacked += len;
+    if (stream->req_chunked && data_len > 0) {
+      char size_line[24];
+      int n = snprintf(size_line, sizeof(size_line), "%zx\r\n", data_len);
+      h2_append(h2, stream->to_upstream, size_line, n);
+    }
+    xps_buffer_list_move(h2->in, stream->to_upstream, data_len);
+    if (stream->req_chunked && data_len > 0)
+      h2_append(h2, stream->to_upstream, "\r\n", 2);
+    if (flags & H2_FLAG_END_STREAM)
+      h2_stream_req_end(stream);
+  }
+
+  xps_buffer_list_clear(h2->in, pad_len);
+}
+
+/**
+ * Starts a header block, handled once its last fragment is in
+ */
+void h2_on_headers(xps_h2_t *h2, u_char flags, u_int id, xps_buffer_t *payload) {
+  size_t len = payload != NULL ? payload->len : 0;
+  u_char *pos = payload != NULL ? payload->pos : NULL;
+  size_t pad_len = 0;
+
+  if (id == 0) {
+    h2_goaway(h2, H2_PROTOCOL_ERROR);
+    return;
+  }
+  if (flags & H2_FLAG_PADDED) {
+    if (len < 1) {
+      h2_goaway(h2, H2_PROTOCOL_ERROR);
+      return;
+    }
+    pad_len = pos[0];
+    pos++;
+    len--;
+  }
+  if (flags & H2_FLAG_PRIORITY) {
+    if (len < 5) {
+      h2_goaway(h2, H2_PROTOCOL_ERROR);
+      return;
+    }
+    pos += 5;
+    len -= 5;
+  }
+  if (pad_len > len) {
+    h2_goaway(h2, H2_PROTOCOL_ERROR);
+    return;
+  }
+  len -= pad_len;
+
+  h2->header_block = xps_buffer_create(H2_MAX_HEADER_BLOCK, 0, NULL);
+  if (h2->header_block == NULL) {
+    h2->closing = true;
+    return;
+  }
+  if (len > 0)
+    memcpy(h2->header_block->pos, pos, len);
+  h2->header_block->len = len;
+  h2->header_stream_id = id;
+  h2->header_end_stream = flags & H2_FLAG_END_STREAM;
+
+  if (flags & H2_FLAG_END_HEADERS)
+    h2_on_header_block(h2);
+}
+
+/**
+ * Decodes a complete header block, opening a stream or ending one with
+ * trailers
+ */
+void h2_on_header_block(xps_h2_t *h2) {
+  xps_buffer_t *block = h2->header_block;
+  u_int id = h2->header_stream_id;
+  bool end_stream = h2->header_end_stream;
+  h2->header_block = NULL;
+
+  struct h2_req_s req;
+  memset(&req, 0, sizeof(req));
+  req.content_length = -1;
+  req.lines = xps_buffer_create(HTTP_MAX_HEAD_SIZE, 0, NULL);
+  req.cookie = xps_buffer_create(HTTP_MAX_HEAD_SIZE, 0, NULL);
+
+  // The block is decoded in any case, it changes the decoder's table
+  int error = req.lines == NULL || req.cookie == NULL
+                  ? E_FAIL
+                  : xps_hpack_decode(h2->decoder, block->pos, block->len, h2_req_header, &req);
+  xps_buffer_destroy(block);
+
+  if (error != OK) {
+    h2_goaway(h2, H2_COMPRESSION_ERROR);
+  } else {
+    xps_h2_stream_t *stream = h2_stream_find(h2, id);
+    if (stream != NULL) {
+      // Trailers, they are not forwarded
+      if (stream->req_done || !end_stream)
+        h2_stream_reset(stream, H2_PROTOCOL_ERROR);
+      else
+        h2_stream_req_end(stream);
+    } else if (id % 2 == 0) {
+      h2_goaway(h2, H2_PROTOCOL_ERROR);
+    } else if (id > h2->last_stream_id && !h2->goaway_recv && !h2->goaway_sent) {
+      h2->last_stream_id = id;
+      if (h2->streams.length >= H2_MAX_STREAMS) {
+        h2_send_u32(h2, H2_RST_STREAM, id, H2_REFUSED_STREAM);
+      } else {
+        stream = h2_stream_create(h2, id, &req, end_stream);
+        if (stream == NULL)
+          h2_send_u32(h2, H2_RST_STREAM, id, H2_INTERNAL_ERROR);
+        else if (req.error || req.method[0] == '\0' || req.path[0] == '\0')
+          h2_stream_reset(stream, H2_PROTOCOL_ERROR);
+        else if (req.too_large)
+          h2_stream_respond(stream, 431);
+        else if (strcmp(req.method, "CONNECT") == 0)
+          h2_stream_respond(stream, 501);
+        else
+          vec_push(&(h2->waiting), stream);
+      }
+    }
+  }
+
+  if (req.lines != NULL)
+    xps_buffer_destroy(req.lines);
+  if (req.cookie != NULL)
+    xps_buffer_destroy(req.cookie);
+}
+
+void h2_on_settings(xps_h2_t *h2, xps_buffer_t *payload) {
+  size_t len = payload != NULL ? payload->len : 0;
+
+  for (size_t i = 0; i + 6 <= len; i += 6) {
+    u_int id = (payload->pos[i] << 8) | payload->pos[i + 1];
+    u_int value = h2_get_u32(payload->pos + i + 2);
+
+    if (id == H2_SETTINGS_INITIAL_WINDOW_SIZE) {
+      if (value > H2_MAX_WINDOW) {
+        h2_goaway(h2, H2_FLOW_CONTROL_ERROR);
+        return;
+      }
+      // Open streams move by the difference
+      long delta = (long)value - h2->peer_initial_window;
+      for (int j = 0; j < h2->streams.length; j++) {
+        xps_h2_stream_t *stream = h2->streams.data[j];
+        stream->send_window += delta;
+      }
+      h2->peer_initial_window = value;
+    } else if (id == H2_SETTINGS_MAX_FRAME_SIZE) {
+      if (value < H2_MAX_FRAME_SIZE || value > 0xffffff) {
+        h2_goaway(h2, H2_PROTOCOL_ERROR);
+        return;
+      }
+      // Frames we send never need to be larger than the ones we accept
+      h2->peer_max_frame = H2_MAX_FRAME_SIZE;
+    }
+    // Others do not matter to an encoder that does not index and a server
+    // that does not push
+  }
+
+  h2_send_frame(h2, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+}
+
+void h2_on_window_update(xps_h2_t *h2, u_int id, xps_buffer_t *payload) {
+  long increment = h2_get_u32(payload->pos) & H2_MAX_WINDOW;
+
+  if (id == 0) {
+    if (increment == 0 || h2->send_window + increment > H2_MAX_WINDOW) {
+      h2_goaway(h2, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+      return;
+    }
+    h2->send_window += increment;
+    return;
+  }
+
+  xps_h2_stream_t *stream = h2_stream_find(h2, id);
+  if (stream == NULL)
+    return;
+  if (increment == 0 || stream->send_window + increment > H2_MAX_WINDOW) {
+    h2_stream_reset(stream, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+    return;
+  }
+  stream->send_window += increment;
+}
+
+/**
+ * Turns a decoded request header into part of an HTTP/1.1 head
+ */
+void h2_req_header(const char *name, const char *value, void *ptr) {
+  struct h2_req_s *req = ptr;
+  size_t value_len = strlen(value);
+
+  // Fields end up in an HTTP/1.1 head, line breaks would split it
+  if (name[0] == '\0' || strpbrk(name + 1, "\r\n: ") != NULL || strpbrk(value, "\r\n") != NULL) {
+    req->error = true;
+    return;
+  }
+
+  if (name[0] == ':') {
+    char *field = NULL;
+    size_t field_size = 0;
+    if (strcmp(name, ":method") == 0) {
+      field = req->method;
+      field_size = sizeof(req->method);
+    } else if (strcmp(name, ":path") == 0) {
+      field = req->path;
+      field_size = sizeof(req->path);
+    } else if (strcmp(name, ":authority") == 0) {
+      field = req->authority;
+      field_size = sizeof(req->authority);
+    } else if (strcmp(name, ":scheme") != 0) {
+      req->error = true;
+      return;
+    }
+
+    if (req->regular_seen || (field != NULL && field[0] != '\0') ||
+        (field != req->authority && strchr(value, ' ') != NULL))
+      req->error = true;
+    else if (field != NULL && value_len >= field_size)
+      req->too_large = true;
+    else if (field != NULL)
+      memcpy(field, value, value_len + 1);
+    return;
+  }
+  req->regular_seen = true;
+
+  // Names are lowercase, connection-specific fields are not allowed
+  for (const char *c = name; *c != '\0'; c++) {
+    if (*c >= 'A' && *c <= 'Z')
+      req->error = true;
+  }
+  if (strcmp(name, "connection") == 0 || strcmp(name, "keep-alive") == 0 ||
+      strcmp(name, "proxy-connection") == 0 || strcmp(name, "transfer-encoding") == 0 ||
+      strcmp(name, "upgrade") == 0 || (strcmp(name, "te") == 0 && strcmp(value, "trailers") != 0))
+    req->error = true;
+  if (req->error || strcmp(name, "te") == 0)
+    return;
+
+  if (strcmp(name, "host") == 0) {
+    if (req->authority[0] == '\0' && value_len < sizeof(req->authority))
+      memcpy(req->authority, value, value_len + 1);
+    return;
+  }
+
+  xps_buffer_t *buff = req->lines;
+  const char *format = "%s: %s\r\n";
+  if (strcmp(name, "cookie") == 0) {
+    buff = req->cookie;
+    format = buff->len == 0 ? "%.0s%s" : "%.0s; %s";
+  } else if (strcmp(name, "content-length") == 0) {
+    long length = xps_http_parse_length(value);
+    if (length < 0 || (req->content_length >= 0 && req->content_length != length))
+      req->error = true;
+    req->content_length = length;
+  }
+
+  size_t room = buff->size - buff->len;
+  int n = snprintf((char *)buff->pos + buff->len, room, format, name, value);
+  if (n < 0 || (size_t)n >= room)
+    req->too_large = true;
+  else
+    buff->len += n;
+}
+
+/**
+ * Adds a response header to the HEADERS block being encoded
+ */
+void h2_res_header(const char *name, const char *value, void *ptr) {
+  xps_buffer_t *block = ptr;
+
+  char lower[HTTP_MAX_HEADER_LEN];
+  size_t i;
+  for (i = 0; name[i] != '\0' && i < sizeof(lower) - 1; i++)
+    lower[i] = name[i] >= 'A' && name[i] <= 'Z' ? name[i] - 'A' + 'a' : name[i];
+  lower[i] = '\0';
+
+  // Connection-specific fields are not allowed in HTTP/2
+  if (strcmp(lower, "connection") == 0 || strcmp(lower, "keep-alive") == 0 ||
+      strcmp(lower, "proxy-connection") == 0 || strcmp(lower, "transfer-encoding") == 0 ||
+      strcmp(lower, "upgrade") == 0)
+    return;
+
+  block->len += xps_hpack_encode(block->pos + block->len, lower, value);
+}
+
+/**
+ * Opens a stream and builds the HTTP/1.1 head of its request
+ *
+ * @param h2 : h2 instance
+ * @param id : stream identifier
+ * @param req : decoded request headers
+ * @param end_stream : request has no body
+ * @return : stream instance, NULL on failure
+ */
+xps_h2_stream_t *h2_stream_create(xps_h2_t *h2, u_int id, struct h2_req_s *req, bool end_stream) {
+  xps_h2_stream_t *stream = calloc(1, sizeof(xps_h2_stream_t));
+  if (stream == NULL) {
+    logger(LOG_ERROR, "h2_stream_create()", "calloc() failed for 'stream'");
+    return NULL;
+  }
+
+  // Init values
+  stream->h2 = h2;
+  stream->id = id;
+  stream->to_upstream = xps_buffer_list_create();
+  stream->out = xps_buffer_list_create();
+  stream->send_window = h2->peer_initial_window;
+  stream->head_only = strcmp(req->method, "HEAD") == 0;
+  stream->req_chunked = !end_stream && req->content_length < 0;
+
+  if (stream->to_upstream == NULL || stream->out == NULL) {
+    logger(LOG_ERROR, "h2_stream_create()", "failed to allocate stream");
+    if (stream->to_upstream != NULL)
+      xps_buffer_list_destroy(stream->to_upstream);
+    if (stream->out != NULL)
+      xps_buffer_list_destroy(stream->out);
+    free(stream);
+    return NULL;
+  }
+  vec_push(&(h2->streams), stream);
+
+  if (!req->error && !req->too_large) {
+    size_t size = strlen(req->method) + strlen(req->path) + strlen(req->authority) +
+                  req->lines->len + req->cookie->len + 128;
+    xps_buffer_t *head = xps_buffer_create(size, 0, NULL);
+    if (head == NULL) {
+      req->error = true;
+      return stream;
+    }
+    head->len = snprintf((char *)head->pos, size, "%s %s HTTP/1.1\r\nHost: %s\r\n%.*s",
+                         req->method, req->path, req->authority, (int)req->lines->len,
+                         req->lines->pos);
+    if (req->cookie->len > 0)
+      head->len += snprintf((char *)head->pos + head->len, size - head->len, "cookie: %.*s\r\n",
+                            (int)req->cookie->len, req->cookie->pos);
+    if (stream->req_chunked)
+      head->len += snprintf((char *)head->pos + head->len, size - head->len,
+                            "transfer-encoding: chunked\r\n");
+    head->len += snprintf((char *)head->pos + head->len, size - head->len, "\r\n");
+    xps_buffer_list_append(stream->to_upstream, head);
+  }
+
+  if (end_stream)
+    stream->req_done = true;
+
+  logger(LOG_DEBUG, "h2_stream_create()", "opened stream %u: %s %s", id, req->method, req->path);
+
+  return stream;
+}
+
+void h2_stream_destroy(xps_h2_stream_t *stream) {
+  xps_h2_t *h2 = stream->h2;
+
+  vec_remove(&(h2->streams), stream);
+  vec_remove(&(h2->waiting), stream);
+
+  // Upstream is in the middle of this stream's exchange and cannot be reused
+  if (stream->upstream != NULL) {
+    stream->upstream->stream = NULL;
+    h2_upstream_destroy(stream->upstream);
+  }
+
+  xps_buffer_list_destroy(stream->to_upstream);
+  xps_buffer_list_destroy(stream->out);
+  free(stream);
+}
+
+xps_h2_stream_t *h2_stream_find(xps_h2_t *h2, u_int id) {
+  for (int i = 0; i < h2->streams.length; i++) {
+    xps_h2_stream_t *stream = h2->streams.data[i];
+    if (stream->id == id)
+      return stream;
+  }
+  return NULL;
+}
+
+/**
+ * Marks the end of a request body, ending the chunked body sent upstream
+ */
+void h2_stream_req_end(xps_h2_stream_t *stream) {
+  stream->req_done = true;
+  if (stream->req_chunked)
+    h2_append(stream->h2, stream->to_upstream, "0\r\n\r\n", 5);
+}
+
+/**
+ * Answers a stream without an upstream, with an empty response
+ */
+void h2_stream_respond(xps_h2_stream_t *stream, int status) {
+  xps_h2_t *h2 = stream->h2;
+
+  vec_remove(&(h2->waiting), stream);
+
+  u_char block[64];
+  size_t len = xps_hpack_encode_status(block, status);
+  len += xps_hpack_encode(block + len, "content-length", "0");
+  h2_send_headers(h2, stream->id, block, len, true);
+
+  xps_buffer_list_clear(stream->out, stream->out->len);
+  stream->res_done = true;
+  stream->end_sent = true;
+}
+
+/**
+ * Sends RST_STREAM and closes the stream
+ */
+void h2_stream_reset(xps_h2_stream_t *stream, u_int error_code) {
+  h2_send_u32(stream->h2, H2_RST_STREAM, stream->id, error_code);
+  h2_stream_destroy(stream);
+}
+
+/**
+ * Connects a new upstream connection of h2 on a healthy backend
+ *
+ * @param h2 : h2 instance
+ * @param error : set to E_NOTFOUND if no backend is healthy, E_FAIL otherwise
+ * @return : upstream instance, NULL on failure
+ */
+xps_h2_upstream_t *h2_upstream_create(xps_h2_t *h2, int *error) {
+  xps_core_t *core = h2->core;
+
+  xps_connection_t *connection = NULL;
+  xps_backend_t *backend = NULL;
+  for (int i = 0; connection == NULL && i < core->backends.length; i++) {
+    backend = xps_backend_pick(core);
+    if (backend == NULL)
+      break;
+    connection = xps_upstream_create(core, backend->host, backend->port);
+    if (connection == NULL)
+      xps_backend_report(backend, false);
+  }
+  *error = backend == NULL ? E_NOTFOUND : E_FAIL;
+  if (backend == NULL) {
+    logger(LOG_WARNING, "h2_upstream_create()", "no healthy upstream");
+    return NULL;
+  }
+  if (connection == NULL) {
+    logger(LOG_ERROR, "h2_upstream_create()", "xps_upstream_create() failed");
+    return NULL;
+  }
+  connection->listener = h2->listener;
+  if (h2->listener != NULL) {
+    h2->listener->n_connections++;
+    connection->sink->weight = h2->listener->weight;
+  }
+
+  xps_h2_upstream_t *up = calloc(1, sizeof(xps_h2_upstream_t));
+  if (up == NULL) {
+    logger(LOG_ERROR, "h2_upstream_create()", "calloc() failed for 'up'");
+    xps_connection_destroy(connection);
+    return NULL;
+  }
+
+  // Init values
+  up->h2 = h2;
+  up->backend = backend;
+  up->source =
+      xps_pipe_source_create(core, up, h2_upstream_source_handler, h2_upstream_source_close_handler);
+  up->sink = xps_pipe_sink_create(core, up, h2_upstream_sink_handler, h2_upstream_sink_close_handler);
+  up->res_buff = xps_buffer_list_create();
+  up->keep_alive = true;
+  up->body_left = -1;
+  up->chunk_left = H2_CHUNK_SIZE;
+  vec_push(&(h2->upstreams), up);
+
+  if (up->source == NULL || up->sink == NULL || up->res_buff == NULL ||
+      xps_pipe_create(core, DEFAULT_PIPE_BUFF_THRESH, up->source, connection->sink) == NULL ||
+      xps_pipe_create(core, DEFAULT_PIPE_BUFF_THRESH, connection->source, up->sink) == NULL) {
+    logger(LOG_ERROR, "h2_upstream_create()", "failed to set up upstream");
+    h2_upstream_destroy(up);
+    if (connection->sink->pipe == NULL || connection->source->pipe == NULL)
+      xps_connection_destroy(connection);
+    return NULL;
+  }
+  if (h2->listener != NULL)
+    up->sink->weight = h2->listener->weight;
+
+  return up;
+}
+
+void h2_upstream_destroy(xps_h2_upstream_t *up) {
+  xps_h2_t *h2 = up->h2;
+
+  vec_remove(&(h2->upstreams), up);
+  if (up->stream != NULL)
+    up->stream->upstream = NULL;
+
+  // Pipes left without a peer close the upstream connection
+  if (up->source != NULL)
+    xps_pipe_source_destroy(up->source);
+  if (up->sink != NULL)
+    xps_pipe_sink_destroy(up->sink);
+  if (up->res_buff != NULL)
+    xps_buffer_list_destroy(up->res_buff);
+  free(up);
+}
+
+/**
+ * Parses the response in up->res_buff into its stream's out list
+ */
+void h2_upstream_process(xps_h2_upstream_t *up) {
+  while (up->res_buff->len > 0) {
+    xps_h2_stream_t *stream = up->stream;
+
+    // An idle upstream has nothing to say, it is out of step
+    if (stream == NULL) {
+      h2_upstream_destroy(up);
+      return;
+    }
+
+    if (!up->head_done) {
+      int error = h2_upstream_process_head(up);
+      if (error == E_AGAIN)
+        return;
+      if (error != OK) {
+        up->stream = NULL;
+        stream->upstream = NULL;
+        h2_stream_respond(stream, 502);
+        h2_upstream_destroy(up);
+        return;
+      }
+      if (up->body_left == 0) {
+        h2_upstream_res_done(up);
+        return;
+      }
+      continue;
+    }
+
+    if (up->chunked) {
+      int error = h2_upstream_dechunk(up);
+      if (error == E_AGAIN)
+        return;
+      if (error != OK) {
+        up->stream = NULL;
+        stream->upstream = NULL;
+        h2_stream_reset(stream, H2_INTERNAL_ERROR);
+        h2_upstream_destroy(up);
+        return;
+      }
+      if (up->body_left == 0) {
+        h2_upstream_res_done(up);
+        return;
+      }
+      continue;
+    }
+
+    size_t len = up->res_buff->len;
+    if (up->body_left >= 0 && len > (size_t)up->body_left)
+      len = up->body_left;
+    xps_buffer_list_move(up->res_buff, stream->out, len);
+    if (up->body_left >= 0) {
+      up->body_left -= len;
+      if (up->body_left == 0) {
+        h2_upstream_res_done(up);
+        return;
+      }
+    }
+  }
+}
+
+/**
+ * Sends the response head at the front of up->res_buff as HEADERS
+ *
+ * @return : OK once the head is sent, E_AGAIN if it is not complete, E_FAIL
+ *           if it is not a response head
+ */
+int h2_upstream_process_head(xps_h2_upstream_t *up) {
+  xps_h2_stream_t *stream = up->stream;
+
+  size_t len = up->res_buff->len;
+  if (len > HTTP_MAX_HEAD_SIZE)
+    len = HTTP_MAX_HEAD_SIZE;
+  xps_buffer_t *head = xps_buffer_list_read(up->res_buff, len);
+  if (head == NULL)
+    return E_FAIL;
+
+  long head_len = xps_http_head_len(head->pos, head->len);
+  xps_http_res_t res;
+  int error = head_len < 0 ? E_AGAIN : xps_http_parse_res(head->pos, head_len, &res);
+  if (error == E_AGAIN && up->res_buff->len >= HTTP_MAX_HEAD_SIZE)
+    error = E_FAIL;
+  if (error != OK || res.status == 101) {
+    xps_buffer_destroy(head);
+    return error == E_AGAIN ? E_AGAIN : E_FAIL;
+  }
+  xps_buffer_list_clear(up->res_buff, head_len);
+
+  // Interim responses are dropped, 100-continue is not asked for
+  if (res.status < 200) {
+    xps_buffer_destroy(head);
+    return OK;
+  }
+
+  up->head_done = true;
+  up->keep_alive = res.keep_alive;
+  up->chunked = res.chunked;
+  up->chunk_left = H2_CHUNK_SIZE;
+  if (stream->head_only || res.status == 204 || res.status == 304)
+    up->body_left = 0;
+  else if (res.chunked)
+    up->body_left = -1;
+  else
+    up->body_left = res.content_length;
+  if (up->body_left == 0)
+    up->chunked = false;
+  if (up->backend != NULL)
+    xps_backend_report(up->backend, true);
+
+  xps_buffer_t *block = xps_buffer_create(head_len * 2 + 64, 0, NULL);
+  if (block == NULL) {
+    xps_buffer_destroy(head);
+    return E_FAIL;
+  }
+  char status_line[256];
+  block->len = xps_hpack_encode_status(block->pos, res.status);
+  xps_http_parse_head(head->pos, head_len, status_line, sizeof(status_line), h2_res_header,
+                      block);
+  xps_buffer_destroy(head);
+
+  h2_send_headers(stream->h2, stream->id, block->pos, block->len, up->body_left == 0);
+  if (up->body_left == 0)
+    stream->end_sent = true;
+  xps_buffer_destroy(block);
+
+  return OK;
+}
+
+/**
+ * Moves chunk data from up->res_buff to the stream, dropping the framing
+ *
+ * @return : OK if some of the body was handled, E_AGAIN if more bytes are
+ *           needed, E_FAIL on a malformed body. body_left is 0 at the end.
+ */
+int h2_upstream_dechunk(xps_h2_upstream_t *up) {
+  if (up->chunk_left > 0) {
+    size_t len = up->res_buff->len;
+    if (len > (size_t)up->chunk_left)
+      len = up->chunk_left;
+    xps_buffer_list_move(up->res_buff, up->stream->out, len);
+    up->chunk_left -= len;
+    if (up->chunk_left == 0)
+      up->chunk_left = H2_CHUNK_CRLF;
+    return OK;
+  }
+
+  // Size, CRLF and trailer lines are short
+  size_t len = up->res_buff->len;
+  if (len > HTTP_MAX_HEADER_LEN)
+    len = HTTP_MAX_HEADER_LEN;
+  xps_buffer_t *buff = xps_buffer_list_read(up->res_buff, len);
+  if (buff == NULL)
+    return E_FAIL;
+  u_char *eol = memmem(buff->pos, buff->len, "\r\n", 2);
+  size_t line_len = eol != NULL ? eol - buff->pos : 0;
+  char line[32];
+  snprintf(line, sizeof(line), "%.*s", (int)(line_len < 31 ? line_len : 31), buff->pos);
+  xps_buffer_destroy(buff);
+
+  if (eol == NULL)
+    return up->res_buff->len >= HTTP_MAX_HEADER_LEN ? E_FAIL : E_AGAIN;
+  xps_buffer_list_clear(up->res_buff, line_len + 2);
+
+  if (up->chunk_left == H2_CHUNK_CRLF) {
+    if (line_len != 0)
+      return E_FAIL;
+    up->chunk_left = H2_CHUNK_SIZE;
+  } else if (up->chunk_left == H2_CHUNK_SIZE) {
+    char *end;
+    long size = strtol(line, &end, 16);
+    if (end == line || size < 0)
+      return E_FAIL;
+    up->chunk_left = size > 0 ? size : H2_CHUNK_TRAILERS;
+  } else if (line_len == 0) {
+    // Empty line after the trailers
+    up->body_left = 0;
+  }
+
+  return OK;
+}
+
+/**
+ * Ends the exchange of an upstream, which takes the next stream if the
+ * connection allows
+ */
+void h2_upstream_res_done(xps_h2_upstream_t *up) {
+  xps_h2_stream_t *stream = up->stream;
+
+  stream->res_done = true;
+  stream->upstream = NULL;
+  up->stream = NULL;
+  up->head_done = false;
+  up->body_left = -1;
+
+  // Another request can only follow a complete one
+  if (!up->keep_alive || !stream->req_done || stream->to_upstream->len > 0 ||
+      up->res_buff->len > 0 || up->source->pipe == NULL)
+    h2_upstream_destroy(up);
+}
+
+/**
+ * Hands waiting streams to idle upstreams, connecting new ones up to
+ * config->h2_upstreams
+ */
+void h2_dispatch(xps_h2_t *h2) {
+  while (h2->waiting.length > 0 && !h2->closing) {
+    xps_h2_stream_t *stream = h2->waiting.data[0];
+
+    xps_h2_upstream_t *up = NULL;
+    for (int i = 0; up == NULL && i < h2->upstreams.length; i++) {
+      xps_h2_upstream_t *idle = h2->upstreams.data[i];
+      if (idle->stream == NULL && idle->source->pipe != NULL && idle->sink->pipe != NULL)
+        up = idle;
+    }
+
+    if (up == NULL && (u_int)h2->upstreams.length < h2->core->config->h2_upstreams) {
+      int error;
+      up = h2_upstream_create(h2, &error);
+      if (up == NULL) {
+        h2_stream_respond(stream, error == E_NOTFOUND ? 503 : 502);
+        continue;
+      }
+    }
+    if (up == NULL)
+      return;
+
+    vec_splice(&(h2->waiting), 0, 1);
+    up->stream = stream;
+    stream->upstream = up;
+  }
+}
+
+/**
+ * Frames response bytes of the streams as DATA, as far as the client's
+ * windows and the room in to_client allow, and closes finished streams
+ */
+void h2_flush(xps_h2_t *h2) {
+  int n_streams = h2->streams.length;
+  for (int j = 0; j < n_streams && h2->to_client->len < DEFAULT_PIPE_BUFF_THRESH; j++) {
+    xps_h2_stream_t *stream = h2->streams.data[(h2->flush_rr + j) % n_streams];
+
+    while (!stream->end_sent && h2->to_client->len < DEFAULT_PIPE_BUFF_THRESH) {
+      size_t len = stream->out->len;
+      if (len == 0 && !stream->res_done)
+        break;
+      if (len > 0) {
+        long window = stream->send_window < h2->send_window ? stream->send_window : h2->send_window;
+        if (window <= 0)
+          break;
+        if (len > (size_t)window)
+          len = window;
+        if (len > h2->peer_max_frame)
+          len = h2->peer_max_frame;
+      }
+      bool end = stream->res_done && len == stream->out->len;
+
+      xps_buffer_t *header = h2_frame_create(H2_DATA, end ? H2_FLAG_END_STREAM : 0, stream->id, len);
+      if (header == NULL) {
+        h2->closing = true;
+        return;
+      }
+      xps_buffer_list_append(h2->to_client, header);
+      xps_buffer_list_move(stream->out, h2->to_client, len);
+      stream->send_window -= len;
+      h2->send_window -= len;
+      stream->end_sent = end;
+    }
+  }
+  if (n_streams > 0)
+    h2->flush_rr = (h2->flush_rr + 1) % n_streams;
+
+  // Streams are closed once their response is sent
+  for (int i = 0; i < h2->streams.length; i++) {
+    xps_h2_stream_t *stream = h2->streams.data[i];
+    if (!stream->end_sent || stream->upstream != NULL)
+      continue;
+
+    // Client need not send the rest of a body nobody waits for
+    if (!stream->req_done)
+      h2_send_u32(h2, H2_RST_STREAM, stream->id, H2_NO_ERROR);
+    h2_stream_destroy(stream);
+    i--;
+  }
+}
+
+/**
+ * Creates a frame with room for len bytes of payload after its header
+ */
+xps_buffer_t *h2_frame_create(u_char type, u_char flags, u_int id, size_t len) {
+  // DATA payloads follow as buffers of their own
+  size_t payload_len = type == H2_DATA ? 0 : len;
+
+  xps_buffer_t *frame =
+      xps_buffer_create(H2_FRAME_HEADER_LEN + payload_len, H2_FRAME_HEADER_LEN + payload_len, NULL);
+  if (frame == NULL)
+    return NULL;
+
+  frame->pos[0] = len >> 16;
+  frame->pos[1] = len >> 8;
+  frame->pos[2] = len;
+  frame->pos[3] = type;
+  frame->pos[4] = flags;
+  h2_put_u32(frame->pos + 5, id);
+
+  return frame;
+}
+
+/**
+ * Appends a copy of len bytes of data to buff_list
+ */
+void h2_append(xps_h2_t *h2, xps_buffer_list_t *buff_list, const char *data, size_t len) {
+  xps_buffer_t *buff = xps_buffer_create(len, len, NULL);
+  if (buff == NULL) {
+    h2->closing = true;
+    return;
+  }
+  memcpy(buff->pos, data, len);
+  xps_buffer_list_append(buff_list, buff);
+}
+
+void h2_send_frame(xps_h2_t *h2, u_char type, u_char flags, u_int id, const u_char *payload,
+                   size_t len) {
+  xps_buffer_t *frame = h2_frame_create(type, flags, id, len);
+  if (frame == NULL) {
+    h2->closing = true;
+    return;
+  }
+  if (len > 0)
+    memcpy(frame->pos + H2_FRAME_HEADER_LEN, payload, len);
+  xps_buffer_list_append(h2->to_client, frame);
+}
+
+/**
+ * Sends a frame whose payload is a single 32 bit value: WINDOW_UPDATE or
+ * RST_STREAM
+ */
+void h2_send_u32(xps_h2_t *h2, u_char type, u_int id, u_int value) {
+  u_char payload[4];
+  h2_put_u32(payload, value);
+  h2_send_frame(h2, type, 0, id, payload, sizeof(payload));
+}
+
+/**
+ * Sends a header block as HEADERS followed by as many CONTINUATION frames as
+ * the client's frame size needs
+ */
+void h2_send_headers(xps_h2_t *h2, u_int id, const u_char *block, size_t len, bool end_stream) {
+  u_char type = H2_HEADERS;
+  u_char flags = end_stream ? H2_FLAG_END_STREAM : 0;
+
+  do {
+    size_t frame_len = len < h2->peer_max_frame ? len : h2->peer_max_frame;
+    if (frame_len == len)
+      flags |= H2_FLAG_END_HEADERS;
+    h2_send_frame(h2, type, flags, id, block, frame_len);
+    block += frame_len;
+    len -= frame_len;
+    type = H2_CONTINUATION;
+    flags = 0;
+  } while (len > 0);
+}
+
+/**
+ * Ends the connection with a GOAWAY, the client is closed once it is sent
+ */
+void h2_goaway(xps_h2_t *h2, u_int error_code) {
+  logger(LOG_DEBUG, "h2_goaway()", "closing h2 connection with error %u", error_code);
+
+  u_char payload[8];
+  h2_put_u32(payload, h2->last_stream_id);
+  h2_put_u32(payload + 4, error_code);
+  h2_send_frame(h2, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+  h2->closing = true;
+}
+
+void h2_update(xps_h2_t *h2) {
+  // Either side said goodbye and nothing is left in flight
+  if ((h2->goaway_recv || h2->goaway_sent) && h2->streams.length == 0)
+    h2->closing = true;
+
+  if (h2->closing && h2->to_client->len == 0) {
+    xps_h2_destroy(h2);
+    return;
+  }
+
+  h2_update_ready(h2);
+}
+
+void h2_update_ready(xps_h2_t *h2) {
+  h2->client_source->ready = h2->to_client->list.length > 0;
+  h2->client_sink->ready = !h2->closing && h2->to_client->len < DEFAULT_PIPE_BUFF_THRESH;
+
+  // Upstreams are read only while their stream has room for the response
+  for (int i = 0; i < h2->upstreams.length; i++) {
+    xps_h2_upstream_t *up = h2->upstreams.data[i];
+    xps_h2_stream_t *stream = up->stream;
+    up->source->ready = stream != NULL && stream->to_upstream->list.length > 0;
+    up->sink->ready =
+        !h2->closing && (stream == NULL || stream->out->len < DEFAULT_PIPE_BUFF_THRESH);
+  }
+}
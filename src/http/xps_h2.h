@@ -0,0 +1,104 @@
+#ifndef XPS_H2_H
+#define XPS_H2_H
+
+#include "../xps.h"
+
+/*
+ * HTTP/2 cleartext frontend (h2c with prior knowledge).
+ *
+ * A proxy session that reads the HTTP/2 connection preface as its first
+ * bytes hands the client pipes over to an xps_h2_t. Each stream is turned
+ * into an HTTP/1.1 request and served by one of a few keep-alive upstream
+ * connections of the client connection, config->h2_upstreams at most.
+ * Streams wait in order for an upstream to become idle.
+ *
+ * Flow control follows the pipes. A stream's receive window is given back
+ * once its request body has been handed to the upstream pipe, so a client
+ * cannot send faster than the upstream reads. Response bytes are framed as
+ * DATA within the client's windows, and an upstream is not read while its
+ * stream has DEFAULT_PIPE_BUFF_THRESH bytes waiting for window.
+ */
+enum xps_h2_frame_type_e {
+  H2_DATA = 0x0,
+  H2_HEADERS = 0x1,
+  H2_PRIORITY = 0x2,
+  H2_RST_STREAM = 0x3,
+  H2_SETTINGS = 0x4,
+  H2_PUSH_PROMISE = 0x5,
+  H2_PING = 0x6,
+  H2_GOAWAY = 0x7,
+  H2_WINDOW_UPDATE = 0x8,
+  H2_CONTINUATION = 0x9
+};
+
+enum xps_h2_error_e {
+  H2_NO_ERROR = 0x0,
+  H2_PROTOCOL_ERROR = 0x1,
+  H2_INTERNAL_ERROR = 0x2,
+  H2_FLOW_CONTROL_ERROR = 0x3,
+  H2_STREAM_CLOSED = 0x5,
+  H2_FRAME_SIZE_ERROR = 0x6,
+  H2_REFUSED_STREAM = 0x7,
+  H2_COMPRESSION_ERROR = 0x9
+};
+
+struct xps_h2_stream_s {
+  xps_h2_t *h2;
+  u_int id;
+  xps_h2_upstream_t *upstream;    // Upstream serving the stream, NULL while waiting or done
+  xps_buffer_list_t *to_upstream; // HTTP/1.1 request bytes not yet in the upstream pipe
+  bool req_done;    // Client ended the stream
+  bool req_chunked; // Body goes upstream in chunks, the client sent no content-length
+  bool head_only;   // HEAD request, response has no body
+  size_t recv_unacked; // DATA bytes received and not yet given back with WINDOW_UPDATE
+  xps_buffer_list_t *out; // Response body not yet sent as DATA
+  long send_window;
+  bool res_done; // Whole response is in out
+  bool end_sent; // END_STREAM was sent, stream is closed once it is
+};
+
+struct xps_h2_upstream_s {
+  xps_h2_t *h2;
+  xps_backend_t *backend;
+  xps_pipe_source_t *source;
+  xps_pipe_sink_t *sink;
+  xps_h2_stream_t *stream; // Stream being served, NULL if idle
+  xps_buffer_list_t *res_buff; // Bytes from upstream not yet handled
+  bool head_done;
+  bool keep_alive; // Connection may take another request after this response
+  bool chunked;
+  long body_left;  // -1 if body ends when upstream closes
+  long chunk_left; // Bytes left of current chunk, or one of H2_CHUNK_*
+};
+
+struct xps_h2_s {
+  xps_core_t *core;
+  xps_listener_t *listener;
+  xps_pipe_source_t *client_source;
+  xps_pipe_sink_t *client_sink;
+  xps_buffer_list_t *in;        // Bytes from client not yet handled
+  xps_buffer_list_t *to_client; // Frames waiting for room in client pipe
+  xps_hpack_t *decoder;
+  bool preface_done;
+  vec_void_t streams;   // Open streams, oldest first
+  vec_void_t waiting;   // Streams waiting for an upstream, oldest first
+  vec_void_t upstreams;
+  u_int last_stream_id;
+  long send_window;         // Connection level window of the client
+  long peer_initial_window; // Window of new streams
+  size_t peer_max_frame;
+  xps_buffer_t *header_block; // HEADERS and CONTINUATION fragments, NULL if none pending
+  u_int header_stream_id;
+  bool header_end_stream;
+  u_int flush_rr;     // Stream DATA framing starts at, for fairness
+  bool goaway_recv;   // Client sends no more streams, closed when open ones are done
+  bool goaway_sent;   // Draining, streams the client opens later are ignored
+  bool closing;       // Client is closed once to_client is sent
+};
+
+xps_h2_t *xps_h2_create(xps_core_t *core, xps_listener_t *listener, xps_pipe_t *in_pipe,
+                        xps_pipe_t *out_pipe, xps_buffer_list_t *pending);
+void xps_h2_destroy(xps_h2_t *h2);
+void xps_h2_drain(xps_h2_t *h2);
+
+#endif
@@ -0,0 +1,477 @@
+#include "../xps.h"
+
+int hpack_decode_int(const u_char **pos, const u_char *end, u_int prefix_bits, size_t *value);
+char *hpack_decode_str(const u_char **pos, const u_char *end);
+char *hpack_huffman_decode(const u_char *data, size_t len);
+int hpack_lookup(xps_hpack_t *hpack, size_t index, const char **name, const char **value);
+void hpack_insert(xps_hpack_t *hpack, const char *name, const char *value);
+void hpack_evict(xps_hpack_t *hpack, size_t max_size);
+size_t hpack_encode_int(u_char *out, u_char first, u_int prefix_bits, size_t value);
+
+// RFC 7541 Appendix A, index 0 is unused
+static const char *hpack_static[HPACK_STATIC_ENTRIES + 1][2] = {
+    {"", ""},
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+// RFC 7541 Appendix B, EOS is 30 ones
+static const u_int hpack_huffman_codes[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+
+static const u_char hpack_huffman_lens[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+/*
+ * Huffman decoding tree built from the code table on first use. Node 0 is
+ * the root; children[n][bit] is the next node, or -(symbol + 1) for a leaf.
+ */
+static int hpack_huffman_tree[256][2];
+static bool hpack_huffman_ready = false;
+
+static void hpack_huffman_init() {
+  int n_nodes = 1;
+  memset(hpack_huffman_tree, 0, sizeof(hpack_huffman_tree));
+
+  for (int sym = 0; sym < 256; sym++) {
+    u_int code = hpack_huffman_codes[sym];
+    int node = 0;
+    for (int bit_i = hpack_huffman_lens[sym] - 1; bit_i >= 0; bit_i--) {
+      int bit = (code >> bit_i) & 1;
+      if (bit_i == 0) {
+        hpack_huffman_tree[node][bit] = -(sym + 1);
+        break;
+      }
+      if (hpack_huffman_tree[node][bit] == 0)
+        hpack_huffman_tree[node][bit] = n_nodes++;
+      node = hpack_huffman_tree[node][bit];
+    }
+  }
+
+  hpack_huffman_ready = true;
+}
+
+xps_hpack_t *xps_hpack_create() {
+  xps_hpack_t *hpack = malloc(sizeof(xps_hpack_t));
+  if (hpack == NULL) {
+    logger(LOG_ERROR, "xps_hpack_create()", "malloc() failed for 'hpack'");
+    return NULL;
+  }
+
+  // Init values
+  vec_init(&(hpack->entries));
+  hpack->size = 0;
+  hpack->max_size = HPACK_TABLE_SIZE;
+
+  return hpack;
+}
+
+void xps_hpack_destroy(xps_hpack_t *hpack) {
+  assert(hpack != NULL);
+
+  for (int i = 0; i < hpack->entries.length; i++)
+    free(hpack->entries.data[i]);
+  vec_deinit(&(hpack->entries));
+  free(hpack);
+}
+
+/**
+ * Decodes a header block, calling header_cb with every field in order
+ *
+ * The dynamic table is updated as the block says, so every block of a
+ * connection has to be decoded, even those of streams that are refused.
+ *
+ * @param hpack : decoder context of the connection
+ * @param data : complete header block
+ * @param len : length of data
+ * @param header_cb : called with NUL terminated name and value
+ * @param ptr : passed on to header_cb
+ * @return : OK on success, E_FAIL on a compression error
+ */
+int xps_hpack_decode(xps_hpack_t *hpack, const u_char *data, size_t len,
+                     xps_http_header_cb_t header_cb, void *ptr) {
+  assert(hpack != NULL);
+  assert(data != NULL);
+
+  const u_char *pos = data;
+  const u_char *end = data + len;
+
+  while (pos < end) {
+    u_char first = *pos;
+    size_t index;
+
+    // Indexed field
+    if (first & 0x80) {
+      const char *name, *value;
+      if (hpack_decode_int(&pos, end, 7, &index) != OK ||
+          hpack_lookup(hpack, index, &name, &value) != OK)
+        return E_FAIL;
+      header_cb(name, value, ptr);
+      continue;
+    }
+
+    // Dynamic table size update
+    if ((first & 0xe0) == 0x20) {
+      size_t max_size;
+      if (hpack_decode_int(&pos, end, 5, &max_size) != OK || max_size > HPACK_TABLE_SIZE)
+        return E_FAIL;
+      hpack->max_size = max_size;
+      hpack_evict(hpack, max_size);
+      continue;
+    }
+
+    // Literal field, with incremental indexing or without
+    bool indexing = (first & 0xc0) == 0x40;
+    if (hpack_decode_int(&pos, end, indexing ? 6 : 4, &index) != OK)
+      return E_FAIL;
+
+    char *name = NULL;
+    if (index > 0) {
+      const char *indexed_name, *indexed_value;
+      if (hpack_lookup(hpack, index, &indexed_name, &indexed_value) != OK)
+        return E_FAIL;
+      name = strdup(indexed_name);
+    } else
+      name = hpack_decode_str(&pos, end);
+    char *value = name != NULL ? hpack_decode_str(&pos, end) : NULL;
+    if (value == NULL) {
+      free(name);
+      return E_FAIL;
+    }
+
+    header_cb(name, value, ptr);
+    if (indexing)
+      hpack_insert(hpack, name, value);
+    free(name);
+    free(value);
+  }
+
+  return OK;
+}
+
+/**
+ * Encodes a literal field without indexing, with the name taken from the
+ * static table if it is there
+ *
+ * @param out : room for at least strlen(name) + strlen(value) + 16 bytes
+ * @param name : lower case field name
+ * @param value : field value
+ * @return : number of bytes written
+ */
+size_t xps_hpack_encode(u_char *out, const char *name, const char *value) {
+  assert(out != NULL);
+
+  size_t index = 0;
+  for (size_t i = 1; i <= HPACK_STATIC_ENTRIES && index == 0; i++) {
+    if (strcmp(hpack_static[i][0], name) == 0)
+      index = i;
+  }
+
+  size_t len = hpack_encode_int(out, 0x00, 4, index);
+  if (index == 0) {
+    size_t name_len = strlen(name);
+    len += hpack_encode_int(out + len, 0x00, 7, name_len);
+    memcpy(out + len, name, name_len);
+    len += name_len;
+  }
+
+  size_t value_len = strlen(value);
+  len += hpack_encode_int(out + len, 0x00, 7, value_len);
+  memcpy(out + len, value, value_len);
+  return len + value_len;
+}
+
+/**
+ * Encodes :status, indexed if the static table has it
+ *
+ * @param out : room for at least 8 bytes
+ * @return : number of bytes written
+ */
+size_t xps_hpack_encode_status(u_char *out, int status) {
+  assert(out != NULL);
+
+  char value[8];
+  snprintf(value, sizeof(value), "%d", status);
+  for (size_t i = 8; i <= 14; i++) {
+    if (strcmp(hpack_static[i][1], value) == 0)
+      return hpack_encode_int(out, 0x80, 7, i);
+  }
+  return xps_hpack_encode(out, ":status", value);
+}
+
+int hpack_decode_int(const u_char **pos, const u_char *end, u_int prefix_bits, size_t *value) {
+  const u_char *curr = *pos;
+  if (curr >= end)
+    return E_FAIL;
+
+  u_int prefix_max = (1 << prefix_bits) - 1;
+  *value = *curr++ & prefix_max;
+  if (*value == prefix_max) {
+    u_int shift = 0;
+    do {
+      // Nothing legitimate needs more than 32 bits
+      if (curr >= end || shift > 28)
+        return E_FAIL;
+      *value += (size_t)(*curr & 0x7f) << shift;
+      shift += 7;
+    } while (*curr++ & 0x80);
+  }
+
+  *pos = curr;
+  return OK;
+}
+
+/**
+ * Decodes a string literal into a new NUL terminated string
+ *
+ * @return : string to be freed, NULL on error
+ */
+char *hpack_decode_str(const u_char **pos, const u_char *end) {
+  if (*pos >= end)
+    return NULL;
+  bool huffman = **pos & 0x80;
+
+  size_t len;
+  if (hpack_decode_int(pos, end, 7, &len) != OK || len > (size_t)(end - *pos))
+    return NULL;
+
+  char *str;
+  if (huffman)
+    str = hpack_huffman_decode(*pos, len);
+  else {
+    str = malloc(len + 1);
+    if (str != NULL) {
+      memcpy(str, *pos, len);
+      str[len] = '\0';
+    }
+  }
+
+  *pos += len;
+  return str;
+}
+
+char *hpack_huffman_decode(const u_char *data, size_t len) {
+  if (!hpack_huffman_ready)
+    hpack_huffman_init();
+
+  // Shortest code is 5 bits
+  char *str = malloc(len * 8 / 5 + 1);
+  if (str == NULL)
+    return NULL;
+
+  size_t str_len = 0;
+  int node = 0;
+  u_int depth = 0;  // Bits read since last symbol
+  bool all_ones = true; // Bits read since last symbol are all 1, as padding must be
+
+  for (size_t i = 0; i < len; i++) {
+    for (int bit_i = 7; bit_i >= 0; bit_i--) {
+      int bit = (data[i] >> bit_i) & 1;
+      int next = hpack_huffman_tree[node][bit];
+      depth++;
+      all_ones = all_ones && bit == 1;
+
+      if (next < 0) {
+        str[str_len++] = -next - 1;
+        node = 0;
+        depth = 0;
+        all_ones = true;
+      } else if (next == 0) {
+        // Only EOS is left off the tree
+        free(str);
+        return NULL;
+      } else
+        node = next;
+    }
+  }
+
+  // Padding is a prefix of EOS shorter than a byte
+  if (depth > 7 || !all_ones) {
+    free(str);
+    return NULL;
+  }
+
+  str[str_len] = '\0';
+  return str;
+}
+
+int hpack_lookup(xps_hpack_t *hpack, size_t index, const char **name, const char **value) {
+  if (index == 0)
+    return E_FAIL;
+
+  if (index <= HPACK_STATIC_ENTRIES) {
+    *name = hpack_static[index][0];
+    *value = hpack_static[index][1];
+    return OK;
+  }
+
+  // Dynamic table counts from the newest entry
+  size_t dynamic_i = index - HPACK_STATIC_ENTRIES;
+  if (dynamic_i > (size_t)hpack->entries.length)
+    return E_FAIL;
+  *name = hpack->entries.data[hpack->entries.length - dynamic_i];
+  *value = *name + strlen(*name) + 1;
+  return OK;
+}
+
+void hpack_insert(xps_hpack_t *hpack, const char *name, const char *value) {
+  size_t name_len = strlen(name);
+  size_t value_len = strlen(value);
+  size_t entry_size = name_len + value_len + 32;
+
+  // An entry larger than the table empties it and is not added
+  if (entry_size > hpack->max_size) {
+    hpack_evict(hpack, 0);
+    return;
+  }
+  hpack_evict(hpack, hpack->max_size - entry_size);
+
+  char *entry = malloc(name_len + value_len + 2);
+  if (entry == NULL) {
+    // Later references to it fail the connection
+    logger(LOG_ERROR, "hpack_insert()", "malloc() failed for 'entry'");
+    return;
+  }
+  memcpy(entry, name, name_len + 1);
+  memcpy(entry + name_len + 1, value, value_len + 1);
+  vec_push(&(hpack->entries), entry);
+  hpack->size += entry_size;
+}
+
+/**
+ * Drops the oldest entries until the table is no larger than max_size
+ */
+void hpack_evict(xps_hpack_t *hpack, size_t max_size) {
+  while (hpack->size > max_size && hpack->entries.length > 0) {
+    char *entry = hpack->entries.data[0];
+    size_t name_len = strlen(entry);
+    hpack->size -= name_len + strlen(entry + name_len + 1) + 32;
+    free(entry);
+    vec_splice(&(hpack->entries), 0, 1);
+  }
+}
+
+size_t hpack_encode_int(u_char *out, u_char first, u_int prefix_bits, size_t value) {
+  u_int prefix_max = (1 << prefix_bits) - 1;
+  if (value < prefix_max) {
+    out[0] = first | value;
+    return 1;
+  }
+
+  out[0] = first | prefix_max;
+  value -= prefix_max;
+  size_t len = 1;
+  while (value >= 0x80) {
+    out[len++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  out[len++] = value;
+  return len;
+}
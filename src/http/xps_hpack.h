@@ -0,0 +1,30 @@
+#ifndef XPS_HPACK_H
+#define XPS_HPACK_H
+
+#include "../xps.h"
+
+/*
+ * HPACK header compression (RFC 7541) for the h2c frontend.
+ *
+ * Each direction of a connection has its own context. The decoder keeps the
+ * dynamic table the peer fills, up to the size it last announced and never
+ * more than the HPACK_TABLE_SIZE we allow. The encoder does not index
+ * anything: names come from the static table where they can, values are
+ * sent as literals, so the peer never has to keep state for us.
+ *
+ * Dynamic table entries are "name\0value\0", oldest first.
+ */
+struct xps_hpack_s {
+  vec_void_t entries;
+  size_t size;     // Sum of name and value lengths plus 32 per entry
+  size_t max_size; // Size set by the peer's last table size update
+};
+
+xps_hpack_t *xps_hpack_create();
+void xps_hpack_destroy(xps_hpack_t *hpack);
+int xps_hpack_decode(xps_hpack_t *hpack, const u_char *data, size_t len,
+                     xps_http_header_cb_t header_cb, void *ptr);
+size_t xps_hpack_encode(u_char *out, const char *name, const char *value);
+size_t xps_hpack_encode_status(u_char *out, int status);
+
+#endif
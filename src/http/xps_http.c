@@ -0,0 +1,507 @@
+#include "../xps.h"
+
+bool http_has_token(const char *value, const char *token);
+bool http_accepts(const char *value, const char *token);
+void http_req_header(const char *name, const char *value, void *ptr);
+void http_res_header(const char *name, const char *value, void *ptr);
+time_t http_parse_date(const char *value);
+long http_rewrite_head(const u_char *head, size_t len, const char *encoding, bool close,
+                       u_char *out);
+void http_put(u_char *out, size_t *n, const void *data, size_t len);
+
+/**
+ * Finds the end of an HTTP message head
+ *
+ * @param data : bytes received so far
+ * @param len : length of data
+ * @return : length of the head including the blank line, -1 if incomplete
+ */
+long xps_http_head_len(const u_char *data, size_t len) {
+  assert(data != NULL);
+
+  for (size_t i = 3; i < len; i++) {
+    if (data[i] == '\n' && data[i - 1] == '\r' && data[i - 2] == '\n' && data[i - 3] == '\r')
+      return i + 1;
+  }
+  return -1;
+}
+
+/**
+ * Parses the head of an HTTP request
+ *
+ * @param head : complete request head, see xps_http_head_len()
+ * @param len : length of head
+ * @param req : request to be filled
+ * @return : OK on success, E_FAIL if head is malformed or too long, or if
+ *           req->bad_length is set
+ */
+int xps_http_parse_req(const u_char *head, size_t len, xps_http_req_t *req) {
+  assert(head != NULL);
+  assert(req != NULL);
+
+  req->method[0] = '\0';
+  req->path[0] = '\0';
+  req->host[0] = '\0';
+  req->head_len = len;
+  req->minor_version = 0;
+  req->content_length = -1;
+  req->bad_length = false;
+  req->chunked = false;
+  req->accept_gzip = false;
+  req->accept_zstd = false;
+  req->upgrade = false;
+  req->close = false;
+  req->keep_alive = false;
+  req->no_cache = false;
+  req->no_store = false;
+
+  char line[HTTP_METHOD_LEN + HTTP_MAX_PATH_LEN + 16];
+  if (xps_http_parse_head(head, len, line, sizeof(line), http_req_header, req) != OK ||
+      req->bad_length)
+    return E_FAIL;
+
+  // Request line: METHOD SP PATH SP VERSION
+  char *path = strchr(line, ' ');
+  if (path == NULL || path - line >= HTTP_METHOD_LEN)
+    return E_FAIL;
+  *path++ = '\0';
+  char *version = strchr(path, ' ');
+  if (version == NULL || version - path >= HTTP_MAX_PATH_LEN || strncmp(version + 1, "HTTP/1.", 7))
+    return E_FAIL;
+  *version = '\0';
+  req->minor_version = version[8] == '1' ? 1 : 0;
+  if (req->minor_version == 1 && !req->close)
+    req->keep_alive = true;
+
+  strcpy(req->method, line);
+  strcpy(req->path, path);
+
+  if (strcmp(req->method, "CONNECT") == 0)
+    req->upgrade = true;
+
+  return OK;
+}
+
+/**
+ * Parses the head of an HTTP response
+ *
+ * @param head : complete response head, see xps_http_head_len()
+ * @param len : length of head
+ * @param res : response to be filled
+ * @return : OK on success, E_FAIL if head is malformed or too long, or if
+ *           res->bad_length is set
+ */
+int xps_http_parse_res(const u_char *head, size_t len, xps_http_res_t *res) {
+  assert(head != NULL);
+  assert(res != NULL);
+
+  res->status = 0;
+  res->head_len = len;
+  res->content_length = -1;
+  res->bad_length = false;
+  res->chunked = false;
+  res->content_type[0] = '\0';
+  res->encoded = false;
+  res->no_transform = false;
+  res->close = false;
+  res->keep_alive = false;
+  res->no_store = false;
+  res->is_private = false;
+  res->max_age = -1;
+  res->date = 0;
+  res->expires = 0;
+
+  char line[256];
+  if (xps_http_parse_head(head, len, line, sizeof(line), http_res_header, res) != OK ||
+      res->bad_length)
+    return E_FAIL;
+
+  // Status line: VERSION SP STATUS SP REASON
+  if (strncmp(line, "HTTP/1.", 7) != 0 || strlen(line) < 12 || line[8] != ' ')
+    return E_FAIL;
+  res->status = atoi(line + 9);
+  if (res->status < 100 || res->status > 999)
+    return E_FAIL;
+  if (line[7] == '1' && !res->close)
+    res->keep_alive = true;
+
+  return OK;
+}
+
+/**
+ * Computes how long a response may be served from cache
+ *
+ * Only explicit freshness is honored: s-maxage/max-age first, then Expires
+ * relative to Date. Responses without either are not cached.
+ *
+ * @param res : parsed response
+ * @return : freshness lifetime in seconds, 0 if response must not be cached
+ */
+long xps_http_res_ttl(xps_http_res_t *res) {
+  assert(res != NULL);
+
+  if (res->no_store)
+    return 0;
+
+  // Statuses that are cacheable by default
+  if (res->status != 200 && res->status != 203 && res->status != 301 && res->status != 404 &&
+      res->status != 410)
+    return 0;
+
+  if (res->max_age >= 0)
+    return res->max_age;
+
+  if (res->expires > 0) {
+    time_t now = res->date > 0 ? res->date : time(NULL);
+    return res->expires > now ? (long)(res->expires - now) : 0;
+  }
+
+  return 0;
+}
+
+/**
+ * Parses a Content-Length value
+ *
+ * Only plain digits are taken: signs, spaces, lists and trailing bytes would
+ * let the proxy and the other end frame the body differently.
+ *
+ * @param value : header value, surrounding whitespace already removed
+ * @return : length, -1 if invalid or too large
+ */
+long xps_http_parse_length(const char *value) {
+  assert(value != NULL);
+
+  if (*value == '\0')
+    return -1;
+
+  long length = 0;
+  for (const char *curr = value; *curr != '\0'; curr++) {
+    if (*curr < '0' || *curr > '9')
+      return -1;
+    int digit = *curr - '0';
+    if (length > (LONG_MAX - digit) / 10)
+      return -1;
+    length = length * 10 + digit;
+  }
+  return length;
+}
+
+/**
+ * Rewrites a response head for its body to be sent with a content coding,
+ * and/or for the client connection to be closed after it
+ *
+ * An encoded body is sent in chunks, so Content-Length is dropped and the
+ * response is sent as HTTP/1.1, the version the client must have asked in.
+ * Strong validators no longer match the bytes sent and are made weak.
+ *
+ * @param head : complete response head, see xps_http_head_len()
+ * @param len : length of head
+ * @param encoding : Content-Encoding token, e.g. "gzip", NULL to keep the body as it is
+ * @param close : replace the Connection header with "Connection: close"
+ * @return : new head, NULL on failure
+ */
+xps_buffer_t *xps_http_res_rewrite_head(const u_char *head, size_t len, const char *encoding,
+                                        bool close) {
+  assert(head != NULL);
+
+  // Measure first, bare LF line ends grow into CRLF and ETags may grow
+  long size = http_rewrite_head(head, len, encoding, close, NULL);
+  if (size < 0) {
+    logger(LOG_ERROR, "xps_http_res_rewrite_head()", "malformed response head");
+    return NULL;
+  }
+
+  xps_buffer_t *buff = xps_buffer_create(size, 0, NULL);
+  if (buff == NULL) {
+    logger(LOG_ERROR, "xps_http_res_rewrite_head()", "xps_buffer_create() failed");
+    return NULL;
+  }
+  buff->len = http_rewrite_head(head, len, encoding, close, buff->pos);
+
+  return buff;
+}
+
+/**
+ * Writes the head built by xps_http_res_rewrite_head()
+ *
+ * @param out : where to write it, NULL to only measure it
+ * @return : length of the new head, -1 if head is malformed
+ */
+long http_rewrite_head(const u_char *head, size_t len, const char *encoding, bool close,
+                       u_char *out) {
+  size_t n = 0;
+  size_t i = 0;
+  bool first = true;
+  while (i < len) {
+    size_t start = i;
+    while (i < len && head[i] != '\n')
+      i++;
+    size_t line_len = i - start;
+    if (line_len > 0 && head[start + line_len - 1] == '\r')
+      line_len--;
+    i++;
+    const char *line = (const char *)head + start;
+
+    // Blank line ends the head
+    if (line_len == 0)
+      break;
+
+    if (first) {
+      // Status line starts with the 8 byte version
+      if (line_len < 8)
+        return -1;
+      first = false;
+      http_put(out, &n, encoding != NULL ? "HTTP/1.1" : line, 8);
+      http_put(out, &n, line + 8, line_len - 8);
+    } else if (close && (strncasecmp(line, "Connection:", 11) == 0 ||
+                         strncasecmp(line, "Keep-Alive:", 11) == 0))
+      continue;
+    else if (encoding == NULL) {
+      http_put(out, &n, line, line_len);
+    } else if (strncasecmp(line, "Content-Length:", 15) == 0 ||
+               strncasecmp(line, "Transfer-Encoding:", 18) == 0)
+      continue;
+    else if (strncasecmp(line, "ETag:", 5) == 0) {
+      size_t skip = 5;
+      while (skip < line_len && line[skip] == ' ')
+        skip++;
+      bool weak = skip < line_len && line[skip] == 'W';
+      http_put(out, &n, weak ? "ETag: " : "ETag: W/", weak ? 6 : 8);
+      http_put(out, &n, line + skip, line_len - skip);
+    } else {
+      http_put(out, &n, line, line_len);
+    }
+    http_put(out, &n, "\r\n", 2);
+  }
+
+  if (encoding != NULL) {
+    const char *trailer[] = {"Content-Encoding: ", encoding,
+                             "\r\nTransfer-Encoding: chunked\r\nVary: Accept-Encoding\r\n"};
+    for (size_t j = 0; j < sizeof(trailer) / sizeof(trailer[0]); j++)
+      http_put(out, &n, trailer[j], strlen(trailer[j]));
+  }
+  if (close)
+    http_put(out, &n, "Connection: close\r\n", 19);
+  http_put(out, &n, "\r\n", 2);
+
+  return n;
+}
+
+/**
+ * Appends bytes at out + *n, or only counts them if out is NULL
+ */
+void http_put(u_char *out, size_t *n, const void *data, size_t len) {
+  if (out != NULL)
+    memcpy(out + *n, data, len);
+  *n += len;
+}
+
+/**
+ * Splits an HTTP message head into its first line and headers
+ *
+ * @param head : complete message head, see xps_http_head_len()
+ * @param len : length of head
+ * @param first_line : filled with the request or status line
+ * @param first_line_size : size of first_line
+ * @param header_cb : called with every header, names as they were sent
+ * @param ptr : passed on to header_cb
+ * @return : OK on success, E_FAIL if head is malformed or its first line too long
+ */
+int xps_http_parse_head(const u_char *head, size_t len, char *first_line, size_t first_line_size,
+                        xps_http_header_cb_t header_cb, void *ptr) {
+  char line[HTTP_MAX_HEADER_LEN];
+  size_t i = 0;
+  bool first = true;
+
+  while (i < len) {
+    // Find end of line
+    size_t start = i;
+    while (i < len && head[i] != '\n')
+      i++;
+    if (i >= len)
+      return E_FAIL;
+    size_t line_len = i - start;
+    if (line_len > 0 && head[start + line_len - 1] == '\r')
+      line_len--;
+    i++;
+
+    // Blank line ends the head
+    if (line_len == 0)
+      return first ? E_FAIL : OK;
+
+    if (first) {
+      if (line_len >= first_line_size)
+        return E_FAIL;
+      memcpy(first_line, head + start, line_len);
+      first_line[line_len] = '\0';
+      first = false;
+      continue;
+    }
+
+    // Headers longer than HTTP_MAX_HEADER_LEN are not needed, skip them
+    if (line_len >= sizeof(line))
+      continue;
+    memcpy(line, head + start, line_len);
+    line[line_len] = '\0';
+
+    char *value = strchr(line, ':');
+    if (value == NULL)
+      return E_FAIL;
+    *value++ = '\0';
+    while (*value == ' ' || *value == '\t')
+      value++;
+    char *end = value + strlen(value);
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t'))
+      *--end = '\0';
+
+    header_cb(line, value, ptr);
+  }
+
+  return E_FAIL;
+}
+
+/**
+ * Checks whether a comma separated header value contains token, ignoring case
+ * and any "=value" part of the token
+ */
+bool http_has_token(const char *value, const char *token) {
+  size_t token_len = strlen(token);
+  const char *curr = value;
+
+  while (*curr != '\0') {
+    while (*curr == ' ' || *curr == ',')
+      curr++;
+    if (strncasecmp(curr, token, token_len) == 0 &&
+        (curr[token_len] == '\0' || curr[token_len] == ',' || curr[token_len] == ' ' ||
+         curr[token_len] == '='))
+      return true;
+    while (*curr != '\0' && *curr != ',')
+      curr++;
+  }
+  return false;
+}
+
+/**
+ * Checks whether an Accept-Encoding style value allows token, i.e. lists it
+ * without q=0
+ */
+bool http_accepts(const char *value, const char *token) {
+  size_t token_len = strlen(token);
+  const char *curr = value;
+
+  while (*curr != '\0') {
+    while (*curr == ' ' || *curr == ',')
+      curr++;
+    if (strncasecmp(curr, token, token_len) == 0 &&
+        (curr[token_len] == '\0' || curr[token_len] == ',' || curr[token_len] == ' ' ||
+         curr[token_len] == ';')) {
+      const char *params = curr + token_len;
+      const char *q = strcasestr(params, "q=");
+      const char *next = strchr(params, ',');
+      if (q == NULL || (next != NULL && q > next))
+        return true;
+      return strtod(q + 2, NULL) > 0;
+    }
+    while (*curr != '\0' && *curr != ',')
+      curr++;
+  }
+  return false;
+}
+
+void http_req_header(const char *name, const char *value, void *ptr) {
+  xps_http_req_t *req = ptr;
+
+  if (strcasecmp(name, "Host") == 0) {
+    strncpy(req->host, value, HTTP_HOST_LEN - 1);
+    req->host[HTTP_HOST_LEN - 1] = '\0';
+  } else if (strcasecmp(name, "Content-Length") == 0) {
+    long length = xps_http_parse_length(value);
+    if (length < 0 || (req->content_length >= 0 && req->content_length != length))
+      req->bad_length = true;
+    req->content_length = length;
+  }
+  else if (strcasecmp(name, "Transfer-Encoding") == 0)
+    req->chunked = http_has_token(value, "chunked");
+  else if (strcasecmp(name, "Accept-Encoding") == 0) {
+    req->accept_gzip = http_accepts(value, "gzip");
+    req->accept_zstd = http_accepts(value, "zstd");
+  } else if (strcasecmp(name, "Upgrade") == 0)
+    req->upgrade = true;
+  else if (strcasecmp(name, "Connection") == 0) {
+    req->close = http_has_token(value, "close");
+    req->keep_alive = !req->close && http_has_token(value, "keep-alive");
+  }
+  else if (strcasecmp(name, "Cache-Control") == 0) {
+    if (http_has_token(value, "no-cache") || http_has_token(value, "max-age=0"))
+      req->no_cache = true;
+    if (http_has_token(value, "no-store"))
+      req->no_store = true;
+  } else if (strcasecmp(name, "Pragma") == 0 && http_has_token(value, "no-cache"))
+    req->no_cache = true;
+  else if (strcasecmp(name, "Authorization") == 0) {
+    req->no_cache = true;
+    req->no_store = true;
+  }
+}
+
+void http_res_header(const char *name, const char *value, void *ptr) {
+  xps_http_res_t *res = ptr;
+
+  if (strcasecmp(name, "Content-Length") == 0) {
+    long length = xps_http_parse_length(value);
+    if (length < 0 || (res->content_length >= 0 && res->content_length != length))
+      res->bad_length = true;
+    res->content_length = length;
+  } else if (strcasecmp(name, "Transfer-Encoding") == 0)
+    res->chunked = http_has_token(value, "chunked");
+  else if (strcasecmp(name, "Content-Type") == 0) {
+    strncpy(res->content_type, value, HTTP_CONTENT_TYPE_LEN - 1);
+    res->content_type[HTTP_CONTENT_TYPE_LEN - 1] = '\0';
+  } else if (strcasecmp(name, "Content-Encoding") == 0)
+    res->encoded = strcasecmp(value, "identity") != 0;
+  else if (strcasecmp(name, "Connection") == 0) {
+    res->close = http_has_token(value, "close");
+    res->keep_alive = !res->close && http_has_token(value, "keep-alive");
+  }
+  else if (strcasecmp(name, "Cache-Control") == 0) {
+    if (http_has_token(value, "no-transform"))
+      res->no_transform = true;
+    if (http_has_token(value, "no-store") || http_has_token(value, "no-cache"))
+      res->no_store = true;
+    if (http_has_token(value, "private")) {
+      res->no_store = true;
+      res->is_private = true;
+    }
+
+    // s-maxage takes precedence over max-age for shared caches
+    const char *max_age = strcasestr(value, "s-maxage=");
+    if (max_age != NULL)
+      res->max_age = strtol(max_age + 9, NULL, 10);
+    else if ((max_age = strcasestr(value, "max-age=")) != NULL)
+      res->max_age = strtol(max_age + 8, NULL, 10);
+  } else if (strcasecmp(name, "Expires") == 0)
+    res->expires = http_parse_date(value);
+  else if (strcasecmp(name, "Date") == 0)
+    res->date = http_parse_date(value);
+  else if (strcasecmp(name, "Set-Cookie") == 0) {
+    res->no_store = true;
+    res->is_private = true;
+  } else if (strcasecmp(name, "Vary") == 0)
+    res->no_store = true;
+}
+
+/**
+ * Parses an IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+ *
+ * @return : seconds since epoch, -1 if invalid
+ */
+time_t http_parse_date(const char *value) {
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+
+  const char *end = strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (end == NULL)
+    return -1;
+
+  return timegm(&tm);
+}
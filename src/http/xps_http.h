@@ -0,0 +1,56 @@
+#ifndef XPS_HTTP_H
+#define XPS_HTTP_H
+
+#include "../xps.h"
+
+/*
+ * Minimal HTTP/1.x head parsing, enough for the proxy to find message
+ * boundaries and decide cacheability. Bodies are never parsed.
+ */
+struct xps_http_req_s {
+  char method[HTTP_METHOD_LEN];
+  char path[HTTP_MAX_PATH_LEN];
+  char host[HTTP_HOST_LEN];
+  size_t head_len;
+  int minor_version; // 0 for HTTP/1.0, 1 for HTTP/1.1
+  long content_length; // -1 if absent
+  bool bad_length; // Content-Length not a number, or given twice with different values
+  bool chunked;
+  bool accept_gzip; // Accept-Encoding allows gzip
+  bool accept_zstd; // Accept-Encoding allows zstd
+  bool upgrade;  // CONNECT or Upgrade header, connection turns into a tunnel
+  bool close;    // Connection: close
+  bool keep_alive; // Connection stays open after the response: HTTP/1.1 without close, or keep-alive
+  bool no_cache; // Must not be answered from cache
+  bool no_store; // Response must not be stored
+};
+
+struct xps_http_res_s {
+  int status;
+  size_t head_len;
+  long content_length; // -1 if absent
+  bool bad_length; // Like bad_length of a request
+  bool chunked;
+  char content_type[HTTP_CONTENT_TYPE_LEN]; // "" if absent
+  bool encoded;      // Content-Encoding other than identity
+  bool no_transform; // Body must be sent as it is
+  bool close;      // Connection: close
+  bool keep_alive; // Connection may take another request, like keep_alive of a request
+  bool no_store; // Response must not be stored
+  bool is_private; // Response is for this client only, must not be shared
+  long max_age;  // s-maxage or max-age in seconds, -1 if absent
+  time_t date;   // Date header, 0 if absent
+  time_t expires; // Expires header, 0 if absent, -1 if invalid
+};
+
+long xps_http_head_len(const u_char *data, size_t len);
+int xps_http_parse_head(const u_char *head, size_t len, char *first_line, size_t first_line_size,
+                        xps_http_header_cb_t header_cb, void *ptr);
+int xps_http_parse_req(const u_char *head, size_t len, xps_http_req_t *req);
+int xps_http_parse_res(const u_char *head, size_t len, xps_http_res_t *res);
+long xps_http_res_ttl(xps_http_res_t *res);
+long xps_http_parse_length(const char *value);
+xps_buffer_t *xps_http_res_rewrite_head(const u_char *head, size_t len, const char *encoding,
+                                        bool close);
+
+#endif
@@ -1,22 +1,53 @@
 #include "xps.h"
 
-xps_core_t *core;
+int main(int argc, char *argv[]) {
+  // Signals are handled by the loop through a signalfd
+  if (xps_signal_block() != OK)
+    exit(EXIT_FAILURE);
 
-void sigint_handler(int signum);
+  // Load config
+  xps_config_t *config = xps_config_create(argv);
+  if (config == NULL)
+    exit(EXIT_FAILURE);
+
+  // Pin before anything is allocated, so memory comes from the CPU's NUMA node
+  if (config->cpu >= 0) {
+    if (pin_to_cpu(config->cpu) != OK) {
+      xps_config_destroy(config);
+      exit(EXIT_FAILURE);
+    }
+    int node = get_cpu_node(config->cpu);
+    if (node >= 0)
+      prefer_node(node);
+    logger(LOG_INFO, "main()", "pinned to cpu %d, node %d", config->cpu, node);
+  }
+
+  // Create response cache
+  xps_cache_t *cache = NULL;
+  if (config->cache_max_bytes > 0) {
+    cache = xps_cache_create(config->cache_max_bytes);
+    if (cache == NULL) {
+      xps_config_destroy(config);
+      exit(EXIT_FAILURE);
+    }
+  }
 
-int main() {
-  signal(SIGINT, sigint_handler);
    // Create core
-  core = xps_core_create();
+  xps_core_t *core = xps_core_create(config, cache);
+  if (core == NULL) {
+    if (cache != NULL)
+      xps_cache_destroy(cache);
+    xps_config_destroy(config);
+    exit(EXIT_FAILURE);
+  }
 
-  // Start core
+  // Start core, returns once the loop is stopped
   xps_core_start(core);
-}
-
-void sigint_handler(int signum) {
-  logger(LOG_WARNING, "sigint_handler()", "SIGINT received");
 
   xps_core_destroy(core);
+  if (cache != NULL)
+    xps_cache_destroy(cache);
+  xps_config_destroy(config);
 
-  exit(EXIT_SUCCESS);
+  return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,459 @@
+#include "../xps.h"
+
+xps_backend_t *backend_create(xps_core_t *core, const char *host, u_int port);
+void backend_destroy(xps_backend_t *backend);
+void backend_eject(xps_backend_t *backend);
+void backend_schedule_check(xps_backend_t *backend);
+void backend_check_handler(void *ptr);
+void backend_probe_start(xps_backend_t *backend);
+int backend_resolve_start(xps_backend_t *backend);
+void backend_resolve_work_handler(void *ptr);
+void backend_resolve_done_handler(void *ptr);
+void backend_probe_connect(xps_backend_t *backend, struct addrinfo *addrinfo);
+void backend_probe_done(xps_backend_t *backend, bool ok);
+void backend_probe_read_handler(void *ptr);
+void backend_probe_write_handler(void *ptr);
+void backend_probe_close_handler(void *ptr);
+void backend_probe_timeout_handler(void *ptr);
+
+/**
+ * Creates the backends listed in config->upstreams
+ *
+ * @param core : core the backends belong to
+ * @return : OK on success, E_FAIL if no valid backend is listed
+ */
+int xps_backends_create(xps_core_t *core) {
+  assert(core != NULL);
+
+  char *list = strdup(core->config->upstreams);
+  if (list == NULL) {
+    logger(LOG_ERROR, "xps_backends_create()", "strdup() failed");
+    return E_FAIL;
+  }
+
+  char *save_ptr;
+  for (char *entry = strtok_r(list, ",", &save_ptr); entry != NULL;
+       entry = strtok_r(NULL, ",", &save_ptr)) {
+    // Unix sockets have no port
+    char *colon = is_unix_host(entry) ? NULL : strrchr(entry, ':');
+    u_int port = colon != NULL ? strtoul(colon + 1, NULL, 10) : 0;
+    if (!is_unix_host(entry) && (colon == NULL || colon == entry || !is_valid_port(port))) {
+      logger(LOG_WARNING, "xps_backends_create()", "invalid upstream '%s'", entry);
+      continue;
+    }
+    if (colon != NULL)
+      *colon = '\0';
+
+    xps_backend_t *backend = backend_create(core, entry, port);
+    if (backend == NULL) {
+      logger(LOG_ERROR, "xps_backends_create()", "backend_create() failed");
+      continue;
+    }
+    vec_push(&(core->backends), backend);
+  }
+  free(list);
+
+  if (core->backends.length == 0) {
+    logger(LOG_ERROR, "xps_backends_create()", "no valid upstream in '%s'",
+           core->config->upstreams);
+    return E_FAIL;
+  }
+
+  return OK;
+}
+
+void xps_backends_destroy(xps_core_t *core) {
+  assert(core != NULL);
+
+  for (int i = 0; i < core->backends.length; i++)
+    backend_destroy(core->backends.data[i]);
+  vec_clear(&(core->backends));
+}
+
+/**
+ * Picks the backend for a new upstream connection, round robin over the
+ * ones that are not ejected
+ *
+ * @param core : core instance
+ * @return : backend, NULL if all are ejected
+ */
+xps_backend_t *xps_backend_pick(xps_core_t *core) {
+  assert(core != NULL);
+
+  u_int n_backends = core->backends.length;
+  for (u_int j = 0; j < n_backends; j++) {
+    u_int i = (core->backends_rr + j) % n_backends;
+    xps_backend_t *backend = core->backends.data[i];
+    if (backend->ejected)
+      continue;
+
+    core->backends_rr = i + 1;
+    backend->n_picked++;
+    return backend;
+  }
+
+  return NULL;
+}
+
+/**
+ * Records the outcome of a request or a connection attempt
+ *
+ * @param backend : backend that was used
+ * @param ok : true if it answered, false if it could not be reached or reset
+ */
+void xps_backend_report(xps_backend_t *backend, bool ok) {
+  assert(backend != NULL);
+
+  if (ok) {
+    backend->n_fails = 0;
+    backend->n_ejections = 0;
+    if (backend->ejected) {
+      backend->ejected = false;
+      logger(LOG_INFO, "xps_backend_report()", "upstream %s:%u is back", backend->host,
+             backend->port);
+      backend_schedule_check(backend);
+    }
+    return;
+  }
+
+  backend->n_failed++;
+  backend->n_fails++;
+  if (!backend->ejected && backend->n_fails >= backend->core->config->max_fails)
+    backend_eject(backend);
+}
+
+void xps_backends_log_stats(xps_core_t *core) {
+  assert(core != NULL);
+
+  for (int i = 0; i < core->backends.length; i++) {
+    xps_backend_t *backend = core->backends.data[i];
+    logger(LOG_INFO, "xps_backends_log_stats()", "upstream %s:%u: %s, picked %lu, failed %lu, ejected %lu",
+           backend->host, backend->port, backend->ejected ? "ejected" : "healthy",
+           backend->n_picked, backend->n_failed, backend->n_ejected);
+  }
+}
+
+xps_backend_t *backend_create(xps_core_t *core, const char *host, u_int port) {
+  xps_backend_t *backend = malloc(sizeof(xps_backend_t));
+  if (backend == NULL) {
+    logger(LOG_ERROR, "backend_create()", "malloc() failed for 'backend'");
+    return NULL;
+  }
+
+  // Init values
+  backend->core = core;
+  backend->host = strdup(host);
+  backend->port = port;
+  backend->ejected = false;
+  backend->eject_until_msec = 0;
+  backend->n_fails = 0;
+  backend->n_ejections = 0;
+  backend->check_timer = NULL;
+  backend->probe_fd = -1;
+  backend->probe_timer = NULL;
+  backend->probe_sent = false;
+  backend->resolve = NULL;
+  backend->n_picked = 0;
+  backend->n_failed = 0;
+  backend->n_ejected = 0;
+
+  if (backend->host == NULL) {
+    logger(LOG_ERROR, "backend_create()", "strdup() failed");
+    free(backend);
+    return NULL;
+  }
+
+  backend_schedule_check(backend);
+
+  logger(LOG_DEBUG, "backend_create()", "created backend %s:%u", host, port);
+
+  return backend;
+}
+
+void backend_destroy(xps_backend_t *backend) {
+  xps_loop_t *loop = backend->core->loop;
+
+  if (backend->check_timer != NULL)
+    xps_loop_cancel_timer(loop, backend->check_timer);
+  if (backend->probe_timer != NULL)
+    xps_loop_cancel_timer(loop, backend->probe_timer);
+  if (backend->probe_fd >= 0) {
+    xps_loop_detach(loop, backend->probe_fd);
+    close(backend->probe_fd);
+  }
+  if (backend->resolve != NULL)
+    backend->resolve->backend = NULL;
+
+  free(backend->host);
+  free(backend);
+}
+
+/**
+ * Takes a backend out of rotation, for twice as long as the last time if it
+ * has not succeeded since
+ */
+void backend_eject(xps_backend_t *backend) {
+  xps_config_t *config = backend->core->config;
+
+  u_int shift = backend->n_ejections < 16 ? backend->n_ejections : 16;
+  u_long eject_msec = config->eject_msec << shift;
+  if (eject_msec > EJECT_MAX_MSEC)
+    eject_msec = EJECT_MAX_MSEC;
+
+  backend->ejected = true;
+  backend->eject_until_msec = backend->core->loop->time_msec + eject_msec;
+  backend->n_ejections++;
+  backend->n_ejected++;
+
+  logger(LOG_WARNING, "backend_eject()", "ejecting upstream %s:%u for %lu msec after %u failures",
+         backend->host, backend->port, eject_msec, backend->n_fails);
+
+  backend_schedule_check(backend);
+}
+
+/**
+ * Sets the timer of the next probe: at the end of an ejection, or after
+ * config->health_interval_msec for a healthy backend if active checks are on
+ */
+void backend_schedule_check(xps_backend_t *backend) {
+  xps_loop_t *loop = backend->core->loop;
+  u_long interval_msec = backend->core->config->health_interval_msec;
+
+  if (backend->check_timer != NULL) {
+    xps_loop_cancel_timer(loop, backend->check_timer);
+    backend->check_timer = NULL;
+  }
+
+  // A running probe schedules the next one when it is done
+  if (backend->probe_fd >= 0)
+    return;
+
+  u_long delay_msec;
+  if (backend->ejected)
+    delay_msec = backend->eject_until_msec > loop->time_msec
+                     ? backend->eject_until_msec - loop->time_msec
+                     : 0;
+  else if (interval_msec > 0)
+    delay_msec = interval_msec;
+  else
+    return;
+
+  backend->check_timer = xps_loop_add_timer(loop, delay_msec, backend, backend_check_handler);
+}
+
+void backend_check_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_backend_t *backend = ptr;
+
+  backend->check_timer = NULL;
+  backend_probe_start(backend);
+}
+
+/**
+ * Starts a probe of a backend, the result comes to backend_probe_done()
+ */
+void backend_probe_start(xps_backend_t *backend) {
+  xps_loop_t *loop = backend->core->loop;
+
+  backend->probe_timer =
+      xps_loop_add_timer(loop, HEALTH_TIMEOUT_MSEC, backend, backend_probe_timeout_handler);
+
+  // Addresses and unix sockets need no lookup
+  struct in_addr addr;
+  if (backend->core->workers != NULL && !is_unix_host(backend->host) &&
+      inet_pton(AF_INET, backend->host, &addr) != 1 && backend_resolve_start(backend) == OK)
+    return;
+
+  backend_probe_connect(backend, xps_getaddrinfo(backend->host, backend->port));
+}
+
+/**
+ * Looks up the host of a backend on a worker, the result comes to
+ * backend_probe_connect()
+ */
+int backend_resolve_start(xps_backend_t *backend) {
+  xps_backend_resolve_t *resolve = malloc(sizeof(xps_backend_resolve_t));
+  if (resolve == NULL) {
+    logger(LOG_ERROR, "backend_resolve_start()", "malloc() failed for 'resolve'");
+    return E_FAIL;
+  }
+
+  // Init values
+  resolve->backend = backend;
+  resolve->host = strdup(backend->host);
+  resolve->port = backend->port;
+  resolve->addrinfo = NULL;
+
+  if (resolve->host == NULL ||
+      xps_workers_submit(backend->core->workers, backend_resolve_work_handler,
+                         backend_resolve_done_handler, resolve) != OK) {
+    logger(LOG_ERROR, "backend_resolve_start()", "failed to submit lookup of %s", backend->host);
+    free(resolve->host);
+    free(resolve);
+    return E_FAIL;
+  }
+
+  backend->resolve = resolve;
+  return OK;
+}
+
+void backend_resolve_work_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_backend_resolve_t *resolve = ptr;
+
+  resolve->addrinfo = xps_getaddrinfo(resolve->host, resolve->port);
+}
+
+void backend_resolve_done_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_backend_resolve_t *resolve = ptr;
+  xps_backend_t *backend = resolve->backend;
+
+  if (backend != NULL) {
+    backend->resolve = NULL;
+    backend_probe_connect(backend, resolve->addrinfo);
+  } else if (resolve->addrinfo != NULL) {
+    xps_freeaddrinfo(resolve->addrinfo);
+  }
+
+  free(resolve->host);
+  free(resolve);
+}
+
+/**
+ * Connects to a backend
+ *
+ * @param backend : backend being probed
+ * @param addrinfo : its address, freed here; NULL if it could not be resolved
+ */
+void backend_probe_connect(xps_backend_t *backend, struct addrinfo *addrinfo) {
+  xps_loop_t *loop = backend->core->loop;
+
+  if (addrinfo == NULL) {
+    backend_probe_done(backend, false);
+    return;
+  }
+
+  int sock_fd = socket(addrinfo->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  int error = sock_fd < 0 ? -1 : connect(sock_fd, addrinfo->ai_addr, addrinfo->ai_addrlen);
+  bool connecting = sock_fd >= 0 && (error == 0 || errno == EINPROGRESS);
+  xps_freeaddrinfo(addrinfo);
+
+  if (!connecting || xps_loop_attach(loop, sock_fd, EPOLLIN | EPOLLOUT | EPOLLET, backend,
+                                     backend_probe_read_handler, backend_probe_write_handler,
+                                     backend_probe_close_handler) != OK) {
+    if (sock_fd >= 0)
+      close(sock_fd);
+    backend_probe_done(backend, false);
+    return;
+  }
+
+  backend->probe_fd = sock_fd;
+  backend->probe_sent = false;
+}
+
+/**
+ * Ends a probe, feeding its result into the backend's health
+ */
+void backend_probe_done(xps_backend_t *backend, bool ok) {
+  xps_loop_t *loop = backend->core->loop;
+
+  if (backend->probe_fd >= 0) {
+    xps_loop_detach(loop, backend->probe_fd);
+    close(backend->probe_fd);
+    backend->probe_fd = -1;
+  }
+  if (backend->probe_timer != NULL) {
+    xps_loop_cancel_timer(loop, backend->probe_timer);
+    backend->probe_timer = NULL;
+  }
+  if (backend->resolve != NULL) {
+    backend->resolve->backend = NULL;
+    backend->resolve = NULL;
+  }
+
+  logger(LOG_DEBUG, "backend_probe_done()", "probe of upstream %s:%u %s", backend->host,
+         backend->port, ok ? "succeeded" : "failed");
+
+  // A failed probe at the end of an ejection extends it
+  if (backend->ejected && !ok) {
+    backend->n_failed++;
+    backend->n_fails++;
+    backend_eject(backend);
+    return;
+  }
+
+  xps_backend_report(backend, ok);
+  backend_schedule_check(backend);
+}
+
+void backend_probe_write_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_backend_t *backend = ptr;
+  const char *health_path = backend->core->config->health_path;
+
+  if (backend->probe_fd < 0 || backend->probe_sent)
+    return;
+
+  // Connected, or failed to
+  int error = 0;
+  socklen_t error_len = sizeof(error);
+  if (getsockopt(backend->probe_fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0 || error != 0) {
+    backend_probe_done(backend, false);
+    return;
+  }
+
+  if (health_path[0] == '\0') {
+    backend_probe_done(backend, true);
+    return;
+  }
+
+  char req[HTTP_MAX_PATH_LEN + HTTP_HOST_LEN + 64];
+  int len = snprintf(req, sizeof(req), "GET %s HTTP/1.0\r\nHost: %s\r\nConnection: close\r\n\r\n",
+                     health_path, is_unix_host(backend->host) ? "localhost" : backend->host);
+  if (len >= (int)sizeof(req) || send(backend->probe_fd, req, len, MSG_NOSIGNAL) != len) {
+    backend_probe_done(backend, false);
+    return;
+  }
+  backend->probe_sent = true;
+}
+
+void backend_probe_read_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_backend_t *backend = ptr;
+
+  if (backend->probe_fd < 0 || !backend->probe_sent)
+    return;
+
+  // The status line is all that matters
+  char buff[16];
+  long read_n = recv(backend->probe_fd, buff, sizeof(buff) - 1, 0);
+  if (read_n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return;
+  if (read_n < 12) {
+    backend_probe_done(backend, false);
+    return;
+  }
+  buff[read_n] = '\0';
+
+  int status = atoi(buff + 9);
+  backend_probe_done(backend, strncmp(buff, "HTTP/1.", 7) == 0 && status >= 200 && status < 400);
+}
+
+void backend_probe_close_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_backend_t *backend = ptr;
+
+  // The response may have arrived together with the hang up
+  backend_probe_read_handler(backend);
+  if (backend->probe_fd >= 0)
+    backend_probe_done(backend, false);
+}
+
+void backend_probe_timeout_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_backend_t *backend = ptr;
+
+  backend->probe_timer = NULL;
+  backend_probe_done(backend, false);
+}
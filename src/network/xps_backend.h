@@ -0,0 +1,53 @@
+#ifndef XPS_BACKEND_H
+#define XPS_BACKEND_H
+
+#include "../xps.h"
+
+/*
+ * Upstream servers the proxy spreads new upstream connections over, with
+ * their health.
+ *
+ * Sessions report every connection that failed before a response head
+ * arrived, and every response head, as passive checks. Backends may also be
+ * probed on a timer with a TCP connect, or an HTTP request when
+ * config->health_path is set. After config->max_fails failures in a row a
+ * backend is ejected for config->eject_msec, doubling with every ejection in
+ * a row up to EJECT_MAX_MSEC. It is probed when the time is up and taken
+ * back once a probe or a request succeeds.
+ *
+ * Probes of backends named by host name look the name up on a worker
+ * thread, getaddrinfo() can wait on DNS for seconds. The probe timeout
+ * covers the lookup.
+ */
+struct xps_backend_s {
+  xps_core_t *core;
+  char *host;
+  u_int port;
+  bool ejected;
+  u_long eject_until_msec;
+  u_int n_fails;      // Failures in a row
+  u_int n_ejections;  // Ejections in a row, without a success in between
+  loop_timer_t *check_timer; // Next probe
+  int probe_fd;       // Probe connection, -1 if no probe is running
+  loop_timer_t *probe_timer; // Probe timeout
+  bool probe_sent;    // HTTP probe request was written
+  xps_backend_resolve_t *resolve; // Host lookup of the probe on a worker, NULL if none
+  u_long n_picked;
+  u_long n_failed;
+  u_long n_ejected;
+};
+
+struct xps_backend_resolve_s {
+  xps_backend_t *backend; // NULL once the probe is over, the result is dropped
+  char *host;
+  u_int port;
+  struct addrinfo *addrinfo; // Result, NULL if the lookup failed
+};
+
+int xps_backends_create(xps_core_t *core);
+void xps_backends_destroy(xps_core_t *core);
+xps_backend_t *xps_backend_pick(xps_core_t *core);
+void xps_backend_report(xps_backend_t *backend, bool ok);
+void xps_backends_log_stats(xps_core_t *core);
+
+#endif
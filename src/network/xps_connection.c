@@ -3,43 +3,53 @@
 void connection_loop_read_handler(void *ptr);
 void connection_loop_write_handler(void *ptr);
 void connection_loop_close_handler(void *ptr);
+void connection_loop_error_handler(void *ptr);
 void connection_source_handler(void *ptr);
 void connection_source_close_handler(void *ptr);
+void connection_source_pause_handler(void *ptr);
+void connection_source_resume_handler(void *ptr);
 void connection_sink_handler(void *ptr);
 void connection_sink_close_handler(void *ptr);
 void connection_close(xps_connection_t *connection, bool peer_closed);
+bool connection_zerocopy(xps_connection_t *connection, size_t len);
+bool connection_throttle(xps_connection_t *connection, bool reading);
+u_long connection_shape_wait(xps_connection_t *connection);
+void connection_rate_timer_handler(void *ptr);
 
 xps_connection_t *xps_connection_create(xps_core_t *core, u_int sock_fd) {
   assert(core != NULL);
 
   // Alloc memory for connection instance
-  xps_connection_t *connection = malloc(sizeof(xps_connection_t));
+  xps_pool_t *pool = core->loop->connection_pool;
+  xps_connection_t *connection = xps_pool_alloc(pool);
   if (connection == NULL) {
     logger(LOG_ERROR, "xps_connection_create()",
-           "malloc() failed for 'connection'");
+           "xps_pool_alloc() failed for 'connection'");
     return NULL;
   }
 
   // Create source instance
   xps_pipe_source_t *source =
-      xps_pipe_source_create((void *)connection, connection_source_handler,
+      xps_pipe_source_create(core, (void *)connection, connection_source_handler,
                              connection_source_close_handler);
   if (source == NULL) {
     logger(LOG_ERROR, "xps_connection_create()",
            "xps_pipe_source_create() failed");
-    free(connection);
+    xps_pool_free(pool, connection);
     return NULL;
   }
+  source->pause_cb = connection_source_pause_handler;
+  source->resume_cb = connection_source_resume_handler;
 
   // Create sink instance
   xps_pipe_sink_t *sink =
-      xps_pipe_sink_create((void *)connection, connection_sink_handler,
+      xps_pipe_sink_create(core, (void *)connection, connection_sink_handler,
                            connection_sink_close_handler);
   if (sink == NULL) {
     logger(LOG_ERROR, "xps_connection_create()",
            "xps_pipe_sink_create() failed");
     xps_pipe_source_destroy(source);
-    free(connection);
+    xps_pool_free(pool, connection);
     return NULL;
   }
 
@@ -50,6 +60,20 @@ xps_connection_t *xps_connection_create(xps_core_t *core, u_int sock_fd) {
   connection->sink = sink;
   connection->listener = NULL;
   connection->remote_ip = get_remote_ip(sock_fd);
+  connection->rate_limited = false;
+  connection->shape_rate = 0;
+  connection->shape_tokens = 0;
+  connection->shape_msec = 0;
+  connection->rate_timer = NULL;
+  connection->source_throttled = false;
+  connection->sink_throttled = false;
+  connection->tls = NULL;
+  connection->tls_done = false;
+  connection->tls_ktls_tx = false;
+  connection->tls_want_write = false;
+  connection->tls_write_len = 0;
+  connection->zerocopy = NULL;
+  connection->zerocopy_off = false;
 
   // Attach connection to loop
   if (xps_loop_attach(core->loop, sock_fd, EPOLLIN | EPOLLOUT | EPOLLET,
@@ -59,10 +83,14 @@ xps_connection_t *xps_connection_create(xps_core_t *core, u_int sock_fd) {
     logger(LOG_ERROR, "xps_connection_create()", "xps_loop_attach() failed");
     xps_pipe_source_destroy(source);
     xps_pipe_sink_destroy(sink);
-    free(connection);
+    xps_pool_free(pool, connection);
     return NULL;
   }
 
+  // Add connection to 'connections' list
+  vec_push(&(core->connections), connection);
+  core->n_connections++;
+
   logger(LOG_DEBUG, "xps_connection_create()", "created connection");
 
   return connection;
@@ -75,15 +103,55 @@ void xps_connection_destroy(xps_connection_t *connection) {
   if (xps_loop_detach(connection->core->loop, connection->sock_fd) != OK)
     logger(LOG_ERROR, "xps_connection_destroy()", "xps_loop_detach() failed");
 
+  // Set connection to NULL in 'connections' list
+  xps_core_t *core = connection->core;
+  for (int i = 0; i < core->connections.length; i++) {
+    if (core->connections.data[i] == connection) {
+      core->connections.data[i] = NULL;
+      core->n_null_connections++;
+      break;
+    }
+  }
+  core->n_connections--;
+  if (connection->listener != NULL)
+    connection->listener->n_connections--;
+
+  if (connection->rate_timer != NULL)
+    xps_loop_cancel_timer(core->loop, connection->rate_timer);
+
   xps_pipe_source_destroy(connection->source);
   xps_pipe_sink_destroy(connection->sink);
-  close(connection->sock_fd);
+  if (connection->tls != NULL)
+    xps_tls_close(connection);
+  // The socket stays open while the kernel still sends from pipe buffers
+  if (connection->zerocopy != NULL)
+    xps_zerocopy_destroy(connection->zerocopy);
+  else
+    close(connection->sock_fd);
   free(connection->remote_ip);
 
-  free(connection);
+  xps_pool_free(core->loop->connection_pool, connection);
   logger(LOG_DEBUG, "xps_connection_destroy()", "destroyed connection");
 }
 
+/**
+ * Caps the rate at which a connection writes to its socket
+ *
+ * A token bucket holding QOS_SHAPE_BURST_MSEC worth of bytes is refilled at
+ * rate, and the sink waits while it is empty.
+ *
+ * @param connection : connection to be shaped
+ * @param rate : bytes per second, 0 for no cap
+ */
+void xps_connection_shape(xps_connection_t *connection, u_long rate) {
+  assert(connection != NULL);
+
+  // Rates per second are thousandths per msec
+  connection->shape_rate = rate;
+  connection->shape_tokens = rate * QOS_SHAPE_BURST_MSEC;
+  connection->shape_msec = connection->core->loop->time_msec;
+}
+
 void connection_loop_read_handler(void *ptr) {
   assert(ptr != NULL);
   xps_connection_t *connection = ptr;
@@ -94,6 +162,8 @@ void connection_loop_write_handler(void *ptr) {
   assert(ptr != NULL);
   xps_connection_t *connection = ptr;
   connection->sink->ready = true;
+  if (connection->tls_want_write)
+    connection->source->ready = true;
 }
 
 void connection_loop_close_handler(void *ptr) {
@@ -102,32 +172,61 @@ void connection_loop_close_handler(void *ptr) {
   connection_close(connection, true);
 }
 
+void connection_loop_error_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_connection_t *connection = ptr;
+
+  if (xps_zerocopy_complete(connection->zerocopy) != OK)
+    connection_close(connection, true);
+}
+
 void connection_source_handler(void *ptr) {
   assert(ptr != NULL);
   xps_pipe_source_t *source = ptr;
   xps_connection_t *connection = source->ptr;
 
-  xps_buffer_t *buff = xps_buffer_create(DEFAULT_BUFFER_SIZE, 0, NULL);
-  if (buff == NULL) {
-    logger(LOG_DEBUG, "connection_source_handler()",
-           "xps_buffer_create() failed");
+  if (connection->rate_limited && connection_throttle(connection, true))
     return;
+
+  if (connection->tls != NULL && !connection->tls_done) {
+    int ret = xps_tls_handshake(connection);
+    if (ret == E_AGAIN) {
+      source->ready = false;
+      return;
+    }
+    if (ret != OK) {
+      connection_close(connection, false);
+      return;
+    }
   }
 
-  // Read from socket
-  long read_n = recv(connection->sock_fd, buff->data, buff->size, 0);
-  buff->len = read_n;
+  // Read into the loop's scratch buffer, xps_pipe_source_write() copies the
+  // bytes into a pooled buffer of the right size class
+  size_t read_size = source->pipe->read_size;
+  if (read_size > MAX_READ_SIZE)
+    read_size = MAX_READ_SIZE;
+  u_char *read_buff = connection->core->loop->read_buff;
 
-  // Socket would block
-  if (read_n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-    xps_buffer_destroy(buff);
-    connection->source->ready = false;
-    return;
+  // Read from socket
+  long read_n;
+  if (connection->tls != NULL) {
+    read_n = xps_tls_read(connection, read_buff, read_size);
+    if (read_n == E_AGAIN) {
+      connection->source->ready = false;
+      return;
+    }
+  } else {
+    read_n = recv(connection->sock_fd, read_buff, read_size, 0);
+
+    // Socket would block
+    if (read_n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      connection->source->ready = false;
+      return;
+    }
   }
 
   // Socket error
   if (read_n < 0) {
-    xps_buffer_destroy(buff);
     logger(LOG_ERROR, "connection_source_handler()", "recv() failed");
     connection_close(connection, false);
     return;
@@ -135,20 +234,28 @@ void connection_source_handler(void *ptr) {
 
   // Peer closed connection
   if (read_n == 0) {
-    xps_buffer_destroy(buff);
     connection_close(connection, true);
     return;
   }
 
-  if (xps_pipe_source_write(source, buff) != OK) {
+  if (connection->rate_limited)
+    xps_ratelimit_charge(connection->core->ratelimit, connection->rate_addr,
+                         connection->core->loop->time_msec, read_n);
+
+  xps_buffer_t buff = {.size = read_size,
+                       .len = read_n,
+                       .pos = read_buff,
+                       .data = read_buff,
+                       .size_class = -1,
+                       .refs = 1,
+                       .shared = NULL};
+
+  if (xps_pipe_source_write(source, &buff) != OK) {
     logger(LOG_ERROR, "connection_source_handler()",
            "xps_pipe_source_write() failed");
-    xps_buffer_destroy(buff);
     connection_close(connection, false);
     return;
   }
-
-  xps_buffer_destroy(buff);
 }
 
 void connection_source_close_handler(void *ptr) {
@@ -160,32 +267,95 @@ void connection_source_close_handler(void *ptr) {
     connection_close(connection, false);
 }
 
+void connection_source_pause_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_pipe_source_t *source = ptr;
+  xps_connection_t *connection = source->ptr;
+
+  // Pipe is full, stop watching for input until it drains
+  if (xps_loop_modify(connection->core->loop, connection->sock_fd,
+                      EPOLLOUT | EPOLLET) != OK)
+    logger(LOG_ERROR, "connection_source_pause_handler()",
+           "xps_loop_modify() failed");
+}
+
+void connection_source_resume_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_pipe_source_t *source = ptr;
+  xps_connection_t *connection = source->ptr;
+
+  // Re-arming reports data that arrived while input was disarmed
+  if (xps_loop_modify(connection->core->loop, connection->sock_fd,
+                      EPOLLIN | EPOLLOUT | EPOLLET) != OK)
+    logger(LOG_ERROR, "connection_source_resume_handler()",
+           "xps_loop_modify() failed");
+}
+
 void connection_sink_handler(void *ptr) {
   assert(ptr != NULL);
   xps_pipe_sink_t *sink = ptr;
   xps_connection_t *connection = sink->ptr;
 
-  xps_buffer_t *buff = xps_pipe_sink_read(sink, sink->pipe->buff_list->len);
-  if (buff == NULL) {
-    logger(LOG_ERROR, "connection_sink_handler()",
-           "xps_pipe_sink_read() failed");
+  // Nothing is sent before the handshake is done
+  if (connection->tls != NULL && !connection->tls_done) {
+    sink->ready = false;
     return;
   }
 
-  // Write to socket
-  int write_n = send(connection->sock_fd, buff->data, buff->len, MSG_NOSIGNAL);
-
-  xps_buffer_destroy(buff);
+  if ((connection->rate_limited || connection->shape_rate > 0) &&
+      connection_throttle(connection, false))
+    return;
 
-  // Socket would block
-  if (write_n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-    sink->ready = false;
+  // Write at most one iteration's byte budget per call, and no more than the
+  // shaping bucket holds
+  size_t len = xps_pipe_sink_len(sink);
+  if (len > connection->core->config->io_budget_bytes)
+    len = connection->core->config->io_budget_bytes;
+  if (connection->shape_rate > 0 && len > (size_t)connection->shape_tokens / 1000 + 1)
+    len = connection->shape_tokens / 1000 + 1;
+  if (len < connection->tls_write_len)
+    len = connection->tls_write_len;
+
+  // Gather the buffers in place, responses queued together go out in one write
+  struct iovec iov[SINK_MAX_IOV];
+  int n_iov = xps_pipe_sink_iov(sink, len, iov, SINK_MAX_IOV);
+  if (n_iov <= 0) {
+    logger(LOG_ERROR, "connection_sink_handler()",
+           "xps_pipe_sink_iov() failed");
     return;
   }
 
+  // Write to socket, with kTLS the kernel encrypts what is written to it
+  long write_n;
+  if (connection->tls != NULL && !connection->tls_ktls_tx) {
+    write_n = xps_tls_write(connection, iov, n_iov);
+    if (write_n == E_AGAIN) {
+      sink->ready = false;
+      return;
+    }
+  } else if (connection_zerocopy(connection, len)) {
+    write_n = xps_zerocopy_send(connection->zerocopy, sink, iov, n_iov);
+    if (write_n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS)) {
+      sink->ready = false;
+      return;
+    }
+  } else {
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n_iov;
+    write_n = sendmsg(connection->sock_fd, &msg, MSG_NOSIGNAL);
+
+    // Socket would block, or a TCP Fast Open upstream without a cookie is
+    // still connecting, see xps_sock_profile_connect()
+    if (write_n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS)) {
+      sink->ready = false;
+      return;
+    }
+  }
+
   // Socket error
   if (write_n < 0) {
-    logger(LOG_ERROR, "connection_sink_handler()", "send() failed");
+    logger(LOG_ERROR, "connection_sink_handler()", "sendmsg() failed");
     connection_close(connection, false);
     return;
   }
@@ -193,10 +363,16 @@ void connection_sink_handler(void *ptr) {
   if (write_n == 0)
     return;
 
+  if (connection->rate_limited)
+    xps_ratelimit_charge(connection->core->ratelimit, connection->rate_addr,
+                         connection->core->loop->time_msec, write_n);
+  if (connection->shape_rate > 0)
+    connection->shape_tokens -= (long)write_n * 1000;
+
   // Clear write_n length from pipe buff_list
   if (xps_pipe_sink_clear(sink, write_n) != OK)
     logger(LOG_ERROR, "connection_sink_handler()",
-           "failed to clear %d bytes from sink", write_n);
+           "failed to clear %ld bytes from sink", write_n);
 }
 
 void connection_sink_close_handler(void *ptr) {
@@ -208,9 +384,109 @@ void connection_sink_close_handler(void *ptr) {
     connection_close(connection, false);
 }
 
+/**
+ * Tells whether a write of len bytes goes out with MSG_ZEROCOPY, enabling it
+ * on the socket with the first one
+ *
+ * Small writes, TLS connections and connections the kernel copied for anyway
+ * are sent plainly. kTLS ones included: the kernel does not take MSG_ZEROCOPY
+ * on a kTLS socket.
+ */
+bool connection_zerocopy(xps_connection_t *connection, size_t len) {
+  xps_core_t *core = connection->core;
+
+  if (core->config->zerocopy_min == 0 || len < core->config->zerocopy_min ||
+      connection->zerocopy_off || connection->tls != NULL)
+    return false;
+  if (connection->zerocopy != NULL)
+    return !connection->zerocopy->copied;
+
+  connection->zerocopy = xps_zerocopy_create(core, connection->sock_fd);
+  if (connection->zerocopy == NULL ||
+      xps_loop_set_error_cb(core->loop, connection->sock_fd, connection_loop_error_handler) != OK) {
+    connection->zerocopy_off = true;
+    return false;
+  }
+  return true;
+}
+
 void connection_close(xps_connection_t *connection, bool peer_closed) {
   assert(connection != NULL);
   logger(LOG_INFO, "connection_close()",
          peer_closed ? "peer closed connection" : "closing connection");
   xps_connection_destroy(connection);
-}
\ No newline at end of file
+}
+
+/**
+ * Holds back the source or the sink of a connection whose client is over its
+ * byte rate, or the sink of a shaped connection that used up its bucket,
+ * until the timer makes it ready again
+ *
+ * @param connection : rate limited connection
+ * @param reading : true for the source, false for the sink
+ * @return : true if the caller must not do I/O now
+ */
+bool connection_throttle(xps_connection_t *connection, bool reading) {
+  xps_core_t *core = connection->core;
+
+  u_long wait_msec = 0;
+  if (connection->rate_limited)
+    wait_msec = xps_ratelimit_wait(core->ratelimit, connection->rate_addr, core->loop->time_msec);
+  if (!reading && connection->shape_rate > 0) {
+    u_long shape_msec = connection_shape_wait(connection);
+    if (shape_msec > wait_msec)
+      wait_msec = shape_msec;
+  }
+  if (wait_msec == 0)
+    return false;
+
+  if (reading) {
+    connection->source->ready = false;
+    connection->source_throttled = true;
+  } else {
+    connection->sink->ready = false;
+    connection->sink_throttled = true;
+  }
+
+  if (connection->rate_timer == NULL)
+    connection->rate_timer =
+        xps_loop_add_timer(core->loop, wait_msec, connection, connection_rate_timer_handler);
+
+  return true;
+}
+
+void connection_rate_timer_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_connection_t *connection = ptr;
+
+  connection->rate_timer = NULL;
+
+  // Handlers check the rate again and may throttle once more
+  if (connection->source_throttled)
+    connection->source->ready = true;
+  if (connection->sink_throttled)
+    connection->sink->ready = true;
+  connection->source_throttled = false;
+  connection->sink_throttled = false;
+}
+
+/**
+ * Refills the shaping bucket of a connection
+ *
+ * @return : msec until the sink may write again, 0 if it may write now
+ */
+u_long connection_shape_wait(xps_connection_t *connection) {
+  u_long now = connection->core->loop->time_msec;
+  long burst = connection->shape_rate * QOS_SHAPE_BURST_MSEC;
+
+  if (now > connection->shape_msec) {
+    connection->shape_tokens += (now - connection->shape_msec) * connection->shape_rate;
+    if (connection->shape_tokens > burst)
+      connection->shape_tokens = burst;
+    connection->shape_msec = now;
+  }
+
+  if (connection->shape_tokens > 0)
+    return 0;
+  return -connection->shape_tokens / connection->shape_rate + 1;
+}
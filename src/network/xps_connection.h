@@ -8,11 +8,27 @@ struct xps_connection_s {
   int sock_fd;
   xps_listener_t *listener;
   char *remote_ip;
+  bool rate_limited;   // Bytes count against the client's rate, see xps_ratelimit.h
+  u_char rate_addr[16];
+  u_long shape_rate;   // Bytes per second the sink may write, 0 for no cap
+  long shape_tokens;   // Thousandths of bytes the sink may write now
+  u_long shape_msec;   // Last refill of shape_tokens
+  loop_timer_t *rate_timer; // Makes throttled source and sink ready again
+  bool source_throttled;
+  bool sink_throttled;
+  SSL *tls;             // TLS state of a client of a TLS listener, NULL for plain TCP
+  bool tls_done;        // Handshake finished, the sink holds back until it is
+  bool tls_ktls_tx;     // Kernel encrypts, the sink writes plaintext to the socket
+  bool tls_want_write;  // Source waits for the socket to take handshake or read bytes
+  size_t tls_write_len; // Bytes a blocked SSL_write() must be retried with, see xps_tls_write()
+  xps_zerocopy_t *zerocopy; // Zerocopy sends of the sink, NULL before the first one
+  bool zerocopy_off;        // Socket does not support zerocopy sends
   xps_pipe_source_t *source;
   xps_pipe_sink_t *sink;
 };
 
 xps_connection_t *xps_connection_create(xps_core_t *core, u_int sock_fd);
 void xps_connection_destroy(xps_connection_t *connection);
+void xps_connection_shape(xps_connection_t *connection, u_long rate);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,426 @@
+#include "../xps.h"
+
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+void handover_accept_handler(void *ptr);
+void handover_ack_handler(void *ptr);
+void handover_timeout_handler(void *ptr);
+void handover_abort(xps_core_t *core);
+void handover_spawn(xps_core_t *core);
+char **handover_child_env(const char *upgrade_socket);
+void handover_free_env(char **envp);
+
+/**
+ * Starts an upgrade by listening on the upgrade socket and starting the new
+ * server process
+ *
+ * @param core : core whose listeners are to be handed over
+ * @return : OK on success and E_FAIL on error
+ */
+int xps_handover_start(xps_core_t *core) {
+  assert(core != NULL);
+
+  if (core->draining || core->handover_fd >= 0) {
+    logger(LOG_ERROR, "xps_handover_start()", "drain or upgrade already in progress");
+    return E_FAIL;
+  }
+
+  const char *path = core->config->upgrade_socket;
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    logger(LOG_ERROR, "xps_handover_start()", "upgrade socket path too long");
+    return E_FAIL;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  int sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (sock_fd < 0) {
+    logger(LOG_ERROR, "xps_handover_start()", "socket() failed");
+    perror("Error message");
+    return E_FAIL;
+  }
+
+  unlink(path);
+  if (bind(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock_fd, 1) < 0) {
+    logger(LOG_ERROR, "xps_handover_start()", "failed to listen on %s", path);
+    perror("Error message");
+    close(sock_fd);
+    return E_FAIL;
+  }
+
+  if (xps_loop_attach(core->loop, sock_fd, EPOLLIN, core, handover_accept_handler, NULL, NULL) !=
+      OK) {
+    logger(LOG_ERROR, "xps_handover_start()", "xps_loop_attach() failed");
+    close(sock_fd);
+    unlink(path);
+    return E_FAIL;
+  }
+
+  core->handover_fd = sock_fd;
+  core->handover_timer =
+      xps_loop_add_timer(core->loop, HANDOVER_TIMEOUT_MSEC, core, handover_timeout_handler);
+
+  handover_spawn(core);
+
+  logger(LOG_INFO, "xps_handover_start()", "waiting for new process on %s", path);
+
+  return OK;
+}
+
+/**
+ * Receives listening sockets from the old server process
+ *
+ * Received sockets are kept in core->inherited until they are claimed with
+ * xps_handover_take_fd(). The connection is kept open in core->handover_fd so
+ * that xps_handover_finish() can ack once the listeners are up.
+ *
+ * @param core : core of the new process
+ * @param path : path of the old process's upgrade socket
+ * @return : OK on success and E_FAIL on error
+ */
+int xps_handover_receive(xps_core_t *core, const char *path) {
+  assert(core != NULL);
+  assert(path != NULL);
+
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    logger(LOG_ERROR, "xps_handover_receive()", "upgrade socket path too long");
+    return E_FAIL;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  int sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock_fd < 0) {
+    logger(LOG_ERROR, "xps_handover_receive()", "socket() failed");
+    perror("Error message");
+    return E_FAIL;
+  }
+
+  if (connect(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    logger(LOG_ERROR, "xps_handover_receive()", "connect() to %s failed", path);
+    perror("Error message");
+    close(sock_fd);
+    return E_FAIL;
+  }
+
+  xps_handover_entry_t entries[MAX_HANDOVER_FDS];
+  char cmsg_buff[CMSG_SPACE(sizeof(int) * MAX_HANDOVER_FDS)];
+  struct iovec iov = {.iov_base = entries, .iov_len = sizeof(entries)};
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsg_buff;
+  msg.msg_controllen = sizeof(cmsg_buff);
+
+  long read_n = recvmsg(sock_fd, &msg, MSG_WAITALL);
+  if (read_n < 0 || read_n % sizeof(xps_handover_entry_t) != 0) {
+    logger(LOG_ERROR, "xps_handover_receive()", "recvmsg() failed");
+    close(sock_fd);
+    return E_FAIL;
+  }
+
+  int n_entries = read_n / sizeof(xps_handover_entry_t);
+  int n_fds = 0;
+  int *fds = NULL;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+    fds = (int *)CMSG_DATA(cmsg);
+    n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+  }
+
+  for (int i = 0; i < n_fds; i++) {
+    // Entries and fds are sent in the same order
+    if (i >= n_entries) {
+      close(fds[i]);
+      continue;
+    }
+
+    xps_handover_entry_t *entry = malloc(sizeof(xps_handover_entry_t));
+    if (entry == NULL) {
+      logger(LOG_ERROR, "xps_handover_receive()", "malloc() failed for 'entry'");
+      close(fds[i]);
+      continue;
+    }
+    *entry = entries[i];
+    entry->host[HANDOVER_HOST_LEN - 1] = '\0';
+    entry->fd = fds[i];
+    vec_push(&(core->inherited), entry);
+  }
+
+  core->handover_fd = sock_fd;
+
+  logger(LOG_INFO, "xps_handover_receive()", "received %d listeners", n_fds);
+
+  return OK;
+}
+
+/**
+ * Claims an inherited listening socket
+ *
+ * @param core : core of the new process
+ * @param host : host of the listener
+ * @param port : port of the listener
+ * @return : socket FD, or -1 if no socket for host and port was inherited
+ */
+int xps_handover_take_fd(xps_core_t *core, const char *host, u_int port) {
+  assert(core != NULL);
+  assert(host != NULL);
+
+  for (int i = 0; i < core->inherited.length; i++) {
+    xps_handover_entry_t *entry = core->inherited.data[i];
+    if (entry->port == port && strcmp(entry->host, host) == 0) {
+      int fd = entry->fd;
+      vec_splice(&(core->inherited), i, 1);
+      free(entry);
+      return fd;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Closes unclaimed inherited sockets and acks the old process
+ *
+ * @param core : core of the new process
+ */
+void xps_handover_finish(xps_core_t *core) {
+  assert(core != NULL);
+
+  for (int i = 0; i < core->inherited.length; i++) {
+    xps_handover_entry_t *entry = core->inherited.data[i];
+    logger(LOG_WARNING, "xps_handover_finish()", "closing unused listener %s:%u", entry->host,
+           entry->port);
+    close(entry->fd);
+    free(entry);
+  }
+  vec_clear(&(core->inherited));
+
+  if (core->handover_fd < 0)
+    return;
+
+  if (send(core->handover_fd, "1", 1, MSG_NOSIGNAL) != 1)
+    logger(LOG_ERROR, "xps_handover_finish()", "failed to ack old process");
+
+  close(core->handover_fd);
+  core->handover_fd = -1;
+}
+
+void handover_accept_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_core_t *core = ptr;
+
+  int conn_fd = accept(core->handover_fd, NULL, NULL);
+  if (conn_fd < 0)
+    return;
+
+  // Only one new process is served per upgrade
+  xps_loop_detach(core->loop, core->handover_fd);
+  close(core->handover_fd);
+  unlink(core->config->upgrade_socket);
+  core->handover_fd = conn_fd;
+
+  xps_handover_entry_t entries[MAX_HANDOVER_FDS];
+  int fds[MAX_HANDOVER_FDS];
+  int n = 0;
+  for (int i = 0; i < core->listeners.length && n < MAX_HANDOVER_FDS; i++) {
+    xps_listener_t *listener = core->listeners.data[i];
+    if (listener == NULL)
+      continue;
+
+    memset(&entries[n], 0, sizeof(xps_handover_entry_t));
+    strncpy(entries[n].host, listener->host, HANDOVER_HOST_LEN - 1);
+    entries[n].port = listener->port;
+    entries[n].fd = -1;
+    fds[n] = listener->sock_fd;
+    n++;
+  }
+
+  char cmsg_buff[CMSG_SPACE(sizeof(int) * MAX_HANDOVER_FDS)];
+  memset(cmsg_buff, 0, sizeof(cmsg_buff));
+  struct iovec iov = {.iov_base = entries, .iov_len = sizeof(xps_handover_entry_t) * n};
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (n > 0) {
+    msg.msg_control = cmsg_buff;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n);
+  }
+
+  // A zero-length message would look like EOF to the new process
+  if (n == 0 || sendmsg(conn_fd, &msg, MSG_NOSIGNAL) < 0) {
+    logger(LOG_ERROR, "handover_accept_handler()", "failed to send listeners");
+    close(conn_fd);
+    core->handover_fd = -1;
+    handover_abort(core);
+    return;
+  }
+
+  // Wait for the new process to take over before draining
+  if (xps_loop_attach(core->loop, conn_fd, EPOLLIN, core, handover_ack_handler, NULL,
+                      handover_ack_handler) != OK) {
+    logger(LOG_ERROR, "handover_accept_handler()", "xps_loop_attach() failed");
+    close(conn_fd);
+    core->handover_fd = -1;
+    handover_abort(core);
+    return;
+  }
+
+  logger(LOG_INFO, "handover_accept_handler()", "sent %d listeners to new process", n);
+}
+
+void handover_ack_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_core_t *core = ptr;
+
+  if (core->handover_fd < 0)
+    return;
+
+  char ack;
+  long read_n = recv(core->handover_fd, &ack, 1, MSG_DONTWAIT);
+  if (read_n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return;
+
+  if (read_n != 1) {
+    logger(LOG_ERROR, "handover_ack_handler()", "new process failed to take over");
+    handover_abort(core);
+    return;
+  }
+
+  xps_loop_detach(core->loop, core->handover_fd);
+  close(core->handover_fd);
+  core->handover_fd = -1;
+  if (core->handover_timer != NULL) {
+    xps_loop_cancel_timer(core->loop, core->handover_timer);
+    core->handover_timer = NULL;
+  }
+
+  logger(LOG_INFO, "handover_ack_handler()", "new process took over, draining");
+  xps_core_drain(core);
+}
+
+void handover_timeout_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_core_t *core = ptr;
+
+  core->handover_timer = NULL;
+  logger(LOG_ERROR, "handover_timeout_handler()", "upgrade timed out");
+  handover_abort(core);
+}
+
+/**
+ * Gives up an upgrade and keeps serving with the current process
+ */
+void handover_abort(xps_core_t *core) {
+  if (core->handover_fd >= 0) {
+    xps_loop_detach(core->loop, core->handover_fd);
+    close(core->handover_fd);
+    core->handover_fd = -1;
+  }
+  unlink(core->config->upgrade_socket);
+
+  if (core->handover_timer != NULL) {
+    xps_loop_cancel_timer(core->loop, core->handover_timer);
+    core->handover_timer = NULL;
+  }
+}
+
+/**
+ * Starts the new server binary with XPS_INHERIT_SOCKET set
+ *
+ * The child closes all inherited FDs before exec, so that client sockets are
+ * not kept open by the new process. Listening sockets reach it over the
+ * upgrade socket instead.
+ */
+void handover_spawn(xps_core_t *core) {
+  char **argv = core->config->argv;
+  if (argv == NULL || argv[0] == NULL) {
+    logger(LOG_WARNING, "handover_spawn()", "no argv, start the new process manually");
+    return;
+  }
+
+  // Worker threads may hold the allocator's locks at fork(), so the child
+  // must not allocate: its environment is built here
+  char **envp = handover_child_env(core->config->upgrade_socket);
+  if (envp == NULL) {
+    logger(LOG_ERROR, "handover_spawn()", "handover_child_env() failed");
+    return;
+  }
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    logger(LOG_ERROR, "handover_spawn()", "fork() failed");
+    perror("Error message");
+    handover_free_env(envp);
+    return;
+  }
+
+  if (pid > 0) {
+    handover_free_env(envp);
+    logger(LOG_INFO, "handover_spawn()", "started new process %d", pid);
+    return;
+  }
+
+  // Child
+  if (syscall(SYS_close_range, 3, ~0U, 0) < 0) {
+    for (int fd = 3; fd < getdtablesize(); fd++)
+      close(fd);
+  }
+
+  execve(argv[0], argv, envp);
+
+  perror("execv() failed");
+  _exit(127);
+}
+
+/**
+ * Copies the environment with XPS_INHERIT_SOCKET set to the upgrade socket
+ *
+ * @return : NULL terminated array to be freed with handover_free_env(), NULL on failure
+ */
+char **handover_child_env(const char *upgrade_socket) {
+  extern char **environ;
+  const char *name = "XPS_INHERIT_SOCKET=";
+  size_t name_len = strlen(name);
+
+  int n_vars = 0;
+  while (environ[n_vars] != NULL)
+    n_vars++;
+
+  char **envp = calloc(n_vars + 2, sizeof(char *));
+  if (envp == NULL)
+    return NULL;
+
+  int n = 0;
+  for (int i = 0; i < n_vars; i++) {
+    if (strncmp(environ[i], name, name_len) == 0)
+      continue;
+    if ((envp[n++] = strdup(environ[i])) == NULL) {
+      handover_free_env(envp);
+      return NULL;
+    }
+  }
+  envp[n] = malloc(name_len + strlen(upgrade_socket) + 1);
+  if (envp[n] == NULL) {
+    handover_free_env(envp);
+    return NULL;
+  }
+  sprintf(envp[n], "%s%s", name, upgrade_socket);
+
+  return envp;
+}
+
+void handover_free_env(char **envp) {
+  for (int i = 0; envp[i] != NULL; i++)
+    free(envp[i]);
+  free(envp);
+}
@@ -0,0 +1,29 @@
+#ifndef XPS_HANDOVER_H
+#define XPS_HANDOVER_H
+
+#include "../xps.h"
+
+/*
+ * Listener handover for zero-downtime upgrades.
+ *
+ * The old process listens on config->upgrade_socket and starts the new binary
+ * with XPS_INHERIT_SOCKET set to that path. The new process connects and
+ * receives all listening sockets with SCM_RIGHTS, picks them up instead of
+ * binding again and acks. Only after the ack does the old process close its
+ * copies and drain, so the sockets and their backlogs are never closed.
+ */
+
+struct xps_handover_entry_s {
+  char host[HANDOVER_HOST_LEN];
+  u_int port;
+  int fd;
+};
+
+typedef struct xps_handover_entry_s xps_handover_entry_t;
+
+int xps_handover_start(xps_core_t *core);
+int xps_handover_receive(xps_core_t *core, const char *path);
+int xps_handover_take_fd(xps_core_t *core, const char *host, u_int port);
+void xps_handover_finish(xps_core_t *core);
+
+#endif
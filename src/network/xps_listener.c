@@ -1,17 +1,30 @@
 #include "../xps.h"
 
-void listener_connection_handler(void *ptr);
+bool listener_is_full(xps_listener_t *listener);
+void listener_pause(xps_listener_t *listener);
+void listener_resume_handler(void *ptr);
+void listener_reject(xps_listener_t *listener);
+void listener_unlink_stale(struct sockaddr_un *addr);
 
 xps_listener_t *xps_listener_create(xps_core_t *core, const char *host,
                                     u_int port) {
   assert(host != NULL);
   assert(is_valid_port(port)); // Will be explained later
 
+  // Setup listener address
+  struct addrinfo *addr_info =
+      xps_getaddrinfo(host, port); // Will be explained later
+  if (addr_info == NULL) {
+    logger(LOG_ERROR, "xps_listener_create()", "xps_getaddrinfo() failed");
+    return NULL;
+  }
+
   // Create socket instance
-  int sock_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  int sock_fd = socket(addr_info->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
   if (sock_fd < 0) {
     logger(LOG_ERROR, "xps_listener_create()", "socket() failed");
     perror("Error message");
+    xps_freeaddrinfo(addr_info);
     return NULL;
   }
 
@@ -21,61 +34,127 @@ xps_listener_t *xps_listener_create(xps_core_t *core, const char *host,
   if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0) {
     logger(LOG_ERROR, "xps_listener_create()", "setsockopt() failed");
     perror("Error message");
+    xps_freeaddrinfo(addr_info);
     close(sock_fd);
     return NULL;
   }
+  bool tcp = addr_info->ai_family != AF_UNIX;
 
-  // Setup listener address
-  struct addrinfo *addr_info =
-      xps_getaddrinfo(host, port); // Will be explained later
-  if (addr_info == NULL) {
-    logger(LOG_ERROR, "xps_listener_create()", "xps_getaddrinfo() failed");
+  // Processes of a reuseport group listen on the port side by side
+  u_int group = tcp ? core->config->reuseport_group : 0;
+  if (group > 0 && setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0) {
+    logger(LOG_ERROR, "xps_listener_create()", "setsockopt() failed for SO_REUSEPORT");
+    perror("Error message");
+    xps_freeaddrinfo(addr_info);
     close(sock_fd);
     return NULL;
   }
 
+  // A unix socket file left by an earlier process would fail bind(). It is
+  // not removed on exit, as a process taking over the listener may still use it.
+  if (addr_info->ai_family == AF_UNIX)
+    listener_unlink_stale((struct sockaddr_un *)addr_info->ai_addr);
+
   // Binding to port
   if (bind(sock_fd, addr_info->ai_addr, addr_info->ai_addrlen) < 0) {
     logger(LOG_ERROR, "xps_listener_create()", "failed to bind() to %s:%u",
            host, port);
     perror("Error message");
-    freeaddrinfo(addr_info); // Will be explained later
+    xps_freeaddrinfo(addr_info); // Will be explained later
     close(sock_fd);
     return NULL;
   }
-  freeaddrinfo(addr_info); // Will be explained later
+  xps_freeaddrinfo(addr_info); // Will be explained later
 
   // Listening on port
-  if (listen(sock_fd, DEFAULT_BACKLOG) < 0) {
+  xps_sock_profile_t *profile = xps_sock_profile_listener(core, port);
+  xps_sock_profile_listen(profile, sock_fd, tcp);
+  if (listen(sock_fd, profile->backlog) < 0) {
     logger(LOG_ERROR, "xps_listener_create()", "listen() failed");
     perror("Error message");
     close(sock_fd);
     return NULL;
   }
 
+  // Without steering the group spreads connections by hash
+  if (group > 0 && xps_sock_reuseport_steer(sock_fd, group) != OK)
+    logger(LOG_WARNING, "xps_listener_create()", "connections on port %u are not steered by CPU",
+           port);
+
+  xps_listener_t *listener = xps_listener_create_from_fd(core, host, port, sock_fd);
+  if (listener == NULL) {
+    logger(LOG_ERROR, "xps_listener_create()", "xps_listener_create_from_fd() failed");
+    close(sock_fd);
+    return NULL;
+  }
+
+  return listener;
+}
+
+/**
+ * Creates a listener instance for an already listening socket
+ *
+ * Used for sockets created by xps_listener_create() and for sockets handed
+ * over by a previous server process during an upgrade.
+ *
+ * @param core : core to which listener belongs
+ * @param host : host the socket is bound to
+ * @param port : port the socket is bound to
+ * @param sock_fd : listening socket, owned by the listener on success
+ * @return : listener instance, NULL on failure
+ */
+xps_listener_t *xps_listener_create_from_fd(xps_core_t *core, const char *host, u_int port,
+                                            u_int sock_fd) {
+  assert(core != NULL);
+  assert(host != NULL);
+
   // Create & allocate memory for a listener instance
   xps_listener_t *listener = malloc(sizeof(xps_listener_t));
   if (listener == NULL) {
-    logger(LOG_ERROR, "xps_listener_create()",
+    logger(LOG_ERROR, "xps_listener_create_from_fd()",
            "malloc() failed for 'listener'");
-    close(sock_fd);
     return NULL;
   }
 
   // Init values
   listener->core = core;
-  listener->host = host;
+  listener->host = strdup(host);
+  if (listener->host == NULL) {
+    logger(LOG_ERROR, "xps_listener_create_from_fd()", "strdup() failed for 'host'");
+    free(listener);
+    return NULL;
+  }
   listener->port = port;
   listener->sock_fd = sock_fd;
+  listener->ready = false;
+  listener->paused = false;
+  listener->resume_timer = NULL;
+  listener->tls = xps_config_tls(core->config, port);
+  listener->profile = xps_sock_profile_listener(core, port);
+  xps_config_qos(core->config, port, &(listener->weight), &(listener->conn_rate));
+  listener->n_connections = 0;
+  listener->n_accepted = 0;
+  listener->n_rejected = 0;
+  listener->n_shed = 0;
+  listener->n_limited = 0;
+  listener->n_paused = 0;
 
   // Attach listener to loop
-  xps_loop_attach(core->loop, sock_fd, EPOLLIN | EPOLLET, listener,
-                  listener_connection_handler, NULL, NULL);
+  if (xps_loop_attach(core->loop, sock_fd, EPOLLIN | EPOLLET, listener,
+                      xps_listener_connection_handler, NULL, NULL) != OK) {
+    logger(LOG_ERROR, "xps_listener_create_from_fd()", "xps_loop_attach() failed");
+    free(listener->host);
+    free(listener);
+    return NULL;
+  }
+
+  // Connections may already be queued on a handed over socket
+  listener->ready = true;
 
   // Add listener to 'listeners' list
   vec_push(&(core->listeners), listener);
 
-  logger(LOG_DEBUG, "xps_listener_create()", "created listener on port %d",
+  logger(LOG_DEBUG, "xps_listener_create_from_fd()", "created listener on port %d",
          port);
 
   return listener;
@@ -89,15 +168,36 @@ void xps_listener_destroy(xps_listener_t *listener) {
   // Detach listener from loop
   xps_loop_detach(listener->core->loop, listener->sock_fd);
 
+  if (listener->resume_timer != NULL)
+    xps_loop_cancel_timer(listener->core->loop, listener->resume_timer);
+
   // Set listener to NULL in 'listeners' list
   for (int i = 0; i < (listener->core)->listeners.length; i++) {
     xps_listener_t *curr = (listener->core)->listeners.data[i];
     if (curr == listener) {
       (listener->core)->listeners.data[i] = NULL;
+      (listener->core)->n_null_listeners++;
       break;
     }
   }
 
+  // Connections may outlive their listener
+  for (int i = 0; i < (listener->core)->connections.length; i++) {
+    xps_connection_t *connection = (listener->core)->connections.data[i];
+    if (connection != NULL && connection->listener == listener)
+      connection->listener = NULL;
+  }
+  for (int i = 0; i < (listener->core)->sessions.length; i++) {
+    xps_session_t *session = (listener->core)->sessions.data[i];
+    if (session != NULL && session->listener == listener)
+      session->listener = NULL;
+  }
+  for (int i = 0; i < (listener->core)->h2s.length; i++) {
+    xps_h2_t *h2 = (listener->core)->h2s.data[i];
+    if (h2 != NULL && h2->listener == listener)
+      h2->listener = NULL;
+  }
+
   // Close socket
   close(listener->sock_fd);
 
@@ -105,22 +205,67 @@ void xps_listener_destroy(xps_listener_t *listener) {
          listener->port);
 
   // Free listener instance
+  free(listener->host);
   free(listener);
 }
 
-void listener_connection_handler(void *ptr) {
+/**
+ * Accepts pending connections on a listener
+ *
+ * Called on EPOLLIN and by the loop while listener->ready is set. At most
+ * config->accept_budget connections are accepted per call so that an accept
+ * flood cannot delay established traffic. If the budget runs out the listener
+ * stays ready and the loop continues accepting in its next iteration, since an
+ * edge-triggered listener is not reported again for the remaining backlog.
+ *
+ * Admission control happens here as well. A listener at its connection limit
+ * is paused and left to queue in the kernel backlog. When FDs run out the
+ * reserve FD is given up to accept-and-close the pending connection, so that
+ * clients fail fast instead of the backlog stalling. While loop lag is above
+ * config->max_loop_lag_msec new connections are shed the same way, and so are
+ * connections from client IPs over their connection rate.
+ *
+ * @param ptr : listener instance
+ */
+void xps_listener_connection_handler(void *ptr) {
   assert(ptr != NULL);
   xps_listener_t *listener = ptr;
+  xps_config_t *config = listener->core->config;
+
+  if (listener->paused)
+    return;
+
+  listener->ready = true;
+
+  for (u_int n_accepts = 0; n_accepts < config->accept_budget; n_accepts++) {
+    if (listener_is_full(listener)) {
+      listener_pause(listener);
+      return;
+    }
 
-  while (1) {
-    struct sockaddr conn_addr;
+    struct sockaddr_storage conn_addr;
     socklen_t conn_addr_len = sizeof(conn_addr);
 
     // Accepting connection
-    int conn_sock_fd = accept(listener->sock_fd, &conn_addr, &conn_addr_len);
+    int conn_sock_fd = accept4(listener->sock_fd, (struct sockaddr *)&conn_addr, &conn_addr_len,
+                               SOCK_NONBLOCK);
 
-    if (conn_sock_fd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    if (conn_sock_fd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      listener->ready = false;
       break;
+    }
+
+    if (conn_sock_fd < 0 && (errno == EMFILE || errno == ENFILE)) {
+      logger(LOG_WARNING, "xps_listener_connection_handler()",
+             "out of file descriptors on port %u", listener->port);
+      listener_reject(listener);
+      listener_pause(listener);
+      return;
+    }
+
+    // Connection was reset while in the backlog
+    if (conn_sock_fd < 0 && (errno == ECONNABORTED || errno == EINTR))
+      continue;
 
     if (conn_sock_fd < 0) {
       logger(LOG_ERROR, "xps_listener_connection_handler()", "accept() failed");
@@ -128,13 +273,31 @@ void listener_connection_handler(void *ptr) {
       return;
     }
 
-    if (make_socket_non_blocking(conn_sock_fd) != OK) {
-      logger(LOG_ERROR, "xps_listener_create()",
-             "make_socket_non_blocking() failed");
+    // Shed load while the loop is overloaded
+    if (config->max_loop_lag_msec > 0 &&
+        listener->core->loop->lag_msec > config->max_loop_lag_msec) {
       close(conn_sock_fd);
-      return;
+      listener->n_shed++;
+      continue;
     }
 
+    // Address from accept() keys the client's buckets, no getpeername() needed
+    // Unix socket peers have no address to tell them apart and are not limited
+    xps_ratelimit_t *ratelimit = listener->core->ratelimit;
+    if (conn_addr.ss_family == AF_UNIX)
+      ratelimit = NULL;
+    u_char rate_addr[16];
+    if (ratelimit != NULL) {
+      xps_ratelimit_addr((struct sockaddr *)&conn_addr, rate_addr);
+      if (!xps_ratelimit_accept(ratelimit, rate_addr, listener->core->loop->time_msec)) {
+        close(conn_sock_fd);
+        listener->n_limited++;
+        continue;
+      }
+    }
+
+    xps_sock_profile_accepted(listener->profile, conn_sock_fd, conn_addr.ss_family != AF_UNIX);
+
     // Creating connection instance
     xps_connection_t *client = xps_connection_create(
         listener->core, conn_sock_fd); // Will be implemented later
@@ -145,21 +308,34 @@ void listener_connection_handler(void *ptr) {
       return;
     }
     client->listener = listener;
+    client->sink->weight = listener->weight;
+    if (listener->conn_rate > 0)
+      xps_connection_shape(client, listener->conn_rate);
+    if (ratelimit != NULL && ratelimit->byte_rate > 0) {
+      memcpy(client->rate_addr, rate_addr, 16);
+      client->rate_limited = true;
+    }
+    listener->n_connections++;
+    listener->n_accepted++;
+
+    // Handshake runs in the connection's source handler before the pipe sees
+    // any bytes
+    if (listener->tls && xps_tls_accept(client) != OK) {
+      logger(LOG_ERROR, "xps_listener_connection_handler()", "xps_tls_accept() failed");
+      xps_connection_destroy(client);
+      continue;
+    }
 
     // TEMP
     if (listener->port == 8001) {
-      /* create upstream connection */
-      xps_connection_t *upstream =
-          xps_upstream_create(listener->core, listener->host, 3000);
-      upstream->listener = listener;
-      /*create pipe connection to  client source and upstream sink for the
-       * listener*/
-      xps_pipe_create(listener->core, DEFAULT_PIPE_BUFF_THRESH, client->source,
-                      upstream->sink);
-      /*create pipe connection to upstream source and client sink for the
-       * listener*/
-      xps_pipe_create(listener->core, DEFAULT_PIPE_BUFF_THRESH,
-                      upstream->source, client->sink);
+      /* proxy to upstream through a session, which answers from the cache
+       * where it can */
+      if (xps_session_create(listener->core, client) == NULL) {
+        logger(LOG_ERROR, "xps_listener_connection_handler()",
+               "xps_session_create() failed");
+        xps_connection_destroy(client);
+        continue;
+      }
     } else {
       xps_pipe_create(listener->core, DEFAULT_PIPE_BUFF_THRESH, client->source,
                       client->sink);
@@ -167,4 +343,131 @@ void listener_connection_handler(void *ptr) {
 
     logger(LOG_INFO, "xps_listener_connection_handler()", "new connection");
   }
+}
+
+/**
+ * Checks whether the listener or the core reached its connection limit
+ */
+bool listener_is_full(xps_listener_t *listener) {
+  xps_config_t *config = listener->core->config;
+
+  if (config->max_connections > 0 &&
+      listener->core->n_connections >= config->max_connections)
+    return true;
+
+  if (config->listener_max_connections > 0 &&
+      listener->n_connections >= config->listener_max_connections)
+    return true;
+
+  return false;
+}
+
+/**
+ * Stops watching the listener for new connections and retries after
+ * LISTENER_PAUSE_MSEC
+ */
+void listener_pause(xps_listener_t *listener) {
+  if (listener->paused)
+    return;
+
+  if (xps_loop_modify(listener->core->loop, listener->sock_fd, EPOLLET) != OK) {
+    logger(LOG_ERROR, "listener_pause()", "xps_loop_modify() failed");
+    return;
+  }
+
+  listener->paused = true;
+  listener->ready = false;
+  listener->n_paused++;
+  listener->resume_timer = xps_loop_add_timer(listener->core->loop, LISTENER_PAUSE_MSEC,
+                                              listener, listener_resume_handler);
+
+  logger(LOG_DEBUG, "listener_pause()", "paused listener on port %u", listener->port);
+}
+
+void listener_resume_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_listener_t *listener = ptr;
+
+  listener->resume_timer = NULL;
+
+  // Still at the limit, check again later
+  if (listener_is_full(listener)) {
+    listener->resume_timer = xps_loop_add_timer(listener->core->loop, LISTENER_PAUSE_MSEC,
+                                                listener, listener_resume_handler);
+    return;
+  }
+
+  // Re-arming reports connections that queued up while paused
+  if (xps_loop_modify(listener->core->loop, listener->sock_fd, EPOLLIN | EPOLLET) != OK) {
+    logger(LOG_ERROR, "listener_resume_handler()", "xps_loop_modify() failed");
+    return;
+  }
+
+  listener->paused = false;
+  listener->ready = true;
+
+  logger(LOG_DEBUG, "listener_resume_handler()", "resumed listener on port %u", listener->port);
+}
+
+/**
+ * Accepts and closes pending connections while out of file descriptors
+ *
+ * The reserve FD is closed to make room for one accept(), the accepted
+ * connection is closed and the reserve FD is opened again.
+ */
+void listener_reject(xps_listener_t *listener) {
+  xps_core_t *core = listener->core;
+
+  for (u_int i = 0; i < core->config->accept_budget && core->reserve_fd >= 0; i++) {
+    close(core->reserve_fd);
+    int conn_sock_fd = accept(listener->sock_fd, NULL, NULL);
+    if (conn_sock_fd >= 0) {
+      close(conn_sock_fd);
+      listener->n_rejected++;
+    }
+    core->reserve_fd = open("/dev/null", O_RDONLY);
+
+    if (conn_sock_fd < 0)
+      break;
+  }
+}
+
+/**
+ * Removes the file of a unix socket path if it is a socket nobody listens on
+ */
+void listener_unlink_stale(struct sockaddr_un *addr) {
+  // Abstract names have no file
+  if (addr->sun_path[0] == '\0')
+    return;
+
+  struct stat st;
+  if (stat(addr->sun_path, &st) != 0 || !S_ISSOCK(st.st_mode))
+    return;
+
+  int sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock_fd < 0)
+    return;
+  bool in_use = connect(sock_fd, (struct sockaddr *)addr, sizeof(struct sockaddr_un)) == 0;
+  close(sock_fd);
+
+  if (!in_use && unlink(addr->sun_path) == 0)
+    logger(LOG_DEBUG, "listener_unlink_stale()", "removed stale socket %s", addr->sun_path);
+}
+
+void xps_listener_log_stats(xps_core_t *core) {
+  assert(core != NULL);
+
+  for (int i = 0; i < core->listeners.length; i++) {
+    xps_listener_t *listener = core->listeners.data[i];
+    if (listener == NULL)
+      continue;
+
+    logger(LOG_INFO, "xps_listener_log_stats()",
+           "port %u%s%s (%s): connections %u, accepted %lu, rejected %lu, shed %lu, limited %lu, paused %lu%s",
+           listener->port, is_unix_host(listener->host) ? " on " : "",
+           is_unix_host(listener->host) ? listener->host : "", listener->profile->name,
+           listener->n_connections, listener->n_accepted,
+           listener->n_rejected, listener->n_shed, listener->n_limited, listener->n_paused,
+           listener->paused ? " (paused)" : "");
+  }
 }
\ No newline at end of file
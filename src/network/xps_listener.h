@@ -5,12 +5,29 @@
 
 struct xps_listener_s {
   xps_core_t *core;
-  const char *host;
+  char *host; // IPv4 host or unix socket, see is_unix_host()
   u_int port;
   u_int sock_fd;
+  bool ready; // Pending connections may be left after an accept budget ran out
+  bool paused; // EPOLLIN disarmed by admission control
+  loop_timer_t *resume_timer;
+  bool tls;  // Clients speak TLS, see xps_tls.h
+  xps_sock_profile_t *profile; // Socket tuning of the listener and its connections
+  u_int weight;     // QoS weight of sinks of this listener's connections
+  u_long conn_rate; // Bytes per second each client connection may write, 0 for no cap
+  u_int n_connections; // Client and upstream connections opened for this listener
+  u_long n_accepted;
+  u_long n_rejected; // Accepted and closed because FDs ran out
+  u_long n_shed;     // Accepted and closed because of loop lag
+  u_long n_limited;  // Accepted and closed because the client IP is over its rate
+  u_long n_paused;
 };
 
 xps_listener_t *xps_listener_create(xps_core_t *core, const char *host, u_int port);
+xps_listener_t *xps_listener_create_from_fd(xps_core_t *core, const char *host, u_int port,
+                                            u_int sock_fd);
 void xps_listener_destroy(xps_listener_t *listener);
+void xps_listener_connection_handler(void *ptr);
+void xps_listener_log_stats(xps_core_t *core);
 
 #endif
\ No newline at end of file
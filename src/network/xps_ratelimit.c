@@ -0,0 +1,288 @@
+#include "../xps.h"
+
+u_long ratelimit_hash(const u_char addr[16]);
+xps_ratelimit_entry_t *ratelimit_find(xps_ratelimit_t *ratelimit, const u_char addr[16],
+                                      u_long now_msec, bool insert);
+bool ratelimit_expired(xps_ratelimit_t *ratelimit, xps_ratelimit_entry_t *entry, u_long now_msec);
+void ratelimit_refill(xps_ratelimit_t *ratelimit, xps_ratelimit_entry_t *entry, u_long now_msec);
+int ratelimit_rebuild(xps_ratelimit_t *ratelimit, u_long now_msec);
+
+/**
+ * Creates the rate limiter of a core
+ *
+ * @param config : rates and bursts are read from here
+ * @return : rate limiter, NULL on failure
+ */
+xps_ratelimit_t *xps_ratelimit_create(xps_config_t *config) {
+  assert(config != NULL);
+
+  xps_ratelimit_t *ratelimit = malloc(sizeof(xps_ratelimit_t));
+  if (ratelimit == NULL) {
+    logger(LOG_ERROR, "xps_ratelimit_create()", "malloc() failed for 'ratelimit'");
+    return NULL;
+  }
+
+  ratelimit->entries = calloc(RATELIMIT_MIN_ENTRIES, sizeof(xps_ratelimit_entry_t));
+  if (ratelimit->entries == NULL) {
+    logger(LOG_ERROR, "xps_ratelimit_create()", "calloc() failed for 'entries'");
+    free(ratelimit);
+    return NULL;
+  }
+
+  // Init values
+  ratelimit->capacity = RATELIMIT_MIN_ENTRIES;
+  ratelimit->n_used = 0;
+  ratelimit->conn_rate = config->rate_conns;
+  ratelimit->conn_burst = config->rate_conns_burst > 0 ? config->rate_conns_burst : config->rate_conns;
+  ratelimit->byte_rate = config->rate_bytes;
+  ratelimit->byte_burst = config->rate_bytes_burst > 0 ? config->rate_bytes_burst : config->rate_bytes;
+  ratelimit->n_rejected = 0;
+  ratelimit->n_throttled = 0;
+
+  logger(LOG_DEBUG, "xps_ratelimit_create()", "created ratelimit");
+
+  return ratelimit;
+}
+
+void xps_ratelimit_destroy(xps_ratelimit_t *ratelimit) {
+  assert(ratelimit != NULL);
+
+  free(ratelimit->entries);
+  free(ratelimit);
+
+  logger(LOG_DEBUG, "xps_ratelimit_destroy()", "destroyed ratelimit");
+}
+
+/**
+ * Fills the 16 byte key of a socket address, IPv4 as IPv4-mapped IPv6
+ */
+void xps_ratelimit_addr(const struct sockaddr *sock_addr, u_char addr[16]) {
+  assert(sock_addr != NULL);
+
+  memset(addr, 0, 16);
+  if (sock_addr->sa_family == AF_INET) {
+    addr[10] = 0xff;
+    addr[11] = 0xff;
+    memcpy(addr + 12, &(((const struct sockaddr_in *)sock_addr)->sin_addr), 4);
+  } else if (sock_addr->sa_family == AF_INET6)
+    memcpy(addr, &(((const struct sockaddr_in6 *)sock_addr)->sin6_addr), 16);
+}
+
+/**
+ * Takes a connection token of a client
+ *
+ * Clients are let through when the table cannot take them.
+ *
+ * @param ratelimit : rate limiter
+ * @param addr : client address, see xps_ratelimit_addr()
+ * @param now_msec : loop time
+ * @return : true if the connection may be accepted
+ */
+bool xps_ratelimit_accept(xps_ratelimit_t *ratelimit, const u_char addr[16], u_long now_msec) {
+  assert(ratelimit != NULL);
+
+  if (ratelimit->conn_rate == 0)
+    return true;
+
+  xps_ratelimit_entry_t *entry = ratelimit_find(ratelimit, addr, now_msec, true);
+  if (entry == NULL)
+    return true;
+
+  ratelimit_refill(ratelimit, entry, now_msec);
+  if (entry->conn_tokens < 1000) {
+    ratelimit->n_rejected++;
+    return false;
+  }
+  entry->conn_tokens -= 1000;
+  return true;
+}
+
+/**
+ * Finds how long a client has to wait before sending or receiving more
+ *
+ * @param ratelimit : rate limiter
+ * @param addr : client address, see xps_ratelimit_addr()
+ * @param now_msec : loop time
+ * @return : msec to wait, 0 if the client may go on
+ */
+u_long xps_ratelimit_wait(xps_ratelimit_t *ratelimit, const u_char addr[16], u_long now_msec) {
+  assert(ratelimit != NULL);
+
+  if (ratelimit->byte_rate == 0)
+    return 0;
+
+  xps_ratelimit_entry_t *entry = ratelimit_find(ratelimit, addr, now_msec, false);
+  if (entry == NULL)
+    return 0;
+
+  ratelimit_refill(ratelimit, entry, now_msec);
+  if (entry->byte_tokens > 0)
+    return 0;
+
+  // Thousandths of a byte over bytes per second is msec
+  ratelimit->n_throttled++;
+  return -entry->byte_tokens / ratelimit->byte_rate + 1;
+}
+
+/**
+ * Takes len bytes from the byte bucket of a client, going into debt if
+ * there are not enough
+ */
+void xps_ratelimit_charge(xps_ratelimit_t *ratelimit, const u_char addr[16], u_long now_msec,
+                          size_t len) {
+  assert(ratelimit != NULL);
+
+  if (ratelimit->byte_rate == 0)
+    return;
+
+  xps_ratelimit_entry_t *entry = ratelimit_find(ratelimit, addr, now_msec, true);
+  if (entry == NULL)
+    return;
+
+  ratelimit_refill(ratelimit, entry, now_msec);
+  entry->byte_tokens -= (long)len * 1000;
+}
+
+void xps_ratelimit_log_stats(xps_ratelimit_t *ratelimit) {
+  assert(ratelimit != NULL);
+
+  logger(LOG_INFO, "xps_ratelimit_log_stats()",
+         "slots used %u/%u, connections rejected %lu, throttled %lu", ratelimit->n_used,
+         ratelimit->capacity, ratelimit->n_rejected, ratelimit->n_throttled);
+}
+
+u_long ratelimit_hash(const u_char addr[16]) {
+  u_long a, b;
+  memcpy(&a, addr, 8);
+  memcpy(&b, addr + 8, 8);
+
+  u_long hash = (a ^ (b * 0x9E3779B97F4A7C15UL)) * 0xBF58476D1CE4E5B9UL;
+  return hash ^ (hash >> 31);
+}
+
+/**
+ * Finds the entry of addr, optionally creating it in the first free slot on
+ * its probe sequence
+ *
+ * @return : entry, NULL if not found or there is no room
+ */
+xps_ratelimit_entry_t *ratelimit_find(xps_ratelimit_t *ratelimit, const u_char addr[16],
+                                      u_long now_msec, bool insert) {
+  // Keep probe sequences short
+  if (insert && ratelimit->n_used * 4 >= ratelimit->capacity * 3)
+    ratelimit_rebuild(ratelimit, now_msec);
+
+  u_int mask = ratelimit->capacity - 1;
+  u_int i = ratelimit_hash(addr) & mask;
+  xps_ratelimit_entry_t *free_entry = NULL;
+
+  for (u_int n = 0; n < ratelimit->capacity; n++, i = (i + 1) & mask) {
+    xps_ratelimit_entry_t *entry = &(ratelimit->entries[i]);
+
+    // Never used slot ends the probe sequence
+    if (entry->refill_msec == 0) {
+      if (free_entry == NULL) {
+        free_entry = entry;
+        ratelimit->n_used++;
+      }
+      break;
+    }
+
+    if (memcmp(entry->addr, addr, 16) == 0)
+      return entry;
+
+    if (free_entry == NULL && ratelimit_expired(ratelimit, entry, now_msec))
+      free_entry = entry;
+  }
+
+  if (!insert || free_entry == NULL) {
+    if (free_entry != NULL && free_entry->refill_msec == 0)
+      ratelimit->n_used--;
+    return NULL;
+  }
+
+  // New clients start with full buckets
+  memcpy(free_entry->addr, addr, 16);
+  free_entry->refill_msec = now_msec;
+  free_entry->conn_tokens = ratelimit->conn_burst * 1000;
+  free_entry->byte_tokens = ratelimit->byte_burst * 1000;
+  return free_entry;
+}
+
+/**
+ * Checks whether both buckets of an entry would be full by now
+ */
+bool ratelimit_expired(xps_ratelimit_t *ratelimit, xps_ratelimit_entry_t *entry, u_long now_msec) {
+  long elapsed = now_msec - entry->refill_msec;
+
+  if (ratelimit->conn_rate > 0 &&
+      entry->conn_tokens + elapsed * (long)ratelimit->conn_rate < (long)ratelimit->conn_burst * 1000)
+    return false;
+  if (ratelimit->byte_rate > 0 &&
+      entry->byte_tokens + elapsed * (long)ratelimit->byte_rate < (long)ratelimit->byte_burst * 1000)
+    return false;
+  return true;
+}
+
+void ratelimit_refill(xps_ratelimit_t *ratelimit, xps_ratelimit_entry_t *entry, u_long now_msec) {
+  long elapsed = now_msec - entry->refill_msec;
+  if (elapsed <= 0)
+    return;
+  entry->refill_msec = now_msec;
+
+  // Rates per second are thousandths per msec
+  entry->conn_tokens += elapsed * (long)ratelimit->conn_rate;
+  if (entry->conn_tokens > (long)ratelimit->conn_burst * 1000)
+    entry->conn_tokens = ratelimit->conn_burst * 1000;
+  entry->byte_tokens += elapsed * (long)ratelimit->byte_rate;
+  if (entry->byte_tokens > (long)ratelimit->byte_burst * 1000)
+    entry->byte_tokens = ratelimit->byte_burst * 1000;
+}
+
+/**
+ * Moves live entries to a new table, dropping expired ones and growing the
+ * table if it would still be over a quarter full
+ */
+int ratelimit_rebuild(xps_ratelimit_t *ratelimit, u_long now_msec) {
+  u_int n_live = 0;
+  for (u_int i = 0; i < ratelimit->capacity; i++) {
+    xps_ratelimit_entry_t *entry = &(ratelimit->entries[i]);
+    if (entry->refill_msec != 0 && !ratelimit_expired(ratelimit, entry, now_msec))
+      n_live++;
+  }
+
+  u_int capacity = ratelimit->capacity;
+  while (n_live * 4 > capacity && capacity < RATELIMIT_MAX_ENTRIES)
+    capacity *= 2;
+
+  // Rebuilding a full table of live clients would not free anything
+  if (n_live * 4 >= capacity * 3)
+    return E_FAIL;
+
+  xps_ratelimit_entry_t *entries = calloc(capacity, sizeof(xps_ratelimit_entry_t));
+  if (entries == NULL) {
+    logger(LOG_ERROR, "ratelimit_rebuild()", "calloc() failed for 'entries'");
+    return E_FAIL;
+  }
+
+  u_int mask = capacity - 1;
+  for (u_int i = 0; i < ratelimit->capacity; i++) {
+    xps_ratelimit_entry_t *entry = &(ratelimit->entries[i]);
+    if (entry->refill_msec == 0 || ratelimit_expired(ratelimit, entry, now_msec))
+      continue;
+
+    u_int j = ratelimit_hash(entry->addr) & mask;
+    while (entries[j].refill_msec != 0)
+      j = (j + 1) & mask;
+    entries[j] = *entry;
+  }
+
+  free(ratelimit->entries);
+  ratelimit->entries = entries;
+  ratelimit->capacity = capacity;
+  ratelimit->n_used = n_live;
+
+  logger(LOG_DEBUG, "ratelimit_rebuild()", "rebuilt table, %u slots, %u clients", capacity, n_live);
+
+  return OK;
+}
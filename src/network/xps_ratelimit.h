@@ -0,0 +1,46 @@
+#ifndef XPS_RATELIMIT_H
+#define XPS_RATELIMIT_H
+
+#include "../xps.h"
+
+/*
+ * Per client IP token buckets, one for new connections and one for bytes
+ * sent and received. Buckets live in an open-addressing table with linear
+ * probing, keyed on the 16 byte address (IPv4 is mapped into IPv6).
+ *
+ * Entries are never deleted. One that has been idle long enough to refill
+ * both of its buckets is no different from a new one, so it counts as free
+ * and is overwritten or dropped when the table is rebuilt.
+ *
+ * Tokens are kept in thousandths so that slow rates refill between calls.
+ * The byte bucket may go into debt; the client waits until it is paid off.
+ */
+struct xps_ratelimit_entry_s {
+  u_char addr[16];
+  u_long refill_msec; // Last refill, 0 if slot was never used
+  long conn_tokens;
+  long byte_tokens;
+};
+
+struct xps_ratelimit_s {
+  xps_ratelimit_entry_t *entries;
+  u_int capacity; // Power of two
+  u_int n_used;   // Slots ever used since last rebuild, expired or not
+  u_long conn_rate; // Connections per second, 0 for no limit
+  u_long conn_burst;
+  u_long byte_rate; // Bytes per second, 0 for no limit
+  u_long byte_burst;
+  u_long n_rejected;  // Connections refused
+  u_long n_throttled; // Times a connection was held back
+};
+
+xps_ratelimit_t *xps_ratelimit_create(xps_config_t *config);
+void xps_ratelimit_destroy(xps_ratelimit_t *ratelimit);
+void xps_ratelimit_addr(const struct sockaddr *sock_addr, u_char addr[16]);
+bool xps_ratelimit_accept(xps_ratelimit_t *ratelimit, const u_char addr[16], u_long now_msec);
+u_long xps_ratelimit_wait(xps_ratelimit_t *ratelimit, const u_char addr[16], u_long now_msec);
+void xps_ratelimit_charge(xps_ratelimit_t *ratelimit, const u_char addr[16], u_long now_msec,
+                          size_t len);
+void xps_ratelimit_log_stats(xps_ratelimit_t *ratelimit);
+
+#endif
@@ -0,0 +1,350 @@
+#include "../xps.h"
+
+xps_sock_profile_t *sock_profile_create(const char *name);
+void sock_profile_destroy(xps_sock_profile_t *profile);
+xps_sock_profile_t *sock_profile_find(xps_core_t *core, const char *name, size_t len);
+bool sock_profile_set(xps_sock_profile_t *profile, const char *option);
+void sock_profiles_check(xps_core_t *core, const char *str, const char *what);
+void sock_set(int sock_fd, int level, int name, int value, const char *what,
+              xps_log_level_t log_level);
+
+// Options of XPS_SOCK_PROFILES, see xps_sockopt.h
+static const struct {
+  const char *name;
+  size_t offset;
+  bool is_bool;
+} sock_options[] = {
+    {"backlog", offsetof(xps_sock_profile_t, backlog), false},
+    {"defer_accept", offsetof(xps_sock_profile_t, defer_accept), false},
+    {"fastopen", offsetof(xps_sock_profile_t, fastopen), false},
+    {"nodelay", offsetof(xps_sock_profile_t, nodelay), true},
+    {"quickack", offsetof(xps_sock_profile_t, quickack), true},
+    {"rcvbuf", offsetof(xps_sock_profile_t, rcvbuf), false},
+    {"sndbuf", offsetof(xps_sock_profile_t, sndbuf), false},
+    {"busy_poll", offsetof(xps_sock_profile_t, busy_poll), false},
+    {"incoming_cpu", offsetof(xps_sock_profile_t, incoming_cpu), false},
+};
+
+/**
+ * Creates the built-in "default" profile and the profiles defined in
+ * config->sock_profiles
+ *
+ * @param core : core the profiles belong to
+ * @return : OK on success, E_FAIL if out of memory
+ */
+int xps_sock_profiles_create(xps_core_t *core) {
+  assert(core != NULL);
+
+  xps_sock_profile_t *profile = sock_profile_create("default");
+  if (profile == NULL)
+    return E_FAIL;
+  vec_push(&(core->sock_profiles), profile);
+
+  char *list = strdup(core->config->sock_profiles);
+  if (list == NULL) {
+    logger(LOG_ERROR, "xps_sock_profiles_create()", "strdup() failed");
+    return E_FAIL;
+  }
+
+  char *save_ptr;
+  for (char *entry = strtok_r(list, ",", &save_ptr); entry != NULL;
+       entry = strtok_r(NULL, ",", &save_ptr)) {
+    char *option_ptr;
+    char *name = strtok_r(entry, ":", &option_ptr);
+    if (name == NULL)
+      continue;
+
+    // Only "default" exists before, later definitions of a name override earlier ones
+    profile = sock_profile_find(core, name, strlen(name));
+    if (profile == NULL) {
+      profile = sock_profile_create(name);
+      if (profile == NULL)
+        break;
+      vec_push(&(core->sock_profiles), profile);
+    }
+
+    for (char *option = strtok_r(NULL, ":", &option_ptr); option != NULL;
+         option = strtok_r(NULL, ":", &option_ptr)) {
+      if (!sock_profile_set(profile, option))
+        logger(LOG_WARNING, "xps_sock_profiles_create()", "invalid option '%s' of profile %s",
+               option, name);
+    }
+  }
+  free(list);
+
+  sock_profiles_check(core, core->config->listener_profiles, "listener");
+  sock_profiles_check(core, core->config->upstream_profiles, "upstream");
+
+  return OK;
+}
+
+void xps_sock_profiles_destroy(xps_core_t *core) {
+  assert(core != NULL);
+
+  for (int i = 0; i < core->sock_profiles.length; i++)
+    sock_profile_destroy(core->sock_profiles.data[i]);
+  vec_clear(&(core->sock_profiles));
+}
+
+/**
+ * Finds the profile of a listener port in config->listener_profiles,
+ * "port=name,..."
+ *
+ * @return : profile of port, the default profile if port is not listed
+ */
+xps_sock_profile_t *xps_sock_profile_listener(xps_core_t *core, u_int port) {
+  assert(core != NULL);
+
+  const char *str = core->config->listener_profiles;
+  while (*str != '\0') {
+    char *end;
+    u_long curr_port = strtoul(str, &end, 10);
+    const char *next = strchr(str, ',');
+    if (next == NULL)
+      next = str + strlen(str);
+
+    if (end != str && *end == '=' && curr_port == port) {
+      xps_sock_profile_t *profile = sock_profile_find(core, end + 1, next - end - 1);
+      if (profile != NULL)
+        return profile;
+      break;
+    }
+
+    str = *next == ',' ? next + 1 : next;
+  }
+  return core->sock_profiles.data[0];
+}
+
+/**
+ * Finds the profile of an upstream in config->upstream_profiles,
+ * "host:port=name,...", with the host alone for unix sockets
+ *
+ * @return : profile of the upstream, the default profile if it is not listed
+ */
+xps_sock_profile_t *xps_sock_profile_upstream(xps_core_t *core, const char *host, u_int port) {
+  assert(core != NULL);
+  assert(host != NULL);
+
+  char key[HANDOVER_HOST_LEN + 8];
+  if (is_unix_host(host))
+    snprintf(key, sizeof(key), "%s", host);
+  else
+    snprintf(key, sizeof(key), "%s:%u", host, port);
+  size_t key_len = strlen(key);
+
+  const char *str = core->config->upstream_profiles;
+  while (*str != '\0') {
+    const char *next = strchr(str, ',');
+    if (next == NULL)
+      next = str + strlen(str);
+
+    if (next - str > (long)key_len && strncmp(str, key, key_len) == 0 && str[key_len] == '=') {
+      const char *name = str + key_len + 1;
+      xps_sock_profile_t *profile = sock_profile_find(core, name, next - name);
+      if (profile != NULL)
+        return profile;
+      break;
+    }
+
+    str = *next == ',' ? next + 1 : next;
+  }
+  return core->sock_profiles.data[0];
+}
+
+/**
+ * Tunes a listening socket, before listen()
+ *
+ * @param profile : profile of the listener
+ * @param sock_fd : bound socket
+ * @param tcp : false for unix sockets
+ */
+void xps_sock_profile_listen(xps_sock_profile_t *profile, int sock_fd, bool tcp) {
+  assert(profile != NULL);
+
+  // Accepted sockets inherit these
+  if (profile->rcvbuf > 0)
+    sock_set(sock_fd, SOL_SOCKET, SO_RCVBUF, profile->rcvbuf, "SO_RCVBUF", LOG_WARNING);
+  if (profile->sndbuf > 0)
+    sock_set(sock_fd, SOL_SOCKET, SO_SNDBUF, profile->sndbuf, "SO_SNDBUF", LOG_WARNING);
+  if (!tcp)
+    return;
+  if (profile->busy_poll > 0)
+    sock_set(sock_fd, SOL_SOCKET, SO_BUSY_POLL, profile->busy_poll, "SO_BUSY_POLL", LOG_WARNING);
+  if (profile->nodelay)
+    sock_set(sock_fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY", LOG_WARNING);
+
+  // Connections of reuseport listeners go to the one of the CPU that took them in
+  if (profile->incoming_cpu >= 0)
+    sock_set(sock_fd, SOL_SOCKET, SO_INCOMING_CPU, profile->incoming_cpu, "SO_INCOMING_CPU",
+             LOG_WARNING);
+  if (profile->defer_accept > 0)
+    sock_set(sock_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, profile->defer_accept, "TCP_DEFER_ACCEPT",
+             LOG_WARNING);
+  if (profile->fastopen > 0)
+    sock_set(sock_fd, IPPROTO_TCP, TCP_FASTOPEN, profile->fastopen, "TCP_FASTOPEN", LOG_WARNING);
+}
+
+/**
+ * Tunes an accepted socket, for the options it does not inherit from its
+ * listener
+ */
+void xps_sock_profile_accepted(xps_sock_profile_t *profile, int sock_fd, bool tcp) {
+  assert(profile != NULL);
+
+  if (tcp && profile->quickack)
+    sock_set(sock_fd, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK", LOG_DEBUG);
+}
+
+/**
+ * Tunes an upstream socket, before connect()
+ *
+ * With fastopen, connect() returns at once and the SYN goes out with the
+ * first write, which fails with EINPROGRESS when the kernel has no cookie of
+ * the upstream yet.
+ */
+void xps_sock_profile_connect(xps_sock_profile_t *profile, int sock_fd, bool tcp) {
+  assert(profile != NULL);
+
+  if (profile->rcvbuf > 0)
+    sock_set(sock_fd, SOL_SOCKET, SO_RCVBUF, profile->rcvbuf, "SO_RCVBUF", LOG_DEBUG);
+  if (profile->sndbuf > 0)
+    sock_set(sock_fd, SOL_SOCKET, SO_SNDBUF, profile->sndbuf, "SO_SNDBUF", LOG_DEBUG);
+  if (!tcp)
+    return;
+  if (profile->busy_poll > 0)
+    sock_set(sock_fd, SOL_SOCKET, SO_BUSY_POLL, profile->busy_poll, "SO_BUSY_POLL", LOG_DEBUG);
+  if (profile->incoming_cpu >= 0)
+    sock_set(sock_fd, SOL_SOCKET, SO_INCOMING_CPU, profile->incoming_cpu, "SO_INCOMING_CPU",
+             LOG_DEBUG);
+  if (profile->nodelay)
+    sock_set(sock_fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY", LOG_DEBUG);
+  if (profile->quickack)
+    sock_set(sock_fd, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK", LOG_DEBUG);
+  if (profile->fastopen > 0)
+    sock_set(sock_fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1, "TCP_FASTOPEN_CONNECT", LOG_DEBUG);
+}
+
+/**
+ * Makes the kernel hand connections of a reuseport group to the socket at
+ * the position of the CPU they came in on, modulo the group's size
+ *
+ * Sockets take positions in the order they start listening. The program is
+ * shared by the whole group, every member attaching it is harmless.
+ *
+ * @param sock_fd : listening socket with SO_REUSEPORT
+ * @param group : number of sockets in the group
+ * @return : OK on success, E_FAIL on error
+ */
+int xps_sock_reuseport_steer(int sock_fd, u_int group) {
+  assert(group > 0);
+
+  struct sock_filter code[] = {
+      {BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU}, // A = CPU of the packet
+      {BPF_ALU | BPF_MOD | BPF_K, 0, 0, group},                   // A %= group
+      {BPF_RET | BPF_A, 0, 0, 0},                                 // Socket at position A
+  };
+  struct sock_fprog prog = {.len = sizeof(code) / sizeof(code[0]), .filter = code};
+  if (setsockopt(sock_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+    logger(LOG_ERROR, "xps_sock_reuseport_steer()", "SO_ATTACH_REUSEPORT_CBPF failed: %s",
+           strerror(errno));
+    return E_FAIL;
+  }
+  return OK;
+}
+
+xps_sock_profile_t *sock_profile_create(const char *name) {
+  xps_sock_profile_t *profile = malloc(sizeof(xps_sock_profile_t));
+  if (profile == NULL) {
+    logger(LOG_ERROR, "sock_profile_create()", "malloc() failed for 'profile'");
+    return NULL;
+  }
+
+  profile->name = strdup(name);
+  if (profile->name == NULL) {
+    logger(LOG_ERROR, "sock_profile_create()", "strdup() failed for 'name'");
+    free(profile);
+    return NULL;
+  }
+
+  // Init values, those of the built-in default profile
+  profile->backlog = DEFAULT_BACKLOG;
+  profile->defer_accept = 0;
+  profile->fastopen = 0;
+  profile->nodelay = true;
+  profile->quickack = false;
+  profile->rcvbuf = 0;
+  profile->sndbuf = 0;
+  profile->busy_poll = 0;
+  profile->incoming_cpu = -1;
+
+  return profile;
+}
+
+void sock_profile_destroy(xps_sock_profile_t *profile) {
+  free(profile->name);
+  free(profile);
+}
+
+xps_sock_profile_t *sock_profile_find(xps_core_t *core, const char *name, size_t len) {
+  for (int i = 0; i < core->sock_profiles.length; i++) {
+    xps_sock_profile_t *profile = core->sock_profiles.data[i];
+    if (strlen(profile->name) == len && strncmp(profile->name, name, len) == 0)
+      return profile;
+  }
+  return NULL;
+}
+
+/**
+ * Sets one "option=value" of a profile
+ *
+ * @return : false if the option is unknown or its value is not a number
+ */
+bool sock_profile_set(xps_sock_profile_t *profile, const char *option) {
+  const char *equals = strchr(option, '=');
+  if (equals == NULL)
+    return false;
+
+  char *end;
+  long value = strtol(equals + 1, &end, 10);
+  if (end == equals + 1 || *end != '\0')
+    return false;
+
+  for (size_t i = 0; i < sizeof(sock_options) / sizeof(sock_options[0]); i++) {
+    if (strlen(sock_options[i].name) != (size_t)(equals - option) ||
+        strncmp(sock_options[i].name, option, equals - option) != 0)
+      continue;
+
+    void *field = (u_char *)profile + sock_options[i].offset;
+    if (sock_options[i].is_bool)
+      *(bool *)field = value != 0;
+    else
+      *(int *)field = value;
+    return true;
+  }
+  return false;
+}
+
+/**
+ * Warns of "key=name" entries of a profile map that name no profile, they
+ * get the default profile
+ */
+void sock_profiles_check(xps_core_t *core, const char *str, const char *what) {
+  while (*str != '\0') {
+    const char *next = strchr(str, ',');
+    if (next == NULL)
+      next = str + strlen(str);
+
+    const char *equals = memrchr(str, '=', next - str);
+    if (equals == NULL || sock_profile_find(core, equals + 1, next - equals - 1) == NULL)
+      logger(LOG_WARNING, "sock_profiles_check()", "invalid %s profile '%.*s'", what,
+             (int)(next - str), str);
+
+    str = *next == ',' ? next + 1 : next;
+  }
+}
+
+void sock_set(int sock_fd, int level, int name, int value, const char *what,
+              xps_log_level_t log_level) {
+  if (setsockopt(sock_fd, level, name, &value, sizeof(value)) < 0)
+    logger(log_level, "sock_set()", "setsockopt() of %s failed: %s", what, strerror(errno));
+}
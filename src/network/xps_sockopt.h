@@ -0,0 +1,54 @@
+#ifndef XPS_SOCKOPT_H
+#define XPS_SOCKOPT_H
+
+#include "../xps.h"
+
+/*
+ * Socket tuning profiles of listeners and upstream connections.
+ *
+ * config->sock_profiles defines named profiles as
+ * "name:option=value:option=value,...", e.g.
+ * "edge:backlog=8192:defer_accept=5:fastopen=1024,lan:sndbuf=4194304:busy_poll=50".
+ * Options left out keep the value of the built-in "default" profile, which
+ * only sets TCP_NODELAY and a DEFAULT_BACKLOG backlog; defining a profile
+ * named "default" replaces it. config->listener_profiles picks a profile per
+ * listener port, config->upstream_profiles one per upstream "host:port".
+ *
+ * Options of a listening socket that accepted sockets inherit are set once
+ * on the listener, so accepting costs no extra system calls unless quickack
+ * is on. Listeners handed over during an upgrade keep the settings of the
+ * process that created them. TCP options are skipped on unix sockets.
+ *
+ * With config->reuseport_group set to N, N processes started with XPS_CPU=0
+ * to N-1, in that order, each listen on the TCP ports with SO_REUSEPORT and
+ * the kernel hands a connection to the process of the CPU whose queue took
+ * it in, so a connection is served where its packets already are. It works
+ * best with RSS or RPS spreading flows over the same N CPUs. The kernel
+ * numbers a group's sockets in the order they start listening and moves the
+ * last socket into the gap when one closes, so a process that exits must be
+ * restarted after the ones above it. Listeners handed over during an upgrade
+ * keep their position.
+ */
+struct xps_sock_profile_s {
+  char *name;
+  int backlog;      // listen() backlog, capped by net.core.somaxconn
+  int defer_accept; // Seconds TCP_DEFER_ACCEPT holds connections back until data arrives, 0 for off
+  int fastopen;     // Listener: TCP Fast Open queue length, upstream: connect with TFO if not 0
+  bool nodelay;     // TCP_NODELAY
+  bool quickack;    // TCP_QUICKACK on new connections, the kernel drops it after a while
+  int rcvbuf;       // SO_RCVBUF, 0 for the kernel's autotuning
+  int sndbuf;       // SO_SNDBUF, 0 for the kernel's autotuning
+  int busy_poll;    // Microseconds of SO_BUSY_POLL, 0 for off
+  int incoming_cpu; // SO_INCOMING_CPU, -1 for any
+};
+
+int xps_sock_profiles_create(xps_core_t *core);
+void xps_sock_profiles_destroy(xps_core_t *core);
+xps_sock_profile_t *xps_sock_profile_listener(xps_core_t *core, u_int port);
+xps_sock_profile_t *xps_sock_profile_upstream(xps_core_t *core, const char *host, u_int port);
+void xps_sock_profile_listen(xps_sock_profile_t *profile, int sock_fd, bool tcp);
+void xps_sock_profile_accepted(xps_sock_profile_t *profile, int sock_fd, bool tcp);
+void xps_sock_profile_connect(xps_sock_profile_t *profile, int sock_fd, bool tcp);
+int xps_sock_reuseport_steer(int sock_fd, u_int group);
+
+#endif
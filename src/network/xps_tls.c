@@ -0,0 +1,421 @@
+#include "../xps.h"
+
+int tls_ticket_key_cb(SSL *ssl, u_char key_name[16], u_char iv[EVP_MAX_IV_LENGTH],
+                      EVP_CIPHER_CTX *cipher_ctx, EVP_MAC_CTX *mac_ctx, int enc);
+int tls_alpn_cb(SSL *ssl, const u_char **out, u_char *out_len, const u_char *in, u_int in_len,
+                void *arg);
+int tls_new_ticket_key(xps_tls_ticket_key_t *key);
+void tls_rotate_handler(void *ptr);
+const char *tls_error_str();
+
+/**
+ * Creates the TLS context of a core from config->tls_cert and
+ * config->tls_key
+ *
+ * @param core : core whose TLS listeners use the context
+ * @return : TLS instance, NULL if the certificate or key cannot be loaded
+ */
+xps_tls_t *xps_tls_create(xps_core_t *core) {
+  assert(core != NULL);
+  xps_config_t *config = core->config;
+
+  xps_tls_t *tls = malloc(sizeof(xps_tls_t));
+  if (tls == NULL) {
+    logger(LOG_ERROR, "xps_tls_create()", "malloc() failed for 'tls'");
+    return NULL;
+  }
+
+  SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+  if (ctx == NULL) {
+    logger(LOG_ERROR, "xps_tls_create()", "SSL_CTX_new() failed: %s", tls_error_str());
+    free(tls);
+    return NULL;
+  }
+
+  if (SSL_CTX_use_certificate_chain_file(ctx, config->tls_cert) != 1 ||
+      SSL_CTX_use_PrivateKey_file(ctx, config->tls_key, SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(ctx) != 1) {
+    logger(LOG_ERROR, "xps_tls_create()", "failed to load '%s' and '%s': %s", config->tls_cert,
+           config->tls_key, tls_error_str());
+    SSL_CTX_free(ctx);
+    free(tls);
+    return NULL;
+  }
+
+  // Only AEAD ciphers, which are the ones the kernel can take over
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  SSL_CTX_set_cipher_list(ctx, "ECDHE+AESGCM:ECDHE+CHACHA20");
+  SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION |
+                               SSL_OP_CIPHER_SERVER_PREFERENCE);
+
+  // Clients commonly close without close_notify, HTTP framing tells a cut
+  // off message anyway
+  SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+
+  // Sinks retry blocked writes from wherever their buffers are by then
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                            SSL_MODE_RELEASE_BUFFERS);
+
+  // Resumption
+  if (config->tls_session_cache > 0) {
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, config->tls_session_cache);
+    SSL_CTX_set_session_id_context(ctx, (const u_char *)"xps", 3);
+    SSL_CTX_set_timeout(ctx, 2 * TLS_TICKET_KEY_MSEC / 1000);
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, tls_ticket_key_cb);
+  } else {
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+    SSL_CTX_set_num_tickets(ctx, 0);
+  }
+  SSL_CTX_set_app_data(ctx, tls);
+
+  // Sessions take the h2c preface over TLS as well, see xps_h2.h
+  SSL_CTX_set_alpn_select_cb(ctx, tls_alpn_cb, config);
+
+  if (tls_new_ticket_key(&(tls->keys[0])) != OK || tls_new_ticket_key(&(tls->keys[1])) != OK) {
+    logger(LOG_ERROR, "xps_tls_create()", "tls_new_ticket_key() failed");
+    SSL_CTX_free(ctx);
+    free(tls);
+    return NULL;
+  }
+
+  // Init values
+  tls->core = core;
+  tls->ctx = ctx;
+  tls->rotate_timer = NULL;
+  if (config->tls_session_cache > 0)
+    tls->rotate_timer = xps_loop_add_timer(core->loop, TLS_TICKET_KEY_MSEC, tls, tls_rotate_handler);
+  tls->n_handshakes = 0;
+  tls->n_resumed = 0;
+  tls->n_failed = 0;
+  tls->n_ktls_tx = 0;
+  tls->n_ktls_rx = 0;
+
+  logger(LOG_DEBUG, "xps_tls_create()", "created tls");
+
+  return tls;
+}
+
+void xps_tls_destroy(xps_tls_t *tls) {
+  assert(tls != NULL);
+
+  if (tls->rotate_timer != NULL)
+    xps_loop_cancel_timer(tls->core->loop, tls->rotate_timer);
+  SSL_CTX_free(tls->ctx);
+  OPENSSL_cleanse(tls->keys, sizeof(tls->keys));
+  free(tls);
+
+  logger(LOG_DEBUG, "xps_tls_destroy()", "destroyed tls");
+}
+
+/**
+ * Starts the server side of TLS on a client connection
+ *
+ * The handshake itself is driven by the connection's source handler.
+ *
+ * @param connection : connection accepted by a TLS listener
+ * @return : OK on success, E_FAIL if the core has no TLS context
+ */
+int xps_tls_accept(xps_connection_t *connection) {
+  assert(connection != NULL);
+  xps_tls_t *tls = connection->core->tls;
+
+  if (tls == NULL)
+    return E_FAIL;
+
+  SSL *ssl = SSL_new(tls->ctx);
+  if (ssl == NULL) {
+    logger(LOG_ERROR, "xps_tls_accept()", "SSL_new() failed: %s", tls_error_str());
+    return E_FAIL;
+  }
+  if (SSL_set_fd(ssl, connection->sock_fd) != 1) {
+    logger(LOG_ERROR, "xps_tls_accept()", "SSL_set_fd() failed: %s", tls_error_str());
+    SSL_free(ssl);
+    return E_FAIL;
+  }
+  SSL_set_accept_state(ssl);
+
+  connection->tls = ssl;
+  connection->tls_done = false;
+  connection->tls_ktls_tx = false;
+  connection->tls_want_write = false;
+  connection->tls_write_len = 0;
+
+  return OK;
+}
+
+/**
+ * Continues the handshake of a TLS connection
+ *
+ * On completion the connection's sink is made ready, it holds back while the
+ * handshake is in progress.
+ *
+ * @param connection : connection with a handshake in progress
+ * @return : OK once done, E_AGAIN if the socket would block, E_FAIL on error
+ */
+int xps_tls_handshake(xps_connection_t *connection) {
+  assert(connection != NULL);
+  assert(connection->tls != NULL);
+  xps_tls_t *tls = connection->core->tls;
+
+  connection->tls_want_write = false;
+
+  ERR_clear_error();
+  int ret = SSL_do_handshake(connection->tls);
+  if (ret != 1) {
+    int err = SSL_get_error(connection->tls, ret);
+    if (err == SSL_ERROR_WANT_READ)
+      return E_AGAIN;
+    if (err == SSL_ERROR_WANT_WRITE) {
+      connection->tls_want_write = true;
+      return E_AGAIN;
+    }
+    tls->n_failed++;
+    logger(LOG_DEBUG, "xps_tls_handshake()", "handshake failed: %s", tls_error_str());
+    return E_FAIL;
+  }
+
+  connection->tls_done = true;
+  connection->sink->ready = true;
+
+  tls->n_handshakes++;
+  if (SSL_session_reused(connection->tls))
+    tls->n_resumed++;
+#ifndef OPENSSL_NO_KTLS
+  connection->tls_ktls_tx = BIO_get_ktls_send(SSL_get_wbio(connection->tls));
+  if (connection->tls_ktls_tx)
+    tls->n_ktls_tx++;
+  if (BIO_get_ktls_recv(SSL_get_rbio(connection->tls)))
+    tls->n_ktls_rx++;
+#endif
+
+  logger(LOG_DEBUG, "xps_tls_handshake()", "%s %s%s", SSL_get_version(connection->tls),
+         SSL_get_cipher_name(connection->tls), connection->tls_ktls_tx ? ", kTLS" : "");
+
+  return OK;
+}
+
+/**
+ * Reads plaintext from a TLS connection
+ *
+ * Records are read until len bytes are filled or the socket would block.
+ *
+ * @param connection : connection with a finished handshake
+ * @param buff : buffer to read into
+ * @param len : size of buff
+ * @return : bytes read, 0 if the peer closed, E_AGAIN or E_FAIL
+ */
+long xps_tls_read(xps_connection_t *connection, u_char *buff, size_t len) {
+  assert(connection != NULL);
+  assert(buff != NULL);
+
+  connection->tls_want_write = false;
+
+  size_t read_n = 0;
+  while (read_n < len) {
+    ERR_clear_error();
+    int ret = SSL_read(connection->tls, buff + read_n, len - read_n);
+    if (ret > 0) {
+      read_n += ret;
+      continue;
+    }
+
+    int err = SSL_get_error(connection->tls, ret);
+    if (read_n > 0 && (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE))
+      break;
+    if (err == SSL_ERROR_WANT_READ)
+      return E_AGAIN;
+    if (err == SSL_ERROR_WANT_WRITE) {
+      connection->tls_want_write = true;
+      return E_AGAIN;
+    }
+
+    // Plaintext read so far is passed on before the close or error is seen again
+    if (read_n > 0)
+      break;
+    if (err == SSL_ERROR_ZERO_RETURN || (err == SSL_ERROR_SYSCALL && ERR_peek_error() == 0 &&
+                                         (errno == 0 || errno == ECONNRESET)))
+      return 0;
+    logger(LOG_DEBUG, "xps_tls_read()", "SSL_read() failed: %s", tls_error_str());
+    return E_FAIL;
+  }
+
+  return read_n;
+}
+
+/**
+ * Writes plaintext to a TLS connection that has no kTLS for sending
+ *
+ * The buffers are gathered into the loop's scratch buffer and encrypted in
+ * user space, one record per SSL_write(). A write that would block is
+ * remembered in connection->tls_write_len, as OpenSSL needs it retried with
+ * at least that many bytes.
+ *
+ * @param connection : connection with a finished handshake
+ * @param iov : buffers to write
+ * @param n_iov : number of buffers
+ * @return : bytes written, E_AGAIN or E_FAIL
+ */
+long xps_tls_write(xps_connection_t *connection, struct iovec *iov, int n_iov) {
+  assert(connection != NULL);
+  assert(iov != NULL);
+
+  u_char *write_buff = connection->core->loop->read_buff;
+  size_t len = 0;
+  for (int i = 0; i < n_iov && len < MAX_READ_SIZE; i++) {
+    size_t n = iov[i].iov_len;
+    if (n > MAX_READ_SIZE - len)
+      n = MAX_READ_SIZE - len;
+    memcpy(write_buff + len, iov[i].iov_base, n);
+    len += n;
+  }
+
+  size_t write_n = 0;
+  while (write_n < len) {
+    ERR_clear_error();
+    int ret = SSL_write(connection->tls, write_buff + write_n, len - write_n);
+    if (ret > 0) {
+      write_n += ret;
+      connection->tls_write_len = 0;
+      continue;
+    }
+
+    int err = SSL_get_error(connection->tls, ret);
+    if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) {
+      connection->tls_write_len = len - write_n;
+      if (write_n > 0)
+        break;
+      return E_AGAIN;
+    }
+    logger(LOG_DEBUG, "xps_tls_write()", "SSL_write() failed: %s", tls_error_str());
+    return E_FAIL;
+  }
+
+  return write_n;
+}
+
+/**
+ * Sends close_notify if the socket takes it right away and frees the TLS
+ * state of a connection
+ */
+void xps_tls_close(xps_connection_t *connection) {
+  assert(connection != NULL);
+  assert(connection->tls != NULL);
+
+  ERR_clear_error();
+  if (connection->tls_done)
+    SSL_shutdown(connection->tls);
+  ERR_clear_error();
+
+  SSL_free(connection->tls);
+  connection->tls = NULL;
+}
+
+void xps_tls_log_stats(xps_tls_t *tls) {
+  assert(tls != NULL);
+
+  logger(LOG_INFO, "xps_tls_log_stats()",
+         "handshakes %lu, resumed %lu, failed %lu, kTLS send %lu, kTLS receive %lu, cached "
+         "sessions %ld",
+         tls->n_handshakes, tls->n_resumed, tls->n_failed, tls->n_ktls_tx, tls->n_ktls_rx,
+         SSL_CTX_sess_number(tls->ctx));
+}
+
+/**
+ * Encrypts new tickets with the current key and finds the key of tickets
+ * presented by clients
+ *
+ * @return : 1 to use the ticket, 2 to use it and issue a new one, 0 for a
+ * full handshake, -1 on error
+ */
+int tls_ticket_key_cb(SSL *ssl, u_char key_name[16], u_char iv[EVP_MAX_IV_LENGTH],
+                      EVP_CIPHER_CTX *cipher_ctx, EVP_MAC_CTX *mac_ctx, int enc) {
+  xps_tls_t *tls = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+
+  int index = 0;
+  if (!enc) {
+    while (index < 2 && memcmp(key_name, tls->keys[index].name, 16) != 0)
+      index++;
+    if (index == 2)
+      return 0;
+  }
+  xps_tls_ticket_key_t *key = &(tls->keys[index]);
+
+  OSSL_PARAM params[] = {
+      OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key->hmac_key, 32),
+      OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0),
+      OSSL_PARAM_construct_end()};
+  if (EVP_MAC_CTX_set_params(mac_ctx, params) != 1)
+    return -1;
+
+  if (enc) {
+    memcpy(key_name, key->name, 16);
+    if (RAND_bytes(iv, 16) != 1 ||
+        EVP_EncryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL, key->aes_key, iv) != 1)
+      return -1;
+    return 1;
+  }
+
+  if (EVP_DecryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL, key->aes_key, iv) != 1)
+    return -1;
+  return index == 0 ? 1 : 2;
+}
+
+/**
+ * Picks h2 if the client offers it and h2c is enabled, else http/1.1
+ */
+int tls_alpn_cb(SSL *ssl, const u_char **out, u_char *out_len, const u_char *in, u_int in_len,
+                void *arg) {
+  (void)ssl;
+  xps_config_t *config = arg;
+  static const u_char h2[] = "\x02h2";
+  static const u_char http11[] = "\x08http/1.1";
+
+  if (config->h2_upstreams > 0 &&
+      SSL_select_next_proto((u_char **)out, out_len, h2, sizeof(h2) - 1, in, in_len) ==
+          OPENSSL_NPN_NEGOTIATED)
+    return SSL_TLSEXT_ERR_OK;
+  if (SSL_select_next_proto((u_char **)out, out_len, http11, sizeof(http11) - 1, in, in_len) ==
+      OPENSSL_NPN_NEGOTIATED)
+    return SSL_TLSEXT_ERR_OK;
+  return SSL_TLSEXT_ERR_NOACK;
+}
+
+int tls_new_ticket_key(xps_tls_ticket_key_t *key) {
+  if (RAND_bytes(key->name, 16) != 1 || RAND_bytes(key->aes_key, 32) != 1 ||
+      RAND_bytes(key->hmac_key, 32) != 1)
+    return E_FAIL;
+  return OK;
+}
+
+void tls_rotate_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_tls_t *tls = ptr;
+
+  // Current key becomes the previous one, tickets of the old previous key
+  // get a full handshake
+  xps_tls_ticket_key_t key;
+  if (tls_new_ticket_key(&key) == OK) {
+    tls->keys[1] = tls->keys[0];
+    tls->keys[0] = key;
+    OPENSSL_cleanse(&key, sizeof(key));
+  } else {
+    logger(LOG_ERROR, "tls_rotate_handler()", "tls_new_ticket_key() failed");
+  }
+
+  // Sessions of the cache expire on their own, expired ones are freed here
+  SSL_CTX_flush_sessions(tls->ctx, time(NULL));
+
+  tls->rotate_timer = xps_loop_add_timer(tls->core->loop, TLS_TICKET_KEY_MSEC, tls, tls_rotate_handler);
+}
+
+/**
+ * @return : reason of the oldest queued OpenSSL error, the queue is cleared
+ */
+const char *tls_error_str() {
+  u_long err = ERR_get_error();
+  ERR_clear_error();
+  const char *str = err != 0 ? ERR_reason_error_string(err) : NULL;
+  return str != NULL ? str : "unknown error";
+}
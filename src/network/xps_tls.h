@@ -0,0 +1,50 @@
+#ifndef XPS_TLS_H
+#define XPS_TLS_H
+
+#include "../xps.h"
+
+/*
+ * TLS termination for listeners in config->tls_ports.
+ *
+ * OpenSSL does the handshake on the client socket before any bytes reach
+ * the connection's pipe. Once it is done the record layer is handed to the
+ * kernel (kTLS) where the kernel and the cipher allow it. With kTLS for
+ * sending, the sink writes plaintext to the socket with sendmsg() like any
+ * other connection, and the kernel encrypts in place of a user space copy.
+ * Reads always go through SSL_read(), which under kTLS for receiving only
+ * passes records the kernel already decrypted. Without kTLS, SSL_read() and
+ * SSL_write() do the crypto in user space.
+ *
+ * Sessions are resumed from a server side cache of config->tls_session_cache
+ * entries and from tickets. Ticket keys are rotated every
+ * TLS_TICKET_KEY_MSEC; tickets of the previous key are still accepted and
+ * renewed, so a ticket lives for one to two rotations.
+ */
+struct xps_tls_ticket_key_s {
+  u_char name[16];
+  u_char aes_key[32];
+  u_char hmac_key[32];
+};
+
+struct xps_tls_s {
+  xps_core_t *core;
+  SSL_CTX *ctx;
+  xps_tls_ticket_key_t keys[2]; // Current key, then previous one
+  loop_timer_t *rotate_timer;
+  u_long n_handshakes;
+  u_long n_resumed;
+  u_long n_failed;
+  u_long n_ktls_tx; // Handshakes after which the kernel encrypts
+  u_long n_ktls_rx; // Handshakes after which the kernel decrypts
+};
+
+xps_tls_t *xps_tls_create(xps_core_t *core);
+void xps_tls_destroy(xps_tls_t *tls);
+int xps_tls_accept(xps_connection_t *connection);
+int xps_tls_handshake(xps_connection_t *connection);
+long xps_tls_read(xps_connection_t *connection, u_char *buff, size_t len);
+long xps_tls_write(xps_connection_t *connection, struct iovec *iov, int n_iov);
+void xps_tls_close(xps_connection_t *connection);
+void xps_tls_log_stats(xps_tls_t *tls);
+
+#endif
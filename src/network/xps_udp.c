@@ -0,0 +1,489 @@
+#include "../xps.h"
+
+void udp_read_handler(void *ptr);
+void udp_error_handler(void *ptr);
+void udp_flow_read_handler(void *ptr);
+void udp_flow_error_handler(void *ptr);
+void udp_sweep_handler(void *ptr);
+void udp_enable_gro(int sock_fd);
+int udp_recv(int sock_fd, xps_udp_batch_t *batch, bool with_addr);
+u_int udp_gso_size(struct msghdr *msg);
+void udp_out_add(xps_udp_batch_t *batch, int k, int i, struct sockaddr_in *addr);
+int udp_send(int sock_fd, xps_udp_batch_t *batch, int n);
+xps_udp_flow_t *udp_flow_get(xps_udp_t *udp, struct sockaddr_in *addr);
+void udp_flow_destroy(xps_udp_flow_t *flow);
+int udp_grow(xps_udp_t *udp);
+u_long udp_hash(const struct sockaddr_in *addr);
+
+/**
+ * Creates a UDP proxy relaying datagrams on a port to an upstream
+ *
+ * @param core : core instance
+ * @param port : UDP port to listen on
+ * @param upstream_host : IPv4 host of the upstream
+ * @param upstream_port : UDP port of the upstream
+ * @return : UDP proxy instance, NULL on failure
+ */
+xps_udp_t *xps_udp_create(xps_core_t *core, u_int port, const char *upstream_host,
+                          u_int upstream_port) {
+  assert(core != NULL);
+  assert(upstream_host != NULL);
+  assert(is_valid_port(port));
+  assert(is_valid_port(upstream_port));
+
+  // Scratch datagrams are shared by all UDP proxies of the loop
+  xps_loop_t *loop = core->loop;
+  if (loop->udp_batch == NULL) {
+    loop->udp_batch = malloc(sizeof(xps_udp_batch_t));
+    if (loop->udp_batch == NULL) {
+      logger(LOG_ERROR, "xps_udp_create()", "malloc() failed for 'udp_batch'");
+      return NULL;
+    }
+  }
+
+  struct addrinfo *addr_info = xps_getaddrinfo(upstream_host, upstream_port);
+  if (addr_info == NULL || addr_info->ai_family != AF_INET) {
+    logger(LOG_ERROR, "xps_udp_create()", "invalid upstream %s:%u", upstream_host, upstream_port);
+    if (addr_info != NULL)
+      xps_freeaddrinfo(addr_info);
+    return NULL;
+  }
+
+  xps_udp_t *udp = malloc(sizeof(xps_udp_t));
+  if (udp == NULL) {
+    logger(LOG_ERROR, "xps_udp_create()", "malloc() failed for 'udp'");
+    xps_freeaddrinfo(addr_info);
+    return NULL;
+  }
+  memcpy(&(udp->upstream_addr), addr_info->ai_addr, sizeof(struct sockaddr_in));
+  xps_freeaddrinfo(addr_info);
+
+  // A new process binds the port alongside the old one during an upgrade
+  int sock_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  const int enable = 1;
+  struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port),
+                             .sin_addr.s_addr = htonl(INADDR_ANY)};
+  if (sock_fd < 0 ||
+      setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0 ||
+      bind(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    logger(LOG_ERROR, "xps_udp_create()", "failed to bind() to UDP port %u", port);
+    perror("Error message");
+    if (sock_fd >= 0)
+      close(sock_fd);
+    free(udp);
+    return NULL;
+  }
+
+  udp_enable_gro(sock_fd);
+
+  udp->buckets = calloc(UDP_MIN_FLOW_BUCKETS, sizeof(xps_udp_flow_t *));
+  if (udp->buckets == NULL) {
+    logger(LOG_ERROR, "xps_udp_create()", "calloc() failed for 'buckets'");
+    close(sock_fd);
+    free(udp);
+    return NULL;
+  }
+
+  // Init values
+  udp->core = core;
+  udp->port = port;
+  udp->sock_fd = sock_fd;
+  udp->n_buckets = UDP_MIN_FLOW_BUCKETS;
+  udp->n_flows = 0;
+  udp->sweep_timer = NULL;
+  udp->n_received = 0;
+  udp->n_replied = 0;
+  udp->n_dropped = 0;
+  udp->n_coalesced = 0;
+  udp->n_flows_created = 0;
+  udp->n_flows_expired = 0;
+
+  // Level triggered, see xps_udp.h
+  if (xps_loop_attach(loop, sock_fd, EPOLLIN, udp, udp_read_handler, NULL, udp_error_handler) !=
+      OK) {
+    logger(LOG_ERROR, "xps_udp_create()", "xps_loop_attach() failed");
+    close(sock_fd);
+    free(udp->buckets);
+    free(udp);
+    return NULL;
+  }
+
+  udp->sweep_timer = xps_loop_add_timer(loop, UDP_SWEEP_MSEC, udp, udp_sweep_handler);
+
+  logger(LOG_DEBUG, "xps_udp_create()", "created UDP proxy on port %u", port);
+
+  return udp;
+}
+
+void xps_udp_destroy(xps_udp_t *udp) {
+  assert(udp != NULL);
+
+  for (u_int i = 0; i < udp->n_buckets; i++) {
+    while (udp->buckets[i] != NULL)
+      udp_flow_destroy(udp->buckets[i]);
+  }
+  free(udp->buckets);
+
+  if (udp->sweep_timer != NULL)
+    xps_loop_cancel_timer(udp->core->loop, udp->sweep_timer);
+  xps_loop_detach(udp->core->loop, udp->sock_fd);
+  close(udp->sock_fd);
+
+  logger(LOG_DEBUG, "xps_udp_destroy()", "destroyed UDP proxy on port %u", udp->port);
+
+  free(udp);
+}
+
+void xps_udp_log_stats(xps_udp_t *udp) {
+  assert(udp != NULL);
+
+  logger(LOG_INFO, "xps_udp_log_stats()",
+         "UDP port %u: flows %u, created %lu, expired %lu, received %lu, replied %lu, dropped "
+         "%lu, coalesced %lu",
+         udp->port, udp->n_flows, udp->n_flows_created, udp->n_flows_expired, udp->n_received,
+         udp->n_replied, udp->n_dropped, udp->n_coalesced);
+}
+
+/**
+ * Reads datagrams from clients and sends them on through their flows
+ *
+ * Datagrams of the same flow that follow each other in a batch go out with
+ * one sendmmsg().
+ */
+void udp_read_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_udp_t *udp = ptr;
+  xps_udp_batch_t *batch = udp->core->loop->udp_batch;
+
+  for (u_int ops = 0; ops < udp->core->config->io_budget_ops; ops++) {
+    int n = udp_recv(udp->sock_fd, batch, true);
+    if (n <= 0)
+      return;
+
+    xps_udp_flow_t *curr = NULL;
+    int k = 0;
+    for (int i = 0; i < n; i++) {
+      udp->n_received++;
+      if (udp_gso_size(&(batch->in[i].msg_hdr)) > 0)
+        udp->n_coalesced++;
+
+      xps_udp_flow_t *flow = udp_flow_get(udp, &(batch->in_addr[i]));
+      if (flow == NULL) {
+        udp->n_dropped++;
+        continue;
+      }
+      flow->last_msec = udp->core->loop->time_msec;
+
+      if (flow != curr && k > 0) {
+        udp->n_dropped += k - udp_send(curr->sock_fd, batch, k);
+        k = 0;
+      }
+      curr = flow;
+      udp_out_add(batch, k++, i, NULL);
+    }
+    if (k > 0)
+      udp->n_dropped += k - udp_send(curr->sock_fd, batch, k);
+
+    if (n < UDP_BATCH)
+      return;
+  }
+}
+
+/**
+ * Clears the pending error of a UDP socket, e.g. from an ICMP message,
+ * which would otherwise be reported by the loop again and again
+ */
+void udp_error_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_udp_t *udp = ptr;
+
+  int error = 0;
+  socklen_t len = sizeof(error);
+  getsockopt(udp->sock_fd, SOL_SOCKET, SO_ERROR, &error, &len);
+}
+
+/**
+ * Reads replies from the upstream and sends them to the flow's client
+ */
+void udp_flow_read_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_udp_flow_t *flow = ptr;
+  xps_udp_t *udp = flow->udp;
+  xps_udp_batch_t *batch = udp->core->loop->udp_batch;
+
+  for (u_int ops = 0; ops < udp->core->config->io_budget_ops; ops++) {
+    int n = udp_recv(flow->sock_fd, batch, false);
+    if (n <= 0)
+      return;
+
+    flow->last_msec = udp->core->loop->time_msec;
+    for (int i = 0; i < n; i++) {
+      if (udp_gso_size(&(batch->in[i].msg_hdr)) > 0)
+        udp->n_coalesced++;
+      udp_out_add(batch, i, i, &(flow->client_addr));
+    }
+
+    int sent = udp_send(udp->sock_fd, batch, n);
+    udp->n_replied += sent;
+    udp->n_dropped += n - sent;
+
+    if (n < UDP_BATCH)
+      return;
+  }
+}
+
+/**
+ * Clears the pending error of a flow, an upstream that is not listening
+ * makes its replies fail with ECONNREFUSED
+ */
+void udp_flow_error_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_udp_flow_t *flow = ptr;
+
+  int error = 0;
+  socklen_t len = sizeof(error);
+  getsockopt(flow->sock_fd, SOL_SOCKET, SO_ERROR, &error, &len);
+}
+
+/**
+ * Closes flows that were idle for config->udp_idle_msec
+ */
+void udp_sweep_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_udp_t *udp = ptr;
+  u_long now = udp->core->loop->time_msec;
+  u_long idle_msec = udp->core->config->udp_idle_msec;
+
+  for (u_int i = 0; i < udp->n_buckets; i++) {
+    xps_udp_flow_t *flow = udp->buckets[i];
+    while (flow != NULL) {
+      xps_udp_flow_t *next = flow->next;
+      if (now - flow->last_msec >= idle_msec) {
+        udp_flow_destroy(flow);
+        udp->n_flows_expired++;
+      }
+      flow = next;
+    }
+  }
+
+  udp->sweep_timer = xps_loop_add_timer(udp->core->loop, UDP_SWEEP_MSEC, udp, udp_sweep_handler);
+}
+
+/**
+ * Lets a UDP socket receive GRO bursts, see xps_udp.h. Kernels without UDP
+ * GRO deliver datagrams one by one.
+ */
+void udp_enable_gro(int sock_fd) {
+  const int enable = 1;
+  setsockopt(sock_fd, SOL_UDP, UDP_GRO, &enable, sizeof(enable));
+}
+
+/**
+ * Receives a batch of datagrams into batch->in
+ *
+ * @param sock_fd : UDP socket
+ * @param batch : scratch datagrams of the loop
+ * @param with_addr : true to fill batch->in_addr with the senders
+ * @return : number of datagrams, 0 if there are none or on error
+ */
+int udp_recv(int sock_fd, xps_udp_batch_t *batch, bool with_addr) {
+  for (int i = 0; i < UDP_BATCH; i++) {
+    batch->in_iov[i].iov_base = batch->data[i];
+    batch->in_iov[i].iov_len = UDP_MAX_DATAGRAM;
+    struct msghdr *msg = &(batch->in[i].msg_hdr);
+    msg->msg_name = with_addr ? &(batch->in_addr[i]) : NULL;
+    msg->msg_namelen = with_addr ? sizeof(struct sockaddr_in) : 0;
+    msg->msg_iov = &(batch->in_iov[i]);
+    msg->msg_iovlen = 1;
+    msg->msg_control = batch->in_ctrl[i];
+    msg->msg_controllen = UDP_CTRL_LEN;
+    msg->msg_flags = 0;
+  }
+
+  int n = recvmmsg(sock_fd, batch->in, UDP_BATCH, MSG_DONTWAIT, NULL);
+  if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED)
+    logger(LOG_ERROR, "udp_recv()", "recvmmsg() failed");
+
+  return n < 0 ? 0 : n;
+}
+
+/**
+ * @return : size of the datagrams of a GRO burst, 0 for a single datagram
+ */
+u_int udp_gso_size(struct msghdr *msg) {
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+      int gso_size;
+      memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+      return gso_size;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Sets up batch->out[k] to send the datagram received in batch->in[i]
+ *
+ * A GRO burst is sent with UDP_SEGMENT of its datagram size.
+ *
+ * @param addr : destination, NULL on a connected socket
+ */
+void udp_out_add(xps_udp_batch_t *batch, int k, int i, struct sockaddr_in *addr) {
+  struct msghdr *in = &(batch->in[i].msg_hdr);
+  struct msghdr *out = &(batch->out[k].msg_hdr);
+  u_int len = batch->in[i].msg_len;
+
+  batch->out_iov[k].iov_base = batch->data[i];
+  batch->out_iov[k].iov_len = len;
+  memset(out, 0, sizeof(struct msghdr));
+  out->msg_name = addr;
+  out->msg_namelen = addr != NULL ? sizeof(struct sockaddr_in) : 0;
+  out->msg_iov = &(batch->out_iov[k]);
+  out->msg_iovlen = 1;
+
+  u_int gso_size = udp_gso_size(in);
+  if (gso_size > 0 && gso_size < len) {
+    out->msg_control = batch->out_ctrl[k];
+    out->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(out);
+    cmsg->cmsg_level = SOL_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t segment = gso_size;
+    memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+  }
+}
+
+/**
+ * Sends batch->out[0] to batch->out[n - 1]
+ *
+ * @return : number of messages sent, the rest are to be counted as dropped
+ */
+int udp_send(int sock_fd, xps_udp_batch_t *batch, int n) {
+  int sent = 0;
+  bool refused = false;
+  while (sent < n) {
+    int ret = sendmmsg(sock_fd, batch->out + sent, n - sent, MSG_DONTWAIT);
+    if (ret > 0) {
+      sent += ret;
+      continue;
+    }
+
+    // Socket buffer full, or an upstream that refused an earlier datagram
+    if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED)
+      logger(LOG_DEBUG, "udp_send()", "sendmmsg() failed: %s", strerror(errno));
+    if (ret < 0 && errno == ECONNREFUSED && !refused) {
+      refused = true;
+      continue;
+    }
+    break;
+  }
+  return sent;
+}
+
+/**
+ * Finds the flow of a client address, creating it if there is none
+ *
+ * @return : flow, NULL if there are config->udp_max_flows flows already or
+ * the upstream socket cannot be created
+ */
+xps_udp_flow_t *udp_flow_get(xps_udp_t *udp, struct sockaddr_in *addr) {
+  u_int i = udp_hash(addr) & (udp->n_buckets - 1);
+  for (xps_udp_flow_t *flow = udp->buckets[i]; flow != NULL; flow = flow->next) {
+    if (flow->client_addr.sin_port == addr->sin_port &&
+        flow->client_addr.sin_addr.s_addr == addr->sin_addr.s_addr)
+      return flow;
+  }
+
+  xps_core_t *core = udp->core;
+  if (udp->n_flows >= core->config->udp_max_flows)
+    return NULL;
+
+  xps_udp_flow_t *flow = malloc(sizeof(xps_udp_flow_t));
+  if (flow == NULL) {
+    logger(LOG_ERROR, "udp_flow_get()", "malloc() failed for 'flow'");
+    return NULL;
+  }
+
+  int sock_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if (sock_fd < 0 ||
+      connect(sock_fd, (struct sockaddr *)&(udp->upstream_addr), sizeof(struct sockaddr_in)) < 0 ||
+      xps_loop_attach(core->loop, sock_fd, EPOLLIN, flow, udp_flow_read_handler, NULL,
+                      udp_flow_error_handler) != OK) {
+    logger(LOG_ERROR, "udp_flow_get()", "failed to create upstream socket");
+    if (sock_fd >= 0)
+      close(sock_fd);
+    free(flow);
+    return NULL;
+  }
+
+  udp_enable_gro(sock_fd);
+
+  // Init values
+  flow->udp = udp;
+  flow->client_addr = *addr;
+  flow->sock_fd = sock_fd;
+  flow->last_msec = core->loop->time_msec;
+
+  if (udp->n_flows >= udp->n_buckets)
+    udp_grow(udp);
+  i = udp_hash(addr) & (udp->n_buckets - 1);
+  flow->next = udp->buckets[i];
+  udp->buckets[i] = flow;
+  udp->n_flows++;
+  udp->n_flows_created++;
+
+  return flow;
+}
+
+void udp_flow_destroy(xps_udp_flow_t *flow) {
+  xps_udp_t *udp = flow->udp;
+
+  // Unlink from bucket
+  xps_udp_flow_t **link = &(udp->buckets[udp_hash(&(flow->client_addr)) & (udp->n_buckets - 1)]);
+  while (*link != flow)
+    link = &((*link)->next);
+  *link = flow->next;
+  udp->n_flows--;
+
+  xps_loop_detach(udp->core->loop, flow->sock_fd);
+  close(flow->sock_fd);
+  free(flow);
+}
+
+/**
+ * Doubles the buckets of the flow table
+ *
+ * @return : OK, or E_FAIL if out of memory, the table keeps working with
+ * longer chains then
+ */
+int udp_grow(xps_udp_t *udp) {
+  u_int n_buckets = udp->n_buckets * 2;
+  xps_udp_flow_t **buckets = calloc(n_buckets, sizeof(xps_udp_flow_t *));
+  if (buckets == NULL) {
+    logger(LOG_ERROR, "udp_grow()", "calloc() failed for 'buckets'");
+    return E_FAIL;
+  }
+
+  for (u_int i = 0; i < udp->n_buckets; i++) {
+    xps_udp_flow_t *flow = udp->buckets[i];
+    while (flow != NULL) {
+      xps_udp_flow_t *next = flow->next;
+      u_int j = udp_hash(&(flow->client_addr)) & (n_buckets - 1);
+      flow->next = buckets[j];
+      buckets[j] = flow;
+      flow = next;
+    }
+  }
+
+  free(udp->buckets);
+  udp->buckets = buckets;
+  udp->n_buckets = n_buckets;
+  return OK;
+}
+
+u_long udp_hash(const struct sockaddr_in *addr) {
+  u_long key = ((u_long)addr->sin_addr.s_addr << 16) | addr->sin_port;
+  u_long hash = key * 0x9E3779B97F4A7C15UL;
+  return hash ^ (hash >> 31);
+}
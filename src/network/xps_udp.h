@@ -0,0 +1,66 @@
+#ifndef XPS_UDP_H
+#define XPS_UDP_H
+
+#include "../xps.h"
+
+/*
+ * UDP proxy, one per port in config->udp_proxies.
+ *
+ * Datagrams from a client go out through a flow, a socket connected to the
+ * upstream that only carries that client's traffic, so replies read from it
+ * are sent back to the client's address. Flows are kept in a hash table on
+ * the client address and closed after config->udp_idle_msec without
+ * traffic either way.
+ *
+ * Sockets are read and written UDP_BATCH datagrams at a time with
+ * recvmmsg() and sendmmsg(). With UDP GRO the kernel may hand over a burst
+ * of equal sized datagrams as one buffer; it is sent on in one piece with
+ * UDP GSO so the datagrams keep their boundaries. Sockets are level
+ * triggered: a socket with datagrams left after config->io_budget_ops
+ * batches is reported again in the next loop iteration. Datagrams that find
+ * a socket buffer full are dropped, as UDP would.
+ */
+#define UDP_CTRL_LEN CMSG_SPACE(sizeof(int))
+
+struct xps_udp_batch_s {
+  struct mmsghdr in[UDP_BATCH];
+  struct iovec in_iov[UDP_BATCH];
+  struct sockaddr_in in_addr[UDP_BATCH];
+  u_char in_ctrl[UDP_BATCH][UDP_CTRL_LEN] __attribute__((aligned(8)));
+  struct mmsghdr out[UDP_BATCH];
+  struct iovec out_iov[UDP_BATCH];
+  u_char out_ctrl[UDP_BATCH][UDP_CTRL_LEN] __attribute__((aligned(8)));
+  u_char data[UDP_BATCH][UDP_MAX_DATAGRAM];
+};
+
+struct xps_udp_flow_s {
+  xps_udp_t *udp;
+  struct sockaddr_in client_addr;
+  int sock_fd; // Connected to the upstream
+  u_long last_msec; // Last datagram either way
+  xps_udp_flow_t *next; // Next flow in bucket
+};
+
+struct xps_udp_s {
+  xps_core_t *core;
+  u_int port;
+  int sock_fd;
+  struct sockaddr_in upstream_addr;
+  xps_udp_flow_t **buckets;
+  u_int n_buckets; // Power of two
+  u_int n_flows;
+  loop_timer_t *sweep_timer;
+  u_long n_received;  // Datagrams from clients, a GRO burst counts once
+  u_long n_replied;   // Datagrams sent back to clients, a GRO burst counts once
+  u_long n_dropped;   // Datagrams a socket did not take, or that found no flow
+  u_long n_coalesced; // Buffers received as a GRO burst
+  u_long n_flows_created;
+  u_long n_flows_expired;
+};
+
+xps_udp_t *xps_udp_create(xps_core_t *core, u_int port, const char *upstream_host,
+                          u_int upstream_port);
+void xps_udp_destroy(xps_udp_t *udp);
+void xps_udp_log_stats(xps_udp_t *udp);
+
+#endif
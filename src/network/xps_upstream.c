@@ -7,13 +7,6 @@ xps_connection_t *xps_upstream_create(xps_core_t *core, const char *host,
   assert(host != NULL);
   assert(is_valid_port(port));
 
-  int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (sock_fd < 0) {
-    logger(LOG_ERROR, "xps_upstream_create()", "socket() failed");
-    perror("Error message");
-    return NULL;
-  }
-
   /* create a socket and connect to host and port to upstream using
    * xps_getaddrinfo and connect function */
 
@@ -21,16 +14,27 @@ xps_connection_t *xps_upstream_create(xps_core_t *core, const char *host,
   if (upstream_addrinfo == NULL) {
     logger(LOG_ERROR, "xps_upstream_create()", "getaddrinfo() failed");
     perror("Error message");
-    close(sock_fd);
     return NULL;
   }
 
+  int sock_fd = socket(upstream_addrinfo->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (sock_fd < 0) {
+    logger(LOG_ERROR, "xps_upstream_create()", "socket() failed");
+    perror("Error message");
+    xps_freeaddrinfo(upstream_addrinfo);
+    return NULL;
+  }
+
+  xps_sock_profile_t *profile = xps_sock_profile_upstream(core, host, port);
+  xps_sock_profile_connect(profile, sock_fd, upstream_addrinfo->ai_family != AF_UNIX);
+
   int connect_error = connect(sock_fd, upstream_addrinfo->ai_addr,
                               upstream_addrinfo->ai_addrlen);
 
   if (!(connect_error == 0 || errno == EINPROGRESS)) {
     logger(LOG_ERROR, "xps_upstream_create()", "connect() failed");
     perror("Error message");
+    xps_freeaddrinfo(upstream_addrinfo);
     close(sock_fd);
     return NULL;
   }
@@ -41,10 +45,21 @@ xps_connection_t *xps_upstream_create(xps_core_t *core, const char *host,
     logger(LOG_ERROR, "xps_upstream_create()",
            "xps_connection_create() failed");
     perror("Error message");
+    xps_freeaddrinfo(upstream_addrinfo);
     close(sock_fd);
     return NULL;
   }
 
+  if (connection->remote_ip == NULL && upstream_addrinfo->ai_family == AF_UNIX) {
+    connection->remote_ip = strdup(host);
+  } else if (connection->remote_ip == NULL) {
+    connection->remote_ip = malloc(INET_ADDRSTRLEN);
+    if (connection->remote_ip != NULL)
+      inet_ntop(AF_INET, &((struct sockaddr_in *)upstream_addrinfo->ai_addr)->sin_addr,
+                connection->remote_ip, INET_ADDRSTRLEN);
+  }
+  xps_freeaddrinfo(upstream_addrinfo);
+
   logger(LOG_DEBUG, "xps_upstream_create()", "upstream connection created");
 
   return connection;
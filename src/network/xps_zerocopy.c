@@ -0,0 +1,244 @@
+#include "../xps.h"
+
+void zerocopy_linger_handler(void *ptr);
+void zerocopy_linger_timer_handler(void *ptr);
+void zerocopy_finish(xps_zerocopy_t *zerocopy, u_int lo, u_int hi);
+
+/**
+ * Enables MSG_ZEROCOPY on a socket
+ *
+ * @param core : core instance
+ * @param sock_fd : connected TCP socket
+ * @return : zerocopy state of the socket, NULL if the socket does not support it
+ */
+xps_zerocopy_t *xps_zerocopy_create(xps_core_t *core, int sock_fd) {
+  assert(core != NULL);
+
+  const int enable = 1;
+  if (setsockopt(sock_fd, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) < 0) {
+    logger(LOG_DEBUG, "xps_zerocopy_create()", "SO_ZEROCOPY not supported: %s", strerror(errno));
+    return NULL;
+  }
+
+  xps_zerocopy_t *zerocopy = malloc(sizeof(xps_zerocopy_t));
+  if (zerocopy == NULL) {
+    logger(LOG_ERROR, "xps_zerocopy_create()", "malloc() failed for 'zerocopy'");
+    return NULL;
+  }
+
+  // Init values
+  zerocopy->core = core;
+  zerocopy->sock_fd = sock_fd;
+  vec_init(&(zerocopy->sends));
+  zerocopy->first_id = 0;
+  zerocopy->copied = false;
+  zerocopy->linger_timer = NULL;
+
+  return zerocopy;
+}
+
+/**
+ * Closes the socket of a closed connection, once the kernel is done with its
+ * zerocopy sends
+ *
+ * The socket must be detached from the loop already; the caller must not
+ * close it.
+ *
+ * @param zerocopy : zerocopy state of the connection
+ */
+void xps_zerocopy_destroy(xps_zerocopy_t *zerocopy) {
+  assert(zerocopy != NULL);
+  xps_core_t *core = zerocopy->core;
+
+  xps_zerocopy_complete(zerocopy);
+  if (zerocopy->sends.length == 0) {
+    xps_zerocopy_free(zerocopy);
+    return;
+  }
+
+  // Completions are reported as EPOLLERR, which needs no interest flags
+  if (xps_loop_attach(core->loop, zerocopy->sock_fd, EPOLLET, zerocopy, NULL, NULL,
+                      zerocopy_linger_handler) != OK) {
+    logger(LOG_ERROR, "xps_zerocopy_destroy()", "xps_loop_attach() failed");
+    xps_zerocopy_free(zerocopy);
+    return;
+  }
+  xps_loop_set_error_cb(core->loop, zerocopy->sock_fd, zerocopy_linger_handler);
+
+  zerocopy->linger_timer =
+      xps_loop_add_timer(core->loop, ZEROCOPY_LINGER_MSEC, zerocopy, zerocopy_linger_timer_handler);
+  vec_push(&(core->lingering), zerocopy);
+}
+
+/**
+ * Sends the gathered bytes of a sink with MSG_ZEROCOPY
+ *
+ * The buffers are held before the send, so the sink never trims what the
+ * kernel may still read. Falls back to a copying send when they cannot be
+ * held, or while the kernel is short of memory to track the pages with.
+ *
+ * @param zerocopy : zerocopy state of the sink's connection
+ * @param sink : sink the bytes are read from
+ * @param iov : bytes at the front of the sink, see xps_pipe_sink_iov()
+ * @param n_iov : number of entries in iov
+ * @return : bytes sent, or -1 with errno set as by sendmsg()
+ */
+long xps_zerocopy_send(xps_zerocopy_t *zerocopy, xps_pipe_sink_t *sink, struct iovec *iov,
+                       int n_iov) {
+  assert(zerocopy != NULL);
+  assert(sink != NULL);
+
+  struct msghdr msg = {0};
+  msg.msg_iov = iov;
+  msg.msg_iovlen = n_iov;
+
+  // Slices of all gathered bytes, a short send holds its unsent tail a little longer
+  size_t len = 0;
+  for (int i = 0; i < n_iov; i++)
+    len += iov[i].iov_len;
+  xps_buffer_list_t *buff_list = xps_buffer_list_create();
+  if (buff_list == NULL || xps_pipe_sink_tee(sink, len, buff_list) != OK) {
+    logger(LOG_ERROR, "xps_zerocopy_send()", "failed to hold buffers, sending a copy");
+    if (buff_list != NULL)
+      xps_buffer_list_destroy(buff_list);
+    return sendmsg(zerocopy->sock_fd, &msg, MSG_NOSIGNAL);
+  }
+
+  long write_n = sendmsg(zerocopy->sock_fd, &msg, MSG_NOSIGNAL | MSG_ZEROCOPY);
+  if (write_n <= 0) {
+    int error = errno;
+    xps_buffer_list_destroy(buff_list);
+    errno = error;
+    if (write_n < 0 && errno == ENOBUFS)
+      return sendmsg(zerocopy->sock_fd, &msg, MSG_NOSIGNAL);
+    return write_n;
+  }
+
+  // The kernel numbered this send, its buffers are kept until it finishes
+  zerocopy->core->n_zerocopy_sends++;
+  vec_push(&(zerocopy->sends), buff_list);
+
+  return write_n;
+}
+
+/**
+ * Reads completions from the socket's error queue and drops the buffers of
+ * finished sends
+ *
+ * @param zerocopy : zerocopy state of a connection
+ * @return : OK, or E_FAIL if the socket has an error of its own
+ */
+int xps_zerocopy_complete(xps_zerocopy_t *zerocopy) {
+  assert(zerocopy != NULL);
+
+  for (;;) {
+    u_char ctrl[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+    struct msghdr msg = {0};
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof(ctrl);
+    if (recvmsg(zerocopy->sock_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+      break;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+          !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+        continue;
+      struct sock_extended_err *err = (struct sock_extended_err *)CMSG_DATA(cmsg);
+      if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        continue;
+
+      if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+        zerocopy->copied = true;
+        zerocopy->core->n_zerocopy_copied += err->ee_data - err->ee_info + 1;
+      }
+      zerocopy_finish(zerocopy, err->ee_info, err->ee_data);
+    }
+  }
+
+  int error = 0;
+  socklen_t len = sizeof(error);
+  if (getsockopt(zerocopy->sock_fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0)
+    return E_FAIL;
+
+  return OK;
+}
+
+/**
+ * Closes the socket and drops the buffers of sends still in flight
+ *
+ * @param zerocopy : zerocopy state, of a closed connection if it is lingering
+ */
+void xps_zerocopy_free(xps_zerocopy_t *zerocopy) {
+  assert(zerocopy != NULL);
+  xps_core_t *core = zerocopy->core;
+
+  if (zerocopy->linger_timer != NULL) {
+    xps_loop_cancel_timer(core->loop, zerocopy->linger_timer);
+    xps_loop_detach(core->loop, zerocopy->sock_fd);
+    vec_remove(&(core->lingering), zerocopy);
+  }
+
+  for (int i = 0; i < zerocopy->sends.length; i++) {
+    if (zerocopy->sends.data[i] != NULL)
+      xps_buffer_list_destroy(zerocopy->sends.data[i]);
+  }
+  vec_deinit(&(zerocopy->sends));
+  close(zerocopy->sock_fd);
+  free(zerocopy);
+}
+
+void xps_zerocopy_log_stats(xps_core_t *core) {
+  assert(core != NULL);
+
+  if (core->config->zerocopy_min == 0)
+    return;
+
+  logger(LOG_INFO, "xps_zerocopy_log_stats()",
+         "zerocopy sends: %lu, copied by kernel: %lu, lingering sockets: %d",
+         core->n_zerocopy_sends, core->n_zerocopy_copied, core->lingering.length);
+}
+
+void zerocopy_linger_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_zerocopy_t *zerocopy = ptr;
+
+  xps_zerocopy_complete(zerocopy);
+  if (zerocopy->sends.length == 0)
+    xps_zerocopy_free(zerocopy);
+}
+
+void zerocopy_linger_timer_handler(void *ptr) {
+  assert(ptr != NULL);
+  xps_zerocopy_t *zerocopy = ptr;
+
+  zerocopy->linger_timer = NULL;
+  logger(LOG_WARNING, "zerocopy_linger_timer_handler()",
+         "%d zerocopy sends did not complete, closing socket", zerocopy->sends.length);
+  xps_loop_detach(zerocopy->core->loop, zerocopy->sock_fd);
+  vec_remove(&(zerocopy->core->lingering), zerocopy);
+  xps_zerocopy_free(zerocopy);
+}
+
+/**
+ * Drops the buffers of sends lo to hi, both inclusive. Ids are 32 bit and
+ * wrap around.
+ */
+void zerocopy_finish(xps_zerocopy_t *zerocopy, u_int lo, u_int hi) {
+  for (int i = 0; i < zerocopy->sends.length; i++) {
+    u_int id = zerocopy->first_id + i;
+    if (id - lo > hi - lo || zerocopy->sends.data[i] == NULL)
+      continue;
+    xps_buffer_list_destroy(zerocopy->sends.data[i]);
+    zerocopy->sends.data[i] = NULL;
+  }
+
+  // Sends finish in order on TCP, this only waits for a straggler otherwise
+  int n = 0;
+  while (n < zerocopy->sends.length && zerocopy->sends.data[n] == NULL)
+    n++;
+  if (n > 0) {
+    vec_splice(&(zerocopy->sends), 0, n);
+    zerocopy->first_id += n;
+  }
+}
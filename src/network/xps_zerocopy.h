@@ -0,0 +1,42 @@
+#ifndef XPS_ZEROCOPY_H
+#define XPS_ZEROCOPY_H
+
+#include "../xps.h"
+
+/*
+ * MSG_ZEROCOPY sends of a connection's sink, for writes of at least
+ * config->zerocopy_min bytes. Smaller writes are copied as usual, pinning
+ * pages and reading completions costs more than copying them.
+ *
+ * The kernel sends straight from the pipe's buffers, so they must not be
+ * freed or reused until it is done with them. Every send holds slices of the
+ * bytes it sent, which keep the buffers alive after the sink has cleared
+ * them from the pipe. The kernel numbers zerocopy sends in order and reports
+ * ranges of finished ones on the socket's error queue, which makes epoll
+ * report EPOLLERR; the loop hands that to xps_zerocopy_complete(), which
+ * drops the slices of finished sends.
+ *
+ * Where the kernel had to copy after all, e.g. over loopback, it says so in
+ * the completion and the connection goes back to plain sends.
+ *
+ * A connection closed with sends in flight leaves its socket open until
+ * their completions arrive, or ZEROCOPY_LINGER_MSEC has passed.
+ */
+struct xps_zerocopy_s {
+  xps_core_t *core;
+  int sock_fd;
+  vec_void_t sends; // xps_buffer_list_t of sends in flight, NULL once finished
+  u_int first_id;   // Kernel's number of sends.data[0]
+  bool copied;      // Kernel copied a send, later writes are sent plainly
+  loop_timer_t *linger_timer;
+};
+
+xps_zerocopy_t *xps_zerocopy_create(xps_core_t *core, int sock_fd);
+void xps_zerocopy_destroy(xps_zerocopy_t *zerocopy);
+long xps_zerocopy_send(xps_zerocopy_t *zerocopy, xps_pipe_sink_t *sink, struct iovec *iov,
+                       int n_iov);
+int xps_zerocopy_complete(xps_zerocopy_t *zerocopy);
+void xps_zerocopy_free(xps_zerocopy_t *zerocopy);
+void xps_zerocopy_log_stats(xps_core_t *core);
+
+#endif
@@ -1,10 +1,112 @@
 #include "../xps.h"
 
+/* buffer pool */
+
+/*
+ * Data blocks of xps_buffer_create() are taken from per size class free lists.
+ * Reads land in the loop's scratch buffer and are copied into the smallest
+ * class that fits, so small messages hold 2 KB instead of a full read size.
+ * Sizes above the largest class are malloc()ed directly.
+ *
+ * Buffers may be released on another thread than the one that created them,
+ * e.g. slices of cache entries shared by several loops, so each class has a
+ * lock. It is held for a few instructions and rarely contended.
+ */
+struct buffer_class_s {
+  size_t size;
+  pthread_mutex_t lock;
+  vec_void_t free_list;
+  u_long n_allocs;  // Blocks handed out
+  u_long n_reuses;  // Blocks handed out from free_list
+  u_long n_in_use;  // Blocks currently handed out
+};
+
+static struct buffer_class_s buffer_classes[N_BUFFER_CLASSES];
+static pthread_once_t buffer_pool_once = PTHREAD_ONCE_INIT;
+static bool buffer_pool_ready = false;
+
+static void buffer_pool_init() {
+  size_t size = MIN_BUFFER_CLASS_SIZE;
+  for (int i = 0; i < N_BUFFER_CLASSES; i++) {
+    buffer_classes[i].size = size;
+    pthread_mutex_init(&(buffer_classes[i].lock), NULL);
+    vec_init(&(buffer_classes[i].free_list));
+    buffer_classes[i].n_allocs = 0;
+    buffer_classes[i].n_reuses = 0;
+    buffer_classes[i].n_in_use = 0;
+    size *= 4;
+  }
+  buffer_pool_ready = true;
+}
+
+static int buffer_class_of(size_t size) {
+  for (int i = 0; i < N_BUFFER_CLASSES; i++) {
+    if (size <= buffer_classes[i].size)
+      return i;
+  }
+  return -1;
+}
+
+static u_char *buffer_pool_alloc(int size_class) {
+  struct buffer_class_s *class = &buffer_classes[size_class];
+
+  u_char *data = NULL;
+  pthread_mutex_lock(&(class->lock));
+  if (class->free_list.length > 0) {
+    data = vec_pop(&(class->free_list));
+    class->n_reuses++;
+  }
+  class->n_allocs++;
+  class->n_in_use++;
+  pthread_mutex_unlock(&(class->lock));
+
+  if (data == NULL)
+    data = malloc(class->size);
+  if (data == NULL) {
+    pthread_mutex_lock(&(class->lock));
+    class->n_allocs--;
+    class->n_in_use--;
+    pthread_mutex_unlock(&(class->lock));
+  }
+  return data;
+}
+
+static void buffer_pool_free(int size_class, u_char *data) {
+  struct buffer_class_s *class = &buffer_classes[size_class];
+
+  // Keep a bounded number of free blocks per class
+  pthread_mutex_lock(&(class->lock));
+  class->n_in_use--;
+  bool kept = class->free_list.length * class->size < BUFFER_POOL_CLASS_MAX_BYTES &&
+              vec_push(&(class->free_list), data) == 0;
+  pthread_mutex_unlock(&(class->lock));
+  if (!kept)
+    free(data);
+}
+
+void xps_buffer_log_stats() {
+  if (!buffer_pool_ready)
+    return;
+
+  for (int i = 0; i < N_BUFFER_CLASSES; i++) {
+    struct buffer_class_s *class = &buffer_classes[i];
+    pthread_mutex_lock(&(class->lock));
+    u_long n_in_use = class->n_in_use, n_allocs = class->n_allocs, n_reuses = class->n_reuses;
+    int n_free = class->free_list.length;
+    pthread_mutex_unlock(&(class->lock));
+    logger(LOG_INFO, "xps_buffer_log_stats()",
+           "class %zu B: in use %lu, free %d, allocs %lu, reused %lu", class->size, n_in_use,
+           n_free, n_allocs, n_reuses);
+  }
+}
+
 /* xps_buffer */
 
 xps_buffer_t *xps_buffer_create(size_t size, size_t len, u_char *data) {
   assert(size > 0);
 
+  pthread_once(&buffer_pool_once, buffer_pool_init);
+
   // Alloc memory for instance
   xps_buffer_t *buff = malloc(sizeof(xps_buffer_t));
   if (buff == NULL) {
@@ -12,9 +114,16 @@ xps_buffer_t *xps_buffer_create(size_t size, size_t len, u_char *data) {
     return NULL;
   }
 
-  // Alloc memory for 'data' if it is NULL
-  if (data == NULL)
-    data = malloc(size);
+  // Alloc memory for 'data' if it is NULL, rounded up to its size class
+  int size_class = -1;
+  if (data == NULL) {
+    size_class = buffer_class_of(size);
+    if (size_class >= 0) {
+      size = buffer_classes[size_class].size;
+      data = buffer_pool_alloc(size_class);
+    } else
+      data = malloc(size);
+  }
 
   if (data == NULL) {
     logger(LOG_ERROR, "xps_buffer_create()", "malloc() failed for 'data'");
@@ -27,34 +136,88 @@ xps_buffer_t *xps_buffer_create(size_t size, size_t len, u_char *data) {
   buff->len = len;
   buff->data = data;
   buff->pos = data;
+  buff->size_class = size_class;
+  buff->refs = 1;
+  buff->shared = NULL;
 
   return buff;
 }
 
+/**
+ * Drops a reference to the buffer, freeing it with the last one
+ *
+ * Slices hold a reference to the buffer owning their data, which is dropped
+ * in turn. References may be dropped from any thread, see the buffer pool.
+ *
+ * @param buff : buffer to be destroyed
+ */
 void xps_buffer_destroy(xps_buffer_t *buff) {
   assert(buff != NULL);
-  free(buff->data);
+
+  if (__atomic_sub_fetch(&(buff->refs), 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+
+  if (buff->shared != NULL)
+    xps_buffer_destroy(buff->shared);
+  else if (buff->size_class >= 0)
+    buffer_pool_free(buff->size_class, buff->data);
+  else
+    free(buff->data);
   free(buff);
 }
 
 xps_buffer_t *xps_buffer_duplicate(xps_buffer_t *buff) {
   assert(buff != NULL);
 
-  xps_buffer_t *dup_buff = xps_buffer_create(buff->size, buff->len, NULL);
+  // Duplicate is sized to the data it holds, not to the capacity of 'buff'
+  xps_buffer_t *dup_buff = xps_buffer_create(buff->len > 0 ? buff->len : 1, buff->len, NULL);
   if (dup_buff == NULL) {
     logger(LOG_ERROR, "xps_buffer_duplicate()", "xps_buffer_create() failed");
     return NULL;
   }
 
-  // Set 'pos' of dup_buff
-  dup_buff->pos = dup_buff->data + (buff->pos - buff->data);
-
   // Copy over data
-  memcpy(dup_buff->data, buff->data, dup_buff->len);
+  memcpy(dup_buff->data, buff->pos, dup_buff->len);
 
   return dup_buff;
 }
 
+/**
+ * Creates a buffer sharing len bytes of buff from offset without copying them
+ *
+ * The slice keeps the underlying data alive until it is destroyed. Neither
+ * buffer should be written to while the data is shared.
+ *
+ * @param buff : buffer to be sliced
+ * @param offset : offset from buff->pos
+ * @param len : length of the slice
+ * @return : slice, NULL on failure
+ */
+xps_buffer_t *xps_buffer_slice(xps_buffer_t *buff, size_t offset, size_t len) {
+  assert(buff != NULL);
+  assert(offset + len <= buff->len);
+
+  xps_buffer_t *slice = malloc(sizeof(xps_buffer_t));
+  if (slice == NULL) {
+    logger(LOG_ERROR, "xps_buffer_slice()", "malloc() failed for 'slice'");
+    return NULL;
+  }
+
+  xps_buffer_t *owner = buff->shared != NULL ? buff->shared : buff;
+  __atomic_add_fetch(&(owner->refs), 1, __ATOMIC_RELAXED);
+
+  // Init values
+  slice->size = len;
+  slice->len = len;
+  slice->data = buff->pos + offset;
+  slice->pos = slice->data;
+  slice->size_class = -1;
+  slice->refs = 1;
+  slice->shared = owner;
+
+  return slice;
+}
+
 /* xps_buffer_list */
 
 xps_buffer_list_t *xps_buffer_list_create() {
@@ -95,19 +258,34 @@ void xps_buffer_list_append(xps_buffer_list_t *buff_list, xps_buffer_t *buff) {
 }
 
 xps_buffer_t *xps_buffer_list_read(xps_buffer_list_t *buff_list, size_t len) {
+  return xps_buffer_list_read_at(buff_list, 0, len);
+}
+
+/**
+ * Copies len bytes starting offset bytes into the list into a new buffer
+ *
+ * The list is left untouched, so several readers can each keep their own
+ * offset into it.
+ *
+ * @param buff_list : list to be read
+ * @param offset : number of bytes to skip from the front of the list
+ * @param len : number of bytes to be read
+ * @return : new buffer, NULL if the range is not available
+ */
+xps_buffer_t *xps_buffer_list_read_at(xps_buffer_list_t *buff_list, size_t offset, size_t len) {
   assert(buff_list != NULL);
   assert(len > 0);
 
   // Check if requested length is available
-  if (buff_list->len < len) {
-    logger(LOG_ERROR, "xps_buffer_list_read()", "requested length not available");
+  if (buff_list->len < offset + len) {
+    logger(LOG_ERROR, "xps_buffer_list_read_at()", "requested length not available");
     return NULL;
   }
 
   // Buffer to be returned
   xps_buffer_t *buff = xps_buffer_create(len, len, NULL);
   if (buff == NULL) {
-    logger(LOG_ERROR, "xps_buffer_list_read()", "xps_buffer_create() failed");
+    logger(LOG_ERROR, "xps_buffer_list_read_at()", "xps_buffer_create() failed");
     return NULL;
   }
 
@@ -115,22 +293,108 @@ xps_buffer_t *xps_buffer_list_read(xps_buffer_list_t *buff_list, size_t len) {
   for (int i = 0; i < buff_list->list.length && curr_len < len; i++) {
     xps_buffer_t *curr_buff = buff_list->list.data[i];
 
-    // Condition where full buffer can be copied
-    if ((curr_len + curr_buff->len) <= len) {
-      memcpy(buff->data + curr_len, curr_buff->data, curr_buff->len);
-      curr_len += curr_buff->len;
-    }
-    // Condition where partial buffer has to be copied
-    else {
-      size_t len_diff = len - curr_len;
-      memcpy(buff->data + curr_len, curr_buff->data, len_diff);
-      curr_len += len_diff;
+    // Skip buffers before offset
+    if (offset >= curr_buff->len) {
+      offset -= curr_buff->len;
+      continue;
     }
+
+    size_t n = curr_buff->len - offset;
+    if (n > len - curr_len)
+      n = len - curr_len;
+    memcpy(buff->data + curr_len, curr_buff->pos + offset, n);
+    curr_len += n;
+    offset = 0;
   }
 
   return buff;
 }
 
+/**
+ * Points iovecs at len bytes starting offset bytes into the list
+ *
+ * Nothing is copied, the iovecs are valid until the list changes.
+ *
+ * @param buff_list : list to be read
+ * @param offset : number of bytes to skip from the front of the list
+ * @param len : number of bytes wanted, fewer are covered if max_iov runs out
+ * @param iov : iovecs to be filled
+ * @param max_iov : size of iov
+ * @return : number of iovecs filled
+ */
+int xps_buffer_list_iov(xps_buffer_list_t *buff_list, size_t offset, size_t len,
+                        struct iovec *iov, int max_iov) {
+  assert(buff_list != NULL);
+  assert(iov != NULL);
+
+  int n_iov = 0;
+  for (int i = 0; i < buff_list->list.length && len > 0 && n_iov < max_iov; i++) {
+    xps_buffer_t *curr_buff = buff_list->list.data[i];
+
+    // Skip buffers before offset
+    if (offset >= curr_buff->len) {
+      offset -= curr_buff->len;
+      continue;
+    }
+
+    size_t n = curr_buff->len - offset;
+    if (n > len)
+      n = len;
+    iov[n_iov].iov_base = curr_buff->pos + offset;
+    iov[n_iov].iov_len = n;
+    n_iov++;
+    len -= n;
+    offset = 0;
+  }
+
+  return n_iov;
+}
+
+/**
+ * Appends slices of len bytes starting offset bytes into one list to another
+ *
+ * No data is copied and 'from' is left untouched; the slices keep the
+ * underlying buffers alive until they are destroyed.
+ *
+ * @param from : list to take bytes from
+ * @param offset : number of bytes to skip from the front of 'from'
+ * @param len : number of bytes to be shared
+ * @param to : list to append slices to
+ * @return : OK on success, E_FAIL on error
+ */
+int xps_buffer_list_tee(xps_buffer_list_t *from, size_t offset, size_t len, xps_buffer_list_t *to) {
+  assert(from != NULL);
+  assert(to != NULL);
+
+  if (from->len < offset + len) {
+    logger(LOG_ERROR, "xps_buffer_list_tee()", "requested length not available");
+    return E_FAIL;
+  }
+
+  for (int i = 0; i < from->list.length && len > 0; i++) {
+    xps_buffer_t *buff = from->list.data[i];
+
+    if (offset >= buff->len) {
+      offset -= buff->len;
+      continue;
+    }
+
+    size_t n = buff->len - offset;
+    if (n > len)
+      n = len;
+    xps_buffer_t *slice = xps_buffer_slice(buff, offset, n);
+    if (slice == NULL) {
+      logger(LOG_ERROR, "xps_buffer_list_tee()", "xps_buffer_slice() failed");
+      return E_FAIL;
+    }
+    xps_buffer_list_append(to, slice);
+    len -= n;
+    offset = 0;
+  }
+
+  return OK;
+}
+
 int xps_buffer_list_clear(xps_buffer_list_t *buff_list, size_t len) {
   assert(buff_list != NULL);
 
@@ -153,9 +417,9 @@ int xps_buffer_list_clear(xps_buffer_list_t *buff_list, size_t len) {
       xps_buffer_destroy(curr_buff);
       buff_list->list.data[i] = NULL;
     }
-    // Condition where partial buffer has to be cleared
+    // Condition where partial buffer has to be cleared, data may be shared
     else {
-      memmove(curr_buff->data, curr_buff->data + to_clear_len, curr_buff->len - to_clear_len);
+      curr_buff->pos += to_clear_len;
       curr_buff->len -= to_clear_len;
       to_clear_len = 0;
     }
@@ -165,4 +429,65 @@ int xps_buffer_list_clear(xps_buffer_list_t *buff_list, size_t len) {
   vec_filter_null(&(buff_list->list));
 
   return OK;
-}
\ No newline at end of file
+}
+
+/**
+ * Removes the first buffer from the list and hands it over to the caller
+ *
+ * @param buff_list : list to be shifted
+ * @return : first buffer, NULL if list is empty
+ */
+xps_buffer_t *xps_buffer_list_shift(xps_buffer_list_t *buff_list) {
+  assert(buff_list != NULL);
+
+  if (buff_list->list.length == 0)
+    return NULL;
+
+  xps_buffer_t *buff = buff_list->list.data[0];
+  vec_splice(&(buff_list->list), 0, 1);
+  buff_list->len -= buff->len;
+
+  return buff;
+}
+
+/**
+ * Moves len bytes from the front of one list to the end of another
+ *
+ * Whole buffers are handed over as they are. A buffer that is only partly
+ * moved is shared through a slice, so no data is copied.
+ *
+ * @param from : list to take bytes from
+ * @param to : list to append bytes to
+ * @param len : number of bytes to be moved
+ * @return : OK on success, E_FAIL on error
+ */
+int xps_buffer_list_move(xps_buffer_list_t *from, xps_buffer_list_t *to, size_t len) {
+  assert(from != NULL);
+  assert(to != NULL);
+
+  if (from->len < len) {
+    logger(LOG_ERROR, "xps_buffer_list_move()", "requested length not available");
+    return E_FAIL;
+  }
+
+  while (len > 0) {
+    xps_buffer_t *buff = from->list.data[0];
+
+    if (buff->len <= len) {
+      len -= buff->len;
+      xps_buffer_list_append(to, xps_buffer_list_shift(from));
+      continue;
+    }
+
+    xps_buffer_t *slice = xps_buffer_slice(buff, 0, len);
+    if (slice == NULL) {
+      logger(LOG_ERROR, "xps_buffer_list_move()", "xps_buffer_slice() failed");
+      return E_FAIL;
+    }
+    xps_buffer_list_append(to, slice);
+    xps_buffer_list_clear(from, len);
+    len = 0;
+  }
+
+  return OK;
+}
@@ -8,6 +8,9 @@ struct xps_buffer_s {
   size_t len;
   u_char *pos;
   u_char *data;
+  int size_class; // Index of pool size class of 'data', -1 if not pooled
+  u_int refs;     // Buffer is freed when the last reference is destroyed
+  xps_buffer_t *shared; // Buffer owning 'data' if this is a slice, NULL otherwise
 };
 
 struct xps_buffer_list_s {
@@ -19,12 +22,20 @@ struct xps_buffer_list_s {
 xps_buffer_t *xps_buffer_create(size_t size, size_t len, u_char *data);
 void xps_buffer_destroy(xps_buffer_t *buff);
 xps_buffer_t *xps_buffer_duplicate(xps_buffer_t *buff);
+xps_buffer_t *xps_buffer_slice(xps_buffer_t *buff, size_t offset, size_t len);
+void xps_buffer_log_stats();
 
 /* xps_buffer_list */
 xps_buffer_list_t *xps_buffer_list_create();
 void xps_buffer_list_destroy(xps_buffer_list_t *buff_list);
 void xps_buffer_list_append(xps_buffer_list_t *buff_list, xps_buffer_t *buff);
 xps_buffer_t *xps_buffer_list_read(xps_buffer_list_t *buff_list, size_t len);
+xps_buffer_t *xps_buffer_list_read_at(xps_buffer_list_t *buff_list, size_t offset, size_t len);
 int xps_buffer_list_clear(xps_buffer_list_t *buff_list, size_t len);
+xps_buffer_t *xps_buffer_list_shift(xps_buffer_list_t *buff_list);
+int xps_buffer_list_move(xps_buffer_list_t *from, xps_buffer_list_t *to, size_t len);
+int xps_buffer_list_iov(xps_buffer_list_t *buff_list, size_t offset, size_t len,
+                        struct iovec *iov, int max_iov);
+int xps_buffer_list_tee(xps_buffer_list_t *from, size_t offset, size_t len, xps_buffer_list_t *to);
 
 #endif
\ No newline at end of file
@@ -26,12 +26,15 @@ void logger(xps_log_level_t level, const char *function_name, const char *format
   va_list args;
   va_start(args, format_string);
 
+  // Worker threads log too, keep lines whole
+  flockfile(stdout);
   printf("%s" BOLD_START " %s " BOLD_END RESET_COLOR " " GREEN_TEXT "%s" RESET_COLOR " : ",
          log_level_colors[level], log_level_strings[level], function_name);
   vprintf(format_string, args);
   printf("\n");
 
   fflush(stdout);
+  funlockfile(stdout);
 
   va_end(args);
 }
\ No newline at end of file
@@ -0,0 +1,171 @@
+#include "../xps.h"
+
+int pool_grow(xps_pool_t *pool);
+bool pool_owns(xps_pool_t *pool, void *obj);
+
+/**
+ * Creates an object pool
+ *
+ * @param name : name used in logs and stats
+ * @param obj_size : size of a single object
+ * @param objs_per_slab : number of objects allocated at once when pool is empty
+ * @param debug : poison freed objects and verify the poison when reused
+ * @return : pool instance, NULL on failure
+ */
+xps_pool_t *xps_pool_create(const char *name, size_t obj_size, u_int objs_per_slab, bool debug) {
+  assert(name != NULL);
+  assert(obj_size > 0);
+  assert(objs_per_slab > 0);
+
+  xps_pool_t *pool = malloc(sizeof(xps_pool_t));
+  if (pool == NULL) {
+    logger(LOG_ERROR, "xps_pool_create()", "malloc() failed for 'pool'");
+    return NULL;
+  }
+
+  // Objects start on their own cache line and can hold the free list link
+  if (obj_size < sizeof(void *))
+    obj_size = sizeof(void *);
+  obj_size = (obj_size + CACHE_LINE_SIZE - 1) & ~((size_t)CACHE_LINE_SIZE - 1);
+
+  // Init values
+  pool->name = name;
+  pool->obj_size = obj_size;
+  pool->objs_per_slab = objs_per_slab;
+  vec_init(&(pool->slabs));
+  pool->free_list = NULL;
+  pool->debug = debug;
+  pool->n_allocs = 0;
+  pool->n_in_use = 0;
+
+  logger(LOG_DEBUG, "xps_pool_create()", "created pool '%s'", name);
+
+  return pool;
+}
+
+void xps_pool_destroy(xps_pool_t *pool) {
+  assert(pool != NULL);
+
+  if (pool->n_in_use > 0)
+    logger(LOG_WARNING, "xps_pool_destroy()", "pool '%s' destroyed with %lu objects in use",
+           pool->name, pool->n_in_use);
+
+  for (int i = 0; i < pool->slabs.length; i++)
+    free(pool->slabs.data[i]);
+  vec_deinit(&(pool->slabs));
+
+  logger(LOG_DEBUG, "xps_pool_destroy()", "destroyed pool '%s'", pool->name);
+
+  free(pool);
+}
+
+/**
+ * Takes an object from the pool, allocating a new slab if it is empty
+ *
+ * Returned memory is not zeroed.
+ *
+ * @param pool : pool to allocate from
+ * @return : object, NULL on failure
+ */
+void *xps_pool_alloc(xps_pool_t *pool) {
+  assert(pool != NULL);
+
+  if (pool->free_list == NULL && pool_grow(pool) != OK)
+    return NULL;
+
+  void *obj = pool->free_list;
+  pool->free_list = *(void **)obj;
+
+  // Anything other than poison past the link was written after free
+  if (pool->debug) {
+    u_char *bytes = obj;
+    for (size_t i = sizeof(void *); i < pool->obj_size; i++) {
+      if (bytes[i] != POOL_POISON) {
+        logger(LOG_ERROR, "xps_pool_alloc()", "pool '%s': object %p modified after free",
+               pool->name, obj);
+        break;
+      }
+    }
+  }
+
+  pool->n_allocs++;
+  pool->n_in_use++;
+
+  return obj;
+}
+
+/**
+ * Returns an object to the pool
+ *
+ * @param pool : pool the object was allocated from
+ * @param obj : object to be freed
+ */
+void xps_pool_free(xps_pool_t *pool, void *obj) {
+  assert(pool != NULL);
+  assert(obj != NULL);
+
+  if (pool->debug) {
+    if (!pool_owns(pool, obj)) {
+      logger(LOG_ERROR, "xps_pool_free()", "pool '%s': %p is not from this pool", pool->name,
+             obj);
+      return;
+    }
+    for (void *curr = pool->free_list; curr != NULL; curr = *(void **)curr) {
+      if (curr == obj) {
+        logger(LOG_ERROR, "xps_pool_free()", "pool '%s': double free of %p", pool->name, obj);
+        return;
+      }
+    }
+    memset(obj, POOL_POISON, pool->obj_size);
+  }
+
+  *(void **)obj = pool->free_list;
+  pool->free_list = obj;
+  pool->n_in_use--;
+}
+
+void xps_pool_log_stats(xps_pool_t *pool) {
+  assert(pool != NULL);
+
+  u_long capacity = (u_long)pool->slabs.length * pool->objs_per_slab;
+  logger(LOG_INFO, "xps_pool_log_stats()",
+         "pool '%s': in use %lu / %lu (%d slabs of %u x %zu B), allocs %lu", pool->name,
+         pool->n_in_use, capacity, pool->slabs.length, pool->objs_per_slab, pool->obj_size,
+         pool->n_allocs);
+}
+
+int pool_grow(xps_pool_t *pool) {
+  void *slab;
+  if (posix_memalign(&slab, CACHE_LINE_SIZE, pool->obj_size * pool->objs_per_slab) != 0) {
+    logger(LOG_ERROR, "pool_grow()", "posix_memalign() failed for pool '%s'", pool->name);
+    return E_FAIL;
+  }
+
+  if (vec_push(&(pool->slabs), slab) != 0) {
+    free(slab);
+    return E_FAIL;
+  }
+
+  if (pool->debug)
+    memset(slab, POOL_POISON, pool->obj_size * pool->objs_per_slab);
+
+  // Link objects so that they are handed out in address order
+  u_char *bytes = slab;
+  for (long i = (long)pool->objs_per_slab - 1; i >= 0; i--) {
+    void *obj = bytes + i * pool->obj_size;
+    *(void **)obj = pool->free_list;
+    pool->free_list = obj;
+  }
+
+  return OK;
+}
+
+bool pool_owns(xps_pool_t *pool, void *obj) {
+  size_t slab_size = pool->obj_size * pool->objs_per_slab;
+  for (int i = 0; i < pool->slabs.length; i++) {
+    u_char *slab = pool->slabs.data[i];
+    if ((u_char *)obj >= slab && (u_char *)obj < slab + slab_size)
+      return ((u_char *)obj - slab) % pool->obj_size == 0;
+  }
+  return false;
+}
@@ -0,0 +1,29 @@
+#ifndef XPS_POOL_H
+#define XPS_POOL_H
+
+#include "../xps.h"
+
+/*
+ * Fixed-size object pool. Objects are carved out of cache-line-aligned slabs
+ * and recycled through a free list, so create/destroy of short-lived objects
+ * does not go through malloc(). Slabs are only released when the pool is
+ * destroyed.
+ */
+struct xps_pool_s {
+  const char *name;
+  size_t obj_size; // Rounded up to CACHE_LINE_SIZE
+  u_int objs_per_slab;
+  vec_void_t slabs;
+  void *free_list; // Free objects, linked through their first word
+  bool debug;      // Poison freed objects and check the poison on reuse
+  u_long n_allocs;
+  u_long n_in_use;
+};
+
+xps_pool_t *xps_pool_create(const char *name, size_t obj_size, u_int objs_per_slab, bool debug);
+void xps_pool_destroy(xps_pool_t *pool);
+void *xps_pool_alloc(xps_pool_t *pool);
+void xps_pool_free(xps_pool_t *pool, void *obj);
+void xps_pool_log_stats(xps_pool_t *pool);
+
+#endif
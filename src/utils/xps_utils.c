@@ -4,31 +4,61 @@
 
 bool is_valid_port(u_int port) { return port >= 0 && port <= 65535; }
 
+struct addrinfo *unix_addrinfo(const char *host);
+
 char *get_remote_ip(u_int sock_fd) {
-  struct sockaddr_in addr;
+  struct sockaddr_storage addr;
   socklen_t addr_len = sizeof(addr);
   char ipstr[INET_ADDRSTRLEN];
 
   if (getpeername(sock_fd, (struct sockaddr *)&addr, &addr_len) != 0) {
+    // Non-blocking connect still in progress
+    if (errno == ENOTCONN)
+      return NULL;
     logger(LOG_ERROR, "get_remote_ip()", "getpeername() failed");
     perror("Error message");
     return NULL;
   }
 
+  // Unix socket peers have no address
+  if (addr.ss_family != AF_INET)
+    return NULL;
+
   char *ip_str = malloc(INET_ADDRSTRLEN);
   if (ip_str == NULL) {
     logger(LOG_ERROR, "get_remote_ip()", "malloc() failed for 'ip_str");
     return NULL;
   }
 
-  inet_ntop(AF_INET, &addr.sin_addr, ip_str, INET_ADDRSTRLEN);
+  inet_ntop(AF_INET, &((struct sockaddr_in *)&addr)->sin_addr, ip_str, INET_ADDRSTRLEN);
 
   return ip_str;
 }
 
+/**
+ * Checks whether a host names a unix socket
+ *
+ * Such hosts are UNIX_SOCKET_PREFIX followed by a path, or by '@' and a name
+ * in the abstract namespace, e.g. "unix:/run/app.sock" or "unix:@app".
+ */
+bool is_unix_host(const char *host) {
+  assert(host != NULL);
+  return strncmp(host, UNIX_SOCKET_PREFIX, strlen(UNIX_SOCKET_PREFIX)) == 0;
+}
+
+/**
+ * Resolves a host and port
+ *
+ * @param host : IPv4 host, or unix socket as in is_unix_host(), which ignores port
+ * @param port : TCP port
+ * @return : address list to be freed with xps_freeaddrinfo(), NULL on failure
+ */
 struct addrinfo *xps_getaddrinfo(const char *host, u_int port) {
   assert(host != NULL);
 
+  if (is_unix_host(host))
+    return unix_addrinfo(host);
+
   struct addrinfo hints, *result;
   memset(&hints, 0, sizeof(struct addrinfo));
   hints.ai_family = AF_INET;
@@ -57,23 +87,164 @@ struct addrinfo *xps_getaddrinfo(const char *host, u_int port) {
   return result;
 }
 
-int make_socket_non_blocking(u_int sock_fd) {
-  int flags = fcntl(sock_fd, F_GETFL, 0);
-  if (flags < 0) {
-    logger(LOG_ERROR, "make_socket_non_blocking()", "failed to get flags");
-    perror("Error message");
-    return E_FAIL;
+void xps_freeaddrinfo(struct addrinfo *addr_info) {
+  assert(addr_info != NULL);
+
+  if (addr_info->ai_family == AF_UNIX)
+    free(addr_info);
+  else
+    freeaddrinfo(addr_info);
+}
+
+/**
+ * Builds the address of a unix socket host in one allocation, the way
+ * getaddrinfo() would for IP hosts
+ */
+struct addrinfo *unix_addrinfo(const char *host) {
+  const char *path = host + strlen(UNIX_SOCKET_PREFIX);
+  size_t path_len = strlen(path);
+
+  struct sockaddr_un *addr;
+  if (path_len == 0 || path_len >= sizeof(addr->sun_path)) {
+    logger(LOG_ERROR, "unix_addrinfo()", "invalid unix socket path '%s'", path);
+    return NULL;
   }
 
-  if (fcntl(sock_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
-    logger(LOG_ERROR, "make_socket_non_blocking()", "failed to set flags");
-    perror("Error message");
+  struct addrinfo *result = calloc(1, sizeof(struct addrinfo) + sizeof(struct sockaddr_un));
+  if (result == NULL) {
+    logger(LOG_ERROR, "unix_addrinfo()", "calloc() failed for 'result'");
+    return NULL;
+  }
+  addr = (struct sockaddr_un *)(result + 1);
+  addr->sun_family = AF_UNIX;
+  memcpy(addr->sun_path, path, path_len);
+
+  // Abstract names start with a NUL byte and are not NUL terminated
+  socklen_t addr_len = offsetof(struct sockaddr_un, sun_path) + path_len + 1;
+  if (path[0] == '@') {
+    addr->sun_path[0] = '\0';
+    addr_len--;
+  }
+
+  result->ai_family = AF_UNIX;
+  result->ai_socktype = SOCK_STREAM;
+  result->ai_addr = (struct sockaddr *)addr;
+  result->ai_addrlen = addr_len;
+
+  logger(LOG_DEBUG, "unix_addrinfo()", "host: %s", host);
+
+  return result;
+}
+
+/* CPUs */
+
+/**
+ * Pins the calling thread to a CPU
+ *
+ * @param cpu : CPU number
+ * @return : OK on success, E_FAIL if the CPU does not exist or is not allowed
+ */
+int pin_to_cpu(int cpu) {
+  if (cpu < 0 || cpu >= CPU_SETSIZE)
+    return E_FAIL;
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+    logger(LOG_ERROR, "pin_to_cpu()", "sched_setaffinity() failed: %s", strerror(errno));
     return E_FAIL;
   }
+  return OK;
+}
 
+/**
+ * @return : NUMA node of a CPU, -1 if the kernel does not tell
+ */
+int get_cpu_node(int cpu) {
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR *dir = opendir(path);
+  if (dir == NULL)
+    return -1;
+
+  // The CPU's directory links to its node as "node<N>"
+  int node = -1;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    char *end;
+    if (strncmp(entry->d_name, "node", 4) != 0)
+      continue;
+    long n = strtol(entry->d_name + 4, &end, 10);
+    if (end != entry->d_name + 4 && *end == '\0') {
+      node = n;
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+}
+
+/**
+ * Makes pages the process faults in from now on come from a NUMA node
+ * while it has free memory
+ *
+ * @param node : NUMA node
+ * @return : OK on success, E_FAIL on error
+ */
+int prefer_node(int node) {
+  if (node < 0 || node >= (int)(sizeof(u_long) * 8))
+    return E_FAIL;
+
+  u_long mask = 1UL << node;
+  if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, sizeof(mask) * 8) < 0) {
+    logger(LOG_ERROR, "prefer_node()", "set_mempolicy() failed: %s", strerror(errno));
+    return E_FAIL;
+  }
   return OK;
 }
 
+/**
+ * Reads the CPUs of a NUMA node
+ *
+ * @param node : NUMA node
+ * @param set : filled with the node's CPUs
+ * @return : OK on success, E_FAIL if the kernel does not tell
+ */
+int get_node_cpus(int node, cpu_set_t *set) {
+  assert(set != NULL);
+
+  if (node < 0)
+    return E_FAIL;
+
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+    return E_FAIL;
+
+  // A list of ranges like "0-3,8-11"
+  char list[256];
+  bool ok = fgets(list, sizeof(list), file) != NULL;
+  fclose(file);
+  if (!ok)
+    return E_FAIL;
+
+  CPU_ZERO(set);
+  char *str = list;
+  while (*str >= '0' && *str <= '9') {
+    char *end;
+    long first = strtol(str, &end, 10);
+    long last = first;
+    if (*end == '-')
+      last = strtol(end + 1, &end, 10);
+    for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+      CPU_SET(cpu, set);
+    str = *end == ',' ? end + 1 : end;
+  }
+  return CPU_COUNT(set) > 0 ? OK : E_FAIL;
+}
+
 /* Misc */
 
 void vec_filter_null(vec_void_t *v) {
@@ -93,4 +264,16 @@ void vec_filter_null(vec_void_t *v) {
     vec_push(v, temp.data[i]);
 
   vec_deinit(&temp);
+}
+
+u_long get_time_msec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u_long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+u_long get_time_usec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u_long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
\ No newline at end of file
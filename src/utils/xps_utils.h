@@ -6,10 +6,19 @@
 /* Sockets */
 bool is_valid_port(u_int port);
 char *get_remote_ip(u_int sock_fd);
+bool is_unix_host(const char *host);
 struct addrinfo *xps_getaddrinfo(const char *host, u_int port);
-int make_socket_non_blocking(u_int sock_fd);
+void xps_freeaddrinfo(struct addrinfo *addr_info);
+
+/* CPUs */
+int pin_to_cpu(int cpu);
+int get_cpu_node(int cpu);
+int prefer_node(int node);
+int get_node_cpus(int node, cpu_set_t *set);
 
 /* Misc */
 void vec_filter_null(vec_void_t *v);
+u_long get_time_msec();
+u_long get_time_usec();
 
 #endif
\ No newline at end of file
@@ -1,29 +1,131 @@
 #ifndef XPS_H
 #define XPS_H
 
+#define _GNU_SOURCE
+
 // Header files
 #include <arpa/inet.h>
 #include <assert.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <linux/errqueue.h>
+#include <linux/filter.h>
+#include <linux/mempolicy.h>
+#include <dirent.h>
+#include <sched.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <sys/epoll.h>
+#include <stddef.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <signal.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
 
 // 3rd party libraries
 #include "lib/vec/vec.h" // https://github.com/rxi/vec
+#include <zlib.h>
+#include <openssl/core_names.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#ifdef XPS_ZSTD
+#include <zstd.h>
+#endif
 
 // Constants
-#define DEFAULT_BACKLOG 64
+#define DEFAULT_BACKLOG 4096 // Of listeners without a profile that sets one, capped by net.core.somaxconn
 #define MAX_EPOLL_EVENTS 32
 #define DEFAULT_BUFFER_SIZE 100000 // 100 KB
-#define DEFAULT_PIPE_BUFF_THRESH 1000000 // 1 MB
+#define DEFAULT_READ_SIZE 16384 // 16 KB, initial read size of a pipe
+#define MIN_READ_SIZE 2048 // 2 KB
+#define MAX_READ_SIZE DEFAULT_BUFFER_SIZE
+#define N_BUFFER_CLASSES 4 // 2 KB, 8 KB, 32 KB, 128 KB
+#define MIN_BUFFER_CLASS_SIZE 2048 // 2 KB, classes grow 4x from here
+#define BUFFER_POOL_CLASS_MAX_BYTES 4194304 // 4 MB of free buffers kept per class
+#define DEFAULT_PIPE_BUFF_THRESH 65536 // 64 KB, initial threshold of a pipe
+#define MIN_PIPE_BUFF_THRESH 16384 // 16 KB
+#define MAX_PIPE_BUFF_THRESH 4194304 // 4 MB
+#define DEFAULT_PIPE_MEM_BUDGET 268435456 // 256 MB, sum of thresholds of all pipes
+#define PIPE_SIZING_INTERVAL_MSEC 100
+#define DEFAULT_IO_BUDGET_BYTES 262144 // 256 KB per pipe side per loop iteration
+#define DEFAULT_IO_BUDGET_OPS 4 // Handler calls per pipe side per loop iteration
+#define DEFAULT_ACCEPT_BUDGET 16 // Accepts per listener per loop iteration
+#define DEFAULT_MAX_CONNECTIONS 10000 // All connections of a core, 0 for no limit
+#define DEFAULT_LISTENER_MAX_CONNECTIONS 4096 // Connections opened by one listener, 0 for no limit
+#define DEFAULT_MAX_LOOP_LAG_MSEC 200 // New connections are shed above this loop lag, 0 to disable
+#define LISTENER_PAUSE_MSEC 100 // Retry interval for paused listeners
+#define DEFAULT_DRAIN_TIMEOUT_MSEC 30000 // Connections left after this are closed
+#define DRAIN_CHECK_MSEC 100
+#define DEFAULT_UPGRADE_SOCKET "/tmp/xps_upgrade.sock"
+#define HANDOVER_TIMEOUT_MSEC 10000 // Upgrade is aborted if new process does not take over
+#define HANDOVER_HOST_LEN 128 // Fits a unix socket host
+#define MAX_HANDOVER_FDS 64
 #define DEFAULT_NULLS_THRESH 32
+#define CACHE_LINE_SIZE 64
+#define POOL_OBJS_PER_SLAB 256
+#define POOL_POISON 0xDB
+#define HTTP_MAX_HEAD_SIZE 16384 // Longer heads are tunneled without parsing
+#define HTTP_MAX_HEADER_LEN 2048
+#define HTTP_METHOD_LEN 16
+#define HTTP_MAX_PATH_LEN 2048
+#define HTTP_HOST_LEN 256
+#define DEFAULT_CACHE_MAX_BYTES 134217728 // 128 MB of cached responses, 0 to disable
+#define N_CACHE_SHARDS 16
+#define CACHE_SHARD_BUCKETS 1024
+#define CACHE_MAX_ENTRY_FRACTION 8 // Responses above 1/8 of a shard are not cached
+#define CACHE_MIN_GHOSTS 64
+#define HTTP_CONTENT_TYPE_LEN 128
+#define DEFAULT_GZIP_LEVEL 6 // 0 disables gzip responses
+#define DEFAULT_ZSTD_LEVEL 3 // 0 disables zstd responses, needs XPS_ZSTD at build time
+#define DEFAULT_COMPRESS_MIN_LEN 256 // Smaller bodies are sent as they are
+#define COMPRESS_CHUNK_SIZE 16384 // 16 KB of compressed data per chunk
+#define COMPRESS_POOL_SIZE 64 // Idle compressors kept per core
+#define RATELIMIT_MIN_ENTRIES 1024 // Initial client table size, power of two
+#define RATELIMIT_MAX_ENTRIES 1048576 // Clients beyond this are not limited
+#define SINK_MAX_IOV 64 // Buffers gathered into one write of a connection
+#define QOS_SHAPE_BURST_MSEC 50 // Shaped connections write up to this much of their rate at once
+#define DEFAULT_UPSTREAMS "127.0.0.1:3000"
+#define UNIX_SOCKET_PREFIX "unix:" // Hosts starting with this are unix sockets, see is_unix_host()
+#define DEFAULT_HEALTH_INTERVAL_MSEC 5000 // Between probes of a healthy upstream, 0 for passive checks only
+#define DEFAULT_MAX_FAILS 3 // Failures in a row that eject an upstream
+#define DEFAULT_EJECT_MSEC 1000 // First ejection, doubled for every ejection in a row
+#define EJECT_MAX_MSEC 60000
+#define HEALTH_TIMEOUT_MSEC 1000 // Probes slower than this fail
+#define DEFAULT_HEDGE_MIN_MSEC 10 // Requests are never hedged sooner than this
+#define DEFAULT_HEDGE_BUDGET_PERCENT 5 // Hedges per 100 requests sent upstream
+#define HEDGE_BUDGET_BURST 10 // Hedges the budget can save up
+#define HEDGE_HIST_BUCKETS 80 // First byte times up to about 17 minutes
+#define HEDGE_MIN_SAMPLES 32 // Requests are not hedged before this many first byte times are known
+#define HEDGE_DECAY_SAMPLES 1024
+#define DEFAULT_WORKERS 2 // Threads running blocking work off the loop, 0 runs it on the loop
+#define DEFAULT_H2_UPSTREAMS 4 // Upstream connections per h2c client, 0 disables h2c
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_FRAME_HEADER_LEN 9
+#define H2_MAX_FRAME_SIZE 16384 // Largest frame accepted from clients
+#define H2_MAX_STREAMS 100 // Concurrent streams per client connection
+#define H2_STREAM_WINDOW DEFAULT_PIPE_BUFF_THRESH // Request body bytes a stream may have in flight
+#define H2_MAX_HEADER_BLOCK 65536 // Larger header blocks fail the connection
+#define HPACK_STATIC_ENTRIES 61
+#define HPACK_TABLE_SIZE 4096 // Dynamic table size allowed to clients
+#define DEFAULT_TLS_SESSION_CACHE 20480 // TLS sessions kept for resumption, 0 disables resumption
+#define TLS_TICKET_KEY_MSEC 3600000 // 1 hour, ticket keys are rotated this often
+#define UDP_BATCH 32 // Datagrams per recvmmsg() and sendmmsg()
+#define UDP_MAX_DATAGRAM 65536 // Also the largest GRO burst
+#define DEFAULT_UDP_IDLE_MSEC 30000 // UDP flows without traffic for this long are closed
+#define DEFAULT_UDP_MAX_FLOWS 4096 // Clients of one UDP proxy, datagrams of others are dropped
+#define UDP_MIN_FLOW_BUCKETS 256
+#define UDP_SWEEP_MSEC 1000 // Idle UDP flows are looked for this often
+#define ZEROCOPY_LINGER_MSEC 60000 // Closed sockets wait this long for zerocopy sends to complete
 
 // Error constants
 #define OK 0            // Success
@@ -39,9 +141,18 @@ typedef unsigned char u_char;
 typedef unsigned int u_int;
 typedef unsigned long u_long;
 
+// Content codings of response bodies
+enum xps_encoding_e {
+  ENCODING_IDENTITY,
+  ENCODING_GZIP,
+  ENCODING_ZSTD // Only with XPS_ZSTD defined at build time
+};
+
 // Structs
+struct xps_config_s;
 struct xps_core_s;
 struct xps_loop_s;
+struct loop_timer_s;
 struct xps_listener_s;
 struct xps_connection_s;
 struct xps_buffer_s;
@@ -49,31 +160,105 @@ struct xps_buffer_list_s;
 struct xps_pipe_s;
 struct xps_pipe_source_s;
 struct xps_pipe_sink_s;
+struct xps_pipe_filter_s;
+struct xps_pool_s;
+struct xps_session_s;
+struct xps_http_req_s;
+struct xps_http_res_s;
+struct xps_cache_s;
+struct xps_compressor_s;
+struct xps_compress_range_s;
+struct xps_compress_s;
+struct xps_ratelimit_entry_s;
+struct xps_ratelimit_s;
+struct xps_backend_s;
+struct xps_hedge_s;
+struct xps_hpack_s;
+struct xps_h2_s;
+struct xps_h2_stream_s;
+struct xps_h2_upstream_s;
+struct xps_tls_ticket_key_s;
+struct xps_udp_batch_s;
+struct xps_udp_flow_s;
+struct xps_udp_s;
+struct xps_zerocopy_s;
+struct xps_sock_profile_s;
+struct xps_tls_s;
 
 // Struct typedefs
+typedef struct xps_config_s xps_config_t;
 typedef struct xps_core_s xps_core_t;
 typedef struct xps_loop_s xps_loop_t;
+typedef struct loop_timer_s loop_timer_t;
 typedef struct xps_listener_s xps_listener_t;
 typedef struct xps_connection_s xps_connection_t;
 typedef struct xps_buffer_s xps_buffer_t;
 typedef struct xps_buffer_list_s xps_buffer_list_t;
 typedef struct xps_pipe_s xps_pipe_t;
+typedef struct xps_pool_s xps_pool_t;
+typedef struct xps_session_s xps_session_t;
+typedef struct xps_http_req_s xps_http_req_t;
+typedef struct xps_http_res_s xps_http_res_t;
+typedef struct xps_cache_s xps_cache_t;
+typedef struct xps_compressor_s xps_compressor_t;
+typedef struct xps_compress_range_s xps_compress_range_t;
+typedef struct xps_compress_s xps_compress_t;
+typedef struct xps_ratelimit_entry_s xps_ratelimit_entry_t;
+typedef struct xps_ratelimit_s xps_ratelimit_t;
+typedef struct xps_backend_s xps_backend_t;
+typedef struct xps_backend_resolve_s xps_backend_resolve_t;
+typedef struct xps_hedge_s xps_hedge_t;
+typedef struct xps_task_s xps_task_t;
+typedef struct xps_worker_s xps_worker_t;
+typedef struct xps_workers_s xps_workers_t;
+typedef struct xps_hpack_s xps_hpack_t;
+typedef struct xps_h2_s xps_h2_t;
+typedef struct xps_h2_stream_s xps_h2_stream_t;
+typedef struct xps_h2_upstream_s xps_h2_upstream_t;
+typedef struct xps_tls_ticket_key_s xps_tls_ticket_key_t;
+typedef struct xps_tls_s xps_tls_t;
+typedef struct xps_udp_batch_s xps_udp_batch_t;
+typedef struct xps_udp_flow_s xps_udp_flow_t;
+typedef struct xps_udp_s xps_udp_t;
+typedef struct xps_zerocopy_s xps_zerocopy_t;
+typedef struct xps_sock_profile_s xps_sock_profile_t;
 typedef struct xps_pipe_source_s xps_pipe_source_t;
 typedef struct xps_pipe_sink_s xps_pipe_sink_t;
+typedef struct xps_pipe_filter_s xps_pipe_filter_t;
 
 // Function typedefs
 typedef void (*xps_handler_t)(void *ptr);
+typedef int (*xps_filter_handler_t)(xps_pipe_filter_t *filter, xps_buffer_t *buff);
+typedef void (*xps_http_header_cb_t)(const char *name, const char *value, void *ptr);
 
 
  // xps headers
+#include "core/xps_config.h"
 #include "core/xps_core.h"
 #include "core/xps_loop.h"
 #include "core/xps_pipe.h"
+#include "core/xps_signal.h"
+#include "core/xps_session.h"
+#include "core/xps_hedge.h"
+#include "core/xps_workers.h"
 #include "network/xps_connection.h"
 #include "network/xps_listener.h"
 #include "network/xps_upstream.h"
+#include "network/xps_handover.h"
+#include "network/xps_ratelimit.h"
+#include "network/xps_backend.h"
+#include "network/xps_tls.h"
+#include "network/xps_udp.h"
+#include "network/xps_zerocopy.h"
+#include "network/xps_sockopt.h"
+#include "http/xps_http.h"
+#include "http/xps_cache.h"
+#include "http/xps_compress.h"
+#include "http/xps_hpack.h"
+#include "http/xps_h2.h"
 #include "utils/xps_logger.h"
 #include "utils/xps_utils.h"
 #include "utils/xps_buffer.h"
+#include "utils/xps_pool.h"
 
 #endif
\ No newline at end of file